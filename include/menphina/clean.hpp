@@ -0,0 +1,95 @@
+/* Copyright 2024 isaki */
+
+#ifndef __MENPHINA_CLEAN_HPP__
+#define __MENPHINA_CLEAN_HPP__
+
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "menphina/exec.hpp"
+
+namespace menphina
+{
+    struct clean_state_t;
+
+    /*
+        What clean works from: the installed mods with the files their
+        options reference, and the mods each configuration file (collections,
+        sort_order.json) has entries for.
+
+        refresh() builds it from a full scan of the ModDirectory, parsing
+        only what changed since the reference index (see refindex.hpp) was
+        written. Watch mode then keeps it current a mod at a time, so a
+        clean() on a warm state costs a few stat() calls.
+    */
+    class CleanState final
+    {
+        public:
+            // Called between units of work with the phase (a string literal)
+            // and progress; it may throw to stop the work.
+            using step_fn = std::function<void(const char *, uint64_t, uint64_t)>;
+
+            CleanState(const std::string_view launcherDir, const std::string& indexFile, step_fn step = {});
+            ~CleanState();
+
+            CleanState(const CleanState&) = delete;
+            CleanState& operator=(const CleanState&) = delete;
+
+            const std::string& launcher_directory() const;
+            const std::string& mod_directory() const;
+            const std::string& config_directory() const;
+
+            // False while the last scan of some part of the ModDirectory was
+            // incomplete; clean() refuses to edit anything in that state.
+            bool complete() const;
+
+            // Installed mods, and the directories of one relative to it ("" is
+            // the mod directory itself).
+            std::vector<std::string> mods() const;
+            std::vector<std::string> mod_directories(const std::string_view name) const;
+
+            // Scans the whole ModDirectory and reads every configuration file.
+            void refresh(std::ostream& out, std::ostream& err);
+
+            // Rescans one mod directory; a mod that is gone is dropped.
+            void refresh_mod(const std::string_view name);
+
+            // Rereads the configuration files that changed.
+            void refresh_config();
+
+            // Reports mod files no option references, removes the entries
+            // of mods that are no longer installed from the configuration
+            // and brings the reference index up to date. The edits are
+            // planned first; dryRun prints the plan and changes nothing.
+            void clean(std::ostream& out, std::ostream& err, const bool dryRun = false);
+
+        private:
+            std::unique_ptr<clean_state_t> m_state;
+    };
+
+    class Clean final : public Execution
+    {
+        public:
+            // indexFile caches what the configuration references so that
+            // the next run only parses what changed. If watchSocket is not
+            // empty and a watch mode process serves it, the clean is done
+            // there against its warm state instead. dryRun prints what
+            // would be changed, always from a state of its own.
+            explicit Clean(const std::string& indexFile, const std::string& watchSocket = {}, const bool dryRun = false);
+            ~Clean();
+
+            void run(const std::string_view& launcherDir) override;
+
+        private:
+            std::string m_indexFile;
+            std::string m_watchSocket;
+            bool m_dryRun;
+    };
+}
+
+#endif
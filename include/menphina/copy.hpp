@@ -0,0 +1,115 @@
+/* Copyright 2024 isaki */
+
+#ifndef __MENPHINA_COPY_HPP__
+#define __MENPHINA_COPY_HPP__
+
+/*
+    Bulk fd to fd copying.
+
+    Callers queue ranges to copy and run() them as one batch. Each range is
+    first offered to copy_file_range(), which stays in the kernel and on
+    btrfs/XFS can share extents instead of copying. Ranges it cannot handle
+    (a different filesystem on older kernels, filesystems without support)
+    go through a data path that keeps many reads and writes in flight: an
+    io_uring ring where the kernel offers one, otherwise pread/pwrite on a
+    thread pool.
+
+    Nothing here orders writes to the same destination; queued ranges must
+    not overlap.
+*/
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace menphina
+{
+    struct copy_op_t
+    {
+        int src_fd;
+        uint64_t src_offset;
+        int dst_fd;
+        uint64_t dst_offset;
+        uint64_t length;
+    };
+
+    enum class CopyMethod : uint8_t
+    {
+        // copy_file_range, then io_uring, then the thread pool.
+        Auto = 0,
+        CopyFileRange = 1,
+        IoUring = 2,
+        ThreadPool = 3
+    };
+
+    struct copy_options_t
+    {
+        CopyMethod method = CopyMethod::Auto;
+
+        // Blocks in flight on the data path.
+        unsigned queue_depth = 32;
+
+        // Size of one read/write on the data path.
+        size_t block_size = 1024 * 1024;
+
+        // Threads for copy_file_range and the thread pool; 0 selects all cores.
+        unsigned threads = 0;
+    };
+
+    struct copy_stats_t
+    {
+        uint64_t ops = 0;
+        uint64_t bytes = 0;
+        uint64_t copy_file_range_bytes = 0;
+        uint64_t io_uring_bytes = 0;
+        uint64_t thread_pool_bytes = 0;
+    };
+
+    class CopyEngine final
+    {
+        public:
+            explicit CopyEngine(const copy_options_t& options = copy_options_t {});
+            ~CopyEngine();
+
+            CopyEngine(const CopyEngine&) = delete;
+            CopyEngine& operator=(const CopyEngine&) = delete;
+
+            void add(const copy_op_t& op);
+
+            inline size_t pending() const
+            {
+                return m_ops.size();
+            }
+
+            inline uint64_t pending_bytes() const
+            {
+                return m_pendingBytes;
+            }
+
+            // Copies everything queued and empties the queue. Throws on the
+            // first failure, once no I/O is in flight any more.
+            void run();
+
+            inline const copy_stats_t& stats() const
+            {
+                return m_stats;
+            }
+
+        private:
+            copy_options_t m_options;
+            std::vector<copy_op_t> m_ops;
+            uint64_t m_pendingBytes;
+            copy_stats_t m_stats;
+
+            // Sticky per engine: once a method is known not to work here it
+            // is not tried again.
+            bool m_copyFileRange;
+            bool m_ioUring;
+
+            std::vector<copy_op_t> run_copy_file_range(const std::vector<copy_op_t>& ops);
+            bool run_io_uring(const std::vector<copy_op_t>& ops);
+            void run_thread_pool(const std::vector<copy_op_t>& ops);
+    };
+}
+
+#endif
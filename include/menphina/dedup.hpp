@@ -0,0 +1,42 @@
+/* Copyright 2024 isaki */
+
+#ifndef __MENPHINA_DEDUP_HPP__
+#define __MENPHINA_DEDUP_HPP__
+
+/*
+    Collapses byte-identical files across the mods of the ModDirectory.
+
+    Candidates are narrowed in rounds, each more expensive than the last:
+    files of the same size, then the same hash over their first and last
+    PARTIAL_HASH_LENGTH bytes, then the same hash over everything. Paths
+    already sharing an inode count as one file. Every duplicate is compared
+    byte for byte against the file it is merged into right before the
+    merge, so neither a hash collision nor a file that changed since it was
+    hashed can lose data.
+
+    A duplicate is replaced by a reflink (FICLONE) of the kept file, which
+    shares the blocks but stays a file of its own with its own mtime. Where
+    the filesystem cannot reflink it becomes a hard link instead; those
+    share everything, so a later in-place edit of one shows in all of them.
+    Either way the replacement is staged and renamed over the duplicate.
+*/
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "menphina/exec.hpp"
+
+namespace menphina
+{
+    class Dedup final : public Execution
+    {
+        public:
+            Dedup();
+            ~Dedup();
+
+            void run(const std::string_view& launcherDir) override;
+    };
+}
+
+#endif
@@ -0,0 +1,30 @@
+/* Copyright 2024 isaki */
+
+#ifndef __MENPHINA_DELTA_HPP__
+#define __MENPHINA_DELTA_HPP__
+
+#include <string>
+#include <string_view>
+
+#include "menphina/exec.hpp"
+
+namespace menphina
+{
+    class Delta final : public Execution
+    {
+        public:
+            // Writes to deltaFile what takes an installation of basePackage
+            // to one of package; deploy applies it.
+            Delta(const std::string& basePackage, const std::string& package, const std::string& deltaFile);
+            ~Delta();
+
+            void run(const std::string_view& launcherDir) override;
+
+        private:
+            std::string m_basePackage;
+            std::string m_package;
+            std::string m_deltaFile;
+    };
+}
+
+#endif
@@ -0,0 +1,37 @@
+/* Copyright 2024 isaki */
+
+#ifndef __MENPHINA_DEPLOY_HPP__
+#define __MENPHINA_DEPLOY_HPP__
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "menphina/exec.hpp"
+
+namespace menphina
+{
+    struct io_policy_t;
+
+    class Deploy final : public Execution
+    {
+        public:
+            // An empty mod list deploys every mod in the package. The package
+            // may also be an xmdelta, applied over an installation of its
+            // base package. Every change is planned before any is made;
+            // dryRun prints the plan instead.
+            Deploy(const std::string& packageFile, const std::vector<std::string>& mods, const bool dryRun = false);
+            ~Deploy();
+
+            void run(const std::string_view& launcherDir) override;
+
+        private:
+            std::string m_packageFile;
+            std::vector<std::string> m_mods;
+            bool m_dryRun;
+
+            void apply_delta(const std::string& modDir, const io_policy_t& policy);
+    };
+}
+
+#endif
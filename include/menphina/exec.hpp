@@ -3,19 +3,113 @@
 #ifndef __MENPHINA_EXEC_HPP__
 #define __MENPHINA_EXEC_HPP__
 
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
 #include <string_view>
 
 namespace menphina
 {
+    struct job_shared_t;
+    struct job_callbacks_t;
+    class Job;
+
     class Execution
     {
         public:
             virtual ~Execution();
 
+            // Blocking; runs to completion or throws. run_async() wraps this.
             virtual void run(const std::string_view& launcherDir) = 0;
+
         protected:
             Execution();
+
+            // Both are no-ops unless the execution is running as a Job.
+            // phase must be a string literal.
+            void report_progress(const char * phase, const uint64_t done, const uint64_t total) const;
+
+            // Throws cancelled_exception once the Job has been cancelled;
+            // executions call it between units of work that leave nothing
+            // half done.
+            void check_cancelled() const;
+
+        private:
+            friend struct job_shared_t;
+            friend Job run_async(std::shared_ptr<Execution> exec, const std::string_view launcherDir, job_callbacks_t callbacks);
+
+            job_shared_t * m_job;
+    };
+
+    enum class JobState : uint8_t
+    {
+        Running = 0,
+        Succeeded = 1,
+        Failed = 2,
+        Cancelled = 3
+    };
+
+    struct job_progress_t
+    {
+        // nullptr until the execution reports its first phase.
+        const char * phase = nullptr;
+        uint64_t done = 0;
+        uint64_t total = 0;
+    };
+
+    struct job_callbacks_t
+    {
+        // Called on the job's thread on every progress report; keep it short.
+        std::function<void(const job_progress_t&)> on_progress;
+
+        // Called on the job's thread once the job has finished.
+        std::function<void(JobState)> on_finished;
     };
+
+    // Handle to an Execution running on its own thread. Destroying a handle
+    // whose job is still running cancels it and waits for it to stop,
+    // except from the job's own thread (on_finished), where it lets go.
+    // Calling anything on a moved-from handle throws std::logic_error.
+    class Job final
+    {
+        public:
+            Job(Job&&) noexcept;
+            Job& operator=(Job&&) noexcept;
+            ~Job();
+
+            Job(const Job&) = delete;
+            Job& operator=(const Job&) = delete;
+
+            JobState state() const;
+            job_progress_t progress() const;
+
+            // Cooperative: the execution stops at its next check_cancelled().
+            void cancel();
+
+            JobState wait();
+
+            // Returns false if the job was still running after timeout.
+            bool wait_for(const std::chrono::milliseconds timeout);
+
+            // What the execution threw; empty unless Failed.
+            std::string error() const;
+
+        private:
+            friend Job run_async(std::shared_ptr<Execution> exec, const std::string_view launcherDir, job_callbacks_t callbacks);
+
+            explicit Job(std::shared_ptr<job_shared_t> shared);
+
+            std::shared_ptr<job_shared_t> m_shared;
+
+            job_shared_t& shared() const;
+            void finish();
+    };
+
+    // Starts exec->run(launcherDir) on a new thread. An Execution can only
+    // run as one job at a time.
+    Job run_async(std::shared_ptr<Execution> exec, const std::string_view launcherDir, job_callbacks_t callbacks = {});
 }
 
 #endif
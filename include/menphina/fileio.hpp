@@ -0,0 +1,89 @@
+/* Copyright 2024 isaki */
+
+#ifndef __MENPHINA_FILEIO_HPP__
+#define __MENPHINA_FILEIO_HPP__
+
+/*
+    Low level file descriptor helpers. Everything in here is a thin wrapper
+    around POSIX calls; the goal is to keep the RAII and errno handling in
+    one place so the heavier modules (scanning, packaging) stay readable.
+*/
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace menphina
+{
+    class UniqueFd final
+    {
+        public:
+            UniqueFd();
+            explicit UniqueFd(const int fd);
+            ~UniqueFd();
+
+            UniqueFd(const UniqueFd&) = delete;
+            UniqueFd& operator=(const UniqueFd&) = delete;
+
+            UniqueFd(UniqueFd&& other) noexcept;
+            UniqueFd& operator=(UniqueFd&& other) noexcept;
+
+            inline int get() const
+            {
+                return m_fd;
+            }
+
+            inline bool valid() const
+            {
+                return m_fd != -1;
+            }
+
+            int release();
+            void reset(const int fd = -1);
+
+        private:
+            int m_fd;
+    };
+
+    struct file_stat_t
+    {
+        uint64_t size = 0;
+        int64_t mtime_ns = 0;
+        uint64_t inode = 0;
+    };
+
+    // Returns false if path does not exist; throws on any other failure.
+    bool try_stat(const std::string_view path, file_stat_t& out);
+
+    // Loops over short writes/EINTR; throws errno_exception on failure. The
+    // what argument names the file in the error message.
+    void write_all(const int fd, const void * data, const size_t length, const std::string_view what);
+    void pwrite_all(const int fd, const void * data, const size_t length, const uint64_t offset, const std::string_view what);
+
+    // Reads until length bytes or EOF; returns the number of bytes read.
+    size_t read_full(const int fd, void * data, const size_t length, const std::string_view what);
+    size_t pread_full(const int fd, void * data, const size_t length, const uint64_t offset, const std::string_view what);
+
+    /*
+        Staged writes: content is written to a hidden sibling of the target
+        (see staging_name) and then published over the target with a single
+        rename, so readers only ever see the old or the new file.
+    */
+
+    // A fresh name on every call (pid and a per-process counter), so jobs
+    // staging the same file never share a staging file.
+    std::string staging_name(const std::string_view name);
+
+    // Opens (creating exclusively) the staging file for name in dirfd.
+    UniqueFd open_staged(const int dirfd, const std::string& staged);
+
+    // Renames staged over name. With replace false the rename fails if
+    // name appeared in the meantime (RENAME_NOREPLACE where supported).
+    void publish_staged(const int dirfd, const std::string& staged, const std::string_view name, const bool replace);
+
+    // Best effort removal of a staging file after a failure.
+    void discard_staged(const int dirfd, const std::string& staged);
+}
+
+#endif
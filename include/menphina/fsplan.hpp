@@ -0,0 +1,143 @@
+/* Copyright 2024 isaki */
+
+#ifndef __MENPHINA_FSPLAN_HPP__
+#define __MENPHINA_FSPLAN_HPP__
+
+/*
+    Everything a mode is about to change below one root directory, worked
+    out before anything is touched so that it can be printed (--dry-run)
+    or run as a whole.
+
+    Operations are grouped by the directory they happen in. run() creates
+    the missing directories, parents first, then goes through the
+    directories with operations, existing ones in inode order (roughly
+    where their metadata sits on disk) and then the new ones, and hands the
+    directory fd to the caller for every operation in it. Within a
+    directory, metadata updates come first in inode order, followed by
+    writes in the order of their locality key (where their content is read
+    from). Below the root only dirfd-relative syscalls are made, and only a
+    bounded number of directories is open at a time.
+*/
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "menphina/fileio.hpp"
+
+namespace menphina
+{
+    enum class FsOpKind : uint8_t
+    {
+        // Only the mtime is brought in line; the content already matches.
+        Touch = 0,
+        Create,
+        Replace,
+        // A file rewritten from its own content.
+        Edit
+    };
+
+    const char * fs_op_name(const FsOpKind kind);
+
+    struct fs_op_t
+    {
+        FsOpKind kind;
+        uint32_t directory;
+        std::string name;
+        uint64_t size;
+        int64_t mtime_ns;
+
+        // Sort key within the directory: the inode for Touch and Edit, the
+        // source offset of the content for Create and Replace.
+        uint64_t locality;
+
+        // Index into the caller's own table of what the operation is about.
+        size_t source;
+
+        // Printed after the operation; empty for most.
+        std::string note;
+    };
+
+    class FsPlan final
+    {
+        public:
+            // Called for every operation with the fd of its directory.
+            using op_fn = std::function<void(const fs_op_t&, const int)>;
+
+            // Called before directory fds handed to op_fn are closed; the
+            // caller must be done with them (e.g. publish what it staged).
+            using flush_fn = std::function<void()>;
+
+            explicit FsPlan(const std::string& root);
+            ~FsPlan();
+
+            FsPlan(const FsPlan&) = delete;
+            FsPlan& operator=(const FsPlan&) = delete;
+
+            inline const std::string& root() const
+            {
+                return m_root;
+            }
+
+            // Index of the directory at path relative to the root ("" is
+            // the root). A directory that does not exist is created, with
+            // any missing parents, when the plan runs.
+            uint32_t directory(const std::string_view path);
+
+            void add(fs_op_t op);
+
+            inline size_t size() const
+            {
+                return m_ops.size();
+            }
+
+            inline bool empty() const
+            {
+                return m_ops.empty() && m_created == 0;
+            }
+
+            inline size_t directories_created() const
+            {
+                return m_created;
+            }
+
+            // One line per operation, in the order run() makes them.
+            void print(std::ostream& out) const;
+
+            // Creates the missing directories and calls fn for every
+            // operation. Finished directories are closed in groups, each
+            // after a call to flush, which also comes once at the end.
+            void run(const op_fn& fn, const flush_fn& flush = {});
+
+        private:
+            struct directory_t
+            {
+                std::string path;
+                uint64_t inode;
+                bool create;
+            };
+
+            std::string m_root;
+            std::vector<directory_t> m_dirs;
+            std::map<std::string, uint32_t, std::less<>> m_dirIndex;
+            std::vector<fs_op_t> m_ops;
+            size_t m_created;
+            std::vector<UniqueFd> m_fds;
+
+            std::string full_path(const uint32_t dir, const std::string_view name) const;
+
+            // Directory indexes and operation indexes in execution order.
+            std::vector<uint32_t> directory_order() const;
+            std::vector<size_t> op_order(const std::vector<uint32_t>& dirs) const;
+
+            void create_directory(const uint32_t dir);
+            void open_directory(const uint32_t dir);
+    };
+}
+
+#endif
@@ -0,0 +1,80 @@
+/* Copyright 2024 isaki */
+
+#ifndef __MENPHINA_HASH_HPP__
+#define __MENPHINA_HASH_HPP__
+
+/*
+    128 bit content hash used to address xmpkg chunks.
+
+    The construction follows XXH3's long input path (eight 64 bit lanes, a
+    32x32->64 multiply per lane, a sliding secret and a periodic scramble),
+    with our own secret and finalization. It is not cryptographic; it only
+    needs to make accidental collisions between mod files implausible while
+    running close to memory bandwidth. The stripe loop is vectorized with
+    SSE2 or AVX2, picked at startup from what the CPU supports.
+*/
+
+#include <array>
+#include <compare>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace menphina
+{
+    struct content_hash_t
+    {
+        uint64_t lo = 0;
+        uint64_t hi = 0;
+
+        auto operator<=>(const content_hash_t&) const = default;
+
+        std::string hex() const;
+    };
+
+    struct content_hash_hasher
+    {
+        // The hash is already uniformly distributed; any 64 bits will do.
+        inline size_t operator()(const content_hash_t& h) const noexcept
+        {
+            return static_cast<size_t>(h.lo);
+        }
+    };
+
+    class ContentHasher final
+    {
+        public:
+            static constexpr size_t STRIPE_LENGTH = 64;
+            static constexpr size_t LANES = 8;
+
+            ContentHasher();
+            ~ContentHasher();
+
+            void update(const void * data, const size_t length);
+            content_hash_t finish() const;
+
+            void reset();
+
+        private:
+            std::array<uint64_t, LANES> m_acc;
+            std::array<unsigned char, STRIPE_LENGTH> m_pending;
+            size_t m_pendingLength;
+            size_t m_stripesInBlock;
+            uint64_t m_totalLength;
+
+            void consume(const unsigned char * stripes, const size_t count);
+    };
+
+    content_hash_t content_hash(const void * data, const size_t length);
+
+    // Instruction set the hash runs on: "avx2", "sse2" or "scalar". All of
+    // them produce the same hashes.
+    const char * content_hash_isa();
+
+    // Hashes the rest of fd, reading as much as buffer holds at a time
+    // (at least 1 MiB; it is grown as needed and may be reused).
+    content_hash_t content_hash_fd(const int fd, std::vector<char>& buffer);
+}
+
+#endif
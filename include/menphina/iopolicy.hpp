@@ -0,0 +1,65 @@
+/* Copyright 2024 isaki */
+
+#ifndef __MENPHINA_IOPOLICY_HPP__
+#define __MENPHINA_IOPOLICY_HPP__
+
+/*
+    Filesystem dependent I/O tuning.
+
+    Windows drives mounted under WSL (/mnt/c and friends) are served by the
+    host over 9P (WSL 2) or drvfs (WSL 1). Every syscall there is a round
+    trip to Windows, so what is cheap on a local filesystem (small reads,
+    re-reading a file to compare it, short directory listings) is not. The
+    policy for a path is picked once from statfs() and threaded through to
+    the code doing the I/O.
+
+    MENPHINA_IO_POLICY=local|remote overrides the detection, so the remote
+    policy can be exercised on an ordinary Linux filesystem; "auto" (or
+    unset) detects.
+*/
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace menphina
+{
+    enum class IoPolicyKind : uint8_t
+    {
+        Local = 0,
+        Remote = 1
+    };
+
+    // Transfers are kept multiples of this.
+    inline constexpr size_t IO_TRANSFER_ALIGNMENT = 1024 * 1024;
+
+    struct io_policy_t
+    {
+        IoPolicyKind kind;
+
+        // getdents64 buffer; a larger one lists a directory in fewer calls.
+        size_t dirent_buffer_length;
+
+        // Length of sequential reads, a multiple of IO_TRANSFER_ALIGNMENT.
+        size_t transfer_length;
+
+        // Precision of the timestamps the filesystem stores. mtimes we set
+        // are only compared at this granularity, otherwise NTFS rounding
+        // would make every deployed file look modified.
+        int64_t mtime_granularity_ns;
+    };
+
+    const char * io_policy_name(const IoPolicyKind kind);
+
+    // Policy for the filesystem holding path (or the open fd), after
+    // applying MENPHINA_IO_POLICY.
+    io_policy_t get_io_policy(const std::string_view path);
+    io_policy_t get_io_policy_fd(const int fd);
+
+    inline bool same_mtime(const io_policy_t& policy, const int64_t a, const int64_t b)
+    {
+        return a / policy.mtime_granularity_ns == b / policy.mtime_granularity_ns;
+    }
+}
+
+#endif
@@ -6,8 +6,12 @@
 #include <string>
 #include <ostream>
 #include <cstdint>
+#include <map>
+#include <vector>
 #include "glaze/json/json_t.hpp"
 
+#include "menphina/fileio.hpp"
+
 // Note the use of Pascal case is to match what Dalamud plugins typically use
 // so as to be familiar to the end user.
 namespace menphina
@@ -22,10 +26,175 @@ namespace menphina
     void read_json_file(penumbra_config_t& obj, const std::string& jsonFile);
 
 
+    /* PACKAGE MANIFEST */
+    /* Kept next to the application config so repeat package runs can skip unchanged files */
+
+    struct package_manifest_file_t
+    {
+        std::string Path;
+        uint64_t Size;
+        int64_t MTime;
+        std::string Hash;
+    };
+
+    struct package_manifest_mod_t
+    {
+        std::string Name;
+        std::vector<package_manifest_file_t> Files;
+    };
+
+    struct package_manifest_t
+    {
+        std::string Package;
+        uint64_t PackageSize;
+        int64_t PackageMTime;
+        std::vector<package_manifest_mod_t> Mods;
+    };
+
+    void read_json_file(package_manifest_t& obj, const std::string& jsonFile);
+    void write_json_file(const package_manifest_t& obj, const std::string& jsonFile);
+
+
+    /* BENCHMARK REPORT */
+    /* Written by menphina-bench so runs of different builds can be compared */
+
+    struct bench_config_t
+    {
+        uint32_t Mods;
+        uint32_t FilesPerMod;
+        uint64_t MinFileSize;
+        uint64_t MaxFileSize;
+        double DuplicateRatio;
+        uint64_t Seed;
+        uint32_t Iterations;
+    };
+
+    struct bench_result_t
+    {
+        std::string Name;
+        uint32_t Iterations;
+        uint64_t Files;
+        uint64_t Bytes;
+        double MinSeconds;
+        double MedianSeconds;
+        double P90Seconds;
+        double MaxSeconds;
+        double MeanSeconds;
+        // Throughput at the median.
+        double FilesPerSecond;
+        double BytesPerSecond;
+    };
+
+    struct bench_report_t
+    {
+        std::string Version;
+        bench_config_t Config;
+        uint64_t TreeFiles;
+        uint64_t TreeBytes;
+        uint64_t TreeUniqueBytes;
+        std::vector<bench_result_t> Results;
+    };
+
+    void write_json_file(const bench_report_t& obj, const std::string& jsonFile);
+
+
     /* GENERIC ACCESS */
     /* This is required to support not having to know every single field in every single json */ 
+    /* Writes are streamed to the file in fixed size pieces; memory use does not grow with the document */
     void read_generic_json_file(glz::json_t& obj, const std::string& jsonFile);
     void write_generic_json_file(const glz::json_t& obj, const std::string& jsonFile);
+
+    enum class JsonWriteMode : uint8_t
+    {
+        // Serialize straight over the file.
+        Overwrite = 0,
+
+        // Leave the file alone (contents and mtime) if it already holds the
+        // serialized bytes; otherwise write a staging file and rename it in.
+        IfChanged = 1
+    };
+
+    // Returns whether the file was written.
+    bool write_generic_json_file(const glz::json_t& obj, const std::string& jsonFile, const JsonWriteMode mode);
+
+    /*
+        IfChanged writes for many files at once. add() serializes, compares
+        and stages each file and starts its writeback; commit() then syncs
+        the staged data, renames everything into place and syncs each
+        affected directory once, instead of a full fsync round trip per file.
+        Anything not committed is discarded on destruction.
+    */
+    class JsonWriteBatch final
+    {
+        public:
+            JsonWriteBatch();
+            ~JsonWriteBatch();
+
+            JsonWriteBatch(const JsonWriteBatch&) = delete;
+            JsonWriteBatch& operator=(const JsonWriteBatch&) = delete;
+
+            // Returns false if jsonFile is already up to date.
+            bool add(const glz::json_t& obj, const std::string& jsonFile);
+
+            // Returns the number of files published.
+            size_t commit();
+
+            inline size_t skipped() const
+            {
+                return m_skipped;
+            }
+
+        private:
+            struct staged_t
+            {
+                int dirfd;
+                std::string name;
+                std::string staged;
+            };
+
+            std::map<std::string, UniqueFd> m_dirs;
+            std::vector<staged_t> m_staged;
+            std::string m_buffer;
+            size_t m_skipped;
+
+            int directory(const std::string& dir);
+            void discard();
+    };
+
+
+    /* BATCH ACCESS */
+    /* Loading every meta.json/default_mod.json/group_*.json of a mod library */
+
+    struct json_batch_result_t
+    {
+        glz::json_t value;
+
+        // Empty on success; otherwise what read_generic_json_file would have thrown.
+        std::string error;
+
+        inline bool ok() const
+        {
+            return error.empty();
+        }
+    };
+
+    // Parses every file on up to threads threads (0 = all cores). Result i
+    // belongs to jsonFiles[i]; a failing file only fails its own result.
+    std::vector<json_batch_result_t> read_generic_json_files(const std::vector<std::string>& jsonFiles, const unsigned threads = 0);
+
+
+    /* PARSE CACHE */
+    /* Warm runs load what they parsed before in glaze's binary format (BEVE) instead of parsing the text again */
+
+    // From here on the read functions above look a file up in cacheFile by
+    // path, size, mtime and inode before parsing it, and remember what they
+    // parse. A missing or unreadable cache file starts out empty. Call
+    // before any reads start.
+    void json_cache_enable(const std::string& cacheFile);
+
+    // Writes the cache back if anything changed; a failure is only a
+    // warning on err.
+    void json_cache_save(std::ostream& err);
 }
 
 #endif
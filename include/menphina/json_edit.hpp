@@ -0,0 +1,118 @@
+/* Copyright 2024 isaki */
+
+#ifndef __MENPHINA_JSON_EDIT_HPP__
+#define __MENPHINA_JSON_EDIT_HPP__
+
+/*
+    In-place editing of large JSON files without a DOM.
+
+    The editor keeps the original text, locates values by walking the raw
+    bytes (skipping whole subtrees without decoding them) and records edits
+    as byte ranges to delete or replace. Saving copies every untouched
+    range verbatim, so the formatting Penumbra wrote is preserved and the
+    cost is proportional to the size of the file, not of a parsed tree.
+*/
+
+#include <cstddef>
+#include <functional>
+#include <initializer_list>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace menphina
+{
+    // Half open byte range [begin, end) within the document.
+    struct json_range_t
+    {
+        size_t begin;
+        size_t end;
+    };
+
+    struct json_member_t
+    {
+        // Key as written, without quotes and with escapes intact.
+        std::string_view raw_key;
+        size_t key_begin;
+        json_range_t value;
+    };
+
+    class JsonEditor final
+    {
+        public:
+            explicit JsonEditor(const std::string& file);
+            ~JsonEditor();
+
+            inline const std::string& file() const
+            {
+                return m_file;
+            }
+
+            inline std::string_view text() const
+            {
+                return m_text;
+            }
+
+            inline bool modified() const
+            {
+                return !m_edits.empty();
+            }
+
+            // The top level value.
+            json_range_t root() const;
+
+            // Follows object keys from the root; nullopt when any is missing
+            // or a value along the way is not an object.
+            std::optional<json_range_t> find(const std::initializer_list<std::string_view> path) const;
+
+            // Members of the object at range, in document order.
+            std::vector<json_member_t> members(const json_range_t& object) const;
+
+            // Elements of the array at range, in document order.
+            std::vector<json_range_t> elements(const json_range_t& array) const;
+
+            // Decoded key of a member.
+            std::string key(const json_member_t& member) const;
+
+            // Decoded value of the string at range; nullopt if it is not a
+            // string.
+            std::optional<std::string> string_value(const json_range_t& range) const;
+
+            // Deletes every member of the object at range for which pred
+            // returns true, together with the commas and whitespace that
+            // separated them, and returns how many were removed. Surviving
+            // members keep their exact formatting.
+            size_t remove_members(const json_range_t& object, const std::function<bool(const json_member_t&)>& pred);
+
+            // Replaces the value at range with already serialized JSON.
+            void replace(const json_range_t& range, const std::string_view json);
+
+            // Writes the edited document over the original file (staged and
+            // renamed into place). Does nothing if there are no edits.
+            void save();
+
+            // save(), with dirfd the directory the file is in.
+            void save(const int dirfd);
+
+        private:
+            struct edit_t
+            {
+                json_range_t range;
+                std::string replacement;
+            };
+
+            std::string m_file;
+            std::string m_text;
+            std::vector<edit_t> m_edits;
+
+            void add_edit(const json_range_t& range, std::string replacement);
+
+            [[noreturn]] void fail(const size_t pos, const std::string_view what) const;
+            size_t skip_ws(size_t pos) const;
+            size_t skip_string(size_t pos) const;
+            size_t skip_value(size_t pos) const;
+    };
+}
+
+#endif
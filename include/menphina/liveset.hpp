@@ -0,0 +1,71 @@
+/* Copyright 2024 isaki */
+
+#ifndef __MENPHINA_LIVESET_HPP__
+#define __MENPHINA_LIVESET_HPP__
+
+/*
+    Immutable set of references (normalized as by normalize_reference())
+    that on-disk paths are checked against.
+
+    A lookup folds the path (case, '\\' separators) while hashing it, so the
+    caller never builds a normalized copy. A one word Bloom filter rejects
+    most paths that are not members without touching the table. The table
+    is open addressed in buckets of eight 32 bit tags, one cache line half
+    each; a bucket is compared against the tag in one go with SSE2 or AVX2,
+    and only a tag match leads to a string compare.
+*/
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace menphina
+{
+    class LiveSet final
+    {
+        public:
+            static constexpr size_t BUCKET_SLOTS = 8;
+
+            LiveSet();
+
+            // Members must already be normalized; duplicates are dropped.
+            explicit LiveSet(const std::vector<std::string>& members);
+            ~LiveSet();
+
+            LiveSet(LiveSet&&) noexcept;
+            LiveSet& operator=(LiveSet&&) noexcept;
+
+            LiveSet(const LiveSet&) = delete;
+            LiveSet& operator=(const LiveSet&) = delete;
+
+            inline size_t size() const
+            {
+                return m_ends.size();
+            }
+
+            // Whether path, normalized, is a member.
+            bool contains(const std::string_view path) const;
+
+        private:
+            struct alignas(32) bucket_t
+            {
+                uint32_t tags[BUCKET_SLOTS];
+            };
+
+            std::vector<uint64_t> m_bloom;
+            std::vector<bucket_t> m_buckets;
+
+            // Member of each slot, parallel to the buckets.
+            std::vector<uint32_t> m_slots;
+
+            // Member i is m_strings[m_ends[i - 1], m_ends[i]).
+            std::string m_strings;
+            std::vector<uint32_t> m_ends;
+
+            std::string_view member(const uint32_t i) const;
+            bool find(const std::string_view path, const uint64_t hash) const;
+    };
+}
+
+#endif
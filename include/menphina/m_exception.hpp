@@ -32,6 +32,16 @@ namespace menphina
         private:
             std::string m_msg;
     };
+
+    // Thrown out of an Execution when its Job has been cancelled.
+    class cancelled_exception final : public std::exception
+    {
+        public:
+            cancelled_exception();
+            ~cancelled_exception();
+
+            const char* what() const throw() override;
+    };
 }
 
 #endif
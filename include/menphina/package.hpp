@@ -0,0 +1,41 @@
+/* Copyright 2024 isaki */
+
+#ifndef __MENPHINA_PACKAGE_HPP__
+#define __MENPHINA_PACKAGE_HPP__
+
+#include <string>
+#include <string_view>
+
+#include "menphina/exec.hpp"
+
+namespace menphina
+{
+    struct package_options_t
+    {
+        // Threads per pipeline stage; 0 picks a default for the core count.
+        unsigned read_threads = 0;
+        unsigned hash_threads = 0;
+        unsigned compress_threads = 0;
+
+        // zlib level chunks are deflated at; 0 stores them as they are.
+        int compression_level = 0;
+    };
+
+    class Package final : public Execution
+    {
+        public:
+            // manifestFile records what went into packageFile so that the
+            // next run only has to read the files that changed since.
+            Package(const std::string& packageFile, const std::string& manifestFile, const package_options_t& options = package_options_t {});
+            ~Package();
+
+            void run(const std::string_view& launcherDir) override;
+
+        private:
+            std::string m_packageFile;
+            std::string m_manifestFile;
+            package_options_t m_options;
+    };
+}
+
+#endif
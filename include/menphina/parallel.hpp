@@ -0,0 +1,94 @@
+/* Copyright 2024 isaki */
+
+#ifndef __MENPHINA_PARALLEL_HPP__
+#define __MENPHINA_PARALLEL_HPP__
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <utility>
+
+namespace menphina
+{
+    // 0 selects std::thread::hardware_concurrency(), never less than 1.
+    unsigned resolve_thread_count(const unsigned requested);
+
+    /*
+        Runs fn(index, worker) for every index in [0, count) on up to threads
+        threads (the calling thread is one of them). Indexes are handed out
+        dynamically, so uneven work balances itself; worker is in
+        [0, threads) and lets callers keep per-thread state without locking.
+        The first exception thrown by fn stops the remaining work and is
+        rethrown once every thread has finished.
+    */
+    void parallel_for(const size_t count, const unsigned threads, const std::function<void(size_t, unsigned)>& fn);
+
+    /*
+        FIFO between the stages of a pipeline. push() blocks while capacity
+        items are queued, which is what holds a fast producer back; pop()
+        blocks until there is an item. After close() pushes are refused and
+        pop() returns false once the queue has drained.
+    */
+    template<class T>
+    class BoundedQueue final
+    {
+        public:
+            explicit BoundedQueue(const size_t capacity) :
+                m_capacity((capacity == 0) ? 1 : capacity),
+                m_closed(false)
+            {
+            }
+
+            BoundedQueue(const BoundedQueue&) = delete;
+            BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+            bool push(T item)
+            {
+                std::unique_lock<std::mutex> lock(m_lock);
+                m_notFull.wait(lock, [this]() { return m_closed || m_items.size() < m_capacity; });
+                if (m_closed)
+                {
+                    return false;
+                }
+
+                m_items.push_back(std::move(item));
+                m_notEmpty.notify_one();
+                return true;
+            }
+
+            bool pop(T& out)
+            {
+                std::unique_lock<std::mutex> lock(m_lock);
+                m_notEmpty.wait(lock, [this]() { return m_closed || !m_items.empty(); });
+                if (m_items.empty())
+                {
+                    return false;
+                }
+
+                out = std::move(m_items.front());
+                m_items.pop_front();
+                m_notFull.notify_one();
+                return true;
+            }
+
+            void close()
+            {
+                const std::lock_guard<std::mutex> guard(m_lock);
+                m_closed = true;
+                m_notEmpty.notify_all();
+                m_notFull.notify_all();
+            }
+
+        private:
+            const size_t m_capacity;
+            bool m_closed;
+            std::deque<T> m_items;
+            std::mutex m_lock;
+            std::condition_variable m_notEmpty;
+            std::condition_variable m_notFull;
+    };
+}
+
+#endif
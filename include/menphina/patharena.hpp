@@ -0,0 +1,125 @@
+/* Copyright 2024 isaki */
+
+#ifndef __MENPHINA_PATHARENA_HPP__
+#define __MENPHINA_PATHARENA_HPP__
+
+/*
+    Interned store of relative paths.
+
+    A path is a node: its last component plus the id of the node it is in.
+    Components are stored once however many directories contain them (a mod
+    tree repeats "chara", "Textures" or "_n.tex" thousands of times), so a
+    path costs 8 bytes plus its share of the hash tables instead of a heap
+    allocated std::string.
+
+    Ids are dense and handed out in insertion order; node 0 is the root (the
+    empty path) and is its own parent. Lookups and name() work on
+    string_views and never allocate; a full path is only built by path(),
+    into a buffer the caller can reuse.
+*/
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace menphina
+{
+    using path_id = uint32_t;
+
+    inline constexpr path_id ROOT_PATH = 0;
+    inline constexpr path_id NO_PATH = std::numeric_limits<path_id>::max();
+
+    class PathArena final
+    {
+        public:
+            PathArena();
+            ~PathArena();
+
+            PathArena(PathArena&&) noexcept;
+            PathArena& operator=(PathArena&&) noexcept;
+
+            PathArena(const PathArena&) = delete;
+            PathArena& operator=(const PathArena&) = delete;
+
+            inline size_t size() const
+            {
+                return m_nodes.size();
+            }
+
+            // Number of distinct components.
+            inline size_t components() const
+            {
+                return m_components.size();
+            }
+
+            inline path_id parent(const path_id id) const
+            {
+                return m_nodes[id].parent;
+            }
+
+            inline std::string_view name(const path_id id) const
+            {
+                const component_t& c = m_components[m_nodes[id].component];
+                return std::string_view(m_names.data() + c.offset, c.length);
+            }
+
+            void reserve(const size_t nodes);
+
+            // The id of name in parent, added if it is not there yet.
+            path_id intern(const path_id parent, const std::string_view name);
+
+            // Adds name to parent without looking for an existing node. For
+            // callers that know the name to be new (directory listings);
+            // parent may be an id that is only added later.
+            path_id add(const path_id parent, const std::string_view name);
+
+            // NO_PATH if name is not in parent.
+            path_id find(const path_id parent, const std::string_view name) const;
+
+            // As above for a '/' separated path relative to the root; empty
+            // components are skipped.
+            path_id intern_path(const std::string_view path);
+            path_id find_path(const std::string_view path) const;
+
+            // The '/' separated path of id relative to the root. The output
+            // buffer is cleared first so callers can reuse it.
+            void path(const path_id id, std::string& out) const;
+            std::string path(const path_id id) const;
+
+            // Bytes held, for statistics.
+            size_t memory_usage() const;
+
+        private:
+            struct node_t
+            {
+                path_id parent;
+                uint32_t component;
+            };
+
+            struct component_t
+            {
+                uint32_t offset;
+                uint32_t length;
+            };
+
+            std::string m_names;
+            std::vector<component_t> m_components;
+            std::vector<node_t> m_nodes;
+
+            // Open addressing tables of (id + 1); 0 marks a free slot. Sizes
+            // are powers of two.
+            std::vector<uint32_t> m_componentTable;
+            std::vector<uint32_t> m_nodeTable;
+
+            uint32_t component_of(const std::string_view name);
+            uint32_t find_component(const std::string_view name) const;
+            path_id find_node(const path_id parent, const uint32_t component) const;
+            void insert_node(const path_id id);
+            void grow_components();
+            void grow_nodes(const size_t nodes);
+    };
+}
+
+#endif
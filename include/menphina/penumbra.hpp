@@ -0,0 +1,29 @@
+/* Copyright 2024 isaki */
+
+#ifndef __MENPHINA_PENUMBRA_HPP__
+#define __MENPHINA_PENUMBRA_HPP__
+
+/*
+    Knowledge of where Penumbra keeps things, relative to the launcher
+    (XIVLauncher / XIV on Mac / xlcore) configuration directory.
+*/
+
+#include <string>
+#include <string_view>
+
+namespace menphina
+{
+    // <launcher>/pluginConfigs/Penumbra.json
+    std::string get_penumbra_config_file(const std::string_view launcherDir);
+
+    // <launcher>/pluginConfigs/Penumbra
+    std::string get_penumbra_config_dir(const std::string_view launcherDir);
+
+    // <launcher>/pluginConfigs/Penumbra/sort_order.json
+    std::string get_penumbra_sort_order_file(const std::string_view launcherDir);
+
+    // <launcher>/pluginConfigs/Penumbra/collections
+    std::string get_penumbra_collections_dir(const std::string_view launcherDir);
+}
+
+#endif
@@ -27,9 +27,24 @@ namespace menphina
 
     std::string path_basename(const std::string_view pathstr);
     std::string path_join(const std::string_view a, const std::string_view b);
+
+    // Allocation free forms of the above: the basename as a view into
+    // pathstr, and b joined onto out in place (an absolute b replaces it).
+    std::string_view path_basename_view(const std::string_view pathstr);
+    void path_append(std::string& out, const std::string_view b);
+
+    // Whether path is relative and made only of plain components (no ".",
+    // "..", empty ones, backslashes or NULs), so that joining it onto a
+    // directory names something below that directory.
+    bool path_is_contained(const std::string_view path);
     bool path_exists(const std::string_view path);
 
+    // Converts a path read from plugin configuration (which on WSL is a
+    // Windows path) into one usable by this process.
+    std::string native_path(const std::string_view path);
+
     const std::string & get_user_home_directory();
+    const std::string & get_relative_launcher_config_dir();
 }
 
 #endif
@@ -0,0 +1,141 @@
+/* Copyright 2024 isaki */
+
+#ifndef __MENPHINA_REFINDEX_HPP__
+#define __MENPHINA_REFINDEX_HPP__
+
+/*
+    Persistent index of what the Penumbra configuration references.
+
+    Two kinds of source are indexed:
+
+        mods          the files the options of a mod point at (the "Files"
+                      of default_mod.json and group_*.json), relative to
+                      the mod directory
+        config files  the mod directories a collection or sort_order.json
+                      holds entries for
+
+    Every source carries a fingerprint of what it was parsed from (names,
+    sizes and mtimes), so a later run only parses the sources whose
+    fingerprint changed and takes everything else straight from the index.
+
+    Layout (all integers little endian):
+
+        refindex_header_t
+        refindex_source_t[]   sorted by kind, then name
+        refindex_ref_t[]      grouped by source, sorted within it
+        char[]                string pool (names, references)
+
+    Like xmpkg the file is only ever mapped read-only and used in place.
+*/
+
+#include <array>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "menphina/hash.hpp"
+
+namespace menphina
+{
+    inline constexpr std::array<char, 8> REFINDEX_MAGIC = { 'M', 'R', 'E', 'F', 'I', 'D', 'X', '\n' };
+    inline constexpr uint32_t REFINDEX_VERSION = 1;
+
+    enum class RefSourceKind : uint32_t
+    {
+        Mod = 0,
+        ConfigFile = 1
+    };
+
+    struct refindex_header_t
+    {
+        std::array<char, 8> magic;
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t source_table_offset;
+        uint64_t source_count;
+        uint64_t ref_table_offset;
+        uint64_t ref_count;
+        uint64_t strings_offset;
+        uint64_t strings_size;
+    };
+
+    struct refindex_source_t
+    {
+        uint64_t name_offset;
+        uint32_t name_length;
+        uint32_t kind;
+        uint64_t fingerprint_lo;
+        uint64_t fingerprint_hi;
+        uint64_t first_ref;
+        uint64_t ref_count;
+    };
+
+    struct refindex_ref_t
+    {
+        uint64_t offset;
+        uint32_t length;
+        uint32_t reserved;
+    };
+
+    static_assert(sizeof(refindex_header_t) == 64);
+    static_assert(sizeof(refindex_source_t) == 48);
+    static_assert(sizeof(refindex_ref_t) == 16);
+
+    // Mod file references are stored as Penumbra compares them: '/'
+    // separated and ASCII lower case.
+    std::string normalize_reference(const std::string_view path);
+
+    class ReferenceIndex final
+    {
+        public:
+            // A missing, outdated or corrupt index loads as empty; it is only
+            // a cache, so the caller just ends up parsing everything.
+            explicit ReferenceIndex(const std::string& file);
+            ~ReferenceIndex();
+
+            ReferenceIndex(const ReferenceIndex&) = delete;
+            ReferenceIndex& operator=(const ReferenceIndex&) = delete;
+
+            inline std::span<const refindex_source_t> sources() const
+            {
+                return m_sources;
+            }
+
+            // nullptr unless indexed with this fingerprint.
+            const refindex_source_t * find(const RefSourceKind kind, const std::string_view name, const content_hash_t& fingerprint) const;
+
+            std::string_view name(const refindex_source_t& source) const;
+
+            // The references of source; string_views stay valid for the
+            // lifetime of the index.
+            std::vector<std::string_view> refs(const refindex_source_t& source) const;
+
+        private:
+            std::string m_file;
+            const char * m_base;
+            uint64_t m_size;
+
+            std::span<const refindex_source_t> m_sources;
+            std::span<const refindex_ref_t> m_refs;
+            std::string_view m_strings;
+
+            bool load();
+            void unload();
+    };
+
+    // One source as written to a new index.
+    struct refindex_entry_t
+    {
+        RefSourceKind kind;
+        std::string name;
+        content_hash_t fingerprint;
+        std::vector<std::string> refs;
+    };
+
+    // Writes a complete index over file (staged and renamed into place).
+    void write_reference_index(const std::string& file, std::vector<refindex_entry_t> entries);
+}
+
+#endif
@@ -0,0 +1,167 @@
+/* Copyright 2024 isaki */
+
+#ifndef __MENPHINA_SCAN_HPP__
+#define __MENPHINA_SCAN_HPP__
+
+/*
+    Parallel directory scanner used for walking the Penumbra ModDirectory.
+
+    On Linux the walk is done with a pool of work-stealing threads that only
+    ever use directory file descriptors (openat/getdents64/statx), so no
+    absolute path is ever built or resolved during the scan. Entry i is path
+    i of a PathArena (see patharena.hpp): names are interned and every entry
+    refers to its parent by id; full paths are only materialized on demand.
+*/
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "menphina/iopolicy.hpp"
+#include "menphina/patharena.hpp"
+
+namespace menphina
+{
+    enum class EntryType : uint8_t
+    {
+        Unknown = 0,
+        File = 1,
+        Directory = 2,
+        Symlink = 3,
+        Other = 4
+    };
+
+    // Name and parent live in the ScanResult's PathArena.
+    struct scan_entry_t
+    {
+        uint16_t depth;
+        EntryType type;
+        uint64_t size;
+        int64_t mtime_ns;
+        uint64_t inode;
+    };
+
+    struct scan_options_t
+    {
+        // 0 selects std::thread::hardware_concurrency()
+        unsigned threads = 0;
+
+        // statx() regular files for size/mtime; d_type alone gives the type.
+        bool stat_files = true;
+
+        // statx() directories as well (only mtime and inode are of interest).
+        bool stat_directories = false;
+    };
+
+    struct scan_stats_t
+    {
+        uint64_t entries = 0;
+        uint64_t directories = 0;
+        uint64_t files = 0;
+        uint64_t bytes = 0;
+        uint64_t errors = 0;
+        unsigned threads = 0;
+        double seconds = 0.0;
+
+        // Policy the root's filesystem was scanned with.
+        IoPolicyKind io_policy = IoPolicyKind::Local;
+
+        double entries_per_second() const;
+    };
+
+    class ScanResult final
+    {
+        public:
+            ScanResult();
+            ~ScanResult();
+
+            ScanResult(ScanResult&&) noexcept;
+            ScanResult& operator=(ScanResult&&) noexcept;
+
+            inline size_t size() const
+            {
+                return m_entries.size();
+            }
+
+            inline const scan_entry_t& operator[](const size_t i) const
+            {
+                return m_entries[i];
+            }
+
+            inline const std::vector<scan_entry_t>& entries() const
+            {
+                return m_entries;
+            }
+
+            inline std::string_view name(const size_t i) const
+            {
+                return m_paths.name(static_cast<path_id>(i));
+            }
+
+            // Index of the containing directory; the root is its own parent.
+            inline size_t parent(const size_t i) const
+            {
+                return m_paths.parent(static_cast<path_id>(i));
+            }
+
+            // Entry i is path i; find_path() looks an entry up by its
+            // relative path without building any string.
+            inline const PathArena& paths() const
+            {
+                return m_paths;
+            }
+
+            inline const std::string& root() const
+            {
+                return m_root;
+            }
+
+            inline const scan_stats_t& stats() const
+            {
+                return m_stats;
+            }
+
+            // Failures below the root (permissions, races with deletes) do
+            // not abort the scan; they are collected here instead.
+            inline const std::vector<std::string>& errors() const
+            {
+                return m_errors;
+            }
+
+            // Path of entry i relative to the root, using '/' as separator.
+            // The output buffer is cleared first so callers can reuse it.
+            inline void relative_path(const size_t i, std::string& out) const
+            {
+                m_paths.path(static_cast<path_id>(i), out);
+            }
+
+            inline std::string relative_path(const size_t i) const
+            {
+                return m_paths.path(static_cast<path_id>(i));
+            }
+
+        private:
+            friend class DirectoryScanner;
+
+            std::string m_root;
+            std::vector<scan_entry_t> m_entries;
+            PathArena m_paths;
+            std::vector<std::string> m_errors;
+            scan_stats_t m_stats;
+    };
+
+    class DirectoryScanner final
+    {
+        public:
+            explicit DirectoryScanner(const scan_options_t& options = scan_options_t {});
+            ~DirectoryScanner();
+
+            ScanResult scan(const std::string_view root) const;
+
+        private:
+            scan_options_t m_options;
+    };
+}
+
+#endif
@@ -0,0 +1,71 @@
+/* Copyright 2024 isaki */
+
+#ifndef __MENPHINA_TRACE_HPP__
+#define __MENPHINA_TRACE_HPP__
+
+/*
+    Span tracing in the Chrome trace event format (chrome://tracing,
+    Perfetto, speedscope).
+
+    Spans are recorded into per-thread buffers, so tracing takes no locks on
+    the hot path; while it is off a span costs one relaxed atomic load.
+    Category and name must be string literals (or otherwise outlive the
+    trace) since only the pointers are kept.
+*/
+
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+
+namespace menphina
+{
+    // Phases a run is made of; the category of every span is one of these.
+    namespace trace_category
+    {
+        inline constexpr const char * RUN = "run";
+        inline constexpr const char * SCAN = "scan";
+        inline constexpr const char * READ = "read";
+        inline constexpr const char * HASH = "hash";
+        inline constexpr const char * COMPRESS = "compress";
+        inline constexpr const char * WRITE = "write";
+        inline constexpr const char * JSON = "json";
+    }
+
+    // The calling thread is shown as the main thread.
+    void trace_enable();
+    bool trace_enabled();
+
+    // Writes everything recorded so far as a trace event JSON file and a
+    // per-phase summary (spans, time, bytes, files) to out. Threads that
+    // record spans must have finished.
+    void trace_write(const std::string& file, std::ostream& out);
+
+    class TraceSpan final
+    {
+        public:
+            TraceSpan(const char * category, const char * name);
+            ~TraceSpan();
+
+            TraceSpan(const TraceSpan&) = delete;
+            TraceSpan& operator=(const TraceSpan&) = delete;
+
+            inline void add_bytes(const uint64_t n)
+            {
+                m_bytes += n;
+            }
+
+            inline void add_files(const uint64_t n)
+            {
+                m_files += n;
+            }
+
+        private:
+            const char * m_category;
+            const char * m_name;
+            uint64_t m_start;
+            uint64_t m_bytes;
+            uint64_t m_files;
+    };
+}
+
+#endif
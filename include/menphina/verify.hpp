@@ -0,0 +1,38 @@
+/* Copyright 2024 isaki */
+
+#ifndef __MENPHINA_VERIFY_HPP__
+#define __MENPHINA_VERIFY_HPP__
+
+/*
+    Checks a deployment against its package: every file the package holds
+    for the selected mods must exist under the ModDirectory with the same
+    size and content hash. Files are hashed in full on all cores, largest
+    first so one big texture does not finish alone at the end. Nothing is
+    written; files the package does not know about are not looked at.
+*/
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "menphina/exec.hpp"
+
+namespace menphina
+{
+    class Verify final : public Execution
+    {
+        public:
+            // An empty mod list verifies every mod in the package.
+            Verify(const std::string& packageFile, const std::vector<std::string>& mods);
+            ~Verify();
+
+            // Throws once everything has been checked if anything differs.
+            void run(const std::string_view& launcherDir) override;
+
+        private:
+            std::string m_packageFile;
+            std::vector<std::string> m_mods;
+    };
+}
+
+#endif
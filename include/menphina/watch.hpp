@@ -0,0 +1,50 @@
+/* Copyright 2024 isaki */
+
+#ifndef __MENPHINA_WATCH_HPP__
+#define __MENPHINA_WATCH_HPP__
+
+/*
+    Watch mode: a long running process that keeps a CleanState warm.
+
+    The ModDirectory (every directory in it) and the Penumbra configuration
+    directory are watched with inotify. Events are coalesced until things
+    have been quiet for a moment, then only the mods they touched are
+    rescanned. Clean requests come in over a Unix socket and are answered
+    from the warm state.
+
+    The protocol is line based: the client sends "clean <launcher dir>",
+    the server answers "ok" followed by the output of the clean and a final
+    "done" or "failed: <message>" line, or "unsupported" if it serves
+    another launcher directory.
+*/
+
+#include <iosfwd>
+#include <string>
+#include <string_view>
+
+#include "menphina/exec.hpp"
+
+namespace menphina
+{
+    class Watch final : public Execution
+    {
+        public:
+            Watch(const std::string& indexFile, const std::string& socketFile);
+            ~Watch();
+
+            // Runs until cancelled (or killed; a stale socket is cleaned up
+            // by the next watch process).
+            void run(const std::string_view& launcherDir) override;
+
+        private:
+            std::string m_indexFile;
+            std::string m_socketFile;
+    };
+
+    // Has the watch process listening on socketFile clean launcherDir and
+    // copies its output to out. Returns false, having written nothing, if
+    // no watch process serves launcherDir there; throws if the clean fails.
+    bool watch_request_clean(const std::string& socketFile, const std::string_view launcherDir, std::ostream& out);
+}
+
+#endif
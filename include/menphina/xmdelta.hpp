@@ -0,0 +1,233 @@
+/* Copyright 2024 isaki */
+
+#ifndef __MENPHINA_XMDELTA_HPP__
+#define __MENPHINA_XMDELTA_HPP__
+
+/*
+    The xmdelta package: what turns an installation of one xmpkg (the
+    base) into an installation of another (the target).
+
+    Every file of the target is one of
+
+        unchanged   same path and content as in the base; only the mtime
+                    is carried
+        patch       rebuilt from a base file (normally the one at the same
+                    path) and literal data: a list of ops that copy ranges
+                    of the base file or of the literal data
+        whole       all literal data
+
+    Patches come from an rsync style block match: the base file is cut into
+    blocks, every block is entered into a table under a rolling checksum,
+    and the checksum is rolled over the target a byte at a time. Since both
+    files are at hand when the delta is built, a checksum hit is confirmed
+    by comparing the bytes rather than with a strong hash.
+
+    Applying a delta reads the base files from the installation, so they
+    carry the size, mtime and hash they had in the base package; a file
+    that no longer matches is not patched.
+
+    Layout (all integers little endian):
+
+        xmdelta_header_t
+        literal data          (back to back)
+        xmdelta_op_t[]        grouped by file
+        xmdelta_mod_t[]       sorted by name
+        xmdelta_file_t[]      grouped by mod, sorted by path
+        char[]                string pool (mod names, file paths)
+        xmdelta_trailer_t
+
+    As with xmpkg the tables are found through the trailer and used in
+    place; every table starts on an 8 byte boundary.
+*/
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <span>
+#include <string>
+#include <string_view>
+
+#include "menphina/fileio.hpp"
+#include "menphina/hash.hpp"
+
+namespace menphina
+{
+    class XmpkgReader;
+
+    inline constexpr std::array<char, 8> XMDELTA_MAGIC = { 'X', 'M', 'D', 'L', 'T', '\r', '\n', '\x1a' };
+    inline constexpr uint32_t XMDELTA_VERSION = 1;
+
+    enum class DeltaFileKind : uint32_t
+    {
+        Unchanged = 0,
+        Patch = 1,
+        Whole = 2
+    };
+
+    enum class DeltaOpKind : uint32_t
+    {
+        // offset is into the base file.
+        Copy = 0,
+
+        // offset is into the delta.
+        Literal = 1
+    };
+
+    struct xmdelta_header_t
+    {
+        std::array<char, 8> magic;
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t base_size;
+        uint64_t target_size;
+    };
+
+    struct xmdelta_op_t
+    {
+        uint64_t offset;
+        uint64_t length;
+        uint32_t kind;
+        uint32_t reserved;
+    };
+
+    struct xmdelta_mod_t
+    {
+        uint64_t name_offset;
+        uint32_t name_length;
+        uint32_t reserved;
+        uint64_t first_file;
+        uint64_t file_count;
+    };
+
+    struct xmdelta_file_t
+    {
+        uint64_t path_offset;
+        uint32_t path_length;
+        uint32_t kind;
+        uint64_t first_op;
+        uint64_t op_count;
+
+        // The file as it is in the target.
+        uint64_t size;
+        int64_t mtime_ns;
+        uint64_t hash_lo;
+        uint64_t hash_hi;
+
+        // The base file a patch reads from; unused otherwise.
+        uint64_t base_mod_offset;
+        uint32_t base_mod_length;
+        uint32_t base_path_length;
+        uint64_t base_path_offset;
+        uint64_t base_size;
+        int64_t base_mtime_ns;
+        uint64_t base_hash_lo;
+        uint64_t base_hash_hi;
+    };
+
+    struct xmdelta_trailer_t
+    {
+        uint64_t op_table_offset;
+        uint64_t op_count;
+        uint64_t mod_table_offset;
+        uint64_t mod_count;
+        uint64_t file_table_offset;
+        uint64_t file_count;
+        uint64_t strings_offset;
+        uint64_t strings_size;
+        uint32_t version;
+        uint32_t reserved;
+        std::array<char, 8> magic;
+    };
+
+    static_assert(sizeof(xmdelta_header_t) == 32);
+    static_assert(sizeof(xmdelta_op_t) == 24);
+    static_assert(sizeof(xmdelta_mod_t) == 32);
+    static_assert(sizeof(xmdelta_file_t) == 120);
+    static_assert(sizeof(xmdelta_trailer_t) == 80);
+
+    struct xmdelta_write_stats_t
+    {
+        uint64_t mods = 0;
+        uint64_t files = 0;
+        uint64_t unchanged = 0;
+        uint64_t patched = 0;
+        uint64_t whole = 0;
+
+        // Of the target's content: copied from base files, and carried in
+        // the delta.
+        uint64_t copied_bytes = 0;
+        uint64_t literal_bytes = 0;
+
+        // Whole files whose content was already in the delta.
+        uint64_t duplicate_bytes = 0;
+
+        uint64_t delta_size = 0;
+    };
+
+    // Writes the delta from base to target to path (through a staging
+    // file, like XmpkgWriter). step runs ahead of every target file.
+    xmdelta_write_stats_t write_xmdelta(const XmpkgReader& base, const XmpkgReader& target, const std::string& path,
+        const std::function<void(uint64_t, uint64_t)>& step);
+
+    // Whether path starts like an xmdelta (rather than an xmpkg).
+    bool is_xmdelta(const std::string& path);
+
+    // Random access view of a finished delta; see XmpkgReader.
+    class XmdeltaReader final
+    {
+        public:
+            explicit XmdeltaReader(const std::string& path);
+            ~XmdeltaReader();
+
+            XmdeltaReader(const XmdeltaReader&) = delete;
+            XmdeltaReader& operator=(const XmdeltaReader&) = delete;
+
+            inline const std::string& path() const
+            {
+                return m_path;
+            }
+
+            inline int fd() const
+            {
+                return m_fd.get();
+            }
+
+            inline std::span<const xmdelta_mod_t> mods() const
+            {
+                return m_mods;
+            }
+
+            std::span<const xmdelta_file_t> files(const xmdelta_mod_t& mod) const;
+
+            // Bounds checked: literal ops against the delta, copy ops
+            // against base_size.
+            std::span<const xmdelta_op_t> ops(const xmdelta_file_t& file) const;
+
+            std::string_view name(const xmdelta_mod_t& mod) const;
+            std::string_view path(const xmdelta_file_t& file) const;
+            std::string_view base_mod(const xmdelta_file_t& file) const;
+            std::string_view base_path(const xmdelta_file_t& file) const;
+
+            // nullptr when not present.
+            const xmdelta_mod_t * find_mod(const std::string_view name) const;
+
+        private:
+            std::string m_path;
+            UniqueFd m_fd;
+            const std::byte * m_base;
+            uint64_t m_size;
+            uint64_t m_dataEnd;
+
+            std::span<const xmdelta_op_t> m_ops;
+            std::span<const xmdelta_mod_t> m_mods;
+            std::span<const xmdelta_file_t> m_files;
+            std::string_view m_strings;
+
+            std::string_view string_at(const uint64_t offset, const uint32_t length) const;
+
+            template<class T>
+            std::span<const T> table_at(const uint64_t offset, const uint64_t count, const uint64_t limit) const;
+    };
+}
+
+#endif
@@ -0,0 +1,312 @@
+/* Copyright 2024 isaki */
+
+#ifndef __MENPHINA_XMPKG_HPP__
+#define __MENPHINA_XMPKG_HPP__
+
+/*
+    The xmpkg deployment package.
+
+    File contents are split into chunks of at most XMPKG_CHUNK_SIZE bytes
+    and every chunk is stored once, addressed by its content hash; identical
+    textures shared between mods therefore cost nothing after the first copy.
+    A chunk is stored as is or, when that saves enough, deflated (zlib);
+    stored chunks can be copied out without passing through memory.
+
+    Layout (all integers little endian):
+
+        xmpkg_header_t
+        chunk data            (stored chunks, back to back)
+        xmpkg_chunk_t[]       chunk table
+        xmpkg_mod_t[]         per-mod manifest, sorted by name
+        xmpkg_file_t[]        files, grouped by mod, sorted by path
+        uint32_t[]            chunk references, grouped by file
+        uint32_t[]            chunk table indexes sorted by hash
+        char[]                string pool (mod names, file paths)
+        xmpkg_trailer_t       index footer; locates everything above
+
+    The trailer sits at the very end of the file so the tables can be
+    written after the (streamed) chunk data, and so a reader only has to
+    map the file and look at its last bytes to find anything in it. Every
+    table starts on an 8 byte boundary so it can be used in place.
+*/
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "menphina/copy.hpp"
+#include "menphina/fileio.hpp"
+#include "menphina/hash.hpp"
+
+namespace menphina
+{
+    inline constexpr std::array<char, 8> XMPKG_MAGIC = { 'X', 'M', 'P', 'K', 'G', '\r', '\n', '\x1a' };
+    inline constexpr uint32_t XMPKG_VERSION = 2;
+    inline constexpr uint32_t XMPKG_CHUNK_SIZE = 4 * 1024 * 1024;
+
+    enum class ChunkCodec : uint32_t
+    {
+        Store = 0,
+        Deflate = 1
+    };
+
+    struct xmpkg_header_t
+    {
+        std::array<char, 8> magic;
+        uint32_t version;
+        uint32_t chunk_size;
+        uint64_t reserved[2];
+    };
+
+    struct xmpkg_chunk_t
+    {
+        uint64_t hash_lo;
+        uint64_t hash_hi;
+        uint64_t offset;
+        uint32_t stored_size;
+        uint32_t raw_size;
+        uint32_t codec;
+        uint32_t reserved;
+    };
+
+    struct xmpkg_mod_t
+    {
+        uint64_t name_offset;
+        uint32_t name_length;
+        uint32_t reserved;
+        uint64_t first_file;
+        uint64_t file_count;
+    };
+
+    struct xmpkg_file_t
+    {
+        uint64_t path_offset;
+        uint32_t path_length;
+        uint32_t chunk_count;
+        uint64_t first_chunk_ref;
+        uint64_t size;
+        int64_t mtime_ns;
+        // Hash of the whole file, so callers can compare without chunking.
+        uint64_t hash_lo;
+        uint64_t hash_hi;
+    };
+
+    struct xmpkg_trailer_t
+    {
+        uint64_t chunk_table_offset;
+        uint64_t chunk_count;
+        uint64_t mod_table_offset;
+        uint64_t mod_count;
+        uint64_t file_table_offset;
+        uint64_t file_count;
+        uint64_t ref_table_offset;
+        uint64_t ref_count;
+        uint64_t chunk_index_offset;
+        uint64_t strings_offset;
+        uint64_t strings_size;
+        uint32_t version;
+        uint32_t reserved;
+        std::array<char, 8> magic;
+    };
+
+    static_assert(sizeof(xmpkg_header_t) == 32);
+    static_assert(sizeof(xmpkg_chunk_t) == 40);
+    static_assert(sizeof(xmpkg_mod_t) == 32);
+    static_assert(sizeof(xmpkg_file_t) == 56);
+    static_assert(sizeof(xmpkg_trailer_t) == 104);
+
+    struct xmpkg_write_stats_t
+    {
+        uint64_t mods = 0;
+        uint64_t files = 0;
+        uint64_t raw_bytes = 0;
+        uint64_t stored_bytes = 0;
+        uint64_t chunks = 0;
+        uint64_t duplicate_chunks = 0;
+        uint64_t reused_files = 0;
+        uint64_t reused_bytes = 0;
+    };
+
+    // Encodes a chunk for storage and returns the codec used. Deflate (at
+    // level) is only chosen when it saves enough to be worth inflating on
+    // deploy; for Store out is left empty and the chunk is stored as given.
+    // The result depends on nothing but data and level.
+    ChunkCodec xmpkg_encode_chunk(const void * data, const uint32_t length, const int level, std::vector<char>& out);
+
+    class XmpkgReader;
+
+    class XmpkgWriter final
+    {
+        public:
+            // The package is written next to path and only renamed into
+            // place by finish(); an unfinished writer leaves nothing behind.
+            explicit XmpkgWriter(const std::string& path);
+            ~XmpkgWriter();
+
+            XmpkgWriter(const XmpkgWriter&) = delete;
+            XmpkgWriter& operator=(const XmpkgWriter&) = delete;
+
+            void begin_mod(const std::string_view name);
+
+            // Reads fd to EOF and adds its content to the current mod.
+            void add_file(const std::string_view path, const int fd, const int64_t mtimeNs);
+
+            // add_file() in pieces, for content read, hashed and encoded
+            // elsewhere: begin_file(), every chunk in file order, end_file()
+            // with the hash of the whole file. data may be null for a chunk
+            // has_chunk() already knows.
+            void begin_file(const std::string_view path, const int64_t mtimeNs);
+            void add_encoded_chunk(const content_hash_t& hash, const void * data, const uint32_t storedSize, const uint32_t rawSize, const ChunkCodec codec);
+            void end_file(const content_hash_t& hash);
+
+            bool has_chunk(const content_hash_t& hash) const;
+
+            // Adds file from an existing package to the current mod by
+            // copying its stored chunks; nothing is re-read or re-encoded.
+            // The copy is done in bulk by finish(), so source must stay open
+            // until then.
+            void add_reused_file(const XmpkgReader& source, const xmpkg_file_t& file);
+
+            void finish();
+
+            inline const xmpkg_write_stats_t& stats() const
+            {
+                return m_stats;
+            }
+
+        private:
+            std::string m_path;
+            UniqueFd m_dirFd;
+            std::string m_name;
+            std::string m_staged;
+            std::string m_stagedPath;
+            UniqueFd m_fd;
+            uint64_t m_offset;
+            bool m_finished;
+            bool m_fileOpen;
+
+            std::vector<xmpkg_chunk_t> m_chunks;
+            std::unordered_map<content_hash_t, uint32_t, content_hash_hasher> m_chunkIndex;
+            std::vector<xmpkg_mod_t> m_mods;
+            std::vector<xmpkg_file_t> m_files;
+            std::vector<uint32_t> m_refs;
+            std::string m_strings;
+
+            std::vector<char> m_buffer;
+            CopyEngine m_copy;
+            xmpkg_write_stats_t m_stats;
+
+            uint64_t add_string(const std::string_view s);
+            void add_chunk(const char * data, const uint32_t length);
+            uint32_t store_chunk(const content_hash_t& hash, const void * data, const uint32_t storedSize, const uint32_t rawSize, const uint32_t codec);
+
+            // Index of the chunk with hash. A chunk not stored yet gets a
+            // table entry and storedSize bytes at the end of the data, and
+            // isNew tells the caller to fill them in.
+            uint32_t reserve_chunk(const content_hash_t& hash, const uint32_t storedSize, const uint32_t rawSize, const uint32_t codec, bool& isNew);
+
+            void align_table();
+
+            template<class T>
+            uint64_t write_table(const std::vector<T>& table);
+    };
+
+    // Random access, zero-copy view of a finished package. The file is
+    // mapped read-only; nothing is read until a table or chunk is touched,
+    // and all lookups go through the sorted tables in O(log n). Spans and
+    // string_views returned stay valid for the lifetime of the reader.
+    class XmpkgReader final
+    {
+        public:
+            explicit XmpkgReader(const std::string& path);
+            ~XmpkgReader();
+
+            XmpkgReader(const XmpkgReader&) = delete;
+            XmpkgReader& operator=(const XmpkgReader&) = delete;
+
+            inline const std::string& path() const
+            {
+                return m_path;
+            }
+
+            inline uint64_t size() const
+            {
+                return m_size;
+            }
+
+            // The package itself, for copying chunks without going through
+            // the mapping.
+            inline int fd() const
+            {
+                return m_fd.get();
+            }
+
+            inline std::span<const xmpkg_mod_t> mods() const
+            {
+                return m_mods;
+            }
+
+            inline std::span<const xmpkg_chunk_t> chunks() const
+            {
+                return m_chunks;
+            }
+
+            std::span<const xmpkg_file_t> files(const xmpkg_mod_t& mod) const;
+            std::span<const uint32_t> chunk_refs(const xmpkg_file_t& file) const;
+
+            // Checked as they are read, so that one bad entry only spoils
+            // the mods that use it: a name or path that would lead out of
+            // the mod directory (see path_is_contained) is corrupt.
+            std::string_view name(const xmpkg_mod_t& mod) const;
+            std::string_view path(const xmpkg_file_t& file) const;
+
+            const xmpkg_chunk_t& chunk(const uint32_t index) const;
+
+            // The bytes of the chunk as stored in the package.
+            std::span<const std::byte> chunk_data(const xmpkg_chunk_t& chunk) const;
+
+            // nullptr when not present.
+            const xmpkg_mod_t * find_mod(const std::string_view name) const;
+            const xmpkg_file_t * find_file(const xmpkg_mod_t& mod, const std::string_view path) const;
+            const xmpkg_chunk_t * find_chunk(const content_hash_t& hash) const;
+
+            // Hint that the chunks of file are about to be read.
+            void will_need(const xmpkg_file_t& file) const;
+
+            // Writes the content of file to fd at its current position.
+            void extract(const xmpkg_file_t& file, const int fd) const;
+
+            // The content of file, in out (resized to fit).
+            void load(const xmpkg_file_t& file, std::vector<char>& out) const;
+
+            // Queues the content of file for copying to the start of fd;
+            // nothing is written until the engine runs. Returns false, and
+            // queues nothing, if a chunk is not stored verbatim.
+            bool queue_extract(const xmpkg_file_t& file, const int fd, CopyEngine& engine) const;
+
+        private:
+            std::string m_path;
+            UniqueFd m_fd;
+            const std::byte * m_base;
+            uint64_t m_size;
+
+            std::span<const xmpkg_chunk_t> m_chunks;
+            std::span<const xmpkg_mod_t> m_mods;
+            std::span<const xmpkg_file_t> m_files;
+            std::span<const uint32_t> m_refs;
+            std::span<const uint32_t> m_chunkIndex;
+            std::string_view m_strings;
+
+            std::string_view string_at(const uint64_t offset, const uint32_t length) const;
+
+            template<class T>
+            std::span<const T> table_at(const uint64_t offset, const uint64_t count, const uint64_t limit) const;
+    };
+}
+
+#endif
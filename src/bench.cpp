@@ -0,0 +1,803 @@
+/* Copyright 2024 isaki */
+
+/*
+    menphina-bench: generates a synthetic Penumbra installation and times
+    the operating modes and the JSON layer against it.
+
+    Everything generated derives from --seed through our own generator (not
+    <random>'s distributions, whose output differs between standard
+    libraries), so the same options give byte identical trees on every
+    machine and numbers from different builds can be compared directly.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "boost/program_options.hpp"
+#include "menphina_internal/config.hpp"
+
+#include "menphina/clean.hpp"
+#include "menphina/deploy.hpp"
+#include "menphina/fileio.hpp"
+#include "menphina/json.hpp"
+#include "menphina/m_exception.hpp"
+#include "menphina/package.hpp"
+#include "menphina/penumbra.hpp"
+#include "menphina/platform.hpp"
+
+namespace po = boost::program_options;
+
+namespace
+{
+    const std::string MODS_DIR_NAME { "mods" };
+    const std::string DEPLOY_DIR_NAME { "deploy" };
+    const std::string SOURCE_LAUNCHER_NAME { "launcher" };
+    const std::string TARGET_LAUNCHER_NAME { "launcher-target" };
+    const std::string JSON_OUT_DIR_NAME { "json-out" };
+    const std::string PACKAGE_NAME { "bench.xmpkg" };
+    const std::string MANIFEST_NAME { "bench.manifest.json" };
+    const std::string REFERENCE_INDEX_NAME { "bench.refindex" };
+
+    const std::string SORT_ORDER_FOLDER { "Synthetic" };
+
+    // Share of extra, orphaned entries in sort_order.json and the
+    // collection so clean always has something to remove.
+    inline constexpr double ORPHAN_RATIO = 0.1;
+
+    // Every synthetic file gets the same mtime so repeated generation does
+    // not look like a change to package.
+    inline constexpr int64_t FILE_MTIME_NS = 1700000000LL * 1000000000LL;
+
+    inline constexpr size_t WRITE_BUFFER_LENGTH = 1024 * 1024;
+
+    // splitmix64; small, fast and identical everywhere.
+    class Random final
+    {
+        public:
+            explicit Random(const uint64_t seed) : m_state(seed) {}
+
+            uint64_t next()
+            {
+                uint64_t z = (m_state += 0x9E3779B97F4A7C15ULL);
+                z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+                return z ^ (z >> 31);
+            }
+
+            // [0, 1)
+            double unit()
+            {
+                return static_cast<double>(next() >> 11) * 0x1.0p-53;
+            }
+
+            // [0, n)
+            uint64_t below(const uint64_t n)
+            {
+                return (n == 0) ? 0 : next() % n;
+            }
+
+        private:
+            uint64_t m_state;
+    };
+
+    struct content_t
+    {
+        uint64_t seed;
+        uint64_t size;
+    };
+
+    struct tree_t
+    {
+        std::string root;
+        std::string modsDir;
+        std::string deployDir;
+        std::string sourceLauncher;
+        std::string targetLauncher;
+        std::string jsonOutDir;
+        std::string packageFile;
+        std::string manifestFile;
+        std::string referenceIndexFile;
+
+        std::vector<std::string> modNames;
+        std::vector<std::string> jsonFiles;
+
+        uint64_t files = 0;
+        uint64_t bytes = 0;
+        uint64_t uniqueBytes = 0;
+        uint64_t jsonBytes = 0;
+    };
+
+    // Temporarily sends std::cout nowhere; the modes report as they go and
+    // that is not what is being measured.
+    class QuietStdout final
+    {
+        public:
+            QuietStdout() : m_saved(std::cout.rdbuf(&m_null)) {}
+
+            ~QuietStdout()
+            {
+                std::cout.rdbuf(m_saved);
+            }
+
+        private:
+            class NullBuffer final : public std::streambuf
+            {
+                protected:
+                    int_type overflow(int_type c) override
+                    {
+                        return traits_type::not_eof(c);
+                    }
+            };
+
+            NullBuffer m_null;
+            std::streambuf * m_saved;
+    };
+
+    std::string _json_string(const std::string_view s)
+    {
+        std::string ret;
+        ret.reserve(s.size() + 2);
+        ret += '"';
+
+        for (const char c : s)
+        {
+            switch (c)
+            {
+                case '"':
+                    ret += "\\\"";
+                    break;
+                case '\\':
+                    ret += "\\\\";
+                    break;
+                default:
+                    if (static_cast<unsigned char>(c) < 0x20)
+                    {
+                        char esc[8];
+                        std::snprintf(esc, sizeof(esc), "\\u%04x", static_cast<unsigned>(c));
+                        ret += esc;
+                    }
+                    else
+                    {
+                        ret += c;
+                    }
+                    break;
+            }
+        }
+
+        ret += '"';
+        return ret;
+    }
+
+    std::string _backslashes(std::string path)
+    {
+        std::replace(path.begin(), path.end(), '/', '\\');
+        return path;
+    }
+
+    void _write_text(const std::string& file, const std::string& text)
+    {
+        const int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1)
+        {
+            throw menphina::file_open_exception(file, false);
+        }
+
+        const menphina::UniqueFd guard(fd);
+        menphina::write_all(fd, text.data(), text.size(), file);
+    }
+
+    void _write_content(const std::string& file, const content_t& content, std::vector<char>& buffer)
+    {
+        const int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1)
+        {
+            throw menphina::file_open_exception(file, false);
+        }
+
+        const menphina::UniqueFd guard(fd);
+
+        // Incompressible, like the BC-compressed textures that make up most
+        // of a real library.
+        Random rng(content.seed);
+        for (uint64_t left = content.size; left > 0;)
+        {
+            const size_t n = static_cast<size_t>(std::min<uint64_t>(left, buffer.size()));
+            for (size_t i = 0; i < n; i += sizeof(uint64_t))
+            {
+                const uint64_t v = rng.next();
+                std::memcpy(buffer.data() + i, &v, std::min(sizeof(v), n - i));
+            }
+
+            menphina::write_all(fd, buffer.data(), n, file);
+            left -= n;
+        }
+
+        const struct timespec times[2] = {
+            { .tv_sec = 0, .tv_nsec = UTIME_OMIT },
+            { .tv_sec = static_cast<time_t>(FILE_MTIME_NS / 1000000000), .tv_nsec = 0 }
+        };
+
+        futimens(fd, times);
+    }
+
+    // A game path in one of the shapes mods most commonly replace.
+    std::string _game_path(const uint32_t mod, const uint32_t index)
+    {
+        const uint32_t item = 1000 + (mod * 97 + index / 3) % 9000;
+
+        char buf[128];
+        switch (index % 3)
+        {
+            case 0:
+                std::snprintf(buf, sizeof(buf), "chara/equipment/e%04u/texture/v01_c0101e%04u_top_%u_n.tex", item, item, index);
+                break;
+            case 1:
+                std::snprintf(buf, sizeof(buf), "chara/equipment/e%04u/model/c0101e%04u_top_%u.mdl", item, item, index);
+                break;
+            default:
+                std::snprintf(buf, sizeof(buf), "chara/equipment/e%04u/material/v0001/mt_c0101e%04u_top_%u_a.mtrl", item, item, index);
+                break;
+        }
+
+        return buf;
+    }
+
+    std::string _files_object(const std::vector<std::string>& gamePaths, const size_t begin, const size_t end, const std::string& indent)
+    {
+        std::string ret = "{";
+        for (size_t i = begin; i < end; ++i)
+        {
+            ret += (i == begin) ? "\n" : ",\n";
+            ret += indent + "  " + _json_string(gamePaths[i]) + ": " + _json_string(_backslashes(gamePaths[i]));
+        }
+
+        ret += (begin == end) ? "}" : "\n" + indent + "}";
+        return ret;
+    }
+
+    // meta.json, default_mod.json and one option group; half of the files
+    // are always on, the other half belong to the group's option.
+    void _write_mod_json(tree_t& tree, const std::string& modDir, const std::string& name, const std::vector<std::string>& gamePaths)
+    {
+        const size_t half = gamePaths.size() / 2;
+
+        const std::string meta = "{\n"
+            "  \"FileVersion\": 3,\n"
+            "  \"Name\": " + _json_string(name) + ",\n"
+            "  \"Author\": \"menphina-bench\",\n"
+            "  \"Description\": \"Synthetic mod\",\n"
+            "  \"Version\": \"1.0.0\",\n"
+            "  \"Website\": \"\",\n"
+            "  \"ModTags\": []\n"
+            "}";
+
+        const std::string defaultMod = "{\n"
+            "  \"Name\": \"\",\n"
+            "  \"Priority\": 0,\n"
+            "  \"Files\": " + _files_object(gamePaths, 0, half, "  ") + ",\n"
+            "  \"FileSwaps\": {},\n"
+            "  \"Manipulations\": []\n"
+            "}";
+
+        const std::string group = "{\n"
+            "  \"Version\": 0,\n"
+            "  \"Name\": \"Options\",\n"
+            "  \"Description\": \"\",\n"
+            "  \"Priority\": 0,\n"
+            "  \"Type\": \"Multi\",\n"
+            "  \"DefaultSettings\": 1,\n"
+            "  \"Options\": [\n"
+            "    {\n"
+            "      \"Name\": \"Extra\",\n"
+            "      \"Description\": \"\",\n"
+            "      \"Priority\": 0,\n"
+            "      \"Files\": " + _files_object(gamePaths, half, gamePaths.size(), "      ") + ",\n"
+            "      \"FileSwaps\": {},\n"
+            "      \"Manipulations\": []\n"
+            "    }\n"
+            "  ]\n"
+            "}";
+
+        const std::pair<const char *, const std::string *> files[] = {
+            { "meta.json", &meta },
+            { "default_mod.json", &defaultMod },
+            { "group_001_options.json", &group }
+        };
+
+        for (const auto& [fileName, text] : files)
+        {
+            const std::string file = menphina::path_join(modDir, fileName);
+            _write_text(file, *text);
+            tree.jsonFiles.push_back(file);
+            tree.jsonBytes += text->size();
+        }
+    }
+
+    void _write_penumbra_config(const std::string& launcher, const std::string& modDir)
+    {
+        std::filesystem::create_directories(menphina::get_penumbra_collections_dir(launcher));
+
+        _write_text(menphina::get_penumbra_config_file(launcher), "{\n"
+            "  \"Version\": 8,\n"
+            "  \"EnableMods\": true,\n"
+            "  \"ModDirectory\": " + _json_string(modDir) + "\n"
+            "}");
+    }
+
+    // sort_order.json and the default collection, with orphaned entries.
+    // Rewritten before every clean iteration since clean removes those.
+    void _write_mod_lists(const tree_t& tree, const uint64_t seed)
+    {
+        std::vector<std::string> names = tree.modNames;
+
+        const size_t orphans = static_cast<size_t>(std::ceil(static_cast<double>(names.size()) * ORPHAN_RATIO));
+        for (size_t i = 0; i < orphans; ++i)
+        {
+            char buf[64];
+            std::snprintf(buf, sizeof(buf), "Removed Mod %04zu", i);
+            names.push_back(buf);
+        }
+
+        // Penumbra keeps these in no particular order; neither do we.
+        Random rng(seed ^ 0x5EED0F0DULL);
+        for (size_t i = names.size(); i > 1; --i)
+        {
+            std::swap(names[i - 1], names[rng.below(i)]);
+        }
+
+        std::string sortOrder = "{\n  \"Data\": {";
+        std::string collection = "{\n"
+            "  \"Version\": 2,\n"
+            "  \"Id\": \"00000000-0000-0000-0000-000000000001\",\n"
+            "  \"Name\": \"Default\",\n"
+            "  \"Settings\": {";
+
+        for (size_t i = 0; i < names.size(); ++i)
+        {
+            const char * sep = (i == 0) ? "\n" : ",\n";
+            sortOrder += sep;
+            sortOrder += "    " + _json_string(names[i]) + ": " + _json_string(SORT_ORDER_FOLDER + "/" + names[i]);
+
+            collection += sep;
+            collection += "    " + _json_string(names[i]) + ": {\n"
+                "      \"Settings\": {\n"
+                "        \"Options\": 1\n"
+                "      },\n"
+                "      \"Priority\": 0,\n"
+                "      \"Enabled\": true\n"
+                "    }";
+        }
+
+        sortOrder += "\n  },\n  \"EmptyFolders\": []\n}";
+        collection += "\n  },\n  \"Inheritance\": []\n}";
+
+        _write_text(menphina::get_penumbra_sort_order_file(tree.sourceLauncher), sortOrder);
+        _write_text(menphina::path_join(menphina::get_penumbra_collections_dir(tree.sourceLauncher), "Default.json"), collection);
+    }
+
+    uint64_t _log_uniform(Random& rng, const uint64_t lo, const uint64_t hi)
+    {
+        if (hi <= lo)
+        {
+            return lo;
+        }
+
+        const double l = std::log(static_cast<double>(std::max<uint64_t>(lo, 1)));
+        const double h = std::log(static_cast<double>(hi));
+        const uint64_t v = static_cast<uint64_t>(std::exp(l + (h - l) * rng.unit()));
+        return std::clamp(v, lo, hi);
+    }
+
+    tree_t _generate_tree(const std::string& root, const menphina::bench_config_t& config)
+    {
+        tree_t tree;
+        tree.root = root;
+        tree.modsDir = menphina::path_join(root, MODS_DIR_NAME);
+        tree.deployDir = menphina::path_join(root, DEPLOY_DIR_NAME);
+        tree.sourceLauncher = menphina::path_join(root, SOURCE_LAUNCHER_NAME);
+        tree.targetLauncher = menphina::path_join(root, TARGET_LAUNCHER_NAME);
+        tree.jsonOutDir = menphina::path_join(root, JSON_OUT_DIR_NAME);
+        tree.packageFile = menphina::path_join(root, PACKAGE_NAME);
+        tree.manifestFile = menphina::path_join(root, MANIFEST_NAME);
+        tree.referenceIndexFile = menphina::path_join(root, REFERENCE_INDEX_NAME);
+
+        std::filesystem::create_directories(tree.modsDir);
+        std::filesystem::create_directories(tree.jsonOutDir);
+
+        _write_penumbra_config(tree.sourceLauncher, tree.modsDir);
+        _write_penumbra_config(tree.targetLauncher, tree.deployDir);
+
+        Random rng(config.Seed);
+        std::vector<content_t> contents;
+        std::vector<char> buffer(WRITE_BUFFER_LENGTH);
+
+        for (uint32_t m = 0; m < config.Mods; ++m)
+        {
+            char name[64];
+            std::snprintf(name, sizeof(name), "Synthetic Mod %04u", m);
+            tree.modNames.push_back(name);
+
+            const std::string modDir = menphina::path_join(tree.modsDir, name);
+            std::vector<std::string> gamePaths;
+            gamePaths.reserve(config.FilesPerMod);
+
+            for (uint32_t f = 0; f < config.FilesPerMod; ++f)
+            {
+                // Duplicates copy an earlier file, possibly from another
+                // mod, the way shared base textures do.
+                content_t content;
+                if (!contents.empty() && rng.unit() < config.DuplicateRatio)
+                {
+                    content = contents[rng.below(contents.size())];
+                }
+                else
+                {
+                    content = content_t { rng.next(), _log_uniform(rng, config.MinFileSize, config.MaxFileSize) };
+                    contents.push_back(content);
+                    tree.uniqueBytes += content.size;
+                }
+
+                gamePaths.push_back(_game_path(m, f));
+
+                const std::string file = menphina::path_join(modDir, gamePaths.back());
+                std::filesystem::create_directories(std::filesystem::path(file).parent_path());
+                _write_content(file, content, buffer);
+
+                ++tree.files;
+                tree.bytes += content.size;
+            }
+
+            _write_mod_json(tree, modDir, name, gamePaths);
+        }
+
+        _write_mod_lists(tree, config.Seed);
+        return tree;
+    }
+
+    double _percentile(const std::vector<double>& sorted, const double p)
+    {
+        const size_t i = static_cast<size_t>(std::ceil(p * static_cast<double>(sorted.size()))) - 1;
+        return sorted[std::min(i, sorted.size() - 1)];
+    }
+
+    /*
+        Runs setup() and body() once untimed (to settle the page cache and
+        create whatever state the next benchmark expects), then iterations
+        more times, timing body() only.
+    */
+    menphina::bench_result_t _measure(const std::string& name, const uint32_t iterations, const uint64_t files, const uint64_t bytes,
+        const std::function<void()>& setup, const std::function<void()>& body)
+    {
+        std::vector<double> samples;
+        samples.reserve(iterations);
+
+        for (uint32_t i = 0; i <= iterations; ++i)
+        {
+            if (setup)
+            {
+                setup();
+            }
+
+            double seconds;
+            {
+                const QuietStdout quiet;
+                const auto start = std::chrono::steady_clock::now();
+                body();
+                const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                seconds = elapsed.count();
+            }
+
+            if (i != 0)
+            {
+                samples.push_back(seconds);
+            }
+        }
+
+        std::sort(samples.begin(), samples.end());
+
+        double total = 0.0;
+        for (const double s : samples)
+        {
+            total += s;
+        }
+
+        menphina::bench_result_t ret {};
+        ret.Name = name;
+        ret.Iterations = iterations;
+        ret.Files = files;
+        ret.Bytes = bytes;
+        ret.MinSeconds = samples.front();
+        ret.MedianSeconds = _percentile(samples, 0.5);
+        ret.P90Seconds = _percentile(samples, 0.9);
+        ret.MaxSeconds = samples.back();
+        ret.MeanSeconds = total / static_cast<double>(samples.size());
+        ret.FilesPerSecond = (ret.MedianSeconds > 0.0) ? static_cast<double>(files) / ret.MedianSeconds : 0.0;
+        ret.BytesPerSecond = (ret.MedianSeconds > 0.0) ? static_cast<double>(bytes) / ret.MedianSeconds : 0.0;
+        return ret;
+    }
+
+    void _print_result(const menphina::bench_result_t& r)
+    {
+        std::cout << std::left << std::setw(26) << r.Name << std::right
+            << std::fixed << std::setprecision(4)
+            << " median " << std::setw(9) << r.MedianSeconds << "s"
+            << "  p90 " << std::setw(9) << r.P90Seconds << "s"
+            << "  min " << std::setw(9) << r.MinSeconds << "s"
+            << std::setprecision(1)
+            << "  " << std::setw(10) << r.FilesPerSecond << " files/s"
+            << "  " << std::setw(8) << r.BytesPerSecond / (1024.0 * 1024.0) << " MiB/s"
+            << std::defaultfloat << std::endl;
+    }
+
+    std::vector<menphina::bench_result_t> _run_benchmarks(const tree_t& tree, const menphina::bench_config_t& config, const std::vector<std::string>& only)
+    {
+        std::vector<menphina::bench_result_t> results;
+
+        const auto selected = [&only](const std::string& name)
+        {
+            if (only.empty())
+            {
+                return true;
+            }
+
+            return std::any_of(only.cbegin(), only.cend(), [&name](const std::string& o) { return name.compare(0, o.size(), o) == 0; });
+        };
+
+        const auto run = [&](const std::string& name, const uint64_t files, const uint64_t bytes, const std::function<void()>& setup, const std::function<void()>& body)
+        {
+            if (!selected(name))
+            {
+                return;
+            }
+
+            results.push_back(_measure(name, config.Iterations, files, bytes, setup, body));
+            _print_result(results.back());
+        };
+
+        const uint64_t jsonCount = tree.jsonFiles.size();
+
+        run("json.read", jsonCount, tree.jsonBytes, nullptr, [&tree]()
+        {
+            static_cast<void>(menphina::read_generic_json_files(tree.jsonFiles));
+        });
+
+        run("json.read.serial", jsonCount, tree.jsonBytes, nullptr, [&tree]()
+        {
+            static_cast<void>(menphina::read_generic_json_files(tree.jsonFiles, 1));
+        });
+
+        // Parsed once up front; only writing is measured below.
+        std::vector<glz::json_t> values;
+        std::vector<std::string> outFiles;
+        for (size_t i = 0; i < tree.jsonFiles.size(); ++i)
+        {
+            glz::json_t value;
+            menphina::read_generic_json_file(value, tree.jsonFiles[i]);
+            values.push_back(std::move(value));
+            outFiles.push_back(menphina::path_join(tree.jsonOutDir, std::to_string(i) + ".json"));
+        }
+
+        run("json.write", jsonCount, tree.jsonBytes, nullptr, [&values, &outFiles]()
+        {
+            for (size_t i = 0; i < values.size(); ++i)
+            {
+                menphina::write_generic_json_file(values[i], outFiles[i]);
+            }
+        });
+
+        // After the warm-up run everything is up to date; this measures
+        // the compare-and-skip path.
+        run("json.write.if_changed", jsonCount, tree.jsonBytes, nullptr, [&values, &outFiles]()
+        {
+            menphina::JsonWriteBatch batch;
+            for (size_t i = 0; i < values.size(); ++i)
+            {
+                batch.add(values[i], outFiles[i]);
+            }
+
+            batch.commit();
+        });
+
+        // Without a reference index every option file is parsed; with one
+        // only the rewritten collection and sort order are.
+        run("clean.full", tree.files, tree.bytes, [&tree, &config]()
+        {
+            _write_mod_lists(tree, config.Seed);
+            std::filesystem::remove(tree.referenceIndexFile);
+        },
+        [&tree]()
+        {
+            menphina::Clean exec(tree.referenceIndexFile);
+            exec.run(tree.sourceLauncher);
+        });
+
+        run("clean.incremental", tree.files, tree.bytes, [&tree, &config]() { _write_mod_lists(tree, config.Seed); }, [&tree]()
+        {
+            menphina::Clean exec(tree.referenceIndexFile);
+            exec.run(tree.sourceLauncher);
+        });
+
+        run("package.full", tree.files, tree.bytes, [&tree]()
+        {
+            std::filesystem::remove(tree.packageFile);
+            std::filesystem::remove(tree.manifestFile);
+        },
+        [&tree]()
+        {
+            menphina::Package exec(tree.packageFile, tree.manifestFile);
+            exec.run(tree.sourceLauncher);
+        });
+
+        run("package.incremental", tree.files, tree.bytes, nullptr, [&tree]()
+        {
+            menphina::Package exec(tree.packageFile, tree.manifestFile);
+            exec.run(tree.sourceLauncher);
+        });
+
+        // Both deploy benchmarks need the package; build it if package.*
+        // was filtered out.
+        if (!menphina::path_exists(tree.packageFile) && (selected("deploy.full") || selected("deploy.incremental")))
+        {
+            const QuietStdout quiet;
+            menphina::Package exec(tree.packageFile, tree.manifestFile);
+            exec.run(tree.sourceLauncher);
+        }
+
+        run("deploy.full", tree.files, tree.bytes, [&tree]() { std::filesystem::remove_all(tree.deployDir); }, [&tree]()
+        {
+            menphina::Deploy exec(tree.packageFile, {});
+            exec.run(tree.targetLauncher);
+        });
+
+        run("deploy.incremental", tree.files, tree.bytes, nullptr, [&tree]()
+        {
+            menphina::Deploy exec(tree.packageFile, {});
+            exec.run(tree.targetLauncher);
+        });
+
+        return results;
+    }
+
+    std::string _default_work_dir()
+    {
+        return (std::filesystem::temp_directory_path() / ("menphina-bench-" + std::to_string(getpid()))).string();
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    menphina::bench_config_t config {};
+    std::string workDir;
+    std::string output;
+    std::vector<std::string> only;
+    bool keep = false;
+
+    try
+    {
+        po::options_description desc("Benchmark options");
+        desc.add_options()
+            ("help,h", "print this message")
+            ("work-dir", po::value<std::string>(), "directory to generate the tree in; must not exist (default: a new temporary directory)")
+            ("output,o", po::value<std::string>()->default_value("menphina-bench.json"), "file to write the JSON results to")
+            ("mods", po::value<uint32_t>()->default_value(20), "number of mods")
+            ("files-per-mod", po::value<uint32_t>()->default_value(50), "files in each mod")
+            ("min-size", po::value<uint64_t>()->default_value(512), "smallest file size in bytes")
+            ("max-size", po::value<uint64_t>()->default_value(1024 * 1024), "largest file size in bytes (sizes are log-uniform in between)")
+            ("duplicate-ratio", po::value<double>()->default_value(0.2), "share of files that duplicate an earlier file")
+            ("seed", po::value<uint64_t>()->default_value(1), "seed for the generated tree")
+            ("iterations,n", po::value<uint32_t>()->default_value(5), "timed runs per benchmark (after one untimed run)")
+            ("only", po::value<std::vector<std::string>>(), "run only benchmarks starting with this name; may be repeated")
+            ("keep", "keep the generated tree")
+        ;
+
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+
+        if (vm.count("help"))
+        {
+            std::cout << menphina::path_basename(argv[0]) << " [options]" << std::endl << std::endl;
+            std::cout << desc << std::endl;
+            return 1;
+        }
+
+        config.Mods = vm["mods"].as<uint32_t>();
+        config.FilesPerMod = vm["files-per-mod"].as<uint32_t>();
+        config.MinFileSize = vm["min-size"].as<uint64_t>();
+        config.MaxFileSize = vm["max-size"].as<uint64_t>();
+        config.DuplicateRatio = vm["duplicate-ratio"].as<double>();
+        config.Seed = vm["seed"].as<uint64_t>();
+        config.Iterations = vm["iterations"].as<uint32_t>();
+
+        if (config.Mods == 0 || config.FilesPerMod == 0 || config.Iterations == 0)
+        {
+            throw std::runtime_error("--mods, --files-per-mod and --iterations must be positive");
+        }
+
+        if (config.MinFileSize > config.MaxFileSize)
+        {
+            throw std::runtime_error("--min-size must not exceed --max-size");
+        }
+
+        if (config.DuplicateRatio < 0.0 || config.DuplicateRatio > 1.0)
+        {
+            throw std::runtime_error("--duplicate-ratio must be between 0 and 1");
+        }
+
+        workDir = (vm.count("work-dir")) ? vm["work-dir"].as<std::string>() : _default_work_dir();
+        output = vm["output"].as<std::string>();
+        only = (vm.count("only")) ? vm["only"].as<std::vector<std::string>>() : std::vector<std::string> {};
+        keep = vm.count("keep") != 0;
+
+        // We delete what we generate, so never work inside something that
+        // was already there.
+        if (menphina::path_exists(workDir))
+        {
+            throw std::runtime_error("Work directory already exists: " + workDir);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    int ret = 0;
+    try
+    {
+        const auto start = std::chrono::steady_clock::now();
+        const tree_t tree = _generate_tree(workDir, config);
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::cout << "Generated " << tree.modNames.size() << " mods, "
+            << tree.files << " files, "
+            << tree.bytes << " bytes ("
+            << tree.uniqueBytes << " unique) in "
+            << workDir << " in " << elapsed.count() << "s"
+            << std::endl;
+
+        menphina::bench_report_t report {};
+        report.Version = std::string(menphina::cmake::project_version);
+        report.Config = config;
+        report.TreeFiles = tree.files;
+        report.TreeBytes = tree.bytes;
+        report.TreeUniqueBytes = tree.uniqueBytes;
+        report.Results = _run_benchmarks(tree, config, only);
+
+        menphina::write_json_file(report, output);
+        std::cout << "Results written to " << output << std::endl;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        ret = 1;
+    }
+
+    if (!keep)
+    {
+        std::error_code ec;
+        std::filesystem::remove_all(workDir, ec);
+    }
+
+    return ret;
+}
@@ -0,0 +1,906 @@
+/* Copyright 2024 isaki */
+
+#include <algorithm>
+#include <cerrno>
+#include <exception>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "menphina/clean.hpp"
+#include "menphina/fileio.hpp"
+#include "menphina/fsplan.hpp"
+#include "menphina/hash.hpp"
+#include "menphina/json.hpp"
+#include "menphina/json_edit.hpp"
+#include "menphina/liveset.hpp"
+#include "menphina/parallel.hpp"
+#include "menphina/penumbra.hpp"
+#include "menphina/platform.hpp"
+#include "menphina/refindex.hpp"
+#include "menphina/scan.hpp"
+#include "menphina/watch.hpp"
+
+namespace
+{
+    // Top level keys holding per-mod entries, keyed by mod directory name.
+    inline constexpr std::string_view SORT_ORDER_MODS_KEY = "Data";
+    inline constexpr std::string_view COLLECTION_MODS_KEY = "Settings";
+
+    // Where a mod's options keep their file redirections: default_mod.json
+    // at the top level, group files in every entry of "Options" (or of
+    // "Containers" for combining groups).
+    inline constexpr std::string_view FILES_KEY = "Files";
+    inline constexpr std::string_view OPTIONS_KEY = "Options";
+    inline constexpr std::string_view CONTAINERS_KEY = "Containers";
+
+    const std::string JSON_EXTENSION { ".json" };
+    const std::string DEFAULT_MOD_NAME { "default_mod.json" };
+    const std::string GROUP_PREFIX { "group_" };
+
+    struct option_file_t
+    {
+        std::string name;
+        uint64_t size;
+        int64_t mtime_ns;
+    };
+
+    struct mod_file_t
+    {
+        // Relative to the mod directory.
+        std::string path;
+        uint64_t size;
+    };
+
+    struct mod_t
+    {
+        // Directly in the mod directory, sorted by name.
+        std::vector<option_file_t> option_files;
+
+        // Every file below a subdirectory of the mod.
+        std::vector<mod_file_t> files;
+
+        // Relative to the mod directory; "" is the mod directory itself.
+        std::vector<std::string> directories;
+
+        menphina::content_hash_t fingerprint;
+
+        // refs and unreferenced are only meaningful once known is set.
+        bool known = false;
+        std::vector<std::string> refs;
+        std::vector<size_t> unreferenced;
+        std::string error;
+    };
+
+    using mod_map_t = std::map<std::string, mod_t, std::less<>>;
+
+    struct config_t
+    {
+        std::string_view key;
+        menphina::content_hash_t fingerprint;
+        std::vector<std::string> refs;
+    };
+
+    using config_map_t = std::map<std::string, config_t, std::less<>>;
+
+    inline bool _is_option_file(const std::string_view name)
+    {
+        return name == DEFAULT_MOD_NAME || (name.starts_with(GROUP_PREFIX) && name.ends_with(JSON_EXTENSION));
+    }
+
+    void _print_scan_stats(const menphina::ScanResult& result, std::ostream& out, std::ostream& err)
+    {
+        const menphina::scan_stats_t& stats = result.stats();
+        out << "Scanned " << result.root() << ": "
+            << stats.entries << " entries ("
+            << stats.directories << " directories, "
+            << stats.files << " files, "
+            << stats.bytes << " bytes) in "
+            << stats.seconds << "s using "
+            << stats.threads << " threads ("
+            << menphina::io_policy_name(stats.io_policy) << " I/O); "
+            << static_cast<uint64_t>(stats.entries_per_second()) << " entries/s"
+            << std::endl;
+
+        for (const auto& e : result.errors())
+        {
+            err << "warning: " << e << std::endl;
+        }
+    }
+
+    // Index of the mod directory that entry i is in.
+    size_t _mod_of(const menphina::ScanResult& result, size_t i, const uint16_t modDepth)
+    {
+        while (result[i].depth > modDepth)
+        {
+            i = result.parent(i);
+        }
+
+        return i;
+    }
+
+    // Groups a scan by mod. Mod directories are the entries at modDepth: 1
+    // for a scan of the ModDirectory, 0 (the root, named rootName) for a
+    // scan of a single mod. The option files of a mod, with their sizes and
+    // mtimes, make up its fingerprint.
+    mod_map_t _collect_mods(const menphina::ScanResult& result, const uint16_t modDepth, const std::string_view rootName)
+    {
+        struct found_t
+        {
+            mod_t * mod;
+
+            // Length of the "<mod>/" prefix of relative paths.
+            size_t prefix;
+        };
+
+        mod_map_t ret;
+        std::unordered_map<size_t, found_t> byEntry;
+
+        for (size_t i = 0; i < result.size(); ++i)
+        {
+            const menphina::scan_entry_t& e = result[i];
+            if (e.depth == modDepth && e.type == menphina::EntryType::Directory)
+            {
+                const std::string_view name = (modDepth == 0) ? rootName : result.name(i);
+                mod_t& mod = ret[std::string(name)];
+                mod.directories.emplace_back();
+                byEntry.emplace(i, found_t { &mod, (modDepth == 0) ? 0 : name.size() + 1 });
+            }
+        }
+
+        std::string path;
+        for (size_t i = 0; i < result.size(); ++i)
+        {
+            const menphina::scan_entry_t& e = result[i];
+            if (e.depth <= modDepth || (e.type != menphina::EntryType::File && e.type != menphina::EntryType::Directory))
+            {
+                continue;
+            }
+
+            const auto found = byEntry.find(_mod_of(result, i, modDepth));
+            if (found == byEntry.end())
+            {
+                continue;
+            }
+
+            mod_t& mod = *found->second.mod;
+
+            if (e.type == menphina::EntryType::File && e.depth == modDepth + 1)
+            {
+                if (_is_option_file(result.name(i)))
+                {
+                    mod.option_files.push_back(option_file_t { std::string(result.name(i)), e.size, e.mtime_ns });
+                }
+
+                continue;
+            }
+
+            result.relative_path(i, path);
+            std::string inMod = path.substr(found->second.prefix);
+
+            if (e.type == menphina::EntryType::Directory)
+            {
+                mod.directories.push_back(std::move(inMod));
+            }
+            else
+            {
+                mod.files.push_back(mod_file_t { std::move(inMod), e.size });
+            }
+        }
+
+        std::string buffer;
+        for (auto& [name, mod] : ret)
+        {
+            std::sort(mod.option_files.begin(), mod.option_files.end(), [](const option_file_t& a, const option_file_t& b) {
+                return a.name < b.name;
+            });
+
+            buffer.clear();
+            for (const auto& f : mod.option_files)
+            {
+                buffer.append(f.name);
+                buffer.push_back('\0');
+                buffer.append(reinterpret_cast<const char *>(&f.size), sizeof(f.size));
+                buffer.append(reinterpret_cast<const char *>(&f.mtime_ns), sizeof(f.mtime_ns));
+            }
+
+            mod.fingerprint = menphina::content_hash(buffer.data(), buffer.size());
+        }
+
+        return ret;
+    }
+
+    std::optional<menphina::json_range_t> _member(const menphina::JsonEditor& editor, const menphina::json_range_t& object, const std::string_view key)
+    {
+        if (editor.text()[object.begin] != '{')
+        {
+            return std::nullopt;
+        }
+
+        for (const auto& m : editor.members(object))
+        {
+            if (editor.key(m) == key)
+            {
+                return m.value;
+            }
+        }
+
+        return std::nullopt;
+    }
+
+    // Collects the targets of the "Files" object of an option.
+    void _add_option_refs(const menphina::JsonEditor& editor, const menphina::json_range_t& option, std::vector<std::string>& refs)
+    {
+        const auto files = _member(editor, option, FILES_KEY);
+        if (!files || editor.text()[files->begin] != '{')
+        {
+            return;
+        }
+
+        for (const auto& m : editor.members(*files))
+        {
+            const std::optional<std::string> target = editor.string_value(m.value);
+            if (target)
+            {
+                refs.push_back(menphina::normalize_reference(*target));
+            }
+        }
+    }
+
+    std::vector<std::string> _parse_mod_refs(const std::string& modRoot, const mod_t& mod)
+    {
+        std::vector<std::string> ret;
+        for (const auto& f : mod.option_files)
+        {
+            const menphina::JsonEditor editor(menphina::path_join(modRoot, f.name));
+            const menphina::json_range_t root = editor.root();
+
+            _add_option_refs(editor, root, ret);
+
+            for (const std::string_view key : { OPTIONS_KEY, CONTAINERS_KEY })
+            {
+                const auto list = _member(editor, root, key);
+                if (!list || editor.text()[list->begin] != '[')
+                {
+                    continue;
+                }
+
+                for (const auto& option : editor.elements(*list))
+                {
+                    _add_option_refs(editor, option, ret);
+                }
+            }
+        }
+
+        return ret;
+    }
+
+    // Files directly in a mod directory (meta.json, option groups, readmes
+    // and preview images) are never referenced and never collected, so
+    // only files further down can end up here.
+    void _find_unreferenced(mod_t& mod)
+    {
+        mod.unreferenced.clear();
+
+        const menphina::LiveSet refs(mod.refs);
+        for (size_t i = 0; i < mod.files.size(); ++i)
+        {
+            if (!refs.contains(mod.files[i].path))
+            {
+                mod.unreferenced.push_back(i);
+            }
+        }
+    }
+
+    menphina::content_hash_t _config_fingerprint(const menphina::file_stat_t& st)
+    {
+        const uint64_t values[3] = { st.size, static_cast<uint64_t>(st.mtime_ns), st.inode };
+        return menphina::content_hash(values, sizeof(values));
+    }
+
+    // Mod directory names the object under key has entries for.
+    std::vector<std::string> _config_refs(const menphina::JsonEditor& editor, const std::string_view key)
+    {
+        std::vector<std::string> ret;
+
+        const auto object = editor.find({ key });
+        if (!object || editor.text()[object->begin] != '{')
+        {
+            return ret;
+        }
+
+        for (const auto& m : editor.members(*object))
+        {
+            ret.push_back(editor.key(m));
+        }
+
+        return ret;
+    }
+
+    // Whether path is a directory or a link to one.
+    bool _is_directory(const std::string& path)
+    {
+        struct stat st;
+        return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+    }
+
+    // The entries of a mod are only orphaned once nothing by its name is
+    // left in the ModDirectory; a file or a dangling link in its place may
+    // be a mod being moved, or one on a drive that is not mounted.
+    bool _is_orphaned(const mod_map_t& mods, const std::string& modDir, const std::string_view name)
+    {
+        if (mods.contains(name))
+        {
+            return false;
+        }
+
+        if (!menphina::path_is_contained(name) || name.find('/') != std::string_view::npos)
+        {
+            return true;
+        }
+
+        struct stat st;
+        return lstat(menphina::path_join(modDir, name).c_str(), &st) != 0 && errno == ENOENT;
+    }
+
+    // Drops the entries of mods that are no longer installed from the
+    // object under key and saves the file (in dirfd) if anything went.
+    size_t _clean_mod_entries(menphina::JsonEditor& editor, const std::string_view key, const mod_map_t& mods, const std::string& modDir, const int dirfd, std::ostream& out)
+    {
+        const auto object = editor.find({ key });
+        if (!object || editor.text()[object->begin] != '{')
+        {
+            return 0;
+        }
+
+        const size_t removed = editor.remove_members(*object, [&editor, &mods, &modDir](const menphina::json_member_t& m) {
+            return _is_orphaned(mods, modDir, editor.key(m));
+        });
+
+        if (removed != 0)
+        {
+            editor.save(dirfd);
+            out << "Removed " << removed << " orphaned entries from " << editor.file() << std::endl;
+        }
+
+        return removed;
+    }
+}
+
+struct menphina::clean_state_t
+{
+    std::string launcherDir;
+    std::string modDir;
+    std::string configDir;
+    std::string indexFile;
+    CleanState::step_fn step;
+
+    mod_map_t mods;
+    config_map_t configs;
+
+    // Mods whose last scan hit errors; "" stands for the last full scan.
+    std::set<std::string, std::less<>> incomplete;
+
+    // Set while refresh() runs.
+    const ReferenceIndex * index = nullptr;
+
+    // The index on disk no longer matches the state.
+    bool dirty = false;
+
+    // Sources parsed and taken from the index since the last clean().
+    uint64_t parsed = 0;
+    uint64_t fromIndex = 0;
+
+    void run_step(const char * phase, const uint64_t done, const uint64_t total) const
+    {
+        if (step)
+        {
+            step(phase, done, total);
+        }
+    }
+
+    // Fills in the references of freshly scanned mods: from the state if
+    // the fingerprint still matches, else from the index, else by parsing
+    // their option files.
+    void resolve(mod_map_t& fresh)
+    {
+        std::vector<std::pair<const std::string *, mod_t *>> changed;
+
+        for (auto& [name, mod] : fresh)
+        {
+            const auto old = mods.find(name);
+            if (old != mods.end() && old->second.known && old->second.fingerprint == mod.fingerprint)
+            {
+                mod.refs = std::move(old->second.refs);
+                mod.known = true;
+            }
+            else if (const refindex_source_t * source = (index != nullptr) ? index->find(RefSourceKind::Mod, name, mod.fingerprint) : nullptr)
+            {
+                for (const std::string_view r : index->refs(*source))
+                {
+                    mod.refs.emplace_back(r);
+                }
+
+                mod.known = true;
+                ++fromIndex;
+            }
+            else
+            {
+                changed.emplace_back(&name, &mod);
+            }
+        }
+
+        run_step("index", 0, changed.size());
+
+        parallel_for(changed.size(), resolve_thread_count(0), [this, &changed](const size_t c, [[maybe_unused]] const unsigned worker)
+        {
+            mod_t& mod = *changed[c].second;
+            try
+            {
+                mod.refs = _parse_mod_refs(path_join(modDir, *changed[c].first), mod);
+                mod.known = true;
+            }
+            catch (const std::exception& e)
+            {
+                mod.error = e.what();
+            }
+        });
+
+        run_step("index", changed.size(), changed.size());
+
+        parsed += changed.size();
+        dirty = dirty || !changed.empty();
+
+        for (auto& [name, mod] : fresh)
+        {
+            if (mod.known)
+            {
+                _find_unreferenced(mod);
+            }
+        }
+    }
+
+    std::vector<std::pair<std::string, std::string_view>> config_files() const
+    {
+        std::vector<std::pair<std::string, std::string_view>> ret;
+        ret.emplace_back(get_penumbra_sort_order_file(launcherDir), SORT_ORDER_MODS_KEY);
+
+        const std::string collections = get_penumbra_collections_dir(launcherDir);
+        if (path_exists(collections))
+        {
+            for (const auto& de : std::filesystem::directory_iterator(collections))
+            {
+                if (de.is_regular_file() && de.path().extension() == JSON_EXTENSION)
+                {
+                    ret.emplace_back(de.path().string(), COLLECTION_MODS_KEY);
+                }
+            }
+        }
+
+        return ret;
+    }
+
+    std::vector<refindex_entry_t> index_entries() const
+    {
+        std::vector<refindex_entry_t> ret;
+
+        for (const auto& [name, mod] : mods)
+        {
+            // Left out so that the next run tries again.
+            if (mod.known)
+            {
+                ret.push_back(refindex_entry_t { RefSourceKind::Mod, name, mod.fingerprint, mod.refs });
+            }
+        }
+
+        for (const auto& [file, config] : configs)
+        {
+            ret.push_back(refindex_entry_t { RefSourceKind::ConfigFile, file, config.fingerprint, config.refs });
+        }
+
+        return ret;
+    }
+};
+
+/* CleanState */
+
+menphina::CleanState::CleanState(const std::string_view launcherDir, const std::string& indexFile, step_fn step) :
+    m_state(std::make_unique<clean_state_t>())
+{
+    penumbra_config_t config {};
+    read_json_file(config, get_penumbra_config_file(launcherDir));
+
+    m_state->launcherDir = std::string(launcherDir);
+    m_state->modDir = native_path(config.ModDirectory);
+    m_state->configDir = get_penumbra_config_dir(launcherDir);
+    m_state->indexFile = indexFile;
+    m_state->step = std::move(step);
+}
+
+menphina::CleanState::~CleanState() {}
+
+const std::string& menphina::CleanState::launcher_directory() const
+{
+    return m_state->launcherDir;
+}
+
+const std::string& menphina::CleanState::mod_directory() const
+{
+    return m_state->modDir;
+}
+
+const std::string& menphina::CleanState::config_directory() const
+{
+    return m_state->configDir;
+}
+
+bool menphina::CleanState::complete() const
+{
+    return m_state->incomplete.empty();
+}
+
+std::vector<std::string> menphina::CleanState::mods() const
+{
+    std::vector<std::string> ret;
+    ret.reserve(m_state->mods.size());
+    for (const auto& [name, mod] : m_state->mods)
+    {
+        ret.push_back(name);
+    }
+
+    return ret;
+}
+
+std::vector<std::string> menphina::CleanState::mod_directories(const std::string_view name) const
+{
+    const auto found = m_state->mods.find(name);
+    return (found != m_state->mods.end()) ? found->second.directories : std::vector<std::string> {};
+}
+
+void menphina::CleanState::refresh(std::ostream& out, std::ostream& err)
+{
+    clean_state_t& s = *m_state;
+
+    s.run_step("scan", 0, 0);
+
+    const DirectoryScanner scanner;
+    const ScanResult result = scanner.scan(s.modDir);
+    _print_scan_stats(result, out, err);
+
+    s.incomplete.clear();
+    if (!result.errors().empty())
+    {
+        s.incomplete.emplace();
+    }
+
+    const ReferenceIndex index(s.indexFile);
+    s.index = &index;
+
+    try
+    {
+        const uint64_t before = s.fromIndex;
+
+        mod_map_t fresh = _collect_mods(result, 1, {});
+
+        // The scan does not follow links, but a link to a directory is as
+        // much a mod as the directory itself.
+        for (size_t i = 0; i < result.size(); ++i)
+        {
+            if (result[i].depth != 1 || result[i].type != EntryType::Symlink)
+            {
+                continue;
+            }
+
+            const std::string name(result.name(i));
+            const std::string root = path_join(s.modDir, name);
+            if (!_is_directory(root))
+            {
+                continue;
+            }
+
+            const ScanResult linked = scanner.scan(root);
+            if (!linked.errors().empty())
+            {
+                s.incomplete.emplace(name);
+            }
+
+            for (auto& [n, mod] : _collect_mods(linked, 0, name))
+            {
+                fresh.insert_or_assign(n, std::move(mod));
+            }
+        }
+
+        s.resolve(fresh);
+        s.mods = std::move(fresh);
+
+        refresh_config();
+
+        // Anything in the index that was not used is gone now.
+        s.dirty = s.dirty || s.fromIndex - before != index.sources().size();
+    }
+    catch (...)
+    {
+        s.index = nullptr;
+        throw;
+    }
+
+    s.index = nullptr;
+}
+
+void menphina::CleanState::refresh_mod(const std::string_view name)
+{
+    clean_state_t& s = *m_state;
+    const std::string root = path_join(s.modDir, name);
+
+    // Directories and links to them are mods, as in the full scan.
+    if (!_is_directory(root))
+    {
+        const auto found = s.mods.find(name);
+        if (found != s.mods.end())
+        {
+            s.mods.erase(found);
+            s.dirty = true;
+        }
+
+        const auto bad = s.incomplete.find(name);
+        if (bad != s.incomplete.end())
+        {
+            s.incomplete.erase(bad);
+        }
+
+        return;
+    }
+
+    const DirectoryScanner scanner;
+    const ScanResult result = scanner.scan(root);
+
+    if (result.errors().empty())
+    {
+        const auto bad = s.incomplete.find(name);
+        if (bad != s.incomplete.end())
+        {
+            s.incomplete.erase(bad);
+        }
+    }
+    else
+    {
+        s.incomplete.emplace(name);
+    }
+
+    mod_map_t fresh = _collect_mods(result, 0, name);
+    s.resolve(fresh);
+
+    for (auto& [n, mod] : fresh)
+    {
+        s.mods.insert_or_assign(n, std::move(mod));
+    }
+}
+
+void menphina::CleanState::refresh_config()
+{
+    clean_state_t& s = *m_state;
+
+    config_map_t fresh;
+    for (const auto& [file, key] : s.config_files())
+    {
+        file_stat_t st;
+        if (!try_stat(file, st))
+        {
+            continue;
+        }
+
+        config_t config { key, _config_fingerprint(st), {} };
+
+        const auto old = s.configs.find(file);
+        if (old != s.configs.end() && old->second.fingerprint == config.fingerprint)
+        {
+            config.refs = std::move(old->second.refs);
+        }
+        else if (const refindex_source_t * source = (s.index != nullptr) ? s.index->find(RefSourceKind::ConfigFile, file, config.fingerprint) : nullptr)
+        {
+            for (const std::string_view r : s.index->refs(*source))
+            {
+                config.refs.emplace_back(r);
+            }
+
+            ++s.fromIndex;
+        }
+        else
+        {
+            const JsonEditor editor(file);
+            config.refs = _config_refs(editor, key);
+            ++s.parsed;
+            s.dirty = true;
+        }
+
+        fresh.emplace(file, std::move(config));
+    }
+
+    for (const auto& [file, config] : s.configs)
+    {
+        if (!fresh.contains(file))
+        {
+            s.dirty = true;
+            break;
+        }
+    }
+
+    s.configs = std::move(fresh);
+}
+
+void menphina::CleanState::clean(std::ostream& out, std::ostream& err, const bool dryRun)
+{
+    clean_state_t& s = *m_state;
+
+    // An incomplete picture of the ModDirectory would make live mods look
+    // orphaned; don't touch anything in that case.
+    if (!complete())
+    {
+        err << "ModDirectory scan was incomplete; not cleaning configuration" << std::endl;
+        return;
+    }
+
+    // Cheap, and catches edits nobody told the state about.
+    refresh_config();
+
+    uint64_t count = 0;
+    uint64_t bytes = 0;
+    for (const auto& [name, mod] : s.mods)
+    {
+        if (!mod.known)
+        {
+            err << "warning: unable to read the options of " << name << ": " << mod.error << std::endl;
+            continue;
+        }
+
+        for (const size_t i : mod.unreferenced)
+        {
+            out << "Unreferenced file: " << name << '/' << mod.files[i].path << std::endl;
+            ++count;
+            bytes += mod.files[i].size;
+        }
+    }
+
+    out << "Found " << count << " unreferenced mod files (" << bytes << " bytes)" << std::endl;
+
+    // Only files with entries for a mod that is gone are edited, going by
+    // the references known for them; the file itself has the final say.
+    FsPlan plan(s.configDir);
+    std::vector<std::pair<const std::string *, config_t *>> edits;
+    for (auto& [file, config] : s.configs)
+    {
+        std::string orphaned;
+        size_t count = 0;
+        for (const std::string& r : config.refs)
+        {
+            if (_is_orphaned(s.mods, s.modDir, r))
+            {
+                orphaned.append((count++ == 0) ? "" : ", ").append(r);
+            }
+        }
+
+        file_stat_t st;
+        if (count == 0 || !try_stat(file, st))
+        {
+            continue;
+        }
+
+        const std::filesystem::path path(file);
+        const std::string dir = path.parent_path().lexically_relative(s.configDir).generic_string();
+
+        plan.add(fs_op_t {
+            .kind = FsOpKind::Edit,
+            .directory = plan.directory((dir == ".") ? std::string {} : dir),
+            .name = path.filename().string(),
+            .size = st.size,
+            .mtime_ns = st.mtime_ns,
+            .locality = st.inode,
+            .source = edits.size(),
+            .note = "remove " + std::to_string(count) + " orphaned entries (" + orphaned + ")"
+        });
+
+        edits.emplace_back(&file, &config);
+    }
+
+    if (dryRun)
+    {
+        plan.print(out);
+    }
+    else
+    {
+        // Each file is saved atomically on its own; stopping between them
+        // is safe.
+        size_t done = 0;
+        plan.run([&s, &edits, &done, &plan, &out](const fs_op_t& op, const int dirfd)
+        {
+            s.run_step("clean", done++, plan.size());
+
+            const std::string& file = *edits[op.source].first;
+            config_t& config = *edits[op.source].second;
+
+            JsonEditor editor(file);
+            config.refs = _config_refs(editor, config.key);
+
+            if (_clean_mod_entries(editor, config.key, s.mods, s.modDir, dirfd, out) != 0)
+            {
+                std::erase_if(config.refs, [&s](const std::string& r) { return _is_orphaned(s.mods, s.modDir, r); });
+
+                file_stat_t st;
+                if (try_stat(file, st))
+                {
+                    config.fingerprint = _config_fingerprint(st);
+                }
+
+                s.dirty = true;
+            }
+        });
+
+        s.run_step("clean", plan.size(), plan.size());
+    }
+
+    out << "Referenced files of " << s.mods.size() << " mods and mods of " << s.configs.size() << " configuration files: "
+        << s.parsed << " parsed, " << s.fromIndex << " from " << s.indexFile << std::endl;
+
+    s.parsed = 0;
+    s.fromIndex = 0;
+
+    if (dryRun)
+    {
+        out << "Planned " << plan.size() << " configuration file edits; nothing changed" << std::endl;
+        return;
+    }
+
+    if (!s.dirty)
+    {
+        return;
+    }
+
+    try
+    {
+        write_reference_index(s.indexFile, s.index_entries());
+        s.dirty = false;
+    }
+    catch (const std::exception& e)
+    {
+        // Only a cache; the next run parses everything instead.
+        err << "warning: unable to write " << s.indexFile << ": " << e.what() << std::endl;
+    }
+}
+
+/* Clean */
+
+menphina::Clean::Clean(const std::string& indexFile, const std::string& watchSocket, const bool dryRun) :
+    m_indexFile(indexFile),
+    m_watchSocket(watchSocket),
+    m_dryRun(dryRun)
+{
+}
+
+menphina::Clean::~Clean() {}
+
+void menphina::Clean::run(const std::string_view& launcherDir)
+{
+    // A watch process would go ahead and clean; a dry run plans here.
+    if (!m_dryRun && !m_watchSocket.empty() && watch_request_clean(m_watchSocket, launcherDir, std::cout))
+    {
+        return;
+    }
+
+    CleanState state(launcherDir, m_indexFile, [this](const char * phase, const uint64_t done, const uint64_t total)
+    {
+        check_cancelled();
+        report_progress(phase, done, total);
+    });
+
+    state.refresh(std::cout, std::cerr);
+    state.clean(std::cout, std::cerr, m_dryRun);
+}
@@ -0,0 +1,614 @@
+/* Copyright 2024 isaki */
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#if defined ( __linux__ ) && __has_include(<linux/io_uring.h>)
+#define MENPHINA_HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+#include "menphina/copy.hpp"
+#include "menphina/fileio.hpp"
+#include "menphina/m_exception.hpp"
+#include "menphina/parallel.hpp"
+#include "menphina/trace.hpp"
+
+namespace
+{
+    // copy_file_range takes a size_t but the kernel caps a call below 2 GiB.
+    inline constexpr size_t COPY_FILE_RANGE_MAX = 1024 * 1024 * 1024;
+
+    // What copy_file_range reports when it cannot do this copy at all (as
+    // opposed to failing while doing it).
+    inline bool _copy_file_range_unsupported(const int err)
+    {
+        return err == EXDEV || err == EOPNOTSUPP || err == ENOSYS || err == EINVAL || err == EBADF;
+    }
+
+    // Splits ops into pieces of at most blockSize bytes.
+    std::vector<menphina::copy_op_t> _blocks(const std::vector<menphina::copy_op_t>& ops, const size_t blockSize)
+    {
+        std::vector<menphina::copy_op_t> ret;
+        for (const auto& op : ops)
+        {
+            for (uint64_t done = 0; done < op.length; done += blockSize)
+            {
+                ret.push_back(menphina::copy_op_t {
+                    .src_fd = op.src_fd,
+                    .src_offset = op.src_offset + done,
+                    .dst_fd = op.dst_fd,
+                    .dst_offset = op.dst_offset + done,
+                    .length = std::min<uint64_t>(blockSize, op.length - done)
+                });
+            }
+        }
+
+        return ret;
+    }
+
+#if defined ( MENPHINA_HAVE_IO_URING )
+    // io_uring_enter failing with EAGAIN or EBUSY in a row this many times
+    // is taken as a hard failure.
+    inline constexpr unsigned URING_RETRY_LIMIT = 64;
+
+    // Just enough of io_uring for READV/WRITEV, on raw syscalls so there is
+    // no dependency on liburing.
+    class Uring final
+    {
+        public:
+            Uring() :
+                m_sqRing(MAP_FAILED),
+                m_sqRingSize(0),
+                m_cqRing(MAP_FAILED),
+                m_cqRingSize(0),
+                m_sqes(MAP_FAILED),
+                m_sqesSize(0),
+                m_localTail(0)
+            {
+            }
+
+            ~Uring()
+            {
+                if (m_sqes != MAP_FAILED)
+                {
+                    munmap(m_sqes, m_sqesSize);
+                }
+
+                if (m_cqRing != MAP_FAILED && m_cqRing != m_sqRing)
+                {
+                    munmap(m_cqRing, m_cqRingSize);
+                }
+
+                if (m_sqRing != MAP_FAILED)
+                {
+                    munmap(m_sqRing, m_sqRingSize);
+                }
+            }
+
+            Uring(const Uring&) = delete;
+            Uring& operator=(const Uring&) = delete;
+
+            // Returns the errno if the kernel will not give us a ring.
+            int open(const unsigned entries)
+            {
+                struct io_uring_params p;
+                std::memset(&p, 0, sizeof(p));
+
+                const long fd = syscall(__NR_io_uring_setup, entries, &p);
+                if (fd < 0)
+                {
+                    return errno;
+                }
+
+                m_fd.reset(static_cast<int>(fd));
+
+                m_sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+                m_cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+                if (p.features & IORING_FEAT_SINGLE_MMAP)
+                {
+                    m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+                }
+
+                m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd.get(), IORING_OFF_SQ_RING);
+                if (m_sqRing == MAP_FAILED)
+                {
+                    return errno;
+                }
+
+                if (p.features & IORING_FEAT_SINGLE_MMAP)
+                {
+                    m_cqRing = m_sqRing;
+                }
+                else
+                {
+                    m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd.get(), IORING_OFF_CQ_RING);
+                    if (m_cqRing == MAP_FAILED)
+                    {
+                        return errno;
+                    }
+                }
+
+                m_sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+                m_sqes = mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd.get(), IORING_OFF_SQES);
+                if (m_sqes == MAP_FAILED)
+                {
+                    return errno;
+                }
+
+                char * sq = static_cast<char *>(m_sqRing);
+                m_sqHead = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+                m_sqTail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+                m_sqMask = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+                m_sqEntries = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_entries);
+                m_sqArray = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+
+                char * cq = static_cast<char *>(m_cqRing);
+                m_cqHead = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+                m_cqTail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+                m_cqMask = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+                m_cqes = reinterpret_cast<struct io_uring_cqe *>(cq + p.cq_off.cqes);
+
+                m_localTail = std::atomic_ref<unsigned>(*m_sqTail).load(std::memory_order_relaxed);
+                return 0;
+            }
+
+            void queue(const uint8_t opcode, const int fd, const struct iovec * iov, const uint64_t offset, const uint64_t userData)
+            {
+                const unsigned head = std::atomic_ref<unsigned>(*m_sqHead).load(std::memory_order_acquire);
+                if (m_localTail - head >= m_sqEntries) [[unlikely]]
+                {
+                    throw std::logic_error("io_uring submission queue overflow");
+                }
+
+                const unsigned index = m_localTail & m_sqMask;
+                struct io_uring_sqe * sqe = static_cast<struct io_uring_sqe *>(m_sqes) + index;
+                std::memset(sqe, 0, sizeof(*sqe));
+                sqe->opcode = opcode;
+                sqe->fd = fd;
+                sqe->addr = reinterpret_cast<uint64_t>(iov);
+                sqe->len = 1;
+                sqe->off = offset;
+                sqe->user_data = userData;
+
+                m_sqArray[index] = index;
+                ++m_localTail;
+            }
+
+            // Submits everything queued and waits for at least one
+            // completion. Returns 0 or the errno of io_uring_enter.
+            int submit_and_wait()
+            {
+                std::atomic_ref<unsigned>(*m_sqTail).store(m_localTail, std::memory_order_release);
+                return enter(true);
+            }
+
+            // Waits for at least one completion without submitting anything.
+            int wait()
+            {
+                return enter(false);
+            }
+
+            // Takes back whatever was queued but not yet picked up by the
+            // kernel, which only does so in io_uring_enter. Returns how many.
+            unsigned discard_unsubmitted()
+            {
+                const unsigned head = std::atomic_ref<unsigned>(*m_sqHead).load(std::memory_order_acquire);
+                const unsigned count = m_localTail - head;
+
+                m_localTail = head;
+                std::atomic_ref<unsigned>(*m_sqTail).store(m_localTail, std::memory_order_release);
+                return count;
+            }
+
+            template<class F>
+            void complete(F&& fn)
+            {
+                unsigned head = std::atomic_ref<unsigned>(*m_cqHead).load(std::memory_order_relaxed);
+                const unsigned tail = std::atomic_ref<unsigned>(*m_cqTail).load(std::memory_order_acquire);
+
+                while (head != tail)
+                {
+                    const struct io_uring_cqe& cqe = m_cqes[head & m_cqMask];
+                    fn(cqe.user_data, cqe.res);
+                    ++head;
+                }
+
+                std::atomic_ref<unsigned>(*m_cqHead).store(head, std::memory_order_release);
+            }
+
+        private:
+            menphina::UniqueFd m_fd;
+
+            void * m_sqRing;
+            size_t m_sqRingSize;
+            void * m_cqRing;
+            size_t m_cqRingSize;
+            void * m_sqes;
+            size_t m_sqesSize;
+
+            unsigned * m_sqHead;
+            unsigned * m_sqTail;
+            unsigned * m_sqArray;
+            unsigned m_sqMask;
+            unsigned m_sqEntries;
+            unsigned m_localTail;
+
+            unsigned * m_cqHead;
+            unsigned * m_cqTail;
+            unsigned m_cqMask;
+            struct io_uring_cqe * m_cqes;
+
+            int enter(const bool submit)
+            {
+                for (;;)
+                {
+                    const unsigned head = std::atomic_ref<unsigned>(*m_sqHead).load(std::memory_order_acquire);
+                    const unsigned toSubmit = (submit) ? m_localTail - head : 0;
+                    if (syscall(__NR_io_uring_enter, m_fd.get(), toSubmit, 1, IORING_ENTER_GETEVENTS, nullptr, 0) >= 0)
+                    {
+                        return 0;
+                    }
+
+                    const int err = errno;
+                    if (err != EINTR)
+                    {
+                        return err;
+                    }
+                }
+            }
+    };
+
+    // One block on its way through the ring: read fully into the buffer,
+    // then written fully out of it. Short transfers are resubmitted for the
+    // remainder.
+    struct uring_slot_t
+    {
+        std::unique_ptr<char[]> buffer;
+        struct iovec iov;
+        menphina::copy_op_t block;
+        uint64_t done;
+        bool writing;
+    };
+#endif
+}
+
+menphina::CopyEngine::CopyEngine(const copy_options_t& options) :
+    m_options(options),
+    m_pendingBytes(0),
+    m_copyFileRange(options.method == CopyMethod::Auto || options.method == CopyMethod::CopyFileRange),
+    m_ioUring(options.method == CopyMethod::Auto || options.method == CopyMethod::IoUring)
+{
+    if (m_options.queue_depth == 0 || m_options.block_size == 0)
+    {
+        throw std::invalid_argument("copy queue depth and block size must be positive");
+    }
+}
+
+menphina::CopyEngine::~CopyEngine() {}
+
+void menphina::CopyEngine::add(const copy_op_t& op)
+{
+    if (op.length == 0)
+    {
+        return;
+    }
+
+    m_ops.push_back(op);
+    m_pendingBytes += op.length;
+}
+
+void menphina::CopyEngine::run()
+{
+    std::vector<copy_op_t> ops;
+    ops.swap(m_ops);
+    m_pendingBytes = 0;
+
+    if (ops.empty())
+    {
+        return;
+    }
+
+    m_stats.ops += ops.size();
+    for (const auto& op : ops)
+    {
+        m_stats.bytes += op.length;
+    }
+
+    if (m_copyFileRange)
+    {
+        ops = run_copy_file_range(ops);
+
+        if (ops.empty())
+        {
+            return;
+        }
+
+        if (m_options.method == CopyMethod::CopyFileRange)
+        {
+            throw std::runtime_error("copy_file_range is not supported between these files");
+        }
+    }
+
+    if (m_ioUring && run_io_uring(ops))
+    {
+        return;
+    }
+
+    if (m_options.method == CopyMethod::IoUring)
+    {
+        throw std::runtime_error("io_uring is not available");
+    }
+
+    run_thread_pool(ops);
+}
+
+std::vector<menphina::copy_op_t> menphina::CopyEngine::run_copy_file_range(const std::vector<copy_op_t>& ops)
+{
+    TraceSpan span(trace_category::WRITE, "copy.copy_file_range");
+
+    std::atomic<bool> supported { true };
+    std::atomic<uint64_t> copied { 0 };
+    std::mutex lock;
+    std::vector<copy_op_t> rest;
+
+    parallel_for(ops.size(), resolve_thread_count(m_options.threads), [&](const size_t i, [[maybe_unused]] const unsigned worker)
+    {
+        const copy_op_t& op = ops[i];
+        uint64_t done = 0;
+
+        while (done < op.length && supported.load(std::memory_order_relaxed))
+        {
+            off_t in = static_cast<off_t>(op.src_offset + done);
+            off_t out = static_cast<off_t>(op.dst_offset + done);
+            const size_t want = static_cast<size_t>(std::min<uint64_t>(op.length - done, COPY_FILE_RANGE_MAX));
+
+            const ssize_t n = copy_file_range(op.src_fd, &in, op.dst_fd, &out, want, 0);
+            if (n > 0)
+            {
+                done += static_cast<uint64_t>(n);
+                continue;
+            }
+
+            if (n == 0)
+            {
+                throw std::runtime_error("Unexpected end of file while copying");
+            }
+
+            const int err = errno;
+            if (err == EINTR)
+            {
+                continue;
+            }
+
+            if (!_copy_file_range_unsupported(err))
+            {
+                throw menphina::errno_exception("copy_file_range failed", err);
+            }
+
+            supported.store(false, std::memory_order_relaxed);
+        }
+
+        copied.fetch_add(done, std::memory_order_relaxed);
+
+        if (done < op.length)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            rest.push_back(copy_op_t {
+                .src_fd = op.src_fd,
+                .src_offset = op.src_offset + done,
+                .dst_fd = op.dst_fd,
+                .dst_offset = op.dst_offset + done,
+                .length = op.length - done
+            });
+        }
+    });
+
+    if (!supported.load(std::memory_order_relaxed))
+    {
+        m_copyFileRange = false;
+    }
+
+    m_stats.copy_file_range_bytes += copied.load(std::memory_order_relaxed);
+    span.add_bytes(copied.load(std::memory_order_relaxed));
+    return rest;
+}
+
+#if defined ( MENPHINA_HAVE_IO_URING )
+bool menphina::CopyEngine::run_io_uring(const std::vector<copy_op_t>& ops)
+{
+    Uring ring;
+    if (ring.open(m_options.queue_depth) != 0)
+    {
+        m_ioUring = false;
+        return false;
+    }
+
+    TraceSpan span(trace_category::WRITE, "copy.io_uring");
+
+    const std::vector<copy_op_t> blocks = _blocks(ops, m_options.block_size);
+    const size_t slotCount = std::min<size_t>(m_options.queue_depth, blocks.size());
+
+    std::vector<uring_slot_t> slots(slotCount);
+    std::vector<size_t> freeSlots;
+    for (size_t i = 0; i < slotCount; ++i)
+    {
+        slots[i].buffer = std::make_unique<char[]>(m_options.block_size);
+        freeSlots.push_back(i);
+    }
+
+    const auto issue = [&ring](uring_slot_t& slot, const size_t index)
+    {
+        const copy_op_t& b = slot.block;
+        slot.iov.iov_base = slot.buffer.get() + slot.done;
+        slot.iov.iov_len = static_cast<size_t>(b.length - slot.done);
+
+        if (slot.writing)
+        {
+            ring.queue(IORING_OP_WRITEV, b.dst_fd, &slot.iov, b.dst_offset + slot.done, index);
+        }
+        else
+        {
+            ring.queue(IORING_OP_READV, b.src_fd, &slot.iov, b.src_offset + slot.done, index);
+        }
+    };
+
+    size_t next = 0;
+    size_t inFlight = 0;
+    uint64_t copied = 0;
+    int error = 0;
+    unsigned retries = 0;
+
+    for (;;)
+    {
+        while (error == 0 && next < blocks.size() && !freeSlots.empty())
+        {
+            const size_t index = freeSlots.back();
+            freeSlots.pop_back();
+
+            uring_slot_t& slot = slots[index];
+            slot.block = blocks[next++];
+            slot.done = 0;
+            slot.writing = false;
+            issue(slot, index);
+            ++inFlight;
+        }
+
+        // Nothing may be freed while the kernel can still touch it, so after
+        // a failure nothing more is submitted, and it is not thrown until
+        // everything already submitted has completed.
+        if (error != 0)
+        {
+            inFlight -= ring.discard_unsubmitted();
+        }
+
+        if (inFlight == 0)
+        {
+            break;
+        }
+
+        const int err = (error == 0) ? ring.submit_and_wait() : ring.wait();
+        if (err == 0)
+        {
+            retries = 0;
+        }
+        else if ((err == EAGAIN || err == EBUSY) && ++retries <= URING_RETRY_LIMIT)
+        {
+            // Short of resources or of completion queue space; reaping
+            // below makes room.
+            std::this_thread::yield();
+        }
+        else if (error == 0)
+        {
+            error = err;
+            retries = 0;
+        }
+        else
+        {
+            // Not even waiting works, so there is no telling when the kernel
+            // is done with the buffers; they are left to it.
+            static_cast<void>(new std::vector<uring_slot_t>(std::move(slots)));
+            break;
+        }
+
+        ring.complete([&](const uint64_t userData, const int32_t res)
+        {
+            const size_t index = static_cast<size_t>(userData);
+            uring_slot_t& slot = slots[index];
+
+            if (res <= 0 || error != 0)
+            {
+                if (error == 0)
+                {
+                    error = (res < 0) ? -res : EIO;
+                }
+
+                --inFlight;
+                freeSlots.push_back(index);
+                return;
+            }
+
+            slot.done += static_cast<uint64_t>(res);
+            if (slot.done < slot.block.length)
+            {
+                issue(slot, index);
+                return;
+            }
+
+            if (!slot.writing)
+            {
+                slot.writing = true;
+                slot.done = 0;
+                issue(slot, index);
+                return;
+            }
+
+            copied += slot.block.length;
+            --inFlight;
+            freeSlots.push_back(index);
+        });
+    }
+
+    m_stats.io_uring_bytes += copied;
+    span.add_bytes(copied);
+
+    if (error != 0)
+    {
+        throw menphina::errno_exception("io_uring copy failed", error);
+    }
+
+    return true;
+}
+#else
+bool menphina::CopyEngine::run_io_uring([[maybe_unused]] const std::vector<copy_op_t>& ops)
+{
+    m_ioUring = false;
+    return false;
+}
+#endif
+
+void menphina::CopyEngine::run_thread_pool(const std::vector<copy_op_t>& ops)
+{
+    TraceSpan span(trace_category::WRITE, "copy.thread_pool");
+
+    const std::vector<copy_op_t> blocks = _blocks(ops, m_options.block_size);
+    const unsigned threads = resolve_thread_count(m_options.threads);
+
+    std::vector<std::vector<char>> buffers(threads);
+
+    parallel_for(blocks.size(), threads, [&](const size_t i, const unsigned worker)
+    {
+        const copy_op_t& b = blocks[i];
+        std::vector<char>& buffer = buffers[worker];
+        buffer.resize(static_cast<size_t>(b.length));
+
+        if (pread_full(b.src_fd, buffer.data(), buffer.size(), b.src_offset, "copy source") != buffer.size())
+        {
+            throw std::runtime_error("Unexpected end of file while copying");
+        }
+
+        pwrite_all(b.dst_fd, buffer.data(), buffer.size(), b.dst_offset, "copy destination");
+    });
+
+    uint64_t bytes = 0;
+    for (const auto& b : blocks)
+    {
+        bytes += b.length;
+    }
+
+    m_stats.thread_pool_bytes += bytes;
+    span.add_bytes(bytes);
+}
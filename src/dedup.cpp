@@ -0,0 +1,554 @@
+/* Copyright 2024 isaki */
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined ( __linux__ )
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+#include "menphina/dedup.hpp"
+#include "menphina/fileio.hpp"
+#include "menphina/hash.hpp"
+#include "menphina/iopolicy.hpp"
+#include "menphina/json.hpp"
+#include "menphina/m_exception.hpp"
+#include "menphina/parallel.hpp"
+#include "menphina/penumbra.hpp"
+#include "menphina/platform.hpp"
+#include "menphina/scan.hpp"
+#include "menphina/trace.hpp"
+
+#if defined ( __linux__ )
+namespace
+{
+    // Hashed from each end of a file in the partial round; files up to
+    // twice this long are hashed whole there.
+    inline constexpr uint64_t PARTIAL_HASH_LENGTH = 64 * 1024;
+
+    // Below a filesystem block nothing is gained.
+    inline constexpr uint64_t MIN_DEDUP_SIZE = 4096;
+
+    struct dedup_file_t
+    {
+        // Relative to the ModDirectory.
+        std::string path;
+        uint64_t size;
+        int64_t mtime_ns;
+        uint64_t inode;
+    };
+
+    // The paths of one inode; hashed once for all of them.
+    struct dedup_unit_t
+    {
+        size_t first;
+        size_t count;
+        uint64_t size;
+        uint64_t inode;
+
+        menphina::content_hash_t partial;
+        menphina::content_hash_t full;
+        bool hashed = false;
+        bool failed = false;
+    };
+
+    struct dedup_stats_t
+    {
+        uint64_t files = 0;
+        uint64_t partial_hashed = 0;
+        uint64_t full_hashed = 0;
+        uint64_t groups = 0;
+        uint64_t reflinked = 0;
+        uint64_t hardlinked = 0;
+        uint64_t shared = 0;
+        uint64_t skipped = 0;
+        uint64_t bytes_reclaimed = 0;
+    };
+
+    // Every file of at least MIN_DEDUP_SIZE inside a mod, by size and inode.
+    std::vector<dedup_file_t> _collect_files(const menphina::ScanResult& scan)
+    {
+        std::vector<dedup_file_t> ret;
+
+        std::string rel;
+        for (size_t i = 0; i < scan.size(); ++i)
+        {
+            const menphina::scan_entry_t& e = scan[i];
+            if (e.type != menphina::EntryType::File || e.depth < 2 || e.size < MIN_DEDUP_SIZE)
+            {
+                continue;
+            }
+
+            scan.relative_path(i, rel);
+            ret.push_back(dedup_file_t { rel, e.size, e.mtime_ns, e.inode });
+        }
+
+        std::sort(ret.begin(), ret.end(), [](const dedup_file_t& a, const dedup_file_t& b) {
+            return std::tie(a.size, a.inode, a.path) < std::tie(b.size, b.inode, b.path);
+        });
+
+        return ret;
+    }
+
+    // Units whose size some other unit shares.
+    std::vector<dedup_unit_t> _same_size_units(const std::vector<dedup_file_t>& files)
+    {
+        std::vector<dedup_unit_t> units;
+        for (size_t i = 0; i < files.size();)
+        {
+            size_t j = i + 1;
+            while (j < files.size() && files[j].size == files[i].size && files[j].inode == files[i].inode)
+            {
+                ++j;
+            }
+
+            units.push_back(dedup_unit_t { .first = i, .count = j - i, .size = files[i].size, .inode = files[i].inode, .partial = {}, .full = {} });
+            i = j;
+        }
+
+        std::vector<dedup_unit_t> ret;
+        for (size_t i = 0; i < units.size();)
+        {
+            size_t j = i + 1;
+            while (j < units.size() && units[j].size == units[i].size)
+            {
+                ++j;
+            }
+
+            if (j - i > 1)
+            {
+                ret.insert(ret.end(), units.begin() + i, units.begin() + j);
+            }
+
+            i = j;
+        }
+
+        return ret;
+    }
+
+    // Keeps the units that share key with another one, sorted by it.
+    template<class Key>
+    void _keep_shared(std::vector<dedup_unit_t>& units, const Key& key)
+    {
+        std::erase_if(units, [](const dedup_unit_t& u) { return u.failed; });
+        std::stable_sort(units.begin(), units.end(), [&key](const dedup_unit_t& a, const dedup_unit_t& b) { return key(a) < key(b); });
+
+        std::vector<dedup_unit_t> ret;
+        for (size_t i = 0; i < units.size();)
+        {
+            size_t j = i + 1;
+            while (j < units.size() && key(units[j]) == key(units[i]))
+            {
+                ++j;
+            }
+
+            if (j - i > 1)
+            {
+                ret.insert(ret.end(), units.begin() + i, units.begin() + j);
+            }
+
+            i = j;
+        }
+
+        units = std::move(ret);
+    }
+
+    menphina::UniqueFd _open_file(const std::string& modDir, const std::string& path)
+    {
+        const std::string full = menphina::path_join(modDir, path);
+        return menphina::UniqueFd(open(full.c_str(), O_RDONLY | O_CLOEXEC));
+    }
+
+    void _partial_hash(dedup_unit_t& unit, const std::string& modDir, const std::vector<dedup_file_t>& files, std::vector<char>& buffer)
+    {
+        const std::string& path = files[unit.first].path;
+        const menphina::UniqueFd fd = _open_file(modDir, path);
+        if (!fd.valid())
+        {
+            unit.failed = true;
+            return;
+        }
+
+        menphina::TraceSpan span(menphina::trace_category::HASH, "dedup.partial");
+
+        if (unit.size <= 2 * PARTIAL_HASH_LENGTH)
+        {
+            span.add_bytes(unit.size);
+            unit.full = menphina::content_hash_fd(fd.get(), buffer);
+            unit.partial = unit.full;
+            unit.hashed = true;
+            return;
+        }
+
+        buffer.resize(std::max<size_t>(buffer.size(), 2 * PARTIAL_HASH_LENGTH));
+        const size_t head = menphina::pread_full(fd.get(), buffer.data(), PARTIAL_HASH_LENGTH, 0, path);
+        const size_t tail = menphina::pread_full(fd.get(), buffer.data() + head, PARTIAL_HASH_LENGTH, unit.size - PARTIAL_HASH_LENGTH, path);
+        span.add_bytes(head + tail);
+
+        unit.partial = menphina::content_hash(buffer.data(), head + tail);
+    }
+
+    void _full_hash(dedup_unit_t& unit, const std::string& modDir, const std::vector<dedup_file_t>& files, std::vector<char>& buffer)
+    {
+        if (unit.hashed)
+        {
+            return;
+        }
+
+        const menphina::UniqueFd fd = _open_file(modDir, files[unit.first].path);
+        if (!fd.valid())
+        {
+            unit.failed = true;
+            return;
+        }
+
+        menphina::TraceSpan span(menphina::trace_category::HASH, "dedup.full");
+        span.add_bytes(unit.size);
+
+        unit.full = menphina::content_hash_fd(fd.get(), buffer);
+        unit.hashed = true;
+    }
+
+    bool _same_bytes(const int a, const int b, const uint64_t size, std::vector<char>& bufferA, std::vector<char>& bufferB, const std::string_view what)
+    {
+        menphina::TraceSpan span(menphina::trace_category::READ, "dedup.compare");
+        span.add_bytes(2 * size);
+
+        for (uint64_t offset = 0; offset < size;)
+        {
+            const size_t length = static_cast<size_t>(std::min<uint64_t>(bufferA.size(), size - offset));
+            if (menphina::pread_full(a, bufferA.data(), length, offset, what) != length
+                || menphina::pread_full(b, bufferB.data(), length, offset, what) != length
+                || std::memcmp(bufferA.data(), bufferB.data(), length) != 0)
+            {
+                return false;
+            }
+
+            offset += length;
+        }
+
+        return true;
+    }
+
+    // Physical address of the first extent of fd, or 0 if unknown.
+    uint64_t _first_extent(const int fd)
+    {
+        alignas(struct fiemap) unsigned char request[sizeof(struct fiemap) + sizeof(struct fiemap_extent)] = {};
+        struct fiemap * map = reinterpret_cast<struct fiemap *>(request);
+
+        map->fm_start = 0;
+        map->fm_length = FIEMAP_MAX_OFFSET;
+        map->fm_extent_count = 1;
+
+        if (ioctl(fd, FS_IOC_FIEMAP, map) != 0 || map->fm_mapped_extents == 0)
+        {
+            return 0;
+        }
+
+        return map->fm_extents[0].fe_physical;
+    }
+
+    enum class MergeResult
+    {
+        Reflinked,
+        Hardlinked,
+
+        // Already a reflink of the kept file, from an earlier run.
+        Shared,
+        Skipped
+    };
+
+    // Replaces path with a copy of the kept file; see dedup.hpp.
+    class Merger final
+    {
+        public:
+            Merger(const std::string& modDir, const size_t bufferLength) :
+                m_modDir(modDir),
+                m_reflink(true),
+                m_bufferA(bufferLength),
+                m_bufferB(bufferLength)
+            {
+            }
+
+            MergeResult merge(const int keeperFd, const std::string& keeperPath, const dedup_file_t& file, std::ostream& err)
+            {
+                const std::string full = menphina::path_join(m_modDir, file.path);
+                const size_t slash = full.rfind('/');
+                const std::string dir = full.substr(0, slash);
+                const std::string name = full.substr(slash + 1);
+
+                const menphina::UniqueFd fd(open(full.c_str(), O_RDONLY | O_CLOEXEC));
+                struct stat st;
+                if (!fd.valid() || fstat(fd.get(), &st) != 0 || static_cast<uint64_t>(st.st_ino) != file.inode || static_cast<uint64_t>(st.st_size) != file.size)
+                {
+                    err << "warning: " << file.path << " changed since it was scanned; left alone" << std::endl;
+                    return MergeResult::Skipped;
+                }
+
+                const uint64_t extent = _first_extent(fd.get());
+                if (extent != 0 && extent == _first_extent(keeperFd))
+                {
+                    return MergeResult::Shared;
+                }
+
+                if (!_same_bytes(keeperFd, fd.get(), file.size, m_bufferA, m_bufferB, file.path))
+                {
+                    err << "warning: " << file.path << " differs from " << keeperPath << " despite equal hashes; left alone" << std::endl;
+                    return MergeResult::Skipped;
+                }
+
+                const menphina::UniqueFd dirfd(open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+                if (!dirfd.valid())
+                {
+                    const int e = errno;
+                    err << "warning: unable to open " << dir << ": " << std::strerror(e) << std::endl;
+                    return MergeResult::Skipped;
+                }
+
+                const std::string staged = menphina::staging_name(name);
+
+                if (m_reflink && reflink(keeperFd, dirfd.get(), staged, st))
+                {
+                    menphina::publish_staged(dirfd.get(), staged, name, true);
+                    return MergeResult::Reflinked;
+                }
+
+                const std::string keeperFull = menphina::path_join(m_modDir, keeperPath);
+                if (linkat(AT_FDCWD, keeperFull.c_str(), dirfd.get(), staged.c_str(), 0) != 0)
+                {
+                    const int e = errno;
+                    err << "warning: unable to link " << file.path << " to " << keeperPath << ": " << std::strerror(e) << std::endl;
+                    return MergeResult::Skipped;
+                }
+
+                menphina::publish_staged(dirfd.get(), staged, name, true);
+                return MergeResult::Hardlinked;
+            }
+
+        private:
+            const std::string& m_modDir;
+
+            // Sticky: once the filesystem turned a reflink down it is not
+            // asked again.
+            bool m_reflink;
+
+            std::vector<char> m_bufferA;
+            std::vector<char> m_bufferB;
+
+            // A staged reflink of keeperFd with the mode and mtime of st;
+            // false (and nothing staged) if the filesystem cannot do it.
+            bool reflink(const int keeperFd, const int dirfd, const std::string& staged, const struct stat& st)
+            {
+                menphina::UniqueFd fd = menphina::open_staged(dirfd, staged);
+
+                if (ioctl(fd.get(), FICLONE, keeperFd) != 0)
+                {
+                    const int err = errno;
+                    fd.reset();
+                    menphina::discard_staged(dirfd, staged);
+
+                    if (err == EOPNOTSUPP || err == ENOTTY || err == EINVAL || err == EXDEV || err == ENOSYS)
+                    {
+                        m_reflink = false;
+                        return false;
+                    }
+
+                    throw menphina::errno_exception("Unable to reflink " + staged, err);
+                }
+
+                const struct timespec times[2] = {
+                    { .tv_sec = 0, .tv_nsec = UTIME_OMIT },
+                    st.st_mtim
+                };
+
+                if (fchmod(fd.get(), st.st_mode & 07777) != 0 || futimens(fd.get(), times) != 0)
+                {
+                    const int err = errno;
+                    fd.reset();
+                    menphina::discard_staged(dirfd, staged);
+                    throw menphina::errno_exception("Unable to set the attributes of " + staged, err);
+                }
+
+                return true;
+            }
+    };
+}
+#endif
+
+menphina::Dedup::Dedup() {}
+
+menphina::Dedup::~Dedup() {}
+
+#if defined ( __linux__ )
+void menphina::Dedup::run(const std::string_view& launcherDir)
+{
+    penumbra_config_t config {};
+    read_json_file(config, get_penumbra_config_file(launcherDir));
+
+    const std::string modDir = native_path(config.ModDirectory);
+    const io_policy_t policy = get_io_policy(modDir);
+
+    report_progress("scan", 0, 0);
+
+    const DirectoryScanner scanner;
+    const ScanResult scan = scanner.scan(modDir);
+
+    // A file missing from the scan could be the only other copy; that
+    // is harmless, but a partial picture is not worth the hashing.
+    if (!scan.errors().empty())
+    {
+        for (const std::string& e : scan.errors())
+        {
+            std::cerr << e << std::endl;
+        }
+
+        throw std::runtime_error("ModDirectory scan was incomplete; not deduplicating");
+    }
+
+    const std::vector<dedup_file_t> files = _collect_files(scan);
+    std::vector<dedup_unit_t> units = _same_size_units(files);
+
+    dedup_stats_t stats;
+    stats.files = files.size();
+
+    const unsigned threads = resolve_thread_count(0);
+    std::vector<std::vector<char>> buffers(threads, std::vector<char>(policy.transfer_length));
+    std::atomic<uint64_t> progress(0);
+
+    // Only the calling thread (worker 0) reports; any of them may stop.
+    const auto step = [this, &progress](const char * phase, const unsigned worker, const uint64_t total)
+    {
+        check_cancelled();
+        const uint64_t done = progress.fetch_add(1, std::memory_order_relaxed);
+        if (worker == 0)
+        {
+            report_progress(phase, done, total);
+        }
+    };
+
+    stats.partial_hashed = units.size();
+    parallel_for(units.size(), threads, [&](const size_t i, const unsigned worker)
+    {
+        step("dedup.partial", worker, units.size());
+        _partial_hash(units[i], modDir, files, buffers[worker]);
+    });
+
+    _keep_shared(units, [](const dedup_unit_t& u) { return std::make_tuple(u.size, u.partial); });
+
+    progress = 0;
+    stats.full_hashed = static_cast<uint64_t>(std::count_if(units.begin(), units.end(), [](const dedup_unit_t& u) { return !u.hashed; }));
+    parallel_for(units.size(), threads, [&](const size_t i, const unsigned worker)
+    {
+        step("dedup.full", worker, units.size());
+        _full_hash(units[i], modDir, files, buffers[worker]);
+    });
+
+    _keep_shared(units, [](const dedup_unit_t& u) { return std::make_tuple(u.size, u.full); });
+
+    // Groups are runs of equal (size, full); the unit whose first path
+    // sorts first is kept, so reruns agree on it.
+    Merger merger(modDir, policy.transfer_length);
+    for (size_t i = 0; i < units.size();)
+    {
+        size_t j = i + 1;
+        while (j < units.size() && units[j].size == units[i].size && units[j].full == units[i].full)
+        {
+            ++j;
+        }
+
+        check_cancelled();
+        report_progress("dedup", i, units.size());
+
+        const auto keeper = std::min_element(units.begin() + i, units.begin() + j, [&files](const dedup_unit_t& a, const dedup_unit_t& b) {
+            return files[a.first].path < files[b.first].path;
+        });
+
+        const std::string& keeperPath = files[keeper->first].path;
+        const UniqueFd keeperFd = _open_file(modDir, keeperPath);
+        if (!keeperFd.valid())
+        {
+            std::cerr << "warning: unable to open " << keeperPath << "; group left alone" << std::endl;
+            i = j;
+            continue;
+        }
+
+        ++stats.groups;
+
+        for (size_t u = i; u < j; ++u)
+        {
+            if (units.begin() + u == keeper)
+            {
+                continue;
+            }
+
+            // The inode's blocks are only freed once its last path is gone.
+            bool allMerged = true;
+            for (size_t f = units[u].first; f < units[u].first + units[u].count; ++f)
+            {
+                const MergeResult r = merger.merge(keeperFd.get(), keeperPath, files[f], std::cerr);
+                if (r == MergeResult::Reflinked)
+                {
+                    ++stats.reflinked;
+                    std::cout << "Reflinked: " << files[f].path << " -> " << keeperPath << std::endl;
+                }
+                else if (r == MergeResult::Hardlinked)
+                {
+                    ++stats.hardlinked;
+                    std::cout << "Hardlinked: " << files[f].path << " -> " << keeperPath << std::endl;
+                }
+                else if (r == MergeResult::Shared)
+                {
+                    ++stats.shared;
+                    allMerged = false;
+                }
+                else
+                {
+                    ++stats.skipped;
+                    allMerged = false;
+                }
+            }
+
+            if (allMerged)
+            {
+                stats.bytes_reclaimed += units[u].size;
+            }
+        }
+
+        i = j;
+    }
+
+    report_progress("dedup", units.size(), units.size());
+
+    std::cout << "Deduplicated " << modDir << " (" << io_policy_name(policy.kind) << " I/O): "
+        << stats.files << " files, "
+        << stats.partial_hashed << " partially hashed, "
+        << stats.full_hashed << " fully hashed, "
+        << stats.groups << " groups of identical files; "
+        << stats.reflinked << " reflinked, "
+        << stats.hardlinked << " hardlinked, "
+        << stats.shared << " already shared, "
+        << stats.skipped << " skipped; "
+        << stats.bytes_reclaimed << " bytes reclaimed"
+        << std::endl;
+}
+#else
+void menphina::Dedup::run([[maybe_unused]] const std::string_view& launcherDir)
+{
+    throw std::runtime_error("Deduplication is only supported on Linux");
+}
+#endif
@@ -0,0 +1,42 @@
+/* Copyright 2024 isaki */
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+#include "menphina/delta.hpp"
+#include "menphina/xmdelta.hpp"
+#include "menphina/xmpkg.hpp"
+
+menphina::Delta::Delta(const std::string& basePackage, const std::string& package, const std::string& deltaFile) :
+    m_basePackage(basePackage),
+    m_package(package),
+    m_deltaFile(deltaFile)
+{
+}
+
+menphina::Delta::~Delta() {}
+
+void menphina::Delta::run([[maybe_unused]] const std::string_view& launcherDir)
+{
+    const XmpkgReader base(m_basePackage);
+    const XmpkgReader target(m_package);
+
+    const xmdelta_write_stats_t stats = write_xmdelta(base, target, m_deltaFile, [this](const uint64_t done, const uint64_t total)
+    {
+        check_cancelled();
+        report_progress("delta", done, total);
+    });
+
+    std::cout << "Wrote delta for " << stats.files << " files in "
+        << stats.mods << " mods into " << m_deltaFile << ": "
+        << stats.unchanged << " unchanged, "
+        << stats.patched << " patched, "
+        << stats.whole << " whole; "
+        << stats.copied_bytes << " bytes copied from the base, "
+        << stats.literal_bytes << " bytes carried ("
+        << stats.duplicate_bytes << " duplicate bytes skipped), "
+        << stats.delta_size << " bytes total"
+        << std::endl;
+}
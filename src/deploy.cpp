@@ -0,0 +1,764 @@
+/* Copyright 2024 isaki */
+
+#include <cerrno>
+#include <ctime>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "menphina/copy.hpp"
+#include "menphina/deploy.hpp"
+#include "menphina/fileio.hpp"
+#include "menphina/fsplan.hpp"
+#include "menphina/hash.hpp"
+#include "menphina/iopolicy.hpp"
+#include "menphina/json.hpp"
+#include "menphina/m_exception.hpp"
+#include "menphina/penumbra.hpp"
+#include "menphina/platform.hpp"
+#include "menphina/scan.hpp"
+#include "menphina/trace.hpp"
+#include "menphina/xmdelta.hpp"
+#include "menphina/xmpkg.hpp"
+
+namespace
+{
+    // Staged files whose content is copied by one run of the copy engine.
+    inline constexpr size_t BATCH_FILES = 64;
+    inline constexpr uint64_t BATCH_BYTES = 256 * 1024 * 1024;
+
+    struct deploy_stats_t
+    {
+        uint64_t mods = 0;
+        uint64_t files = 0;
+        uint64_t unchanged = 0;
+        uint64_t hashed = 0;
+        uint64_t written = 0;
+        uint64_t patched = 0;
+        uint64_t bytes_written = 0;
+    };
+
+    std::vector<const menphina::xmpkg_mod_t *> _select_mods(const menphina::XmpkgReader& reader, const std::vector<std::string>& names)
+    {
+        std::vector<const menphina::xmpkg_mod_t *> ret;
+
+        if (names.empty())
+        {
+            ret.reserve(reader.mods().size());
+            for (const auto& mod : reader.mods())
+            {
+                ret.push_back(&mod);
+            }
+
+            return ret;
+        }
+
+        ret.reserve(names.size());
+        for (const auto& name : names)
+        {
+            const menphina::xmpkg_mod_t * mod = reader.find_mod(name);
+            if (mod == nullptr)
+            {
+                throw std::runtime_error("Mod not found in " + reader.path() + ": " + name);
+            }
+
+            ret.push_back(mod);
+        }
+
+        return ret;
+    }
+
+    // What is currently installed for one mod; files are looked up by their
+    // path relative to the mod directory in the scan's PathArena.
+    menphina::ScanResult _scan_installed(const std::string& modRoot)
+    {
+        if (!menphina::path_exists(modRoot))
+        {
+            return menphina::ScanResult();
+        }
+
+        const menphina::DirectoryScanner scanner;
+        return scanner.scan(modRoot);
+    }
+
+    const menphina::scan_entry_t * _find_installed(const menphina::ScanResult& installed, const std::string_view path)
+    {
+        const menphina::path_id id = installed.paths().find_path(path);
+        if (id == menphina::NO_PATH || installed[id].type != menphina::EntryType::File)
+        {
+            return nullptr;
+        }
+
+        return &installed[id];
+    }
+
+    void _set_mtime(const int fd, const int64_t mtimeNs, const std::string_view name)
+    {
+        const struct timespec times[2] = {
+            { .tv_sec = 0, .tv_nsec = UTIME_OMIT },
+            { .tv_sec = static_cast<time_t>(mtimeNs / 1000000000), .tv_nsec = static_cast<long>(mtimeNs % 1000000000) }
+        };
+
+        if (futimens(fd, times) != 0)
+        {
+            const int err = errno;
+            throw menphina::errno_exception("Unable to set mtime of " + std::string(name), err);
+        }
+    }
+
+    // utimensat() relative to the directory, for files whose content is
+    // already right.
+    void _set_mtime_at(const int dirfd, const std::string& name, const int64_t mtimeNs)
+    {
+        const struct timespec times[2] = {
+            { .tv_sec = 0, .tv_nsec = UTIME_OMIT },
+            { .tv_sec = static_cast<time_t>(mtimeNs / 1000000000), .tv_nsec = static_cast<long>(mtimeNs % 1000000000) }
+        };
+
+        if (utimensat(dirfd, name.c_str(), times, 0) != 0)
+        {
+            const int err = errno;
+            throw menphina::errno_exception("Unable to set mtime of " + name, err);
+        }
+    }
+
+    // Same size, different mtime: the content decides. A match only needs
+    // the mtime brought in line so the next run takes the fast path; that
+    // is left to the plan. File is an xmpkg_file_t or an xmdelta_file_t.
+    template<class File>
+    bool _same_content(const std::string& full, const File& file, std::vector<char>& buffer)
+    {
+        const menphina::UniqueFd fd(open(full.c_str(), O_RDONLY | O_CLOEXEC));
+        if (!fd.valid())
+        {
+            return false;
+        }
+
+        menphina::TraceSpan span(menphina::trace_category::HASH, "file.verify");
+        span.add_files(1);
+        span.add_bytes(file.size);
+
+        return menphina::content_hash_fd(fd.get(), buffer) == menphina::content_hash_t { file.hash_lo, file.hash_hi };
+    }
+
+    struct path_parts_t
+    {
+        std::string_view dir;
+        std::string_view name;
+    };
+
+    path_parts_t _split_path(const std::string_view path)
+    {
+        const size_t slash = path.rfind('/');
+        if (slash == std::string_view::npos)
+        {
+            return path_parts_t { {}, path };
+        }
+
+        return path_parts_t { path.substr(0, slash), path.substr(slash + 1) };
+    }
+
+    // A file found to be unchanged by its content still gets its mtime set,
+    // which the plan does as a Touch. Returns true if nothing else is needed.
+    template<class File>
+    bool _plan_unchanged(menphina::FsPlan& plan, const menphina::scan_entry_t * current, const std::string_view path, const File& file, const size_t index,
+        const menphina::io_policy_t& policy, std::vector<char>& buffer, deploy_stats_t& stats)
+    {
+        if (current == nullptr || current->size != file.size)
+        {
+            return false;
+        }
+
+        if (menphina::same_mtime(policy, current->mtime_ns, file.mtime_ns))
+        {
+            ++stats.unchanged;
+            return true;
+        }
+
+        ++stats.hashed;
+        if (!_same_content(menphina::path_join(plan.root(), path), file, buffer))
+        {
+            return false;
+        }
+
+        ++stats.unchanged;
+
+        const path_parts_t parts = _split_path(path);
+        plan.add(menphina::fs_op_t {
+            .kind = menphina::FsOpKind::Touch,
+            .directory = plan.directory(parts.dir),
+            .name = std::string(parts.name),
+            .size = file.size,
+            .mtime_ns = file.mtime_ns,
+            .locality = current->inode,
+            .source = index,
+            .note = {}
+        });
+
+        return true;
+    }
+
+    void _plan_write(menphina::FsPlan& plan, const bool exists, const std::string_view path, const uint64_t size, const int64_t mtimeNs,
+        const uint64_t sourceOffset, const size_t index, deploy_stats_t& stats)
+    {
+        const path_parts_t parts = _split_path(path);
+        plan.add(menphina::fs_op_t {
+            .kind = (exists) ? menphina::FsOpKind::Replace : menphina::FsOpKind::Create,
+            .directory = plan.directory(parts.dir),
+            .name = std::string(parts.name),
+            .size = size,
+            .mtime_ns = mtimeNs,
+            .locality = sourceOffset,
+            .source = index,
+            .note = {}
+        });
+
+        ++stats.written;
+        stats.bytes_written += size;
+    }
+
+    // Files are staged as they are visited but their content is copied in
+    // batches, so the copy engine has many files' worth of I/O to overlap.
+    // Nothing is published before its batch has been copied; whatever is
+    // still pending when the batch is destroyed is discarded.
+    class StagedBatch final
+    {
+        public:
+            // Queues (or writes) the content of a staged file, given its fd.
+            using fill_t = std::function<void(const int, menphina::CopyEngine&)>;
+
+            StagedBatch() = default;
+
+            ~StagedBatch()
+            {
+                discard();
+            }
+
+            StagedBatch(const StagedBatch&) = delete;
+            StagedBatch& operator=(const StagedBatch&) = delete;
+
+            // Keeps fd open until the batch has been copied, for files whose
+            // queued copies read from it.
+            void hold(menphina::UniqueFd fd)
+            {
+                m_held.push_back(std::move(fd));
+            }
+
+            void add(const int dirfd, const std::string_view name, const bool exists, const int64_t mtimeNs, const fill_t& fill)
+            {
+                std::string staged = menphina::staging_name(name);
+                menphina::UniqueFd fd = menphina::open_staged(dirfd, staged);
+
+                m_pending.push_back(pending_t {
+                    .dirfd = dirfd,
+                    .staged = std::move(staged),
+                    .name = std::string(name),
+                    .exists = exists,
+                    .mtimeNs = mtimeNs,
+                    .fd = std::move(fd)
+                });
+
+                fill(m_pending.back().fd.get(), m_copy);
+
+                if (m_pending.size() >= BATCH_FILES || m_copy.pending_bytes() >= BATCH_BYTES)
+                {
+                    flush();
+                }
+            }
+
+            void flush()
+            {
+                if (m_pending.empty())
+                {
+                    return;
+                }
+
+                {
+                    menphina::TraceSpan span(menphina::trace_category::WRITE, "deploy.copy");
+                    span.add_files(m_pending.size());
+                    span.add_bytes(m_copy.pending_bytes());
+                    m_copy.run();
+                }
+
+                while (!m_pending.empty())
+                {
+                    pending_t& p = m_pending.back();
+
+                    // Keep the packaged mtime so later runs can compare cheaply.
+                    _set_mtime(p.fd.get(), p.mtimeNs, p.name);
+                    p.fd.reset();
+
+                    menphina::publish_staged(p.dirfd, p.staged, p.name, p.exists);
+                    m_pending.pop_back();
+                }
+
+                m_held.clear();
+            }
+
+        private:
+            struct pending_t
+            {
+                int dirfd;
+                std::string staged;
+                std::string name;
+                bool exists;
+                int64_t mtimeNs;
+                menphina::UniqueFd fd;
+            };
+
+            menphina::CopyEngine m_copy;
+            std::vector<pending_t> m_pending;
+            std::vector<menphina::UniqueFd> m_held;
+
+            void discard()
+            {
+                for (pending_t& p : m_pending)
+                {
+                    p.fd.reset();
+                    menphina::discard_staged(p.dirfd, p.staged);
+                }
+
+                m_pending.clear();
+                m_held.clear();
+            }
+    };
+
+
+    // What deploying one mod changes; operations refer to files by their
+    // index in the mod. beforeFile runs ahead of every file and is where the
+    // execution reports progress and honours cancellation.
+    std::unique_ptr<menphina::FsPlan> _plan_mod(const menphina::XmpkgReader& reader, const menphina::xmpkg_mod_t& mod, const std::string& modRoot,
+        const menphina::io_policy_t& policy, const std::function<void()>& beforeFile, deploy_stats_t& stats)
+    {
+        const menphina::ScanResult installed = _scan_installed(modRoot);
+        auto plan = std::make_unique<menphina::FsPlan>(modRoot);
+
+        // content_hash_fd reads in pieces as large as the buffer it is given.
+        std::vector<char> buffer(policy.transfer_length);
+
+        const std::span<const menphina::xmpkg_file_t> files = reader.files(mod);
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            beforeFile();
+            ++stats.files;
+
+            const menphina::xmpkg_file_t& file = files[i];
+            const std::string_view path = reader.path(file);
+            const menphina::scan_entry_t * current = _find_installed(installed, path);
+
+            if (_plan_unchanged(*plan, current, path, file, i, policy, buffer, stats))
+            {
+                continue;
+            }
+
+            // Written in the order their content sits in the package.
+            const std::span<const uint32_t> refs = reader.chunk_refs(file);
+            const uint64_t offset = (refs.empty()) ? 0 : reader.chunk(refs.front()).offset;
+
+            _plan_write(*plan, current != nullptr, path, file.size, file.mtime_ns, offset, i, stats);
+        }
+
+        ++stats.mods;
+        return plan;
+    }
+
+    void _run_mod_plan(const menphina::XmpkgReader& reader, const menphina::xmpkg_mod_t& mod, menphina::FsPlan& plan, const std::function<void()>& beforeOp)
+    {
+        const std::span<const menphina::xmpkg_file_t> files = reader.files(mod);
+        StagedBatch batch;
+
+        plan.run([&reader, &files, &batch, &beforeOp](const menphina::fs_op_t& op, const int dirfd)
+        {
+            beforeOp();
+
+            if (op.kind == menphina::FsOpKind::Touch)
+            {
+                _set_mtime_at(dirfd, op.name, op.mtime_ns);
+                return;
+            }
+
+            const menphina::xmpkg_file_t& file = files[op.source];
+            batch.add(dirfd, op.name, op.kind == menphina::FsOpKind::Replace, op.mtime_ns, [&reader, &file](const int fd, menphina::CopyEngine& engine)
+            {
+                if (!reader.queue_extract(file, fd, engine))
+                {
+                    reader.will_need(file);
+                    reader.extract(file, fd);
+                }
+            });
+        }, [&batch]() { batch.flush(); });
+    }
+
+    // The base file a patch reads from, or nothing if it is no longer what
+    // the base package had.
+    menphina::UniqueFd _open_basis(const std::string& modDir, const menphina::XmdeltaReader& delta, const menphina::xmdelta_file_t& file,
+        const menphina::io_policy_t& policy, std::vector<char>& buffer)
+    {
+        const std::string full = menphina::path_join(menphina::path_join(modDir, delta.base_mod(file)), delta.base_path(file));
+        menphina::UniqueFd fd(open(full.c_str(), O_RDONLY | O_CLOEXEC));
+        if (!fd.valid())
+        {
+            return fd;
+        }
+
+        struct stat st;
+        if (fstat(fd.get(), &st) != 0 || !S_ISREG(st.st_mode) || static_cast<uint64_t>(st.st_size) != file.base_size)
+        {
+            return menphina::UniqueFd();
+        }
+
+        const int64_t mtimeNs = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        if (menphina::same_mtime(policy, mtimeNs, file.base_mtime_ns))
+        {
+            return fd;
+        }
+
+        menphina::TraceSpan span(menphina::trace_category::HASH, "file.verify");
+        span.add_files(1);
+        span.add_bytes(file.base_size);
+
+        if (menphina::content_hash_fd(fd.get(), buffer) != menphina::content_hash_t { file.base_hash_lo, file.base_hash_hi })
+        {
+            return menphina::UniqueFd();
+        }
+
+        return fd;
+    }
+
+    // As _plan_mod(), with the content coming from the delta and the
+    // installed base files. Files that cannot be brought up to date are
+    // added to failed and left out of the plan.
+    std::unique_ptr<menphina::FsPlan> _plan_delta_mod(const menphina::XmdeltaReader& delta, const menphina::xmdelta_mod_t& mod, const std::string& modDir,
+        const menphina::io_policy_t& policy, const std::function<void()>& beforeFile, deploy_stats_t& stats, std::vector<std::string>& failed)
+    {
+        const std::string modRoot = menphina::path_join(modDir, delta.name(mod));
+        const menphina::ScanResult installed = _scan_installed(modRoot);
+        auto plan = std::make_unique<menphina::FsPlan>(modRoot);
+
+        std::vector<char> buffer(policy.transfer_length);
+
+        const std::span<const menphina::xmdelta_file_t> files = delta.files(mod);
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            beforeFile();
+            ++stats.files;
+
+            const menphina::xmdelta_file_t& file = files[i];
+            const std::string_view path = delta.path(file);
+            const menphina::scan_entry_t * current = _find_installed(installed, path);
+
+            if (_plan_unchanged(*plan, current, path, file, i, policy, buffer, stats))
+            {
+                continue;
+            }
+
+            const auto kind = static_cast<menphina::DeltaFileKind>(file.kind);
+            if (kind == menphina::DeltaFileKind::Unchanged
+                || (kind == menphina::DeltaFileKind::Patch && !_open_basis(modDir, delta, file, policy, buffer).valid()))
+            {
+                failed.push_back(std::string(delta.name(mod)) + "/" + std::string(path));
+                continue;
+            }
+
+            if (kind == menphina::DeltaFileKind::Patch)
+            {
+                ++stats.patched;
+            }
+
+            const std::span<const menphina::xmdelta_op_t> ops = delta.ops(file);
+            const uint64_t offset = (ops.empty()) ? 0 : ops.front().offset;
+
+            _plan_write(*plan, current != nullptr, path, file.size, file.mtime_ns, offset, i, stats);
+        }
+
+        ++stats.mods;
+        return plan;
+    }
+
+    // The basis of every patch is opened again, and checked again, as its
+    // file is written; one that changed since planning fails the file.
+    void _run_delta_plan(const menphina::XmdeltaReader& delta, const menphina::xmdelta_mod_t& mod, const std::string& modDir, const menphina::io_policy_t& policy,
+        menphina::FsPlan& plan, const std::function<void()>& beforeOp, std::vector<std::string>& failed)
+    {
+        const std::span<const menphina::xmdelta_file_t> files = delta.files(mod);
+        std::vector<char> buffer(policy.transfer_length);
+        StagedBatch batch;
+
+        plan.run([&](const menphina::fs_op_t& op, const int dirfd)
+        {
+            beforeOp();
+
+            if (op.kind == menphina::FsOpKind::Touch)
+            {
+                _set_mtime_at(dirfd, op.name, op.mtime_ns);
+                return;
+            }
+
+            const menphina::xmdelta_file_t& file = files[op.source];
+
+            menphina::UniqueFd basis;
+            if (static_cast<menphina::DeltaFileKind>(file.kind) == menphina::DeltaFileKind::Patch)
+            {
+                basis = _open_basis(modDir, delta, file, policy, buffer);
+                if (!basis.valid())
+                {
+                    failed.push_back(std::string(delta.name(mod)) + "/" + std::string(delta.path(file)));
+                    return;
+                }
+            }
+
+            const std::span<const menphina::xmdelta_op_t> ops = delta.ops(file);
+            const int basisFd = basis.get();
+
+            // The basis may be the very file being replaced; holding it open
+            // keeps its content readable until the batch has been copied.
+            if (basis.valid())
+            {
+                batch.hold(std::move(basis));
+            }
+
+            batch.add(dirfd, op.name, op.kind == menphina::FsOpKind::Replace, op.mtime_ns, [&delta, ops, basisFd](const int fd, menphina::CopyEngine& engine)
+            {
+                uint64_t offset = 0;
+                for (const menphina::xmdelta_op_t& op : ops)
+                {
+                    const bool literal = op.kind == static_cast<uint32_t>(menphina::DeltaOpKind::Literal);
+
+                    engine.add(menphina::copy_op_t {
+                        .src_fd = (literal) ? delta.fd() : basisFd,
+                        .src_offset = op.offset,
+                        .dst_fd = fd,
+                        .dst_offset = offset,
+                        .length = op.length
+                    });
+
+                    offset += op.length;
+                }
+            });
+        }, [&batch]() { batch.flush(); });
+    }
+
+    uint64_t _planned_ops(const std::vector<std::unique_ptr<menphina::FsPlan>>& plans)
+    {
+        uint64_t ret = 0;
+        for (const auto& plan : plans)
+        {
+            ret += plan->size();
+        }
+
+        return ret;
+    }
+
+    void _print_plans(const std::vector<std::unique_ptr<menphina::FsPlan>>& plans, std::ostream& out)
+    {
+        for (const auto& plan : plans)
+        {
+            plan->print(out);
+        }
+    }
+}
+
+menphina::Deploy::Deploy(const std::string& packageFile, const std::vector<std::string>& mods, const bool dryRun) :
+    m_packageFile(packageFile),
+    m_mods(mods),
+    m_dryRun(dryRun)
+{
+}
+
+menphina::Deploy::~Deploy() {}
+
+void menphina::Deploy::run(const std::string_view& launcherDir)
+{
+    penumbra_config_t config {};
+    read_json_file(config, get_penumbra_config_file(launcherDir));
+
+    const std::string modDir = native_path(config.ModDirectory);
+    const io_policy_t policy = get_io_policy(modDir);
+
+    if (is_xmdelta(m_packageFile))
+    {
+        apply_delta(modDir, policy);
+        return;
+    }
+
+    const XmpkgReader reader(m_packageFile);
+
+    const std::vector<const xmpkg_mod_t *> mods = _select_mods(reader, m_mods);
+
+    uint64_t total = 0;
+    for (const xmpkg_mod_t * mod : mods)
+    {
+        total += mod->file_count;
+    }
+
+    // Nothing is changed until every mod has been planned.
+    deploy_stats_t stats;
+    const auto beforeFile = [this, &stats, total]()
+    {
+        check_cancelled();
+        report_progress("plan", stats.files, total);
+    };
+
+    std::vector<std::unique_ptr<FsPlan>> plans;
+    for (const xmpkg_mod_t * mod : mods)
+    {
+        plans.push_back(_plan_mod(reader, *mod, path_join(modDir, reader.name(*mod)), policy, beforeFile, stats));
+    }
+
+    report_progress("plan", stats.files, total);
+
+    if (m_dryRun)
+    {
+        _print_plans(plans, std::cout);
+
+        std::cout << "Planned deploy of " << stats.mods << " mods into " << modDir << " (" << io_policy_name(policy.kind) << " I/O): "
+            << stats.files << " files, "
+            << stats.unchanged << " unchanged ("
+            << stats.hashed << " compared by hash), "
+            << stats.written << " to write ("
+            << stats.bytes_written << " bytes); nothing changed"
+            << std::endl;
+
+        return;
+    }
+
+    const uint64_t ops = _planned_ops(plans);
+    uint64_t done = 0;
+    const auto beforeOp = [this, &done, ops]()
+    {
+        // Every file is published atomically, so stopping between files
+        // leaves each one either old or new.
+        check_cancelled();
+        report_progress("deploy", done++, ops);
+    };
+
+    for (size_t m = 0; m < mods.size(); ++m)
+    {
+        _run_mod_plan(reader, *mods[m], *plans[m], beforeOp);
+
+        // Done with; no need to hold every mod's operations until the end.
+        plans[m].reset();
+    }
+
+    report_progress("deploy", ops, ops);
+
+    std::cout << "Deployed " << stats.mods << " mods into " << modDir << " (" << io_policy_name(policy.kind) << " I/O): "
+        << stats.files << " files, "
+        << stats.unchanged << " unchanged ("
+        << stats.hashed << " compared by hash), "
+        << stats.written << " written ("
+        << stats.bytes_written << " bytes)"
+        << std::endl;
+}
+
+void menphina::Deploy::apply_delta(const std::string& modDir, const io_policy_t& policy)
+{
+    const XmdeltaReader delta(m_packageFile);
+
+    std::vector<const xmdelta_mod_t *> mods;
+    if (m_mods.empty())
+    {
+        for (const xmdelta_mod_t& mod : delta.mods())
+        {
+            mods.push_back(&mod);
+        }
+    }
+    else
+    {
+        for (const std::string& name : m_mods)
+        {
+            const xmdelta_mod_t * mod = delta.find_mod(name);
+            if (mod == nullptr)
+            {
+                throw std::runtime_error("Mod not found in " + delta.path() + ": " + name);
+            }
+
+            mods.push_back(mod);
+        }
+    }
+
+    uint64_t total = 0;
+    for (const xmdelta_mod_t * mod : mods)
+    {
+        total += mod->file_count;
+    }
+
+    deploy_stats_t stats;
+    std::vector<std::string> failed;
+    const auto beforeFile = [this, &stats, total]()
+    {
+        check_cancelled();
+        report_progress("plan", stats.files, total);
+    };
+
+    std::vector<std::unique_ptr<FsPlan>> plans;
+    for (const xmdelta_mod_t * mod : mods)
+    {
+        plans.push_back(_plan_delta_mod(delta, *mod, modDir, policy, beforeFile, stats, failed));
+    }
+
+    report_progress("plan", stats.files, total);
+
+    if (m_dryRun)
+    {
+        _print_plans(plans, std::cout);
+
+        std::cout << "Planned delta of " << stats.mods << " mods in " << modDir << " (" << io_policy_name(policy.kind) << " I/O): "
+            << stats.files << " files, "
+            << stats.unchanged << " unchanged ("
+            << stats.hashed << " compared by hash), "
+            << stats.written << " to write ("
+            << stats.patched << " patched, "
+            << stats.bytes_written << " bytes); nothing changed"
+            << std::endl;
+    }
+    else
+    {
+        const uint64_t ops = _planned_ops(plans);
+        uint64_t done = 0;
+        const auto beforeOp = [this, &done, ops]()
+        {
+            check_cancelled();
+            report_progress("deploy", done++, ops);
+        };
+
+        for (size_t m = 0; m < mods.size(); ++m)
+        {
+            _run_delta_plan(delta, *mods[m], modDir, policy, *plans[m], beforeOp, failed);
+            plans[m].reset();
+        }
+
+        report_progress("deploy", ops, ops);
+
+        std::cout << "Applied delta to " << stats.mods << " mods in " << modDir << " (" << io_policy_name(policy.kind) << " I/O): "
+            << stats.files << " files, "
+            << stats.unchanged << " unchanged ("
+            << stats.hashed << " compared by hash), "
+            << stats.written << " written ("
+            << stats.patched << " patched, "
+            << stats.bytes_written << " bytes)"
+            << std::endl;
+    }
+
+    if (!failed.empty())
+    {
+        for (const std::string& f : failed)
+        {
+            std::cerr << "Not as in the base package: " << f << std::endl;
+        }
+
+        throw std::runtime_error(std::to_string(failed.size()) + " files could not be updated by the delta; deploy the full package instead");
+    }
+}
@@ -1,7 +1,246 @@
 /* Copyright 2024 isaki */
 
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+
 #include "menphina/exec.hpp"
+#include "menphina/m_exception.hpp"
+
+struct menphina::job_shared_t
+{
+    std::shared_ptr<Execution> exec;
+    std::string launcherDir;
+    job_callbacks_t callbacks;
+
+    std::atomic<bool> cancelled { false };
+
+    mutable std::mutex lock;
+    std::condition_variable finished;
+    JobState state = JobState::Running;
+    job_progress_t progress;
+    std::string error;
+
+    std::thread thread;
+
+    void report(const char * phase, const uint64_t done, const uint64_t total)
+    {
+        const job_progress_t p { phase, done, total };
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            progress = p;
+        }
+
+        if (callbacks.on_progress)
+        {
+            callbacks.on_progress(p);
+        }
+    }
+
+    void run()
+    {
+        JobState result = JobState::Failed;
+        std::string message;
+
+        try
+        {
+            exec->run(launcherDir);
+            result = JobState::Succeeded;
+        }
+        catch (const menphina::cancelled_exception&)
+        {
+            result = JobState::Cancelled;
+        }
+        catch (const std::exception& e)
+        {
+            message = e.what();
+        }
+        catch (...)
+        {
+            message = "unknown error";
+        }
+
+        exec->m_job = nullptr;
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            state = result;
+            error = std::move(message);
+        }
+
+        finished.notify_all();
+
+        if (callbacks.on_finished)
+        {
+            // Nobody is left to report a failure to.
+            try
+            {
+                callbacks.on_finished(result);
+            }
+            catch (...)
+            {
+            }
+        }
+    }
+};
+
+/* Execution */
 
 menphina::Execution::~Execution() {}
 
-menphina::Execution::Execution() {}
+menphina::Execution::Execution() : m_job(nullptr) {}
+
+void menphina::Execution::report_progress(const char * phase, const uint64_t done, const uint64_t total) const
+{
+    if (m_job != nullptr)
+    {
+        m_job->report(phase, done, total);
+    }
+}
+
+void menphina::Execution::check_cancelled() const
+{
+    if (m_job != nullptr && m_job->cancelled.load(std::memory_order_relaxed))
+    {
+        throw menphina::cancelled_exception();
+    }
+}
+
+/* Job */
+
+menphina::Job::Job(std::shared_ptr<job_shared_t> shared) : m_shared(std::move(shared)) {}
+
+menphina::Job::Job(Job&&) noexcept = default;
+
+menphina::Job& menphina::Job::operator=(Job&& other) noexcept
+{
+    if (this != &other)
+    {
+        finish();
+        m_shared = std::move(other.m_shared);
+    }
+
+    return *this;
+}
+
+menphina::Job::~Job()
+{
+    finish();
+}
+
+void menphina::Job::finish()
+{
+    if (!m_shared)
+    {
+        return;
+    }
+
+    cancel();
+    if (m_shared->thread.joinable())
+    {
+        // The last handle dropped from on_finished: the thread cannot wait
+        // for itself, and keeps the shared state alive until it returns.
+        if (m_shared->thread.get_id() == std::this_thread::get_id())
+        {
+            m_shared->thread.detach();
+        }
+        else
+        {
+            m_shared->thread.join();
+        }
+    }
+
+    m_shared.reset();
+}
+
+menphina::job_shared_t& menphina::Job::shared() const
+{
+    if (!m_shared) [[unlikely]]
+    {
+        throw std::logic_error("Job handle has been moved from");
+    }
+
+    return *m_shared;
+}
+
+menphina::JobState menphina::Job::state() const
+{
+    job_shared_t& s = shared();
+    std::lock_guard<std::mutex> guard(s.lock);
+    return s.state;
+}
+
+menphina::job_progress_t menphina::Job::progress() const
+{
+    job_shared_t& s = shared();
+    std::lock_guard<std::mutex> guard(s.lock);
+    return s.progress;
+}
+
+void menphina::Job::cancel()
+{
+    shared().cancelled.store(true, std::memory_order_relaxed);
+}
+
+menphina::JobState menphina::Job::wait()
+{
+    job_shared_t& s = shared();
+    std::unique_lock<std::mutex> guard(s.lock);
+    s.finished.wait(guard, [&s]() { return s.state != JobState::Running; });
+    return s.state;
+}
+
+bool menphina::Job::wait_for(const std::chrono::milliseconds timeout)
+{
+    job_shared_t& s = shared();
+    std::unique_lock<std::mutex> guard(s.lock);
+    return s.finished.wait_for(guard, timeout, [&s]() { return s.state != JobState::Running; });
+}
+
+std::string menphina::Job::error() const
+{
+    job_shared_t& s = shared();
+    std::lock_guard<std::mutex> guard(s.lock);
+    return s.error;
+}
+
+menphina::Job menphina::run_async(std::shared_ptr<Execution> exec, const std::string_view launcherDir, job_callbacks_t callbacks)
+{
+    if (!exec)
+    {
+        throw std::invalid_argument("run_async requires an execution");
+    }
+
+    if (exec->m_job != nullptr)
+    {
+        throw std::logic_error("execution is already running as a job");
+    }
+
+    auto shared = std::make_shared<job_shared_t>();
+    shared->exec = exec;
+    shared->launcherDir = std::string(launcherDir);
+    shared->callbacks = std::move(callbacks);
+
+    exec->m_job = shared.get();
+
+    try
+    {
+        // The thread holds its own reference, so that the last handle can
+        // go away while on_finished is still running.
+        shared->thread = std::thread([s = shared]() { s->run(); });
+    }
+    catch (...)
+    {
+        exec->m_job = nullptr;
+        throw;
+    }
+
+    return Job(std::move(shared));
+}
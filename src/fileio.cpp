@@ -0,0 +1,246 @@
+/* Copyright 2024 isaki */
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "menphina/fileio.hpp"
+#include "menphina/m_exception.hpp"
+
+/* UniqueFd */
+
+menphina::UniqueFd::UniqueFd() : m_fd(-1) {}
+
+menphina::UniqueFd::UniqueFd(const int fd) : m_fd(fd) {}
+
+menphina::UniqueFd::~UniqueFd()
+{
+    reset();
+}
+
+menphina::UniqueFd::UniqueFd(UniqueFd&& other) noexcept : m_fd(other.release()) {}
+
+menphina::UniqueFd& menphina::UniqueFd::operator=(UniqueFd&& other) noexcept
+{
+    if (this != &other)
+    {
+        reset(other.release());
+    }
+
+    return *this;
+}
+
+int menphina::UniqueFd::release()
+{
+    return std::exchange(m_fd, -1);
+}
+
+void menphina::UniqueFd::reset(const int fd)
+{
+    if (m_fd != -1)
+    {
+        // As with IOPipe, a failed close leaves us nothing useful to do.
+        close(m_fd);
+    }
+
+    m_fd = fd;
+}
+
+namespace
+{
+    const std::string STAGING_PREFIX { "." };
+    const std::string STAGING_SUFFIX { ".menphina-" };
+}
+
+/* Helpers */
+
+bool menphina::try_stat(const std::string_view path, file_stat_t& out)
+{
+    const std::string p(path);
+
+    struct stat st;
+    if (stat(p.c_str(), &st) != 0)
+    {
+        const int err = errno;
+        if (err == ENOENT)
+        {
+            return false;
+        }
+
+        throw menphina::errno_exception("Unable to stat " + p, err);
+    }
+
+    out.size = static_cast<uint64_t>(st.st_size);
+    out.mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    out.inode = static_cast<uint64_t>(st.st_ino);
+    return true;
+}
+
+void menphina::write_all(const int fd, const void * data, const size_t length, const std::string_view what)
+{
+    const char * p = static_cast<const char *>(data);
+    size_t remaining = length;
+
+    while (remaining != 0)
+    {
+        const ssize_t n = write(fd, p, remaining);
+        if (n < 0)
+        {
+            const int err = errno;
+            if (err == EINTR)
+            {
+                continue;
+            }
+
+            throw menphina::errno_exception("Failed to write " + std::string(what), err);
+        }
+
+        p += n;
+        remaining -= static_cast<size_t>(n);
+    }
+}
+
+void menphina::pwrite_all(const int fd, const void * data, const size_t length, const uint64_t offset, const std::string_view what)
+{
+    const char * p = static_cast<const char *>(data);
+    size_t remaining = length;
+    off_t pos = static_cast<off_t>(offset);
+
+    while (remaining != 0)
+    {
+        const ssize_t n = pwrite(fd, p, remaining, pos);
+        if (n < 0)
+        {
+            const int err = errno;
+            if (err == EINTR)
+            {
+                continue;
+            }
+
+            throw menphina::errno_exception("Failed to write " + std::string(what), err);
+        }
+
+        p += n;
+        pos += n;
+        remaining -= static_cast<size_t>(n);
+    }
+}
+
+size_t menphina::read_full(const int fd, void * data, const size_t length, const std::string_view what)
+{
+    char * p = static_cast<char *>(data);
+    size_t total = 0;
+
+    while (total < length)
+    {
+        const ssize_t n = read(fd, p + total, length - total);
+        if (n < 0)
+        {
+            const int err = errno;
+            if (err == EINTR)
+            {
+                continue;
+            }
+
+            throw menphina::errno_exception("Failed to read " + std::string(what), err);
+        }
+
+        if (n == 0)
+        {
+            break;
+        }
+
+        total += static_cast<size_t>(n);
+    }
+
+    return total;
+}
+
+size_t menphina::pread_full(const int fd, void * data, const size_t length, const uint64_t offset, const std::string_view what)
+{
+    char * p = static_cast<char *>(data);
+    size_t total = 0;
+
+    while (total < length)
+    {
+        const ssize_t n = pread(fd, p + total, length - total, static_cast<off_t>(offset + total));
+        if (n < 0)
+        {
+            const int err = errno;
+            if (err == EINTR)
+            {
+                continue;
+            }
+
+            throw menphina::errno_exception("Failed to read " + std::string(what), err);
+        }
+
+        if (n == 0)
+        {
+            break;
+        }
+
+        total += static_cast<size_t>(n);
+    }
+
+    return total;
+}
+
+/* Staged writes */
+
+std::string menphina::staging_name(const std::string_view name)
+{
+    // The pid keeps concurrent runs from trampling each other's staging
+    // files, the counter concurrent jobs within one run.
+    static std::atomic<uint64_t> counter(0);
+    const uint64_t n = counter.fetch_add(1, std::memory_order_relaxed);
+
+    std::string ret;
+    ret.reserve(STAGING_PREFIX.size() + name.size() + STAGING_SUFFIX.size() + 32);
+    ret.append(STAGING_PREFIX).append(name).append(STAGING_SUFFIX).append(std::to_string(getpid())).append(1, '.').append(std::to_string(n));
+    return ret;
+}
+
+menphina::UniqueFd menphina::open_staged(const int dirfd, const std::string& staged)
+{
+    // Staging names are never reused within a run, so an existing file is
+    // someone else's; it is left alone and reported.
+    const int fd = openat(dirfd, staged.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        throw menphina::file_open_exception(staged, false);
+    }
+
+    return UniqueFd(fd);
+}
+
+void menphina::publish_staged(const int dirfd, const std::string& staged, const std::string_view name, const bool replace)
+{
+    const std::string target(name);
+
+    int rc = renameat2(dirfd, staged.c_str(), dirfd, target.c_str(), (replace) ? 0 : RENAME_NOREPLACE);
+    if (rc != 0 && !replace && errno == EINVAL)
+    {
+        // Filesystems without flag support (drvfs, 9p, some FUSE) get a plain rename.
+        rc = renameat(dirfd, staged.c_str(), dirfd, target.c_str());
+    }
+
+    if (rc != 0)
+    {
+        const int err = errno;
+        throw menphina::errno_exception("Unable to publish " + target, err);
+    }
+}
+
+void menphina::discard_staged(const int dirfd, const std::string& staged)
+{
+    unlinkat(dirfd, staged.c_str(), 0);
+}
@@ -0,0 +1,328 @@
+/* Copyright 2024 isaki */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <filesystem>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "menphina/fileio.hpp"
+#include "menphina/fsplan.hpp"
+#include "menphina/m_exception.hpp"
+#include "menphina/platform.hpp"
+
+namespace
+{
+    inline constexpr uint32_t NO_DIRECTORY = UINT32_MAX;
+
+    // Finished directories kept open for the caller before it is asked to
+    // flush so they can be closed.
+    inline constexpr size_t MAX_OPEN_DIRECTORIES = 64;
+
+    // Metadata updates go ahead of the writes in a directory.
+    inline int _phase(const menphina::FsOpKind kind)
+    {
+        return (kind == menphina::FsOpKind::Touch) ? 0 : 1;
+    }
+
+    std::string_view _parent_of(const std::string_view path)
+    {
+        const size_t slash = path.rfind('/');
+        return (slash == std::string_view::npos) ? std::string_view {} : path.substr(0, slash);
+    }
+}
+
+const char * menphina::fs_op_name(const FsOpKind kind)
+{
+    switch (kind)
+    {
+        case FsOpKind::Touch:
+            return "touch";
+        case FsOpKind::Create:
+            return "create";
+        case FsOpKind::Replace:
+            return "replace";
+        case FsOpKind::Edit:
+            return "edit";
+    }
+
+    return "unknown";
+}
+
+menphina::FsPlan::FsPlan(const std::string& root) :
+    m_root(root),
+    m_created(0)
+{
+    directory({});
+}
+
+menphina::FsPlan::~FsPlan() {}
+
+uint32_t menphina::FsPlan::directory(const std::string_view path)
+{
+    const auto found = m_dirIndex.find(path);
+    if (found != m_dirIndex.end())
+    {
+        return found->second;
+    }
+
+    const std::string full = (path.empty()) ? m_root : path_join(m_root, path);
+
+    struct stat st;
+    bool exists = false;
+    if (stat(full.c_str(), &st) == 0)
+    {
+        exists = S_ISDIR(st.st_mode);
+    }
+    else if (errno != ENOENT && errno != ENOTDIR)
+    {
+        const int err = errno;
+        throw menphina::errno_exception("Unable to stat " + full, err);
+    }
+
+    // Something other than a directory in the way makes the mkdir fail
+    // when the plan runs, which is where it is reported.
+    if (!exists && !path.empty())
+    {
+        directory(_parent_of(path));
+    }
+
+    const uint32_t index = static_cast<uint32_t>(m_dirs.size());
+    m_dirs.push_back(directory_t {
+        .path = std::string(path),
+        .inode = (exists) ? static_cast<uint64_t>(st.st_ino) : 0,
+        .create = !exists
+    });
+
+    m_dirIndex.emplace(std::string(path), index);
+    if (!exists)
+    {
+        ++m_created;
+    }
+
+    return index;
+}
+
+void menphina::FsPlan::add(fs_op_t op)
+{
+    if (op.directory >= m_dirs.size()) [[unlikely]]
+    {
+        throw std::logic_error("FsPlan operation for an unknown directory");
+    }
+
+    m_ops.push_back(std::move(op));
+}
+
+std::string menphina::FsPlan::full_path(const uint32_t dir, const std::string_view name) const
+{
+    std::string ret = (m_dirs[dir].path.empty()) ? m_root : path_join(m_root, m_dirs[dir].path);
+    if (!name.empty())
+    {
+        path_append(ret, name);
+    }
+
+    return ret;
+}
+
+std::vector<uint32_t> menphina::FsPlan::directory_order() const
+{
+    std::vector<uint32_t> ret(m_dirs.size());
+    for (uint32_t i = 0; i < ret.size(); ++i)
+    {
+        ret[i] = i;
+    }
+
+    // The root is opened first either way, since everything below is opened
+    // relative to it. Missing directories sort after the existing ones, and
+    // by path a parent comes before its children.
+    std::sort(ret.begin() + 1, ret.end(), [this](const uint32_t a, const uint32_t b) {
+        const directory_t& x = m_dirs[a];
+        const directory_t& y = m_dirs[b];
+        if (x.create != y.create)
+        {
+            return !x.create;
+        }
+
+        return (x.create) ? x.path < y.path : x.inode < y.inode;
+    });
+
+    return ret;
+}
+
+std::vector<size_t> menphina::FsPlan::op_order(const std::vector<uint32_t>& dirs) const
+{
+    std::vector<uint32_t> rank(m_dirs.size());
+    for (uint32_t i = 0; i < dirs.size(); ++i)
+    {
+        rank[dirs[i]] = i;
+    }
+
+    std::vector<size_t> ret(m_ops.size());
+    for (size_t i = 0; i < ret.size(); ++i)
+    {
+        ret[i] = i;
+    }
+
+    std::sort(ret.begin(), ret.end(), [this, &rank](const size_t a, const size_t b) {
+        const fs_op_t& x = m_ops[a];
+        const fs_op_t& y = m_ops[b];
+        if (x.directory != y.directory)
+        {
+            return rank[x.directory] < rank[y.directory];
+        }
+
+        if (_phase(x.kind) != _phase(y.kind))
+        {
+            return _phase(x.kind) < _phase(y.kind);
+        }
+
+        if (x.locality != y.locality)
+        {
+            return x.locality < y.locality;
+        }
+
+        return x.name < y.name;
+    });
+
+    return ret;
+}
+
+void menphina::FsPlan::print(std::ostream& out) const
+{
+    const std::vector<uint32_t> dirs = directory_order();
+    for (const uint32_t d : dirs)
+    {
+        if (m_dirs[d].create)
+        {
+            out << "mkdir " << full_path(d, {}) << std::endl;
+        }
+    }
+
+    for (const size_t i : op_order(dirs))
+    {
+        const fs_op_t& op = m_ops[i];
+        out << fs_op_name(op.kind) << ' ' << full_path(op.directory, op.name);
+
+        if (op.kind == FsOpKind::Create || op.kind == FsOpKind::Replace)
+        {
+            out << " (" << op.size << " bytes)";
+        }
+
+        if (!op.note.empty())
+        {
+            out << ": " << op.note;
+        }
+
+        out << std::endl;
+    }
+}
+
+void menphina::FsPlan::create_directory(const uint32_t dir)
+{
+    const directory_t& d = m_dirs[dir];
+    if (dir == 0)
+    {
+        std::filesystem::create_directories(m_root);
+        return;
+    }
+
+    // Parents come first in directory_order(), so only the last component
+    // is missing.
+    if (mkdirat(m_fds[0].get(), d.path.c_str(), 0777) != 0 && errno != EEXIST)
+    {
+        const int err = errno;
+        throw menphina::errno_exception("Unable to create directory " + full_path(dir, {}), err);
+    }
+}
+
+void menphina::FsPlan::open_directory(const uint32_t dir)
+{
+    const int fd = (dir == 0)
+        ? open(m_root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+        : openat(m_fds[0].get(), m_dirs[dir].path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd == -1)
+    {
+        const int err = errno;
+        throw menphina::errno_exception("Unable to open directory " + full_path(dir, {}), err);
+    }
+
+    m_fds[dir].reset(fd);
+}
+
+void menphina::FsPlan::run(const op_fn& fn, const flush_fn& flush)
+{
+    m_fds.clear();
+    m_fds.resize(m_dirs.size());
+
+    const std::vector<uint32_t> dirs = directory_order();
+    if (m_dirs[0].create)
+    {
+        create_directory(0);
+    }
+
+    open_directory(0);
+
+    for (const uint32_t d : dirs)
+    {
+        if (d != 0 && m_dirs[d].create)
+        {
+            create_directory(d);
+        }
+    }
+
+    // Directories are opened as their operations come up. Finished ones
+    // are only closed once the caller has flushed, since what it staged in
+    // them may not be published yet.
+    std::vector<uint32_t> finished;
+    uint32_t current = NO_DIRECTORY;
+    for (const size_t i : op_order(dirs))
+    {
+        const fs_op_t& op = m_ops[i];
+        if (op.directory != current)
+        {
+            if (current != NO_DIRECTORY && current != 0)
+            {
+                finished.push_back(current);
+            }
+
+            if (finished.size() >= MAX_OPEN_DIRECTORIES)
+            {
+                if (flush)
+                {
+                    flush();
+                }
+
+                for (const uint32_t f : finished)
+                {
+                    m_fds[f].reset();
+                }
+
+                finished.clear();
+            }
+
+            current = op.directory;
+            if (!m_fds[current].valid())
+            {
+                open_directory(current);
+            }
+        }
+
+        fn(op, m_fds[current].get());
+    }
+
+    if (flush)
+    {
+        flush();
+    }
+
+    m_fds.clear();
+}
@@ -0,0 +1,403 @@
+/* Copyright 2024 isaki */
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined ( __x86_64__ ) && defined ( __GNUC__ )
+#define MENPHINA_HASH_X86 1
+#include <immintrin.h>
+#endif
+
+#include "menphina/fileio.hpp"
+#include "menphina/hash.hpp"
+
+namespace
+{
+    static_assert(std::endian::native == std::endian::little, "content hashing assumes a little endian host");
+
+    __extension__ typedef unsigned __int128 uint128_t;
+
+    inline constexpr uint64_t PRIME32_1 = 0x9E3779B1u;
+    inline constexpr uint64_t PRIME32_2 = 0x85EBCA77u;
+    inline constexpr uint64_t PRIME32_3 = 0xC2B2AE3Du;
+    inline constexpr uint64_t PRIME64_1 = 0x9E3779B185EBCA87ull;
+    inline constexpr uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4Full;
+    inline constexpr uint64_t PRIME64_3 = 0x165667B19E3779F9ull;
+    inline constexpr uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ull;
+    inline constexpr uint64_t PRIME64_5 = 0x27D4EB2F165667C5ull;
+
+    inline constexpr size_t LANES = menphina::ContentHasher::LANES;
+    inline constexpr size_t STRIPE_LENGTH = menphina::ContentHasher::STRIPE_LENGTH;
+
+    // Stripe n of a block reads secret words [n, n + LANES); the last LANES
+    // words are the scramble key.
+    inline constexpr size_t STRIPES_PER_BLOCK = 16;
+    inline constexpr size_t SECRET_WORDS = STRIPES_PER_BLOCK + LANES;
+
+    constexpr std::array<uint64_t, SECRET_WORDS> _make_secret()
+    {
+        // splitmix64; any fixed, well mixed sequence works.
+        std::array<uint64_t, SECRET_WORDS> ret {};
+        uint64_t state = 0x4D656E7068696E61ull; // "Menphina"
+        for (auto& w : ret)
+        {
+            state += 0x9E3779B97F4A7C15ull;
+            uint64_t z = state;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            w = z ^ (z >> 31);
+        }
+
+        return ret;
+    }
+
+    inline constexpr std::array<uint64_t, SECRET_WORDS> SECRET = _make_secret();
+
+    inline constexpr std::array<uint64_t, LANES> INITIAL_ACC = {
+        PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3,
+        PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1
+    };
+
+    inline uint64_t _read64(const unsigned char * p)
+    {
+        uint64_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    inline void _accumulate(uint64_t * acc, const unsigned char * stripe, const uint64_t * secret)
+    {
+        for (size_t i = 0; i < LANES; ++i)
+        {
+            const uint64_t data = _read64(stripe + i * 8);
+            const uint64_t key = data ^ secret[i];
+            acc[i ^ 1] += data;
+            acc[i] += (key & 0xFFFFFFFFu) * (key >> 32);
+        }
+    }
+
+    inline void _scramble(uint64_t * acc)
+    {
+        const uint64_t * key = SECRET.data() + STRIPES_PER_BLOCK;
+        for (size_t i = 0; i < LANES; ++i)
+        {
+            uint64_t a = acc[i];
+            a ^= a >> 47;
+            a ^= key[i];
+            a *= PRIME32_1;
+            acc[i] = a;
+        }
+    }
+
+    inline uint64_t _mix(const uint64_t a, const uint64_t b)
+    {
+        const uint128_t product = static_cast<uint128_t>(a) * b;
+        return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+    }
+
+    inline uint64_t _avalanche(uint64_t h)
+    {
+        h ^= h >> 37;
+        h *= 0x165667919E3779F9ull;
+        h ^= h >> 32;
+        return h;
+    }
+
+    // Runs the stripes through acc, scrambling at every block boundary; the
+    // vector versions produce exactly what the scalar one does.
+    using consume_fn = void (*)(uint64_t * acc, const unsigned char * stripes, const size_t count, size_t& stripesInBlock);
+
+    void _consume_scalar(uint64_t * acc, const unsigned char * stripes, const size_t count, size_t& stripesInBlock)
+    {
+        for (size_t s = 0; s < count; ++s)
+        {
+            _accumulate(acc, stripes + s * STRIPE_LENGTH, SECRET.data() + stripesInBlock);
+
+            if (++stripesInBlock == STRIPES_PER_BLOCK)
+            {
+                _scramble(acc);
+                stripesInBlock = 0;
+            }
+        }
+    }
+
+#if defined ( MENPHINA_HASH_X86 )
+    // acc[i ^ 1] += data[i] is a swap of the 64 bit halves of every 128 bit
+    // lane; the 32x32 multiply is mul_epu32 of key and key >> 32.
+    void _consume_sse2(uint64_t * acc, const unsigned char * stripes, const size_t count, size_t& stripesInBlock)
+    {
+        static constexpr size_t VECTORS = STRIPE_LENGTH / sizeof(__m128i);
+
+        __m128i a[VECTORS];
+        for (size_t v = 0; v < VECTORS; ++v)
+        {
+            a[v] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(acc) + v);
+        }
+
+        const __m128i prime = _mm_set1_epi32(static_cast<int>(PRIME32_1));
+
+        for (size_t s = 0; s < count; ++s)
+        {
+            const __m128i * stripe = reinterpret_cast<const __m128i *>(stripes + s * STRIPE_LENGTH);
+            const __m128i * secret = reinterpret_cast<const __m128i *>(SECRET.data() + stripesInBlock);
+
+            for (size_t v = 0; v < VECTORS; ++v)
+            {
+                const __m128i data = _mm_loadu_si128(stripe + v);
+                const __m128i key = _mm_xor_si128(data, _mm_loadu_si128(secret + v));
+                const __m128i product = _mm_mul_epu32(key, _mm_srli_epi64(key, 32));
+                const __m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+                a[v] = _mm_add_epi64(a[v], _mm_add_epi64(product, swapped));
+            }
+
+            if (++stripesInBlock == STRIPES_PER_BLOCK)
+            {
+                const __m128i * key = reinterpret_cast<const __m128i *>(SECRET.data() + STRIPES_PER_BLOCK);
+                for (size_t v = 0; v < VECTORS; ++v)
+                {
+                    __m128i x = _mm_xor_si128(a[v], _mm_srli_epi64(a[v], 47));
+                    x = _mm_xor_si128(x, _mm_loadu_si128(key + v));
+
+                    // x * PRIME32_1, from two 32x32 products.
+                    const __m128i lo = _mm_mul_epu32(x, prime);
+                    const __m128i hi = _mm_mul_epu32(_mm_srli_epi64(x, 32), prime);
+                    a[v] = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+                }
+
+                stripesInBlock = 0;
+            }
+        }
+
+        for (size_t v = 0; v < VECTORS; ++v)
+        {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(acc) + v, a[v]);
+        }
+    }
+
+    // _consume_sse2() on 256 bit vectors.
+    __attribute__((target("avx2")))
+    void _consume_avx2(uint64_t * acc, const unsigned char * stripes, const size_t count, size_t& stripesInBlock)
+    {
+        static constexpr size_t VECTORS = STRIPE_LENGTH / sizeof(__m256i);
+
+        __m256i a[VECTORS];
+        for (size_t v = 0; v < VECTORS; ++v)
+        {
+            a[v] = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(acc) + v);
+        }
+
+        const __m256i prime = _mm256_set1_epi32(static_cast<int>(PRIME32_1));
+
+        for (size_t s = 0; s < count; ++s)
+        {
+            const __m256i * stripe = reinterpret_cast<const __m256i *>(stripes + s * STRIPE_LENGTH);
+            const __m256i * secret = reinterpret_cast<const __m256i *>(SECRET.data() + stripesInBlock);
+
+            for (size_t v = 0; v < VECTORS; ++v)
+            {
+                const __m256i data = _mm256_loadu_si256(stripe + v);
+                const __m256i key = _mm256_xor_si256(data, _mm256_loadu_si256(secret + v));
+                const __m256i product = _mm256_mul_epu32(key, _mm256_srli_epi64(key, 32));
+                const __m256i swapped = _mm256_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+                a[v] = _mm256_add_epi64(a[v], _mm256_add_epi64(product, swapped));
+            }
+
+            if (++stripesInBlock == STRIPES_PER_BLOCK)
+            {
+                const __m256i * key = reinterpret_cast<const __m256i *>(SECRET.data() + STRIPES_PER_BLOCK);
+                for (size_t v = 0; v < VECTORS; ++v)
+                {
+                    __m256i x = _mm256_xor_si256(a[v], _mm256_srli_epi64(a[v], 47));
+                    x = _mm256_xor_si256(x, _mm256_loadu_si256(key + v));
+
+                    const __m256i lo = _mm256_mul_epu32(x, prime);
+                    const __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(x, 32), prime);
+                    a[v] = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+                }
+
+                stripesInBlock = 0;
+            }
+        }
+
+        for (size_t v = 0; v < VECTORS; ++v)
+        {
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(acc) + v, a[v]);
+        }
+    }
+#endif
+
+    struct hash_impl_t
+    {
+        const char * name;
+        consume_fn consume;
+    };
+
+    // The widest the CPU has, unless MENPHINA_HASH_ISA=scalar|sse2|avx2
+    // asks for a narrower one (for comparing them).
+    hash_impl_t _select_impl()
+    {
+        const char * env = std::getenv("MENPHINA_HASH_ISA");
+        const std::string_view requested = (env != nullptr) ? env : "";
+
+        if (requested == "scalar")
+        {
+            return hash_impl_t { "scalar", _consume_scalar };
+        }
+
+#if defined ( MENPHINA_HASH_X86 )
+        if (requested != "sse2" && __builtin_cpu_supports("avx2"))
+        {
+            return hash_impl_t { "avx2", _consume_avx2 };
+        }
+
+        return hash_impl_t { "sse2", _consume_sse2 };
+#else
+        return hash_impl_t { "scalar", _consume_scalar };
+#endif
+    }
+
+    const hash_impl_t HASH_IMPL = _select_impl();
+
+    const char HEX_DIGITS[] = "0123456789abcdef";
+
+    inline constexpr size_t FD_READ_LENGTH = 1024 * 1024;
+}
+
+const char * menphina::content_hash_isa()
+{
+    return HASH_IMPL.name;
+}
+
+/* content_hash_t */
+
+std::string menphina::content_hash_t::hex() const
+{
+    std::string ret(32, '0');
+    for (size_t i = 0; i < 16; ++i)
+    {
+        ret[15 - i] = HEX_DIGITS[(hi >> (i * 4)) & 0xF];
+        ret[31 - i] = HEX_DIGITS[(lo >> (i * 4)) & 0xF];
+    }
+
+    return ret;
+}
+
+/* ContentHasher */
+
+menphina::ContentHasher::ContentHasher()
+{
+    reset();
+}
+
+menphina::ContentHasher::~ContentHasher() {}
+
+void menphina::ContentHasher::reset()
+{
+    m_acc = INITIAL_ACC;
+    m_pending.fill(0);
+    m_pendingLength = 0;
+    m_stripesInBlock = 0;
+    m_totalLength = 0;
+}
+
+void menphina::ContentHasher::consume(const unsigned char * stripes, const size_t count)
+{
+    if (count != 0)
+    {
+        HASH_IMPL.consume(m_acc.data(), stripes, count, m_stripesInBlock);
+    }
+}
+
+void menphina::ContentHasher::update(const void * data, const size_t length)
+{
+    const unsigned char * p = static_cast<const unsigned char *>(data);
+    size_t remaining = length;
+    m_totalLength += length;
+
+    if (m_pendingLength != 0)
+    {
+        const size_t take = std::min(remaining, STRIPE_LENGTH - m_pendingLength);
+        std::memcpy(m_pending.data() + m_pendingLength, p, take);
+        m_pendingLength += take;
+        p += take;
+        remaining -= take;
+
+        if (m_pendingLength != STRIPE_LENGTH)
+        {
+            return;
+        }
+
+        consume(m_pending.data(), 1);
+        m_pendingLength = 0;
+    }
+
+    const size_t stripes = remaining / STRIPE_LENGTH;
+    consume(p, stripes);
+    p += stripes * STRIPE_LENGTH;
+    remaining -= stripes * STRIPE_LENGTH;
+
+    if (remaining != 0)
+    {
+        std::memcpy(m_pending.data(), p, remaining);
+        m_pendingLength = remaining;
+    }
+}
+
+menphina::content_hash_t menphina::ContentHasher::finish() const
+{
+    std::array<uint64_t, LANES> acc = m_acc;
+
+    // A trailing partial stripe is zero padded; the total length is mixed in
+    // below so padding can not alias a longer input.
+    if (m_pendingLength != 0)
+    {
+        std::array<unsigned char, STRIPE_LENGTH> last {};
+        std::memcpy(last.data(), m_pending.data(), m_pendingLength);
+        _accumulate(acc.data(), last.data(), SECRET.data() + m_stripesInBlock);
+    }
+
+    uint64_t lo = m_totalLength * PRIME64_1;
+    uint64_t hi = ~m_totalLength * PRIME64_2;
+    for (size_t i = 0; i < LANES; i += 2)
+    {
+        lo += _mix(acc[i] ^ SECRET[i], acc[i + 1] ^ SECRET[i + 1]);
+        hi += _mix(acc[i] ^ SECRET[SECRET_WORDS - 1 - i], acc[i + 1] ^ SECRET[SECRET_WORDS - 2 - i]);
+    }
+
+    return content_hash_t { _avalanche(lo), _avalanche(hi) };
+}
+
+menphina::content_hash_t menphina::content_hash(const void * data, const size_t length)
+{
+    ContentHasher h;
+    h.update(data, length);
+    return h.finish();
+}
+
+menphina::content_hash_t menphina::content_hash_fd(const int fd, std::vector<char>& buffer)
+{
+    if (buffer.size() < FD_READ_LENGTH)
+    {
+        buffer.resize(FD_READ_LENGTH);
+    }
+
+    ContentHasher h;
+    for (;;)
+    {
+        const size_t n = read_full(fd, buffer.data(), buffer.size(), "file being hashed");
+        h.update(buffer.data(), n);
+
+        if (n < buffer.size())
+        {
+            break;
+        }
+    }
+
+    return h.finish();
+}
@@ -0,0 +1,155 @@
+/* Copyright 2024 isaki */
+
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#if defined ( __linux__ )
+#include <cerrno>
+#include <sys/vfs.h>
+#endif
+
+#include "menphina/iopolicy.hpp"
+#include "menphina/m_exception.hpp"
+
+namespace
+{
+    const std::string IO_POLICY_VAR_NAME { "MENPHINA_IO_POLICY" };
+
+    inline constexpr menphina::io_policy_t LOCAL_POLICY {
+        .kind = menphina::IoPolicyKind::Local,
+        .dirent_buffer_length = 64 * 1024,
+        .transfer_length = menphina::IO_TRANSFER_ALIGNMENT,
+        .mtime_granularity_ns = 1
+    };
+
+    // 9P moves at most msize bytes per message either way; big buffers at
+    // least keep it to one syscall per batch of messages.
+    inline constexpr menphina::io_policy_t REMOTE_POLICY {
+        .kind = menphina::IoPolicyKind::Remote,
+        .dirent_buffer_length = 1024 * 1024,
+        .transfer_length = 8 * menphina::IO_TRANSFER_ALIGNMENT,
+        .mtime_granularity_ns = 100
+    };
+
+    static_assert(LOCAL_POLICY.transfer_length % menphina::IO_TRANSFER_ALIGNMENT == 0);
+    static_assert(REMOTE_POLICY.transfer_length % menphina::IO_TRANSFER_ALIGNMENT == 0);
+
+#if defined ( __linux__ )
+    // linux/magic.h has the first; WSL 1 drvfs reports "WSLF" and is not in
+    // any header.
+    inline constexpr long V9FS_FS_MAGIC = 0x01021997;
+    inline constexpr long WSL_DRVFS_MAGIC = 0x53464846;
+#endif
+
+    enum class PolicyOverride : uint8_t
+    {
+        Auto = 0,
+        Local = 1,
+        Remote = 2
+    };
+
+    PolicyOverride _read_override()
+    {
+        const char * v = std::getenv(IO_POLICY_VAR_NAME.c_str());
+        if (v == nullptr)
+        {
+            return PolicyOverride::Auto;
+        }
+
+        const std::string_view value(v);
+        if (value.empty() || value == "auto")
+        {
+            return PolicyOverride::Auto;
+        }
+
+        if (value == "local")
+        {
+            return PolicyOverride::Local;
+        }
+
+        if (value == "remote")
+        {
+            return PolicyOverride::Remote;
+        }
+
+        throw std::runtime_error(IO_POLICY_VAR_NAME + " must be auto, local or remote; got '" + std::string(value) + "'");
+    }
+
+    PolicyOverride _get_override()
+    {
+        static const PolicyOverride o = _read_override();
+        return o;
+    }
+
+    // nullptr means detection decides.
+    const menphina::io_policy_t * _overridden()
+    {
+        switch (_get_override())
+        {
+            case PolicyOverride::Local:
+                return &LOCAL_POLICY;
+            case PolicyOverride::Remote:
+                return &REMOTE_POLICY;
+            default:
+                return nullptr;
+        }
+    }
+
+#if defined ( __linux__ )
+    menphina::io_policy_t _from_statfs(const struct statfs& st)
+    {
+        const long type = static_cast<long>(st.f_type);
+        return (type == V9FS_FS_MAGIC || type == WSL_DRVFS_MAGIC) ? REMOTE_POLICY : LOCAL_POLICY;
+    }
+#endif
+}
+
+const char * menphina::io_policy_name(const IoPolicyKind kind)
+{
+    return (kind == IoPolicyKind::Remote) ? "remote" : "local";
+}
+
+menphina::io_policy_t menphina::get_io_policy([[maybe_unused]] const std::string_view path)
+{
+    if (const io_policy_t * p = _overridden())
+    {
+        return *p;
+    }
+
+#if defined ( __linux__ )
+    const std::string p(path);
+    struct statfs st;
+    if (statfs(p.c_str(), &st) != 0)
+    {
+        const int err = errno;
+        throw menphina::errno_exception("Unable to statfs " + p, err);
+    }
+
+    return _from_statfs(st);
+#else
+    return LOCAL_POLICY;
+#endif
+}
+
+menphina::io_policy_t menphina::get_io_policy_fd([[maybe_unused]] const int fd)
+{
+    if (const io_policy_t * p = _overridden())
+    {
+        return *p;
+    }
+
+#if defined ( __linux__ )
+    struct statfs st;
+    if (fstatfs(fd, &st) != 0)
+    {
+        const int err = errno;
+        throw menphina::errno_exception("Unable to statfs open directory", err);
+    }
+
+    return _from_statfs(st);
+#else
+    return LOCAL_POLICY;
+#endif
+}
@@ -4,11 +4,27 @@
 #include <ostream>
 #include <stdexcept>
 #include <utility>
+#include <vector>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "glaze/glaze.hpp"
 
+#include "menphina/fileio.hpp"
 #include "menphina/m_exception.hpp"
 #include "menphina/json.hpp"
+#include "menphina/parallel.hpp"
+#include "menphina/trace.hpp"
 
 
 namespace
@@ -44,6 +60,12 @@ namespace
         .force_conformance = true
     };
 
+    // Our own data files (manifests, caches) are never edited by hand.
+    inline constexpr glz::opts DATA_WRITE_SETTINGS = {
+        .skip_null_members = false,
+        .force_conformance = true
+    };
+
     inline constexpr glz::opts PLUGIN_STRUCT_READ_SETTINGS = {
         .error_on_unknown_keys = false,
         .error_on_missing_keys = true,
@@ -56,11 +78,15 @@ namespace
     };
 
     // Exception adapters, inspired by Glaze's own exception types (which dont have a write file version)
+    // The buffer receives the file contents; passing the same one in keeps its capacity between reads.
     template<auto O = glz::opts{}, class T>
-    void _read_json_file(T& value, const std::string& file)
+    void _read_json_file(T& value, const std::string& file, std::string& buffer)
     {
-        std::string buffer {};
+        menphina::TraceSpan span(menphina::trace_category::JSON, "json.read");
+        span.add_files(1);
+
         const auto ec = glz::read_file_json<O, T>(value, file, buffer);
+        span.add_bytes(buffer.size());
     
         if (ec == glz::error_code::file_open_failure)
         {
@@ -72,9 +98,19 @@ namespace
         }
     }
 
+    template<auto O = glz::opts{}, class T>
+    void _read_json_file(T& value, const std::string& file)
+    {
+        std::string buffer {};
+        _read_json_file<O, T>(value, file, buffer);
+    }
+
     template<auto O = glz::opts{}, class T>
     void _write_json_file(T&& value, const std::string& file)
     {
+        menphina::TraceSpan span(menphina::trace_category::JSON, "json.write");
+        span.add_files(1);
+
         const auto ec = glz::write_file_json<O, T>(std::forward<T>(value), file, std::string {});
     
         if (ec == glz::error_code::file_open_failure)
@@ -86,19 +122,708 @@ namespace
             throw std::runtime_error("json write error");
         }
     }
+
+    // Pieces the streaming writer hands on; the most it holds at once.
+    inline constexpr size_t JSON_STREAM_CHUNK = 64 * 1024;
+
+    /*
+        Writes a glz::json_t exactly as glz::write<JSON_WRITE_SETTINGS> would,
+        but hands the text to a sink in JSON_STREAM_CHUNK pieces as it goes
+        instead of building all of it first. Scalars are still written by
+        glaze; only the containers and their layout are done here. A sink
+        returning false stops the writer early.
+    */
+    class JsonStreamWriter final
+    {
+        public:
+            using sink_fn = std::function<bool(const char *, size_t)>;
+
+            explicit JsonStreamWriter(const sink_fn& sink) :
+                m_sink(sink),
+                m_written(0),
+                m_stopped(false)
+            {
+                m_buffer.reserve(JSON_STREAM_CHUNK);
+            }
+
+            JsonStreamWriter(const JsonStreamWriter&) = delete;
+            JsonStreamWriter& operator=(const JsonStreamWriter&) = delete;
+
+            // Returns false if the sink stopped it.
+            bool write(const glz::json_t& value)
+            {
+                write_value(value, 0);
+                flush();
+                return !m_stopped;
+            }
+
+            // Bytes handed to the sink.
+            inline uint64_t written() const
+            {
+                return m_written;
+            }
+
+        private:
+            sink_fn m_sink;
+            std::string m_buffer;
+            std::string m_scalar;
+            uint64_t m_written;
+            bool m_stopped;
+
+            void flush()
+            {
+                if (!m_stopped && !m_buffer.empty())
+                {
+                    m_stopped = !m_sink(m_buffer.data(), m_buffer.size());
+                    m_written += m_buffer.size();
+                }
+
+                m_buffer.clear();
+            }
+
+            void put(std::string_view s)
+            {
+                while (!s.empty() && !m_stopped)
+                {
+                    const size_t n = std::min(s.size(), JSON_STREAM_CHUNK - m_buffer.size());
+                    m_buffer.append(s.substr(0, n));
+                    s.remove_prefix(n);
+
+                    if (m_buffer.size() == JSON_STREAM_CHUNK)
+                    {
+                        flush();
+                    }
+                }
+            }
+
+            void put(const char c)
+            {
+                put(std::string_view(&c, 1));
+            }
+
+            void newline(const size_t indent)
+            {
+                put('\n');
+                for (size_t i = 0; i < indent; ++i)
+                {
+                    put(JSON_WRITE_SETTINGS.indentation_char);
+                }
+            }
+
+            template<class T>
+            void write_scalar(const T& value)
+            {
+                m_scalar.clear();
+                static_cast<void>(glz::write<JSON_WRITE_SETTINGS>(value, m_scalar));
+                put(m_scalar);
+            }
+
+            void write_value(const glz::json_t& value, const size_t indent)
+            {
+                const size_t inner = indent + JSON_WRITE_SETTINGS.indentation_width;
+
+                if (value.is<glz::json_t::object_t>())
+                {
+                    const auto& object = value.get<glz::json_t::object_t>();
+                    put('{');
+                    bool first = true;
+                    for (const auto& [key, member] : object)
+                    {
+                        if (m_stopped)
+                        {
+                            return;
+                        }
+
+                        if (!first)
+                        {
+                            put(',');
+                        }
+
+                        newline(inner);
+                        write_scalar(key);
+                        put(": ");
+                        write_value(member, inner);
+                        first = false;
+                    }
+
+                    if (!object.empty())
+                    {
+                        newline(indent);
+                    }
+
+                    put('}');
+                }
+                else if (value.is<glz::json_t::array_t>())
+                {
+                    const auto& array = value.get<glz::json_t::array_t>();
+                    put('[');
+                    for (size_t i = 0; i < array.size() && !m_stopped; ++i)
+                    {
+                        if (i != 0)
+                        {
+                            put(',');
+                        }
+
+                        newline(inner);
+                        write_value(array[i], inner);
+                    }
+
+                    if (!array.empty())
+                    {
+                        newline(indent);
+                    }
+
+                    put(']');
+                }
+                else if (value.is<std::string>())
+                {
+                    write_scalar(value.get<std::string>());
+                }
+                else if (value.is<double>())
+                {
+                    write_scalar(value.get<double>());
+                }
+                else if (value.is<bool>())
+                {
+                    put((value.get<bool>()) ? "true" : "false");
+                }
+                else
+                {
+                    put("null");
+                }
+            }
+    };
+
+    // True when file exists and holds exactly what obj serializes to. The
+    // file is read alongside the serialization, a piece at a time, and the
+    // first difference ends both; buffer is scratch space.
+    bool _file_has_json(const std::string& file, const glz::json_t& obj, std::string& buffer, uint64_t& serialized)
+    {
+        serialized = 0;
+
+        const int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            return false;
+        }
+
+        const menphina::UniqueFd guard(fd);
+
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            return false;
+        }
+
+        buffer.resize(JSON_STREAM_CHUNK);
+        uint64_t compared = 0;
+
+        const JsonStreamWriter::sink_fn sink = [fd, &file, &buffer, &compared, &st](const char * data, const size_t length)
+        {
+            if (compared + length > static_cast<uint64_t>(st.st_size)
+                || menphina::read_full(fd, buffer.data(), length, file) != length
+                || std::memcmp(buffer.data(), data, length) != 0)
+            {
+                return false;
+            }
+
+            compared += length;
+            return true;
+        };
+
+        JsonStreamWriter writer(sink);
+        const bool same = writer.write(obj) && compared == static_cast<uint64_t>(st.st_size);
+        serialized = writer.written();
+        return same;
+    }
+
+    // Streams obj into fd; returns the bytes written.
+    uint64_t _write_json_fd(const int fd, const glz::json_t& obj, const std::string& what)
+    {
+        const JsonStreamWriter::sink_fn sink = [fd, &what](const char * data, const size_t length)
+        {
+            menphina::write_all(fd, data, length, what);
+            return true;
+        };
+
+        JsonStreamWriter writer(sink);
+        writer.write(obj);
+        return writer.written();
+    }
+
+    void _sync(const int fd, const std::string& what)
+    {
+        if (fsync(fd) != 0)
+        {
+            const int err = errno;
+            throw menphina::errno_exception("Failed to sync " + what, err);
+        }
+    }
+
+    /* Parse cache */
+
+    inline constexpr uint32_t JSON_CACHE_VERSION = 1;
+
+    // A file written this recently can be written again within the same
+    // mtime tick without changing size; it is not cached until it settles.
+    inline constexpr int64_t JSON_CACHE_SETTLE_NS = 2000000000;
+
+    // What Data decodes to; a path read as something else is a miss.
+    enum class JsonCacheKind : uint32_t
+    {
+        PenumbraConfig = 1,
+        PackageManifest = 2,
+        Generic = 3
+    };
+
+    struct json_cache_entry_t
+    {
+        std::string Path;
+        uint32_t Kind;
+        uint64_t Size;
+        int64_t MTime;
+        uint64_t Inode;
+
+        // The parsed value, BEVE encoded.
+        std::string Data;
+    };
+
+    struct json_cache_file_t
+    {
+        uint32_t Version;
+        std::vector<json_cache_entry_t> Entries;
+    };
+
+    class JsonParseCache final
+    {
+        public:
+            // A cache file that is missing, unreadable or from another
+            // version makes an empty cache.
+            explicit JsonParseCache(const std::string& file) :
+                m_file(file),
+                m_dirty(false)
+            {
+                const menphina::UniqueFd fd(open(file.c_str(), O_RDONLY | O_CLOEXEC));
+                struct stat st;
+                if (!fd.valid() || fstat(fd.get(), &st) != 0)
+                {
+                    return;
+                }
+
+                menphina::TraceSpan span(menphina::trace_category::JSON, "json.cache.load");
+                span.add_bytes(static_cast<uint64_t>(st.st_size));
+
+                std::string buffer(static_cast<size_t>(st.st_size), '\0');
+                json_cache_file_t cached {};
+                try
+                {
+                    if (menphina::read_full(fd.get(), buffer.data(), buffer.size(), file) != buffer.size() || glz::read_beve(cached, buffer)
+                        || cached.Version != JSON_CACHE_VERSION)
+                    {
+                        m_dirty = true;
+                        return;
+                    }
+                }
+                catch (const std::exception&)
+                {
+                    m_dirty = true;
+                    return;
+                }
+
+                for (json_cache_entry_t& e : cached.Entries)
+                {
+                    std::string path = e.Path;
+                    m_entries.insert_or_assign(std::move(path), cached_t { std::move(e), false });
+                }
+            }
+
+            JsonParseCache(const JsonParseCache&) = delete;
+            JsonParseCache& operator=(const JsonParseCache&) = delete;
+
+            // Decodes the cached value of source into value if its key still
+            // matches st; buffer is scratch space.
+            template<class T>
+            bool lookup(const JsonCacheKind kind, const std::string& source, const menphina::file_stat_t& st, T& value, std::string& buffer)
+            {
+                {
+                    std::lock_guard<std::mutex> guard(m_lock);
+                    const auto found = m_entries.find(source);
+                    if (found == m_entries.end() || !_matches(found->second.entry, kind, st))
+                    {
+                        return false;
+                    }
+
+                    found->second.used = true;
+                    buffer = found->second.entry.Data;
+                }
+
+                menphina::TraceSpan span(menphina::trace_category::JSON, "json.cache");
+                span.add_files(1);
+                span.add_bytes(buffer.size());
+
+                return !glz::read_beve(value, buffer);
+            }
+
+            template<class T>
+            void store(const JsonCacheKind kind, const std::string& source, const menphina::file_stat_t& st, const T& value)
+            {
+                const int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+                if (now - st.mtime_ns < JSON_CACHE_SETTLE_NS)
+                {
+                    return;
+                }
+
+                json_cache_entry_t entry { source, static_cast<uint32_t>(kind), st.size, st.mtime_ns, st.inode, {} };
+                static_cast<void>(glz::write_beve(value, entry.Data));
+
+                std::lock_guard<std::mutex> guard(m_lock);
+                m_entries.insert_or_assign(source, cached_t { std::move(entry), true });
+                m_dirty = true;
+            }
+
+            // Entries not used by this run are kept while their source is
+            // unchanged, so modes reading different files share the cache.
+            void save()
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                if (!m_dirty)
+                {
+                    return;
+                }
+
+                menphina::TraceSpan span(menphina::trace_category::JSON, "json.cache.save");
+
+                json_cache_file_t out { JSON_CACHE_VERSION, {} };
+                out.Entries.reserve(m_entries.size());
+                for (const auto& [path, cached] : m_entries)
+                {
+                    menphina::file_stat_t st;
+                    if (cached.used || (menphina::try_stat(path, st) && _matches(cached.entry, static_cast<JsonCacheKind>(cached.entry.Kind), st)))
+                    {
+                        out.Entries.push_back(cached.entry);
+                    }
+                }
+
+                std::string buffer;
+                static_cast<void>(glz::write_beve(out, buffer));
+                span.add_files(out.Entries.size());
+                span.add_bytes(buffer.size());
+
+                // Only a cache: staged so a reader never sees half of it,
+                // but not synced.
+                const std::filesystem::path target(m_file);
+                const std::string dir = (target.has_parent_path()) ? target.parent_path().string() : std::string(".");
+                const menphina::UniqueFd dirfd(open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+                if (!dirfd.valid())
+                {
+                    const int err = errno;
+                    throw menphina::errno_exception("Unable to open directory " + dir, err);
+                }
+
+                const std::string name = target.filename().string();
+                const std::string staged = menphina::staging_name(name);
+                menphina::UniqueFd fd = menphina::open_staged(dirfd.get(), staged);
+
+                try
+                {
+                    menphina::write_all(fd.get(), buffer.data(), buffer.size(), m_file);
+                    fd.reset();
+                    menphina::publish_staged(dirfd.get(), staged, name, true);
+                }
+                catch (...)
+                {
+                    fd.reset();
+                    menphina::discard_staged(dirfd.get(), staged);
+                    throw;
+                }
+
+                m_dirty = false;
+            }
+
+        private:
+            struct cached_t
+            {
+                json_cache_entry_t entry;
+                bool used;
+            };
+
+            std::string m_file;
+            std::mutex m_lock;
+            std::map<std::string, cached_t, std::less<>> m_entries;
+            bool m_dirty;
+
+            static bool _matches(const json_cache_entry_t& e, const JsonCacheKind kind, const menphina::file_stat_t& st)
+            {
+                return e.Kind == static_cast<uint32_t>(kind) && e.Size == st.size && e.MTime == st.mtime_ns && e.Inode == st.inode;
+            }
+    };
+
+    // Set by json_cache_enable() before any reads start.
+    std::unique_ptr<JsonParseCache> g_cache;
+
+    // _read_json_file() through the parse cache, when there is one.
+    template<auto O = glz::opts{}, class T>
+    void _read_json_file_cached(const JsonCacheKind kind, T& value, const std::string& file, std::string& buffer)
+    {
+        menphina::file_stat_t st;
+        bool cacheable = false;
+        if (g_cache)
+        {
+            try
+            {
+                cacheable = menphina::try_stat(file, st);
+            }
+            catch (const std::exception&)
+            {
+                // The read reports it.
+            }
+        }
+
+        if (cacheable && g_cache->lookup(kind, file, st, value, buffer))
+        {
+            return;
+        }
+
+        _read_json_file<O, T>(value, file, buffer);
+
+        if (cacheable)
+        {
+            g_cache->store(kind, file, st, value);
+        }
+    }
+
+    template<auto O = glz::opts{}, class T>
+    void _read_json_file_cached(const JsonCacheKind kind, T& value, const std::string& file)
+    {
+        std::string buffer {};
+        _read_json_file_cached<O, T>(kind, value, file, buffer);
+    }
 }
 
 void menphina::read_json_file(penumbra_config_t& obj, const std::string& jsonFile)
 {
-    _read_json_file<PLUGIN_STRUCT_READ_SETTINGS, penumbra_config_t>(obj, jsonFile);
+    _read_json_file_cached<PLUGIN_STRUCT_READ_SETTINGS, penumbra_config_t>(JsonCacheKind::PenumbraConfig, obj, jsonFile);
+}
+
+void menphina::read_json_file(package_manifest_t& obj, const std::string& jsonFile)
+{
+    _read_json_file_cached<PLUGIN_STRUCT_READ_SETTINGS, package_manifest_t>(JsonCacheKind::PackageManifest, obj, jsonFile);
+}
+
+void menphina::write_json_file(const package_manifest_t& obj, const std::string& jsonFile)
+{
+    _write_json_file<DATA_WRITE_SETTINGS>(obj, jsonFile);
+}
+
+void menphina::write_json_file(const bench_report_t& obj, const std::string& jsonFile)
+{
+    _write_json_file<JSON_WRITE_SETTINGS>(obj, jsonFile);
 }
 
 void menphina::read_generic_json_file(glz::json_t& obj, const std::string& jsonFile)
 {
-    _read_json_file<GENERIC_READ_SETTINGS>(obj, jsonFile);
+    _read_json_file_cached<GENERIC_READ_SETTINGS>(JsonCacheKind::Generic, obj, jsonFile);
 }
 
 void menphina::write_generic_json_file(const glz::json_t& obj, const std::string& jsonFile)
 {
-    _write_json_file<JSON_WRITE_SETTINGS>(obj, jsonFile);
+    TraceSpan span(trace_category::JSON, "json.write");
+    span.add_files(1);
+
+    const int fd = open(jsonFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        throw menphina::file_open_exception(jsonFile, false);
+    }
+
+    const UniqueFd guard(fd);
+    span.add_bytes(_write_json_fd(fd, obj, jsonFile));
+}
+
+bool menphina::write_generic_json_file(const glz::json_t& obj, const std::string& jsonFile, const JsonWriteMode mode)
+{
+    if (mode == JsonWriteMode::Overwrite)
+    {
+        write_generic_json_file(obj, jsonFile);
+        return true;
+    }
+
+    JsonWriteBatch batch;
+    if (!batch.add(obj, jsonFile))
+    {
+        return false;
+    }
+
+    batch.commit();
+    return true;
+}
+
+std::vector<menphina::json_batch_result_t> menphina::read_generic_json_files(const std::vector<std::string>& jsonFiles, const unsigned threads)
+{
+    // One allocation for every result slot; workers fill them in place.
+    std::vector<json_batch_result_t> ret(jsonFiles.size());
+
+    // Per worker read buffers; after the first few files they stop growing.
+    std::vector<std::string> buffers(resolve_thread_count(threads));
+
+    parallel_for(jsonFiles.size(), static_cast<unsigned>(buffers.size()), [&](const size_t i, const unsigned worker) {
+        try
+        {
+            _read_json_file_cached<GENERIC_READ_SETTINGS>(JsonCacheKind::Generic, ret[i].value, jsonFiles[i], buffers[worker]);
+        }
+        catch (const std::exception& e)
+        {
+            ret[i].value = glz::json_t {};
+            ret[i].error = e.what();
+        }
+    });
+
+    return ret;
+}
+
+void menphina::json_cache_enable(const std::string& cacheFile)
+{
+    g_cache = std::make_unique<JsonParseCache>(cacheFile);
+}
+
+void menphina::json_cache_save(std::ostream& err)
+{
+    if (!g_cache)
+    {
+        return;
+    }
+
+    try
+    {
+        g_cache->save();
+    }
+    catch (const std::exception& e)
+    {
+        // The next run parses instead.
+        err << "warning: unable to write the JSON cache: " << e.what() << std::endl;
+    }
+}
+
+/* JsonWriteBatch */
+
+menphina::JsonWriteBatch::JsonWriteBatch() : m_skipped(0) {}
+
+menphina::JsonWriteBatch::~JsonWriteBatch()
+{
+    discard();
+}
+
+int menphina::JsonWriteBatch::directory(const std::string& dir)
+{
+    const auto found = m_dirs.find(dir);
+    if (found != m_dirs.end())
+    {
+        return found->second.get();
+    }
+
+    const int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        const int err = errno;
+        throw menphina::errno_exception("Unable to open directory " + dir, err);
+    }
+
+    m_dirs.emplace(dir, UniqueFd(fd));
+    return fd;
+}
+
+bool menphina::JsonWriteBatch::add(const glz::json_t& obj, const std::string& jsonFile)
+{
+    TraceSpan span(trace_category::JSON, "json.write");
+    span.add_files(1);
+
+    // Compared first and only then written, serializing twice when the
+    // file changed, so that neither needs the whole text in memory.
+    uint64_t compared = 0;
+    if (_file_has_json(jsonFile, obj, m_buffer, compared))
+    {
+        span.add_bytes(compared);
+        ++m_skipped;
+        return false;
+    }
+
+    const std::filesystem::path target(jsonFile);
+    const std::string dir = (target.has_parent_path()) ? target.parent_path().string() : std::string(".");
+    const int dirfd = directory(dir);
+
+    staged_t entry { dirfd, target.filename().string(), {} };
+    entry.staged = staging_name(entry.name);
+
+    UniqueFd fd = open_staged(dirfd, entry.staged);
+    m_staged.push_back(entry);
+
+    // Writeback of each piece starts as soon as it is written, so it runs
+    // while the next one is serialized and commit()'s fsyncs mostly find
+    // clean pages.
+    uint64_t offset = 0;
+    const int out = fd.get();
+    const JsonStreamWriter::sink_fn sink = [out, &offset, &jsonFile](const char * data, const size_t length)
+    {
+        write_all(out, data, length, jsonFile);
+
+#if defined ( __linux__ )
+        sync_file_range(out, static_cast<off_t>(offset), static_cast<off_t>(length), SYNC_FILE_RANGE_WRITE);
+#endif
+
+        offset += length;
+        return true;
+    };
+
+    JsonStreamWriter writer(sink);
+    writer.write(obj);
+    span.add_bytes(writer.written());
+
+    return true;
+}
+
+size_t menphina::JsonWriteBatch::commit()
+{
+    TraceSpan span(trace_category::WRITE, "json.commit");
+    span.add_files(m_staged.size());
+
+    // Data first, so no rename can publish a file whose contents are not
+    // yet durable.
+    for (const auto& e : m_staged)
+    {
+        const int fd = openat(e.dirfd, e.staged.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            throw menphina::file_open_exception(e.staged, true);
+        }
+
+        const UniqueFd guard(fd);
+        _sync(fd, e.staged);
+    }
+
+    for (const auto& e : m_staged)
+    {
+        publish_staged(e.dirfd, e.staged, e.name, true);
+    }
+
+    const size_t ret = m_staged.size();
+    m_staged.clear();
+
+    // One sync per directory makes all of its renames durable.
+    for (const auto& [dir, fd] : m_dirs)
+    {
+        _sync(fd.get(), dir);
+    }
+
+    m_dirs.clear();
+    return ret;
+}
+
+void menphina::JsonWriteBatch::discard()
+{
+    for (const auto& e : m_staged)
+    {
+        discard_staged(e.dirfd, e.staged);
+    }
+
+    m_staged.clear();
 }
@@ -0,0 +1,610 @@
+/* Copyright 2024 isaki */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "menphina/fileio.hpp"
+#include "menphina/json_edit.hpp"
+#include "menphina/m_exception.hpp"
+#include "menphina/trace.hpp"
+
+namespace
+{
+    inline constexpr std::string_view UTF8_BOM = "\xEF\xBB\xBF";
+
+    inline bool _is_ws(const char c)
+    {
+        return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+    }
+
+    inline bool _is_scalar_end(const char c)
+    {
+        return _is_ws(c) || c == ',' || c == '}' || c == ']';
+    }
+
+    int _hex_value(const char c)
+    {
+        if (c >= '0' && c <= '9')
+        {
+            return c - '0';
+        }
+
+        if (c >= 'a' && c <= 'f')
+        {
+            return c - 'a' + 10;
+        }
+
+        if (c >= 'A' && c <= 'F')
+        {
+            return c - 'A' + 10;
+        }
+
+        return -1;
+    }
+
+    bool _read_hex4(const std::string_view s, const size_t pos, uint32_t& out)
+    {
+        if (pos + 4 > s.size())
+        {
+            return false;
+        }
+
+        out = 0;
+        for (size_t i = 0; i < 4; ++i)
+        {
+            const int v = _hex_value(s[pos + i]);
+            if (v < 0)
+            {
+                return false;
+            }
+
+            out = (out << 4) | static_cast<uint32_t>(v);
+        }
+
+        return true;
+    }
+
+    void _append_utf8(std::string& out, const uint32_t cp)
+    {
+        if (cp < 0x80)
+        {
+            out += static_cast<char>(cp);
+        }
+        else if (cp < 0x800)
+        {
+            out += static_cast<char>(0xC0 | (cp >> 6));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        }
+        else if (cp < 0x10000)
+        {
+            out += static_cast<char>(0xE0 | (cp >> 12));
+            out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        }
+        else
+        {
+            out += static_cast<char>(0xF0 | (cp >> 18));
+            out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+            out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        }
+    }
+
+    // Decodes the body of a JSON string (no surrounding quotes).
+    std::string _unescape(const std::string_view raw)
+    {
+        std::string ret;
+        ret.reserve(raw.size());
+
+        for (size_t i = 0; i < raw.size(); ++i)
+        {
+            const char c = raw[i];
+            if (c != '\\' || i + 1 >= raw.size())
+            {
+                ret += c;
+                continue;
+            }
+
+            const char e = raw[++i];
+            switch (e)
+            {
+                case 'b': ret += '\b'; break;
+                case 'f': ret += '\f'; break;
+                case 'n': ret += '\n'; break;
+                case 'r': ret += '\r'; break;
+                case 't': ret += '\t'; break;
+                case 'u':
+                {
+                    uint32_t cp;
+                    if (!_read_hex4(raw, i + 1, cp))
+                    {
+                        throw std::runtime_error("invalid \\u escape in JSON string");
+                    }
+
+                    i += 4;
+
+                    // Surrogate pair
+                    uint32_t low;
+                    if (cp >= 0xD800 && cp < 0xDC00 && i + 2 < raw.size() && raw[i + 1] == '\\' && raw[i + 2] == 'u'
+                        && _read_hex4(raw, i + 3, low) && low >= 0xDC00 && low < 0xE000)
+                    {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                        i += 6;
+                    }
+
+                    _append_utf8(ret, cp);
+                    break;
+                }
+                default:
+                    // \" \\ \/
+                    ret += e;
+                    break;
+            }
+        }
+
+        return ret;
+    }
+
+    std::string _read_file(const std::string& file)
+    {
+        menphina::TraceSpan span(menphina::trace_category::JSON, "json.edit.load");
+        span.add_files(1);
+
+        const int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            throw menphina::file_open_exception(file, true);
+        }
+
+        const menphina::UniqueFd guard(fd);
+
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            const int err = errno;
+            throw menphina::errno_exception("Unable to stat " + file, err);
+        }
+
+        std::string ret(static_cast<size_t>(st.st_size), '\0');
+        ret.resize(menphina::read_full(fd, ret.data(), ret.size(), file));
+        return ret;
+    }
+}
+
+menphina::JsonEditor::JsonEditor(const std::string& file) :
+    m_file(file),
+    m_text(_read_file(file))
+{
+}
+
+menphina::JsonEditor::~JsonEditor() {}
+
+void menphina::JsonEditor::fail(const size_t pos, const std::string_view what) const
+{
+    throw std::runtime_error("json error in " + m_file + " at offset " + std::to_string(pos) + ": " + std::string(what));
+}
+
+size_t menphina::JsonEditor::skip_ws(size_t pos) const
+{
+    while (pos < m_text.size() && _is_ws(m_text[pos]))
+    {
+        ++pos;
+    }
+
+    return pos;
+}
+
+size_t menphina::JsonEditor::skip_string(size_t pos) const
+{
+    // pos is at the opening quote; returns one past the closing quote.
+    for (size_t cur = pos + 1;;)
+    {
+        const size_t q = m_text.find('"', cur);
+        if (q == std::string::npos)
+        {
+            fail(pos, "unterminated string");
+        }
+
+        // The quote is escaped only by an odd run of backslashes.
+        size_t slashes = 0;
+        while (q - slashes > pos + 1 && m_text[q - slashes - 1] == '\\')
+        {
+            ++slashes;
+        }
+
+        if ((slashes & 1) == 0)
+        {
+            return q + 1;
+        }
+
+        cur = q + 1;
+    }
+}
+
+size_t menphina::JsonEditor::skip_value(size_t pos) const
+{
+    if (pos >= m_text.size())
+    {
+        fail(pos, "expected a value");
+    }
+
+    const char c = m_text[pos];
+    if (c == '"')
+    {
+        return skip_string(pos);
+    }
+
+    if (c != '{' && c != '[')
+    {
+        const size_t start = pos;
+        while (pos < m_text.size() && !_is_scalar_end(m_text[pos]))
+        {
+            ++pos;
+        }
+
+        if (pos == start)
+        {
+            fail(pos, "expected a value");
+        }
+
+        return pos;
+    }
+
+    // Containers are skipped by bracket depth alone; only strings need care.
+    size_t depth = 0;
+    while (pos < m_text.size())
+    {
+        switch (m_text[pos])
+        {
+            case '"':
+                pos = skip_string(pos);
+                continue;
+            case '{':
+            case '[':
+                ++depth;
+                break;
+            case '}':
+            case ']':
+                if (--depth == 0)
+                {
+                    return pos + 1;
+                }
+                break;
+            default:
+                break;
+        }
+
+        ++pos;
+    }
+
+    fail(pos, "unterminated container");
+}
+
+menphina::json_range_t menphina::JsonEditor::root() const
+{
+    size_t pos = (std::string_view(m_text).starts_with(UTF8_BOM)) ? UTF8_BOM.size() : 0;
+    pos = skip_ws(pos);
+    return json_range_t { pos, skip_value(pos) };
+}
+
+std::vector<menphina::json_member_t> menphina::JsonEditor::members(const json_range_t& object) const
+{
+    std::vector<json_member_t> ret;
+
+    size_t pos = object.begin;
+    if (pos >= m_text.size() || m_text[pos] != '{')
+    {
+        fail(pos, "expected an object");
+    }
+
+    pos = skip_ws(pos + 1);
+    if (pos < m_text.size() && m_text[pos] == '}')
+    {
+        return ret;
+    }
+
+    for (;;)
+    {
+        if (pos >= m_text.size() || m_text[pos] != '"')
+        {
+            fail(pos, "expected a key");
+        }
+
+        const size_t keyBegin = pos;
+        const size_t keyEnd = skip_string(pos);
+
+        pos = skip_ws(keyEnd);
+        if (pos >= m_text.size() || m_text[pos] != ':')
+        {
+            fail(pos, "expected ':'");
+        }
+
+        const size_t valueBegin = skip_ws(pos + 1);
+        const size_t valueEnd = skip_value(valueBegin);
+
+        ret.push_back(json_member_t {
+            .raw_key = std::string_view(m_text).substr(keyBegin + 1, keyEnd - keyBegin - 2),
+            .key_begin = keyBegin,
+            .value = json_range_t { valueBegin, valueEnd }
+        });
+
+        pos = skip_ws(valueEnd);
+        if (pos < m_text.size() && m_text[pos] == ',')
+        {
+            pos = skip_ws(pos + 1);
+            continue;
+        }
+
+        if (pos < m_text.size() && m_text[pos] == '}')
+        {
+            return ret;
+        }
+
+        fail(pos, "expected ',' or '}'");
+    }
+}
+
+std::vector<menphina::json_range_t> menphina::JsonEditor::elements(const json_range_t& array) const
+{
+    std::vector<json_range_t> ret;
+
+    size_t pos = array.begin;
+    if (pos >= m_text.size() || m_text[pos] != '[')
+    {
+        fail(pos, "expected an array");
+    }
+
+    pos = skip_ws(pos + 1);
+    if (pos < m_text.size() && m_text[pos] == ']')
+    {
+        return ret;
+    }
+
+    for (;;)
+    {
+        const size_t valueEnd = skip_value(pos);
+        ret.push_back(json_range_t { pos, valueEnd });
+
+        pos = skip_ws(valueEnd);
+        if (pos < m_text.size() && m_text[pos] == ',')
+        {
+            pos = skip_ws(pos + 1);
+            continue;
+        }
+
+        if (pos < m_text.size() && m_text[pos] == ']')
+        {
+            return ret;
+        }
+
+        fail(pos, "expected ',' or ']'");
+    }
+}
+
+std::optional<std::string> menphina::JsonEditor::string_value(const json_range_t& range) const
+{
+    if (range.begin >= m_text.size() || m_text[range.begin] != '"' || range.end - range.begin < 2)
+    {
+        return std::nullopt;
+    }
+
+    const std::string_view raw = std::string_view(m_text).substr(range.begin + 1, range.end - range.begin - 2);
+    if (raw.find('\\') == std::string_view::npos)
+    {
+        return std::string(raw);
+    }
+
+    return _unescape(raw);
+}
+
+std::string menphina::JsonEditor::key(const json_member_t& member) const
+{
+    if (member.raw_key.find('\\') == std::string_view::npos)
+    {
+        return std::string(member.raw_key);
+    }
+
+    return _unescape(member.raw_key);
+}
+
+std::optional<menphina::json_range_t> menphina::JsonEditor::find(const std::initializer_list<std::string_view> path) const
+{
+    json_range_t cur = root();
+
+    for (const std::string_view k : path)
+    {
+        if (m_text[cur.begin] != '{')
+        {
+            return std::nullopt;
+        }
+
+        bool found = false;
+        for (const auto& m : members(cur))
+        {
+            if (key(m) == k)
+            {
+                cur = m.value;
+                found = true;
+                break;
+            }
+        }
+
+        if (!found)
+        {
+            return std::nullopt;
+        }
+    }
+
+    return cur;
+}
+
+size_t menphina::JsonEditor::remove_members(const json_range_t& object, const std::function<bool(const json_member_t&)>& pred)
+{
+    const std::vector<json_member_t> list = members(object);
+
+    std::vector<bool> removed(list.size());
+    size_t count = 0;
+    for (size_t i = 0; i < list.size(); ++i)
+    {
+        removed[i] = pred(list[i]);
+        count += removed[i];
+    }
+
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    if (count == list.size())
+    {
+        // Everything goes; leave "{}".
+        add_edit(json_range_t { object.begin + 1, object.end - 1 }, {});
+        return count;
+    }
+
+    // Each run of removed members becomes one deletion. A run followed by
+    // a kept member is cut up to that member's key, which takes the run's
+    // trailing commas with it and keeps the indentation in front of the run.
+    // A run at the end is cut from the end of the last kept value instead,
+    // taking the comma that preceded it.
+    for (size_t i = 0; i < list.size();)
+    {
+        if (!removed[i])
+        {
+            ++i;
+            continue;
+        }
+
+        size_t j = i;
+        while (j + 1 < list.size() && removed[j + 1])
+        {
+            ++j;
+        }
+
+        if (j + 1 < list.size())
+        {
+            add_edit(json_range_t { list[i].key_begin, list[j + 1].key_begin }, {});
+        }
+        else
+        {
+            add_edit(json_range_t { list[i - 1].value.end, list[j].value.end }, {});
+        }
+
+        i = j + 1;
+    }
+
+    return count;
+}
+
+void menphina::JsonEditor::replace(const json_range_t& range, const std::string_view json)
+{
+    add_edit(range, std::string(json));
+}
+
+void menphina::JsonEditor::add_edit(const json_range_t& range, std::string replacement)
+{
+    if (range.begin > range.end || range.end > m_text.size()) [[unlikely]]
+    {
+        throw std::logic_error("JsonEditor edit out of range");
+    }
+
+    m_edits.push_back(edit_t { range, std::move(replacement) });
+}
+
+void menphina::JsonEditor::save()
+{
+    if (m_edits.empty())
+    {
+        return;
+    }
+
+    const std::filesystem::path target(m_file);
+    const std::string dir = (target.has_parent_path()) ? target.parent_path().string() : std::string(".");
+
+    const int dirfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd == -1)
+    {
+        const int err = errno;
+        throw menphina::errno_exception("Unable to open directory " + dir, err);
+    }
+
+    const UniqueFd dirGuard(dirfd);
+    save(dirfd);
+}
+
+void menphina::JsonEditor::save(const int dirfd)
+{
+    if (m_edits.empty())
+    {
+        return;
+    }
+
+    TraceSpan span(trace_category::JSON, "json.edit.save");
+    span.add_files(1);
+
+    std::sort(m_edits.begin(), m_edits.end(), [](const edit_t& a, const edit_t& b) {
+        return a.range.begin < b.range.begin;
+    });
+
+    // Untouched ranges are copied verbatim around the edits.
+    std::string out;
+    size_t length = m_text.size();
+    for (const auto& e : m_edits)
+    {
+        length = length - (e.range.end - e.range.begin) + e.replacement.size();
+    }
+
+    out.reserve(length);
+
+    size_t pos = 0;
+    for (const auto& e : m_edits)
+    {
+        if (e.range.begin < pos) [[unlikely]]
+        {
+            throw std::logic_error("JsonEditor edits overlap");
+        }
+
+        out.append(m_text, pos, e.range.begin - pos);
+        out.append(e.replacement);
+        pos = e.range.end;
+    }
+
+    out.append(m_text, pos, std::string::npos);
+
+    const std::string name = std::filesystem::path(m_file).filename().string();
+    const std::string staged = staging_name(name);
+    UniqueFd fd = open_staged(dirfd, staged);
+
+    try
+    {
+        write_all(fd.get(), out.data(), out.size(), m_file);
+        if (fsync(fd.get()) != 0)
+        {
+            const int err = errno;
+            throw menphina::errno_exception("Failed to sync " + m_file, err);
+        }
+
+        fd.reset();
+        publish_staged(dirfd, staged, name, true);
+    }
+    catch (...)
+    {
+        fd.reset();
+        discard_staged(dirfd, staged);
+        throw;
+    }
+
+    m_text = std::move(out);
+    m_edits.clear();
+}
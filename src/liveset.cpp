@@ -0,0 +1,282 @@
+/* Copyright 2024 isaki */
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined ( __AVX2__ )
+#include <immintrin.h>
+#elif defined ( __SSE2__ )
+#include <emmintrin.h>
+#endif
+
+#include "menphina/liveset.hpp"
+
+namespace
+{
+    inline constexpr uint32_t EMPTY_TAG = 0;
+
+    // Bloom bits per member, all in the same 64 bit word.
+    inline constexpr unsigned BLOOM_BITS = 4;
+    inline constexpr size_t MEMBERS_PER_BLOOM_WORD = 4;
+
+    // At most half of the slots are used.
+    inline constexpr size_t SLOTS_PER_MEMBER = 2;
+
+    inline constexpr uint64_t BYTES_01 = 0x0101010101010101ull;
+    inline constexpr uint64_t BYTES_7F = 0x7F7F7F7F7F7F7F7Full;
+    inline constexpr uint64_t BYTES_80 = 0x8080808080808080ull;
+
+    inline unsigned char _fold(const unsigned char c)
+    {
+        if (c == '\\')
+        {
+            return '/';
+        }
+
+        return (c >= 'A' && c <= 'Z') ? static_cast<unsigned char>(c - 'A' + 'a') : c;
+    }
+
+    // _fold() on eight bytes at once; bytes outside ASCII are left alone,
+    // as normalize_reference() does.
+    inline uint64_t _fold_word(uint64_t w)
+    {
+        const uint64_t ascii = ~w & BYTES_80;
+        const uint64_t low = w & BYTES_7F;
+
+        // High bit of each byte: equal to '\\' ...
+        const uint64_t bs = w ^ (BYTES_01 * '\\');
+        const uint64_t isBackslash = ~(((bs & BYTES_7F) + BYTES_7F) | bs) & BYTES_80;
+
+        // ... and within 'A'..'Z'.
+        const uint64_t geA = low + BYTES_01 * (0x80 - 'A');
+        const uint64_t gtZ = low + BYTES_01 * (0x7F - 'Z');
+        const uint64_t isUpper = ascii & (geA ^ gtZ) & BYTES_80;
+
+        w ^= (isBackslash >> 7) * ('\\' ^ '/');
+        return w | (isUpper >> 2);
+    }
+
+    inline uint64_t _mix(uint64_t h)
+    {
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDull;
+        h ^= h >> 33;
+        h *= 0xC4CEB9FE1A85EC53ull;
+        return h ^ (h >> 33);
+    }
+
+    // Hash of the normalized form of path.
+    uint64_t _hash(const std::string_view path)
+    {
+        const char * p = path.data();
+        const size_t n = path.size();
+
+        uint64_t h = 0x9E3779B97F4A7C15ull ^ n;
+
+        size_t i = 0;
+        for (; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t))
+        {
+            uint64_t w;
+            std::memcpy(&w, p + i, sizeof(w));
+            h = (h ^ _fold_word(w)) * 0x9FB21C651E98DF25ull;
+            h ^= h >> 29;
+        }
+
+        if (i < n)
+        {
+            uint64_t w = 0;
+            std::memcpy(&w, p + i, n - i);
+            h = (h ^ _fold_word(w)) * 0x9FB21C651E98DF25ull;
+        }
+
+        return _mix(h);
+    }
+
+    inline uint64_t _bloom_bits(const uint64_t hash)
+    {
+        uint64_t ret = 0;
+        for (unsigned k = 0; k < BLOOM_BITS; ++k)
+        {
+            ret |= uint64_t { 1 } << ((hash >> (40 + 6 * k)) & 63);
+        }
+
+        return ret;
+    }
+
+    inline uint32_t _tag(const uint64_t hash)
+    {
+        const uint32_t tag = static_cast<uint32_t>(hash >> 8);
+        return (tag == EMPTY_TAG) ? 1 : tag;
+    }
+
+    inline size_t _first_bucket(const uint64_t hash, const size_t mask)
+    {
+        return static_cast<size_t>((hash * 0xC2B2AE3D27D4EB4Full) >> 32) & mask;
+    }
+
+    // Bit i is set where tags[i] == value.
+    inline unsigned _match(const uint32_t * tags, const uint32_t value)
+    {
+#if defined ( __AVX2__ )
+        const __m256i v = _mm256_load_si256(reinterpret_cast<const __m256i *>(tags));
+        const __m256i eq = _mm256_cmpeq_epi32(v, _mm256_set1_epi32(static_cast<int>(value)));
+        return static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(eq)));
+#elif defined ( __SSE2__ )
+        const __m128i needle = _mm_set1_epi32(static_cast<int>(value));
+        const __m128i lo = _mm_cmpeq_epi32(_mm_load_si128(reinterpret_cast<const __m128i *>(tags)), needle);
+        const __m128i hi = _mm_cmpeq_epi32(_mm_load_si128(reinterpret_cast<const __m128i *>(tags + 4)), needle);
+        return static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(lo)))
+            | (static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(hi))) << 4);
+#else
+        unsigned ret = 0;
+        for (unsigned i = 0; i < menphina::LiveSet::BUCKET_SLOTS; ++i)
+        {
+            ret |= static_cast<unsigned>(tags[i] == value) << i;
+        }
+
+        return ret;
+#endif
+    }
+
+    // member is normalized; path is compared as if it were.
+    bool _equal_folded(const std::string_view member, const std::string_view path)
+    {
+        if (member.size() != path.size())
+        {
+            return false;
+        }
+
+        const size_t n = path.size();
+
+        size_t i = 0;
+        for (; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t))
+        {
+            uint64_t m;
+            uint64_t p;
+            std::memcpy(&m, member.data() + i, sizeof(m));
+            std::memcpy(&p, path.data() + i, sizeof(p));
+            if (m != _fold_word(p))
+            {
+                return false;
+            }
+        }
+
+        for (; i < n; ++i)
+        {
+            if (static_cast<unsigned char>(member[i]) != _fold(static_cast<unsigned char>(path[i])))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+}
+
+menphina::LiveSet::LiveSet() :
+    m_bloom(1, 0),
+    m_buckets(1, bucket_t {}),
+    m_slots(BUCKET_SLOTS, 0)
+{
+}
+
+menphina::LiveSet::LiveSet(const std::vector<std::string>& members)
+{
+    const size_t bloomWords = std::bit_ceil(std::max<size_t>(1, (members.size() + MEMBERS_PER_BLOOM_WORD - 1) / MEMBERS_PER_BLOOM_WORD));
+    const size_t buckets = std::bit_ceil(std::max<size_t>(1, (members.size() * SLOTS_PER_MEMBER + BUCKET_SLOTS - 1) / BUCKET_SLOTS));
+
+    m_bloom.assign(bloomWords, 0);
+    m_buckets.assign(buckets, bucket_t {});
+    m_slots.assign(buckets * BUCKET_SLOTS, 0);
+    m_ends.reserve(members.size());
+
+    const size_t mask = buckets - 1;
+
+    for (const std::string& m : members)
+    {
+        const uint64_t hash = _hash(m);
+        if (find(m, hash))
+        {
+            continue;
+        }
+
+        if (m_strings.size() + m.size() > std::numeric_limits<uint32_t>::max()) [[unlikely]]
+        {
+            throw std::runtime_error("live set exceeds the supported size");
+        }
+
+        const uint32_t index = static_cast<uint32_t>(m_ends.size());
+        m_strings.append(m);
+        m_ends.push_back(static_cast<uint32_t>(m_strings.size()));
+
+        m_bloom[hash & (bloomWords - 1)] |= _bloom_bits(hash);
+
+        // There is always a free slot; the table is at most half full.
+        for (size_t b = _first_bucket(hash, mask);; b = (b + 1) & mask)
+        {
+            const unsigned free = _match(m_buckets[b].tags, EMPTY_TAG);
+            if (free != 0)
+            {
+                const unsigned slot = static_cast<unsigned>(std::countr_zero(free));
+                m_buckets[b].tags[slot] = _tag(hash);
+                m_slots[b * BUCKET_SLOTS + slot] = index;
+                break;
+            }
+        }
+    }
+}
+
+menphina::LiveSet::~LiveSet() {}
+
+menphina::LiveSet::LiveSet(LiveSet&&) noexcept = default;
+
+menphina::LiveSet& menphina::LiveSet::operator=(LiveSet&&) noexcept = default;
+
+bool menphina::LiveSet::contains(const std::string_view path) const
+{
+    return find(path, _hash(path));
+}
+
+std::string_view menphina::LiveSet::member(const uint32_t i) const
+{
+    const uint32_t start = (i == 0) ? 0 : m_ends[i - 1];
+    return std::string_view(m_strings.data() + start, m_ends[i] - start);
+}
+
+bool menphina::LiveSet::find(const std::string_view path, const uint64_t hash) const
+{
+    const uint64_t bits = _bloom_bits(hash);
+    if ((m_bloom[hash & (m_bloom.size() - 1)] & bits) != bits)
+    {
+        return false;
+    }
+
+    const uint32_t tag = _tag(hash);
+    const size_t mask = m_buckets.size() - 1;
+
+    for (size_t b = _first_bucket(hash, mask);; b = (b + 1) & mask)
+    {
+        const uint32_t * tags = m_buckets[b].tags;
+
+        for (unsigned hits = _match(tags, tag); hits != 0; hits &= hits - 1)
+        {
+            const unsigned slot = static_cast<unsigned>(std::countr_zero(hits));
+            if (_equal_folded(member(m_slots[b * BUCKET_SLOTS + slot]), path))
+            {
+                return true;
+            }
+        }
+
+        // A member would have gone into the first free slot on its way.
+        if (_match(tags, EMPTY_TAG) != 0)
+        {
+            return false;
+        }
+    }
+}
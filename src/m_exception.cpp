@@ -37,3 +37,13 @@ const char * menphina::file_open_exception::what() const throw()
 {
     return m_msg.c_str();
 }
+
+/* cancelled_exception */
+menphina::cancelled_exception::~cancelled_exception() {}
+
+menphina::cancelled_exception::cancelled_exception() {}
+
+const char * menphina::cancelled_exception::what() const throw()
+{
+    return "operation cancelled";
+}
@@ -2,20 +2,28 @@
 
 #include <iostream>
 #include <filesystem>
+#include <memory>
 #include <string>
 #include <string_view>
+#include <stdexcept>
+#include <vector>
 
 #include "boost/program_options.hpp"
 #include "menphina_internal/config.hpp"
 
+#include "menphina/json.hpp"
 #include "menphina/platform.hpp"
+#include "menphina/trace.hpp"
 
 // Execution support
 #include "menphina/exec.hpp"
-
-// TODO: REMOVE LATER
-#include "menphina/json.hpp"
-#include "glaze/json/json_t.hpp"
+#include "menphina/clean.hpp"
+#include "menphina/dedup.hpp"
+#include "menphina/package.hpp"
+#include "menphina/deploy.hpp"
+#include "menphina/delta.hpp"
+#include "menphina/verify.hpp"
+#include "menphina/watch.hpp"
 
 namespace po = boost::program_options;
 
@@ -24,9 +32,16 @@ namespace
     const std::string MODE_CLEAN { "clean" };
     const std::string MODE_PACKAGE { "package" };
     const std::string MODE_DEPLOY { "deploy" };
+    const std::string MODE_DELTA { "delta" };
+    const std::string MODE_VERIFY { "verify" };
     const std::string MODE_CREATE_CONF { "create-config"};
+    const std::string MODE_WATCH { "watch" };
 
     const std::string CONFIG_NAME { ".menphina.json" };
+    const std::string MANIFEST_NAME { ".menphina.manifest.json" };
+    const std::string REFERENCE_INDEX_NAME { ".menphina.refindex" };
+    const std::string WATCH_SOCKET_NAME { ".menphina.sock" };
+    const std::string JSON_CACHE_NAME { ".menphina.jsoncache" };
 
     std::string _argv_basename(const char * name)
     {
@@ -39,11 +54,67 @@ namespace
         const std::string home = menphina::get_user_home_directory();
         return menphina::path_join(home, CONFIG_NAME);
     }
+
+    // Lives next to the config file.
+    std::string _get_manifest_file()
+    {
+        std::filesystem::path p(_get_config_file());
+        p.replace_filename(MANIFEST_NAME);
+        return p.string();
+    }
+
+    // Lives next to the config file.
+    std::string _get_reference_index_file()
+    {
+        std::filesystem::path p(_get_config_file());
+        p.replace_filename(REFERENCE_INDEX_NAME);
+        return p.string();
+    }
+
+    // Lives next to the config file.
+    std::string _get_watch_socket_file()
+    {
+        std::filesystem::path p(_get_config_file());
+        p.replace_filename(WATCH_SOCKET_NAME);
+        return p.string();
+    }
+
+    const std::string & _require_option(const po::variables_map& vm, const char * name)
+    {
+        if (!vm.count(name))
+        {
+            throw std::runtime_error(std::string("This mode requires --") + name);
+        }
+
+        return vm[name].as<std::string>();
+    }
+
+    const std::string & _require_package(const po::variables_map& vm)
+    {
+        return _require_option(vm, "package");
+    }
+
+    // Lives next to the config file.
+    std::string _get_json_cache_file()
+    {
+        std::filesystem::path p(_get_config_file());
+        p.replace_filename(JSON_CACHE_NAME);
+        return p.string();
+    }
+
+    std::string _get_default_launcher_dir()
+    {
+        const std::string home = menphina::get_user_home_directory();
+        return menphina::path_join(home, menphina::get_relative_launcher_config_dir());
+    }
 }
 
 int main(int argc, char ** argv)
 {
-    menphina::Execution * exec;
+    std::unique_ptr<menphina::Execution> exec;
+    std::string launcherDir;
+    std::string mode;
+    std::string traceFile;
     try
     {    
         // Declare the supported options.
@@ -52,11 +123,22 @@ int main(int argc, char ** argv)
             ("help,h", "print this message message")
             ("version,v", "display version information")
             ("launcher-dir", po::value<std::string>(), "provide an explicit launcher directory instead of the default")
+            ("package,p", po::value<std::string>(), "the deployment package (xmpkg) to write or read")
+            ("base", po::value<std::string>(), "the earlier package a delta starts from")
+            ("delta", po::value<std::string>(), "the delta package (xmdelta) to write")
+            ("mod", po::value<std::vector<std::string>>(), "deploy or verify only the named mod; may be repeated")
+            ("dedup", "clean: merge byte-identical mod files (reflinks, or hard links where unsupported) instead")
+            ("dry-run", "clean, deploy: print the planned filesystem operations without making them")
+            ("compress", po::value<int>()->implicit_value(6), "deflate package chunks that compress well, at the given zlib level (1-9, default 6)")
+            ("read-threads", po::value<unsigned>(), "package: threads reading source files (default: up to 4)")
+            ("hash-threads", po::value<unsigned>(), "package: threads hashing chunks (default: a quarter of the cores)")
+            ("compress-threads", po::value<unsigned>(), "package: threads compressing chunks (default: all cores)")
+            ("trace", po::value<std::string>(), "record a Chrome trace (chrome://tracing, Perfetto) of the run to the given file")
         ;
 
         po::options_description hidden("Hidden options");
         hidden.add_options()
-            ("mode", po::value<std::string>(), "The operating mode: clean, deploy, or package")
+            ("mode", po::value<std::string>(), "The operating mode: clean, delta, deploy, package, verify, or watch")
         ;
 
         po::options_description all;
@@ -90,7 +172,9 @@ int main(int argc, char ** argv)
             std::cout << std::endl
                 << "  clean" << std::endl
                 << "    analyzes and cleans orphaned data from the Penumbra configuration" << std::endl
-                << "    directory" << std::endl;
+                << "    directory; with --dedup, replaces identical files across mods with" << std::endl
+                << "    reflinks (hard links where the filesystem has none; those share later" << std::endl
+                << "    in-place edits)" << std::endl;
 
             std::cout << std::endl
                 << "  package" << std::endl
@@ -98,13 +182,29 @@ int main(int argc, char ** argv)
 
             std::cout << std::endl
                 << "  deploy" << std::endl
-                << "    deploys all configured (if present) mod data from a deployment package" << std::endl;
+                << "    deploys all configured (if present) mod data from a deployment package," << std::endl
+                << "    or applies a delta package over a deployment of its base package" << std::endl;
+
+            std::cout << std::endl
+                << "  verify" << std::endl
+                << "    checks that the deployed mod data matches a deployment package, hashing" << std::endl
+                << "    every file; reports files that differ or are missing" << std::endl;
+
+            std::cout << std::endl
+                << "  delta" << std::endl
+                << "    writes the difference between two deployment packages (--base and" << std::endl
+                << "    --package) into a delta package (--delta) for deploy" << std::endl;
 
             std::cout << std::endl
                 << "  create-config" << std::endl
                 << "    attempts to locate the required files and directories to automatically" << std::endl
                 << "    create the " << CONFIG_NAME << " file" << std::endl;
 
+            std::cout << std::endl
+                << "  watch" << std::endl
+                << "    keeps the state clean works from current until interrupted; clean runs" << std::endl
+                << "    are then answered by this process instead of rescanning" << std::endl;
+
             std::cout << std::endl;
 
             return 1;
@@ -112,20 +212,60 @@ int main(int argc, char ** argv)
 
         if (vm.count("mode"))
         {
-            const std::string mode = vm["mode"].as<std::string>();
+            mode = vm["mode"].as<std::string>();
 
-            if (mode == MODE_CLEAN)
+            const bool dryRun = vm.count("dry-run") != 0;
+            if (dryRun && mode != MODE_CLEAN && mode != MODE_DEPLOY)
+            {
+                throw std::runtime_error("--dry-run is only supported by clean and deploy");
+            }
+
+            if (mode == MODE_CLEAN && vm.count("dedup"))
+            {
+                if (dryRun)
+                {
+                    throw std::runtime_error("--dry-run is not supported with --dedup");
+                }
+
+                exec = std::make_unique<menphina::Dedup>();
+            }
+            else if (mode == MODE_CLEAN)
+            {
+                exec = std::make_unique<menphina::Clean>(_get_reference_index_file(), _get_watch_socket_file(), dryRun);
+            }
+            else if (mode == MODE_WATCH)
             {
-                // We would allocate clean object
-                exec = nullptr;
+                exec = std::make_unique<menphina::Watch>(_get_reference_index_file(), _get_watch_socket_file());
             }
             else if (mode == MODE_PACKAGE)
             {
-                exec = nullptr;
+                menphina::package_options_t options {};
+                options.read_threads = (vm.count("read-threads")) ? vm["read-threads"].as<unsigned>() : 0;
+                options.hash_threads = (vm.count("hash-threads")) ? vm["hash-threads"].as<unsigned>() : 0;
+                options.compress_threads = (vm.count("compress-threads")) ? vm["compress-threads"].as<unsigned>() : 0;
+                options.compression_level = (vm.count("compress")) ? vm["compress"].as<int>() : 0;
+
+                // Leaving --compress out is how compression is turned off.
+                if (vm.count("compress") && (options.compression_level < 1 || options.compression_level > 9))
+                {
+                    throw std::runtime_error("--compress takes a zlib level from 1 to 9");
+                }
+
+                exec = std::make_unique<menphina::Package>(_require_package(vm), _get_manifest_file(), options);
             }
             else if (mode == MODE_DEPLOY)
             {
-                exec = nullptr;
+                const std::vector<std::string> mods = (vm.count("mod")) ? vm["mod"].as<std::vector<std::string>>() : std::vector<std::string> {};
+                exec = std::make_unique<menphina::Deploy>(_require_package(vm), mods, dryRun);
+            }
+            else if (mode == MODE_VERIFY)
+            {
+                const std::vector<std::string> mods = (vm.count("mod")) ? vm["mod"].as<std::vector<std::string>>() : std::vector<std::string> {};
+                exec = std::make_unique<menphina::Verify>(_require_package(vm), mods);
+            }
+            else if (mode == MODE_DELTA)
+            {
+                exec = std::make_unique<menphina::Delta>(_require_option(vm, "base"), _require_package(vm), _require_option(vm, "delta"));
             }
             else
             {
@@ -139,6 +279,14 @@ int main(int argc, char ** argv)
             std::cerr << "No operating mode specified; please run with --help" << std::endl;
             return 1;
         }
+
+        launcherDir = (vm.count("launcher-dir")) ? vm["launcher-dir"].as<std::string>() : _get_default_launcher_dir();
+
+        if (vm.count("trace"))
+        {
+            traceFile = vm["trace"].as<std::string>();
+            menphina::trace_enable();
+        }
     }
     catch(const std::exception& e)
     {
@@ -146,18 +294,37 @@ int main(int argc, char ** argv)
         return 1;
     }
 
-    // TODO: The null check isnt needed once all execs are built.
-    if (exec)
+    int ret = 0;
+    menphina::json_cache_enable(_get_json_cache_file());
+
+    try
     {
-        const std::string appConfigFile = _get_config_file();
-        exec->run(appConfigFile);
-        delete exec;
+        menphina::TraceSpan span(menphina::trace_category::RUN, mode.c_str());
+        exec->run(launcherDir);
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        ret = 1;
     }
 
-    glz::json_t x {};
-    const std::string appConfigFile = _get_config_file();
-    std::cout << "Attempting to load " << appConfigFile << std::endl;
-    menphina::read_generic_json_file(x, appConfigFile);
+    exec.reset();
+
+    menphina::json_cache_save(std::cerr);
+
+    // A trace of a failed run is the most interesting kind.
+    if (!traceFile.empty())
+    {
+        try
+        {
+            menphina::trace_write(traceFile, std::cerr);
+        }
+        catch(const std::exception& e)
+        {
+            std::cerr << e.what() << std::endl;
+            ret = 1;
+        }
+    }
 
-    return 0;
+    return ret;
 }
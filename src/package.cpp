@@ -0,0 +1,731 @@
+/* Copyright 2024 isaki */
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+
+#include "menphina/fileio.hpp"
+#include "menphina/hash.hpp"
+#include "menphina/json.hpp"
+#include "menphina/m_exception.hpp"
+#include "menphina/package.hpp"
+#include "menphina/parallel.hpp"
+#include "menphina/penumbra.hpp"
+#include "menphina/platform.hpp"
+#include "menphina/scan.hpp"
+#include "menphina/trace.hpp"
+#include "menphina/xmpkg.hpp"
+
+namespace
+{
+    struct package_source_t
+    {
+        // Both relative to the ModDirectory; path is "<mod>/<file path>".
+        std::string path;
+        size_t mod_length;
+        uint64_t size;
+        int64_t mtime_ns;
+
+        inline std::string_view mod() const
+        {
+            return std::string_view(path).substr(0, mod_length);
+        }
+
+        inline std::string_view file() const
+        {
+            return std::string_view(path).substr(mod_length + 1);
+        }
+    };
+
+    // Reading is bound by the disk more than the core count.
+    inline constexpr unsigned MAX_DEFAULT_READ_THREADS = 4;
+
+    // Chunks in flight per pipeline thread.
+    inline constexpr size_t CHUNKS_PER_THREAD = 2;
+
+    // Manifest entries keyed the same way as package_source_t::path.
+    using manifest_index_t = std::unordered_map<std::string, const menphina::package_manifest_file_t *>;
+
+    // Every regular file below a mod directory, sorted so the package layout
+    // does not depend on directory order or scan thread count.
+    std::vector<package_source_t> _collect_sources(const menphina::ScanResult& scan)
+    {
+        std::vector<package_source_t> ret;
+        ret.reserve(scan.stats().files);
+
+        std::string rel;
+        for (size_t i = 0; i < scan.size(); ++i)
+        {
+            const menphina::scan_entry_t& e = scan[i];
+
+            // Depth 1 is the mod directory itself; loose files next to the
+            // mods are not part of any mod.
+            if (e.type != menphina::EntryType::File || e.depth < 2)
+            {
+                continue;
+            }
+
+            scan.relative_path(i, rel);
+
+            // Deploy refuses names that could lead out of the mod directory,
+            // which includes a few that are legal here (a backslash).
+            if (!menphina::path_is_contained(rel))
+            {
+                std::cerr << "warning: not packaging " << rel << ": the name cannot be deployed safely" << std::endl;
+                continue;
+            }
+
+            ret.push_back(package_source_t { rel, rel.find('/'), e.size, e.mtime_ns });
+        }
+
+        std::sort(ret.begin(), ret.end(), [](const package_source_t& a, const package_source_t& b) {
+            return std::make_tuple(a.mod(), a.file()) < std::make_tuple(b.mod(), b.file());
+        });
+
+        return ret;
+    }
+
+    // Loads the manifest of the previous run, provided it describes the
+    // package that is still on disk. Anything else means a full rebuild.
+    bool _load_manifest(const std::string& manifestFile, const std::string& packageFile, menphina::package_manifest_t& out)
+    {
+        menphina::file_stat_t st;
+        if (!menphina::path_exists(manifestFile) || !menphina::try_stat(packageFile, st))
+        {
+            return false;
+        }
+
+        try
+        {
+            menphina::read_json_file(out, manifestFile);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "warning: ignoring package manifest: " << e.what() << std::endl;
+            return false;
+        }
+
+        return out.Package == packageFile && out.PackageSize == st.size && out.PackageMTime == st.mtime_ns;
+    }
+
+    manifest_index_t _index_manifest(const menphina::package_manifest_t& manifest)
+    {
+        manifest_index_t ret;
+        for (const auto& mod : manifest.Mods)
+        {
+            for (const auto& file : mod.Files)
+            {
+                ret.emplace(mod.Name + '/' + file.Path, &file);
+            }
+        }
+
+        return ret;
+    }
+
+    bool _unchanged(const package_source_t& src, const manifest_index_t& index)
+    {
+        const auto it = index.find(src.path);
+        return it != index.end() && it->second->Size == src.size && it->second->MTime == src.mtime_ns;
+    }
+
+    menphina::package_manifest_t _build_manifest(const std::string& packageFile)
+    {
+        const menphina::XmpkgReader reader(packageFile);
+
+        menphina::file_stat_t st;
+        menphina::try_stat(packageFile, st);
+
+        menphina::package_manifest_t ret {
+            .Package = packageFile,
+            .PackageSize = st.size,
+            .PackageMTime = st.mtime_ns,
+            .Mods = {}
+        };
+
+        ret.Mods.reserve(reader.mods().size());
+        for (const auto& mod : reader.mods())
+        {
+            menphina::package_manifest_mod_t& m = ret.Mods.emplace_back();
+            m.Name = reader.name(mod);
+
+            const auto files = reader.files(mod);
+            m.Files.reserve(files.size());
+            for (const auto& file : files)
+            {
+                m.Files.push_back(menphina::package_manifest_file_t {
+                    .Path = std::string(reader.path(file)),
+                    .Size = file.size,
+                    .MTime = file.mtime_ns,
+                    .Hash = menphina::content_hash_t { file.hash_lo, file.hash_hi }.hex()
+                });
+            }
+        }
+
+        return ret;
+    }
+
+    struct pipeline_threads_t
+    {
+        unsigned read;
+        unsigned hash;
+        unsigned compress;
+    };
+
+    pipeline_threads_t _resolve_threads(const menphina::package_options_t& options)
+    {
+        const unsigned cores = menphina::resolve_thread_count(0);
+
+        return pipeline_threads_t {
+            .read = (options.read_threads != 0) ? options.read_threads : std::min(cores, MAX_DEFAULT_READ_THREADS),
+            .hash = (options.hash_threads != 0) ? options.hash_threads : std::max(1u, cores / 4),
+            .compress = (options.compression_level == 0) ? 0 : menphina::resolve_thread_count(options.compress_threads)
+        };
+    }
+
+    // One chunk of a source file on its way from a reader to the writer.
+    struct chunk_job_t
+    {
+        size_t file = 0;
+        uint32_t chunk = 0;
+        uint32_t length = 0;
+
+        // The last chunk of its file carries the hash of the whole file.
+        bool last = false;
+
+        // The file is this one chunk, so its hash is the chunk's.
+        bool single = false;
+
+        // Already in the package; nothing to encode.
+        bool duplicate = false;
+
+        std::unique_ptr<char[]> raw;
+        menphina::content_hash_t hash;
+        menphina::content_hash_t fileHash;
+        menphina::ChunkCodec codec = menphina::ChunkCodec::Store;
+        std::vector<char> encoded;
+
+        inline const char * stored_data() const
+        {
+            return (codec == menphina::ChunkCodec::Store) ? raw.get() : encoded.data();
+        }
+
+        inline uint32_t stored_size() const
+        {
+            return (codec == menphina::ChunkCodec::Store) ? length : static_cast<uint32_t>(encoded.size());
+        }
+    };
+
+    using chunk_job_ptr = std::unique_ptr<chunk_job_t>;
+
+    /*
+        Reads, hashes and encodes the files to be packaged ahead of the
+        writer, each stage on its own threads, connected by bounded queues.
+        The writer takes the chunks back in file order, so the package is the
+        same whatever the thread counts.
+
+        Chunks come out of a fixed budget that the writer refills as it
+        stores them, which is what bounds memory. The file the writer is
+        waiting on may always have a chunk, so readers that are far ahead
+        can never starve it.
+    */
+    class PackagePipeline final
+    {
+        public:
+            PackagePipeline(const std::string& modDir, const std::vector<const package_source_t *>& files, const pipeline_threads_t& threads, const int level) :
+                m_modDir(modDir),
+                m_files(files),
+                m_level(level),
+                m_budget(CHUNKS_PER_THREAD * (threads.read + threads.hash + threads.compress)),
+                m_toHash(m_budget),
+                m_toCompress(m_budget),
+                m_nextFile(0),
+                m_readers(threads.read),
+                m_hashers(threads.hash),
+                m_inFlight(0),
+                m_writerFile(0),
+                m_aborted(false)
+            {
+                try
+                {
+                    for (unsigned i = 0; i < threads.read; ++i)
+                    {
+                        m_threads.emplace_back([this]() { stage([this]() { read(); }); });
+                    }
+
+                    for (unsigned i = 0; i < threads.hash; ++i)
+                    {
+                        m_threads.emplace_back([this]() { stage([this]() { hash(); }); });
+                    }
+
+                    for (unsigned i = 0; i < threads.compress; ++i)
+                    {
+                        m_threads.emplace_back([this]() { stage([this]() { compress(); }); });
+                    }
+                }
+                catch (...)
+                {
+                    fail(std::current_exception());
+                    join();
+                    throw;
+                }
+            }
+
+            ~PackagePipeline()
+            {
+                fail(nullptr);
+                join();
+            }
+
+            PackagePipeline(const PackagePipeline&) = delete;
+            PackagePipeline& operator=(const PackagePipeline&) = delete;
+
+            // The writer has moved on to file.
+            void advance(const size_t file)
+            {
+                const std::lock_guard<std::mutex> guard(m_budgetLock);
+                m_writerFile = file;
+                m_budgetFreed.notify_all();
+            }
+
+            // Chunk of file, once it is through the pipeline. Rethrows what
+            // a stage failed with.
+            chunk_job_ptr take(const size_t file, const uint32_t chunk)
+            {
+                std::unique_lock<std::mutex> lock(m_doneLock);
+                m_doneReady.wait(lock, [this, file, chunk]() { return m_error || m_aborted || m_done.contains({ file, chunk }); });
+
+                if (m_error)
+                {
+                    std::rethrow_exception(m_error);
+                }
+
+                const auto found = m_done.find({ file, chunk });
+                if (found == m_done.end())
+                {
+                    throw std::logic_error("package pipeline stopped");
+                }
+
+                chunk_job_ptr ret = std::move(found->second);
+                m_done.erase(found);
+                return ret;
+            }
+
+            // The writer is done with job; hash is in the package from now on.
+            void release(chunk_job_ptr job)
+            {
+                if (job->length != 0)
+                {
+                    const std::lock_guard<std::mutex> guard(m_storedLock);
+                    m_stored.insert(job->hash);
+                }
+
+                const std::lock_guard<std::mutex> guard(m_budgetLock);
+                --m_inFlight;
+                m_free.push_back(std::move(job));
+                m_budgetFreed.notify_all();
+            }
+
+        private:
+            const std::string& m_modDir;
+            const std::vector<const package_source_t *>& m_files;
+            const int m_level;
+            const size_t m_budget;
+
+            menphina::BoundedQueue<chunk_job_ptr> m_toHash;
+            menphina::BoundedQueue<chunk_job_ptr> m_toCompress;
+            std::atomic<size_t> m_nextFile;
+            std::atomic<unsigned> m_readers;
+            std::atomic<unsigned> m_hashers;
+
+            std::mutex m_budgetLock;
+            std::condition_variable m_budgetFreed;
+            std::vector<chunk_job_ptr> m_free;
+            size_t m_inFlight;
+            size_t m_writerFile;
+
+            std::mutex m_doneLock;
+            std::condition_variable m_doneReady;
+            std::map<std::pair<size_t, uint32_t>, chunk_job_ptr> m_done;
+            std::exception_ptr m_error;
+            std::atomic<bool> m_aborted;
+
+            std::mutex m_storedLock;
+            std::unordered_set<menphina::content_hash_t, menphina::content_hash_hasher> m_stored;
+
+            std::vector<std::thread> m_threads;
+
+            template<class Fn>
+            void stage(const Fn& fn)
+            {
+                try
+                {
+                    fn();
+                }
+                catch (...)
+                {
+                    fail(std::current_exception());
+                }
+            }
+
+            // Stops every stage; error (if any) goes to the writer.
+            void fail(const std::exception_ptr& error)
+            {
+                {
+                    const std::lock_guard<std::mutex> guard(m_doneLock);
+                    if (error && !m_error)
+                    {
+                        m_error = error;
+                    }
+
+                    m_aborted = true;
+                    m_doneReady.notify_all();
+                }
+
+                {
+                    const std::lock_guard<std::mutex> guard(m_budgetLock);
+                    m_budgetFreed.notify_all();
+                }
+
+                m_toHash.close();
+                m_toCompress.close();
+            }
+
+            void join()
+            {
+                for (std::thread& t : m_threads)
+                {
+                    t.join();
+                }
+
+                m_threads.clear();
+            }
+
+            // A job for a chunk of file; null once the pipeline is stopping.
+            chunk_job_ptr acquire(const size_t file)
+            {
+                std::unique_lock<std::mutex> lock(m_budgetLock);
+                m_budgetFreed.wait(lock, [this, file]() { return m_aborted || m_inFlight < m_budget || file <= m_writerFile; });
+
+                if (m_aborted)
+                {
+                    return nullptr;
+                }
+
+                ++m_inFlight;
+                if (m_free.empty())
+                {
+                    lock.unlock();
+
+                    chunk_job_ptr ret = std::make_unique<chunk_job_t>();
+
+                    // Not value initialized; pages are only touched as they
+                    // are read into.
+                    ret->raw.reset(new char[menphina::XMPKG_CHUNK_SIZE]);
+                    return ret;
+                }
+
+                chunk_job_ptr ret = std::move(m_free.back());
+                m_free.pop_back();
+                return ret;
+            }
+
+            void done(chunk_job_ptr job)
+            {
+                const std::lock_guard<std::mutex> guard(m_doneLock);
+                m_done.emplace(std::make_pair(job->file, job->chunk), std::move(job));
+                m_doneReady.notify_all();
+            }
+
+            void read()
+            {
+                std::string full;
+
+                for (size_t f = m_nextFile++; f < m_files.size() && !m_aborted; f = m_nextFile++)
+                {
+                    const package_source_t& src = *m_files[f];
+
+                    full.assign(m_modDir);
+                    menphina::path_append(full, src.path);
+                    const int fd = open(full.c_str(), O_RDONLY | O_CLOEXEC);
+                    if (fd == -1)
+                    {
+                        throw menphina::file_open_exception(full, true);
+                    }
+
+                    const menphina::UniqueFd guard(fd);
+
+                    menphina::ContentHasher fileHash;
+                    for (uint32_t chunk = 0;; ++chunk)
+                    {
+                        chunk_job_ptr job = acquire(f);
+                        if (!job)
+                        {
+                            return;
+                        }
+
+                        {
+                            menphina::TraceSpan span(menphina::trace_category::READ, "file.read");
+                            job->length = static_cast<uint32_t>(menphina::read_full(fd, job->raw.get(), menphina::XMPKG_CHUNK_SIZE, full));
+                            span.add_bytes(job->length);
+                            span.add_files((chunk == 0) ? 1 : 0);
+                        }
+
+                        job->file = f;
+                        job->chunk = chunk;
+                        job->last = job->length < menphina::XMPKG_CHUNK_SIZE;
+                        job->single = chunk == 0 && job->last;
+                        job->duplicate = false;
+
+                        // Files of more than one chunk are hashed as they are
+                        // read, since that has to go in order.
+                        if (!job->single)
+                        {
+                            menphina::TraceSpan span(menphina::trace_category::HASH, "file.hash");
+                            span.add_bytes(job->length);
+                            fileHash.update(job->raw.get(), job->length);
+
+                            if (job->last)
+                            {
+                                job->fileHash = fileHash.finish();
+                            }
+                        }
+
+                        const bool last = job->last;
+                        if (!m_toHash.push(std::move(job)) || last)
+                        {
+                            break;
+                        }
+                    }
+                }
+
+                if (--m_readers == 0)
+                {
+                    m_toHash.close();
+                }
+            }
+
+            void hash()
+            {
+                chunk_job_ptr job;
+                while (m_toHash.pop(job) && !m_aborted)
+                {
+                    if (job->length != 0 || job->single)
+                    {
+                        menphina::TraceSpan span(menphina::trace_category::HASH, "chunk.hash");
+                        span.add_bytes(job->length);
+                        job->hash = menphina::content_hash(job->raw.get(), job->length);
+                    }
+
+                    if (job->single)
+                    {
+                        job->fileHash = job->hash;
+                    }
+
+                    if (job->length != 0)
+                    {
+                        const std::lock_guard<std::mutex> guard(m_storedLock);
+                        job->duplicate = m_stored.contains(job->hash);
+                    }
+
+                    job->codec = menphina::ChunkCodec::Store;
+                    job->encoded.clear();
+
+                    if (m_level != 0 && job->length != 0 && !job->duplicate)
+                    {
+                        m_toCompress.push(std::move(job));
+                    }
+                    else
+                    {
+                        done(std::move(job));
+                    }
+                }
+
+                if (--m_hashers == 0)
+                {
+                    m_toCompress.close();
+                }
+            }
+
+            void compress()
+            {
+                chunk_job_ptr job;
+                while (m_toCompress.pop(job) && !m_aborted)
+                {
+                    job->codec = menphina::xmpkg_encode_chunk(job->raw.get(), job->length, m_level, job->encoded);
+                    done(std::move(job));
+                }
+            }
+    };
+
+    void _print_stats(const menphina::xmpkg_write_stats_t& stats, const uint64_t changedMods, const std::string& file)
+    {
+        std::cout << "Packaged " << stats.files << " files from "
+            << stats.mods << " mods (" << changedMods << " changed) into " << file << ": "
+            << stats.raw_bytes << " bytes of content ("
+            << stats.reused_files << " files, " << stats.reused_bytes << " bytes reused), "
+            << stats.stored_bytes << " bytes stored in "
+            << stats.chunks << " chunks ("
+            << stats.duplicate_chunks << " duplicate chunks skipped)"
+            << std::endl;
+    }
+}
+
+menphina::Package::Package(const std::string& packageFile, const std::string& manifestFile, const package_options_t& options) :
+    m_packageFile(packageFile),
+    m_manifestFile(manifestFile),
+    m_options(options)
+{
+}
+
+menphina::Package::~Package() {}
+
+void menphina::Package::run(const std::string_view& launcherDir)
+{
+    penumbra_config_t config {};
+    read_json_file(config, get_penumbra_config_file(launcherDir));
+
+    const std::string modDir = native_path(config.ModDirectory);
+
+    report_progress("scan", 0, 0);
+
+    const DirectoryScanner scanner;
+    const ScanResult scan = scanner.scan(modDir);
+    const std::vector<package_source_t> sources = _collect_sources(scan);
+
+    check_cancelled();
+
+    package_manifest_t previous {};
+    manifest_index_t index;
+    std::unique_ptr<XmpkgReader> old;
+
+    if (_load_manifest(m_manifestFile, m_packageFile, previous))
+    {
+        index = _index_manifest(previous);
+
+        const bool upToDate = index.size() == sources.size()
+            && std::all_of(sources.begin(), sources.end(), [&index](const package_source_t& src) { return _unchanged(src, index); });
+
+        if (upToDate)
+        {
+            std::cout << m_packageFile << " is up to date (" << sources.size() << " files)" << std::endl;
+            return;
+        }
+
+        old = std::make_unique<XmpkgReader>(m_packageFile);
+    }
+
+    // Unchanged files are copied out of the previous package as stored
+    // chunks, without touching the source file; everything else goes
+    // through the pipeline.
+    std::vector<const xmpkg_file_t *> reused(sources.size(), nullptr);
+    std::vector<const package_source_t *> toRead;
+
+    for (size_t i = 0; i < sources.size(); ++i)
+    {
+        const package_source_t& src = sources[i];
+        const xmpkg_mod_t * oldMod = (old && _unchanged(src, index)) ? old->find_mod(src.mod()) : nullptr;
+        const xmpkg_file_t * oldFile = (oldMod != nullptr) ? old->find_file(*oldMod, src.file()) : nullptr;
+
+        if (oldFile != nullptr && oldFile->size == src.size && oldFile->mtime_ns == src.mtime_ns)
+        {
+            reused[i] = oldFile;
+        }
+        else
+        {
+            toRead.push_back(&src);
+        }
+    }
+
+    XmpkgWriter writer(m_packageFile);
+
+    const pipeline_threads_t threads = _resolve_threads(m_options);
+    PackagePipeline pipeline(modDir, toRead, threads, m_options.compression_level);
+
+    std::string_view currentMod {};
+    bool modChanged = false;
+    uint64_t changedMods = 0;
+    uint64_t done = 0;
+    size_t readIndex = 0;
+
+    for (size_t i = 0; i < sources.size(); ++i)
+    {
+        const package_source_t& src = sources[i];
+
+        // The writer only renames the package into place in finish(), so a
+        // cancelled run leaves the previous package untouched.
+        check_cancelled();
+        report_progress("package", done++, sources.size());
+        if (src.mod() != currentMod)
+        {
+            currentMod = src.mod();
+            writer.begin_mod(currentMod);
+            modChanged = false;
+        }
+
+        if (reused[i] != nullptr)
+        {
+            writer.add_reused_file(*old, *reused[i]);
+            continue;
+        }
+
+        if (!modChanged)
+        {
+            modChanged = true;
+            ++changedMods;
+        }
+
+        pipeline.advance(readIndex);
+        writer.begin_file(src.file(), src.mtime_ns);
+
+        for (uint32_t chunk = 0;; ++chunk)
+        {
+            chunk_job_ptr job = pipeline.take(readIndex, chunk);
+            if (job->length != 0)
+            {
+                writer.add_encoded_chunk(job->hash, (job->duplicate) ? nullptr : job->stored_data(), job->stored_size(), job->length, job->codec);
+            }
+
+            const bool last = job->last;
+            if (last)
+            {
+                writer.end_file(job->fileHash);
+            }
+
+            pipeline.release(std::move(job));
+            if (last)
+            {
+                break;
+            }
+        }
+
+        ++readIndex;
+    }
+
+    check_cancelled();
+    report_progress("package", done, sources.size());
+
+    writer.finish();
+    _print_stats(writer.stats(), changedMods, m_packageFile);
+
+    if (!toRead.empty())
+    {
+        std::cout << "Pipeline: " << threads.read << " read, " << threads.hash << " hash, " << threads.compress << " compress threads" << std::endl;
+    }
+
+    write_json_file(_build_manifest(m_packageFile), m_manifestFile);
+}
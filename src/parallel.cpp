@@ -0,0 +1,79 @@
+/* Copyright 2024 isaki */
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "menphina/parallel.hpp"
+
+unsigned menphina::resolve_thread_count(const unsigned requested)
+{
+    return (requested != 0) ? requested : std::max(1u, std::thread::hardware_concurrency());
+}
+
+void menphina::parallel_for(const size_t count, const unsigned threads, const std::function<void(size_t, unsigned)>& fn)
+{
+    const unsigned workers = static_cast<unsigned>(std::min<size_t>(resolve_thread_count(threads), std::max<size_t>(count, 1)));
+
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    std::mutex errorLock;
+    std::exception_ptr error;
+
+    const auto body = [&](const unsigned worker) {
+        try
+        {
+            for (size_t i = next.fetch_add(1, std::memory_order_relaxed); i < count; i = next.fetch_add(1, std::memory_order_relaxed))
+            {
+                if (failed.load(std::memory_order_relaxed))
+                {
+                    break;
+                }
+
+                fn(i, worker);
+            }
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> guard(errorLock);
+            if (!error)
+            {
+                error = std::current_exception();
+            }
+
+            failed.store(true, std::memory_order_relaxed);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    pool.reserve(workers - 1);
+    for (unsigned w = 1; w < workers; ++w)
+    {
+        // Out of threads (EAGAIN) or memory: the workers already running
+        // and this thread share the remaining work instead.
+        try
+        {
+            pool.emplace_back(body, w);
+        }
+        catch (...)
+        {
+            break;
+        }
+    }
+
+    body(0);
+
+    for (auto& t : pool)
+    {
+        t.join();
+    }
+
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+}
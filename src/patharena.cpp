@@ -0,0 +1,327 @@
+/* Copyright 2024 isaki */
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "menphina/patharena.hpp"
+
+namespace
+{
+    inline constexpr uint32_t FREE_SLOT = 0;
+    inline constexpr size_t MIN_TABLE_SIZE = 64;
+    inline constexpr uint32_t MAX_ID = std::numeric_limits<uint32_t>::max() - 1;
+
+    inline size_t _component_hash(const std::string_view name)
+    {
+        return std::hash<std::string_view> {}(name);
+    }
+
+    // A multiply and fold is enough to spread (parent, component) pairs,
+    // which are small dense integers.
+    inline size_t _node_hash(const menphina::path_id parent, const uint32_t component)
+    {
+        const uint64_t key = (static_cast<uint64_t>(parent) << 32) | component;
+        const uint64_t mixed = key * 0x9E3779B97F4A7C15ull;
+        return static_cast<size_t>(mixed ^ (mixed >> 29));
+    }
+
+    // Tables are kept at most 3/4 full.
+    inline size_t _table_size_for(const size_t count)
+    {
+        return std::bit_ceil(std::max(MIN_TABLE_SIZE, count + count / 3 + 1));
+    }
+
+    inline bool _over_load(const size_t count, const size_t tableSize)
+    {
+        return count * 4 >= tableSize * 3;
+    }
+}
+
+menphina::PathArena::PathArena()
+{
+    m_componentTable.assign(MIN_TABLE_SIZE, FREE_SLOT);
+    m_nodeTable.assign(MIN_TABLE_SIZE, FREE_SLOT);
+
+    // The root: the empty name, its own parent. It is not in the node
+    // table; nothing is looked up by its name.
+    m_components.push_back(component_t { 0, 0 });
+    m_componentTable[_component_hash({}) & (m_componentTable.size() - 1)] = 1;
+    m_nodes.push_back(node_t { ROOT_PATH, 0 });
+}
+
+menphina::PathArena::~PathArena() {}
+
+menphina::PathArena::PathArena(PathArena&&) noexcept = default;
+
+menphina::PathArena& menphina::PathArena::operator=(PathArena&&) noexcept = default;
+
+void menphina::PathArena::reserve(const size_t nodes)
+{
+    m_nodes.reserve(nodes);
+    if (_table_size_for(nodes) > m_nodeTable.size())
+    {
+        grow_nodes(nodes);
+    }
+}
+
+menphina::path_id menphina::PathArena::intern(const path_id parent, const std::string_view name)
+{
+    const uint32_t component = component_of(name);
+
+    const path_id found = find_node(parent, component);
+    if (found != NO_PATH)
+    {
+        return found;
+    }
+
+    if (m_nodes.size() > MAX_ID) [[unlikely]]
+    {
+        throw std::runtime_error("path arena exceeds the supported number of paths");
+    }
+
+    const path_id id = static_cast<path_id>(m_nodes.size());
+    m_nodes.push_back(node_t { parent, component });
+    insert_node(id);
+    return id;
+}
+
+menphina::path_id menphina::PathArena::add(const path_id parent, const std::string_view name)
+{
+    if (m_nodes.size() > MAX_ID) [[unlikely]]
+    {
+        throw std::runtime_error("path arena exceeds the supported number of paths");
+    }
+
+    const path_id id = static_cast<path_id>(m_nodes.size());
+    m_nodes.push_back(node_t { parent, component_of(name) });
+    insert_node(id);
+    return id;
+}
+
+menphina::path_id menphina::PathArena::find(const path_id parent, const std::string_view name) const
+{
+    const uint32_t component = find_component(name);
+    return (component == NO_PATH) ? NO_PATH : find_node(parent, component);
+}
+
+menphina::path_id menphina::PathArena::intern_path(const std::string_view path)
+{
+    path_id cur = ROOT_PATH;
+
+    size_t start = 0;
+    while (start <= path.size())
+    {
+        const size_t slash = std::min(path.find('/', start), path.size());
+        if (slash != start)
+        {
+            cur = intern(cur, path.substr(start, slash - start));
+        }
+
+        start = slash + 1;
+    }
+
+    return cur;
+}
+
+menphina::path_id menphina::PathArena::find_path(const std::string_view path) const
+{
+    path_id cur = ROOT_PATH;
+
+    size_t start = 0;
+    while (start <= path.size() && cur != NO_PATH)
+    {
+        const size_t slash = std::min(path.find('/', start), path.size());
+        if (slash != start)
+        {
+            cur = find(cur, path.substr(start, slash - start));
+        }
+
+        start = slash + 1;
+    }
+
+    return cur;
+}
+
+void menphina::PathArena::path(const path_id id, std::string& out) const
+{
+    out.clear();
+
+    // Walk up once to size the buffer, then fill it from the back.
+    size_t length = 0;
+    size_t components = 0;
+    for (path_id cur = id; cur != ROOT_PATH; cur = m_nodes[cur].parent)
+    {
+        length += m_components[m_nodes[cur].component].length;
+        ++components;
+    }
+
+    if (components == 0)
+    {
+        return;
+    }
+
+    out.resize(length + components - 1);
+
+    size_t pos = out.size();
+    for (path_id cur = id; cur != ROOT_PATH; cur = m_nodes[cur].parent)
+    {
+        const component_t& c = m_components[m_nodes[cur].component];
+        pos -= c.length;
+        std::memcpy(out.data() + pos, m_names.data() + c.offset, c.length);
+
+        if (pos != 0)
+        {
+            out[--pos] = '/';
+        }
+    }
+}
+
+std::string menphina::PathArena::path(const path_id id) const
+{
+    std::string ret;
+    path(id, ret);
+    return ret;
+}
+
+size_t menphina::PathArena::memory_usage() const
+{
+    return m_names.capacity()
+        + m_components.capacity() * sizeof(component_t)
+        + m_nodes.capacity() * sizeof(node_t)
+        + (m_componentTable.capacity() + m_nodeTable.capacity()) * sizeof(uint32_t);
+}
+
+uint32_t menphina::PathArena::component_of(const std::string_view name)
+{
+    const size_t mask = m_componentTable.size() - 1;
+    size_t slot = _component_hash(name) & mask;
+
+    for (; m_componentTable[slot] != FREE_SLOT; slot = (slot + 1) & mask)
+    {
+        const component_t& c = m_components[m_componentTable[slot] - 1];
+        if (std::string_view(m_names.data() + c.offset, c.length) == name)
+        {
+            return m_componentTable[slot] - 1;
+        }
+    }
+
+    if (m_names.size() + name.size() > MAX_ID || m_components.size() > MAX_ID) [[unlikely]]
+    {
+        throw std::runtime_error("path arena exceeds the supported name length");
+    }
+
+    const uint32_t id = static_cast<uint32_t>(m_components.size());
+    m_components.push_back(component_t { static_cast<uint32_t>(m_names.size()), static_cast<uint32_t>(name.size()) });
+    m_names.append(name);
+    m_componentTable[slot] = id + 1;
+
+    if (_over_load(m_components.size(), m_componentTable.size()))
+    {
+        grow_components();
+    }
+
+    return id;
+}
+
+uint32_t menphina::PathArena::find_component(const std::string_view name) const
+{
+    const size_t mask = m_componentTable.size() - 1;
+
+    for (size_t slot = _component_hash(name) & mask; m_componentTable[slot] != FREE_SLOT; slot = (slot + 1) & mask)
+    {
+        const component_t& c = m_components[m_componentTable[slot] - 1];
+        if (std::string_view(m_names.data() + c.offset, c.length) == name)
+        {
+            return m_componentTable[slot] - 1;
+        }
+    }
+
+    return NO_PATH;
+}
+
+menphina::path_id menphina::PathArena::find_node(const path_id parent, const uint32_t component) const
+{
+    const size_t mask = m_nodeTable.size() - 1;
+
+    for (size_t slot = _node_hash(parent, component) & mask; m_nodeTable[slot] != FREE_SLOT; slot = (slot + 1) & mask)
+    {
+        const node_t& n = m_nodes[m_nodeTable[slot] - 1];
+        if (n.parent == parent && n.component == component)
+        {
+            return m_nodeTable[slot] - 1;
+        }
+    }
+
+    return NO_PATH;
+}
+
+void menphina::PathArena::insert_node(const path_id id)
+{
+    // The root is not in the table, hence the - 1. Growing rehashes every
+    // node, this one included.
+    if (_over_load(m_nodes.size() - 1, m_nodeTable.size()))
+    {
+        grow_nodes(m_nodes.size());
+        return;
+    }
+
+    const node_t& n = m_nodes[id];
+    const size_t mask = m_nodeTable.size() - 1;
+
+    size_t slot = _node_hash(n.parent, n.component) & mask;
+    while (m_nodeTable[slot] != FREE_SLOT)
+    {
+        slot = (slot + 1) & mask;
+    }
+
+    m_nodeTable[slot] = id + 1;
+}
+
+void menphina::PathArena::grow_components()
+{
+    std::vector<uint32_t> table(m_componentTable.size() * 2, FREE_SLOT);
+    const size_t mask = table.size() - 1;
+
+    for (uint32_t id = 0; id < m_components.size(); ++id)
+    {
+        const component_t& c = m_components[id];
+        size_t slot = _component_hash(std::string_view(m_names.data() + c.offset, c.length)) & mask;
+        while (table[slot] != FREE_SLOT)
+        {
+            slot = (slot + 1) & mask;
+        }
+
+        table[slot] = id + 1;
+    }
+
+    m_componentTable = std::move(table);
+}
+
+void menphina::PathArena::grow_nodes(const size_t nodes)
+{
+    std::vector<uint32_t> table(std::max(_table_size_for(nodes), m_nodeTable.size() * 2), FREE_SLOT);
+    const size_t mask = table.size() - 1;
+
+    // Nodes that are already in are rehashed in id order, so the first of
+    // two equal nodes (see add()) keeps coming up first.
+    for (path_id id = 1; id < m_nodes.size(); ++id)
+    {
+        const node_t& n = m_nodes[id];
+        size_t slot = _node_hash(n.parent, n.component) & mask;
+        while (table[slot] != FREE_SLOT)
+        {
+            slot = (slot + 1) & mask;
+        }
+
+        table[slot] = id + 1;
+    }
+
+    m_nodeTable = std::move(table);
+}
@@ -0,0 +1,36 @@
+/* Copyright 2024 isaki */
+
+#include <string>
+#include <string_view>
+
+#include "menphina/platform.hpp"
+#include "menphina/penumbra.hpp"
+
+namespace
+{
+    const std::string PLUGIN_CONFIG_DIR_NAME { "pluginConfigs" };
+    const std::string PENUMBRA_NAME { "Penumbra" };
+    const std::string PENUMBRA_CONFIG_NAME { "Penumbra.json" };
+    const std::string SORT_ORDER_NAME { "sort_order.json" };
+    const std::string COLLECTIONS_DIR_NAME { "collections" };
+}
+
+std::string menphina::get_penumbra_config_file(const std::string_view launcherDir)
+{
+    return menphina::path_join(menphina::path_join(launcherDir, PLUGIN_CONFIG_DIR_NAME), PENUMBRA_CONFIG_NAME);
+}
+
+std::string menphina::get_penumbra_config_dir(const std::string_view launcherDir)
+{
+    return menphina::path_join(menphina::path_join(launcherDir, PLUGIN_CONFIG_DIR_NAME), PENUMBRA_NAME);
+}
+
+std::string menphina::get_penumbra_sort_order_file(const std::string_view launcherDir)
+{
+    return menphina::path_join(get_penumbra_config_dir(launcherDir), SORT_ORDER_NAME);
+}
+
+std::string menphina::get_penumbra_collections_dir(const std::string_view launcherDir)
+{
+    return menphina::path_join(get_penumbra_config_dir(launcherDir), COLLECTIONS_DIR_NAME);
+}
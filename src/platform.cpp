@@ -12,9 +12,17 @@
 #include <fstream>
 #include <cstdio>
 #include <cstring>
+#include <fcntl.h>
+#include <sys/utsname.h>
 #include <sys/wait.h>
 #include <memory>
 #include <cctype>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "menphina/fileio.hpp"
 #endif
 
 #include "menphina/m_exception.hpp"
@@ -35,9 +43,6 @@ namespace
 #error "Unsupported platform; no launcher path defined."
 #endif
 
-    // Sub directory for plugins.
-    //const std::string PLUGIN_CONFIG_DIR_NAME = "pluginConfigs";
-
 #if defined ( _WIN32 )
     // While this is not targetting Windows for the first release, windows suppose is planned.
     const std::string HOME_VAR_NAME { "USERPROFILE" };
@@ -46,8 +51,14 @@ namespace
 #endif
 
 #if defined ( __linux__ )
-    const std::string PROC_VERSION { "/proc/version" };
     const std::string WSL_VERSION_STRING { "microsoft" };
+    const std::string BOOT_ID_FILE { "/proc/sys/kernel/random/boot_id" };
+    const std::string WIN_CMD_PATH { "/mnt/c/Windows/system32/cmd.exe" };
+
+    const std::string XDG_CACHE_VAR_NAME { "XDG_CACHE_HOME" };
+    const std::string CACHE_DIR_NAME { "menphina" };
+    const std::string WIN_ENV_CACHE_NAME { "winenv" };
+    const std::string WIN_ENV_CACHE_HEADER { "menphina-winenv 1" };
 
     const std::string WSL_HOME_VAR_NAME { "USERPROFILE" };
 
@@ -61,6 +72,7 @@ namespace
     inline constexpr size_t WIN_LINE_END_LENGTH = 2;
     inline constexpr size_t WIN_ENV_DATA_LENGTH = 32767;
     inline constexpr size_t WIN_ENV_READ_BUFFER_LENGTH = WIN_ENV_DATA_LENGTH + WIN_LINE_END_LENGTH;
+    inline constexpr size_t WIN_ENV_READ_CHUNK_LENGTH = 4096;
     
     // C++ likes RAII
     class IOPipe final
@@ -110,23 +122,47 @@ namespace
 
     menphina::Platform _get_linux_platform()
     {
-        std::ifstream in(PROC_VERSION);
-        if (!in)
+        // The kernel release carries the same marker as /proc/version
+        // ("-microsoft-standard-WSL2", or "-Microsoft" on WSL 1) and uname
+        // does not need to touch the filesystem.
+        struct utsname u;
+        if (uname(&u) != 0)
         {
-            throw menphina::file_open_exception(PROC_VERSION, true);
+            const int err = errno;
+            throw menphina::errno_exception("uname failed", err);
         }
 
-        std::string line;
-        if (!std::getline(in, line))
+        std::string release(u.release);
+        for (char& c : release)
         {
-            throw std::runtime_error("failure to read data from file: " + PROC_VERSION);
+            c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
         }
 
-        return (line.find(WSL_VERSION_STRING) != std::string::npos) ? menphina::Platform::WSL : menphina::Platform::Linux;
+        return (release.find(WSL_VERSION_STRING) != std::string::npos) ? menphina::Platform::WSL : menphina::Platform::Linux;
     }
 
-    std::string _get_win_env(const std::string& v)
+    // Resolves every name in a single cmd.exe invocation ("echo %A%&echo %B%"),
+    // one output line per variable. Unset variables come back empty.
+    std::vector<std::string> _get_win_envs(const std::vector<std::string>& names)
     {
+        std::string command;
+        for (const auto& v : names)
+        {
+            if (v.empty() || v.find_first_of("%&|<>^\"\r\n ") != std::string::npos)
+            {
+                throw std::runtime_error("Invalid Windows enviornment variable name '" + v + "'");
+            }
+
+            if (!command.empty())
+            {
+                command += '&';
+            }
+
+            command += "echo %";
+            command += v;
+            command += '%';
+        }
+
         IOPipe xpipe;
 
         const pid_t pid = fork();
@@ -159,61 +195,58 @@ namespace
                 std::exit(errno);
             }
 
-            // Construct null terminated argument.
-            const size_t wsize = v.size() + 3;
-            char * winenv = new char[wsize];
-            winenv[0] = '%';
-            memcpy(winenv + 1, v.c_str(), v.size());
-            winenv[wsize - 2] = '%';
-            winenv[wsize - 1] = '\0';
-
-            execl("/mnt/c/Windows/system32/cmd.exe", "/c", "echo", winenv, nullptr);
+            execl(WIN_CMD_PATH.c_str(), "cmd.exe", "/c", command.c_str(), nullptr);
             std::exit(errno);
         }
 
-
         // We are the parent.
         // Note: We don't have to close xpipe; it will take care of that in its
         // destructor invocation.
         const int fd = xpipe.reader();
 
-        // We might as well do this on the heap, 32k on the stack seems... not great.
-        // We use unique_ptr so we don't have to think about delete/free in the
-        // various places this function can exit, via exception or success.
+        // Every value is bounded, so the whole answer is too.
+        const size_t limit = names.size() * WIN_ENV_READ_BUFFER_LENGTH;
 
-        // We don't need to allocate the null, we are forcing it to truncate.
-        auto buffer = std::unique_ptr<char[]>(new char[WIN_ENV_READ_BUFFER_LENGTH]);
-        char * ptr = buffer.get();
+        std::string output;
+        output.resize(WIN_ENV_READ_CHUNK_LENGTH);
         size_t total_read = 0;
-        size_t last_read = 0;
+        bool overflow = false;
 
-        do
+        while (true)
         {
-            last_read = read(fd, ptr, WIN_ENV_READ_BUFFER_LENGTH - total_read);
+            if (total_read == output.size())
+            {
+                output.resize(output.size() * 2);
+            }
+
+            const ssize_t last_read = read(fd, output.data() + total_read, output.size() - total_read);
 
             if (last_read == 0)
             {
                 break;
             }
 
-            total_read += last_read;
-            ptr += last_read;
-        } while (total_read < WIN_ENV_READ_BUFFER_LENGTH);
+            if (last_read < 0)
+            {
+                const int err = errno;
+                if (err == EINTR)
+                {
+                    continue;
+                }
 
-        // This shouldn't happen unless our assumptions break, which, with WSL, you never know.
-        if (last_read != 0)
-        {
-            // Drain down the buffer
-            do
+                throw menphina::errno_exception("Failed to read from cmd.exe", err);
+            }
+
+            // This shouldn't happen unless our assumptions break, which, with
+            // WSL, you never know. Keep draining so the child can exit.
+            if (overflow || total_read + last_read > limit)
             {
-                last_read = read(fd, buffer.get(), WIN_ENV_READ_BUFFER_LENGTH);
-            } while (last_read != 0);
-            
+                overflow = true;
+                total_read = 0;
+                continue;
+            }
 
-            throw std::runtime_error("Windows enviornment variable "
-                + v
-                + " has value that exceeds documented data lengh "
-                + std::to_string(WIN_ENV_DATA_LENGTH));
+            total_read += last_read;
         }
 
         int child_status;
@@ -224,20 +257,232 @@ namespace
             throw std::runtime_error("Wait for child process interrupted");
         }
 
+        if (overflow)
+        {
+            throw std::runtime_error("Windows enviornment variables have values that exceed documented data lengh "
+                + std::to_string(WIN_ENV_DATA_LENGTH));
+        }
+
         if (child_status != 0)
         {
             throw std::runtime_error("Execution of cmd.exe has failed");
         }
 
-        if (total_read < WIN_LINE_END_LENGTH)
+        output.resize(total_read);
+
+        std::vector<std::string> ret;
+        ret.reserve(names.size());
+
+        size_t pos = 0;
+        for (const auto& v : names)
         {
-            throw std::runtime_error("Execution of cmd.exe has provided too little data");
+            const size_t eol = output.find("\r\n", pos);
+            if (eol == std::string::npos)
+            {
+                throw std::runtime_error("Execution of cmd.exe has provided too little data");
+            }
+
+            std::string value = output.substr(pos, eol - pos);
+            pos = eol + WIN_LINE_END_LENGTH;
+
+            // cmd leaves references to unset variables unexpanded.
+            if (value.size() == v.size() + 2 && value.front() == '%' && value.back() == '%' && value.compare(1, v.size(), v) == 0)
+            {
+                value.clear();
+            }
+
+            ret.push_back(std::move(value));
         }
 
-        std::string ret(buffer.get(), total_read - WIN_LINE_END_LENGTH);
         return ret;
     }
 
+    std::string _read_boot_id()
+    {
+        std::ifstream in(BOOT_ID_FILE);
+        std::string line;
+
+        if (!in || !std::getline(in, line))
+        {
+            return {};
+        }
+
+        return line;
+    }
+
+    std::string _get_cache_dir()
+    {
+        const char * xdg = std::getenv(XDG_CACHE_VAR_NAME.c_str());
+        if (xdg != nullptr && xdg[0] == '/')
+        {
+            return menphina::path_join(xdg, CACHE_DIR_NAME);
+        }
+
+        const char * home = std::getenv(HOME_VAR_NAME.c_str());
+        if (home == nullptr || home[0] == '\0')
+        {
+            return {};
+        }
+
+        return menphina::path_join(menphina::path_join(home, ".cache"), CACHE_DIR_NAME);
+    }
+
+    /*
+        Windows environment values, cached on disk between runs.
+
+        Spawning cmd.exe through WSL interop costs hundreds of milliseconds,
+        while the values only change when the user logs on to Windows again,
+        which also restarts the WSL VM. The cache is therefore keyed on the
+        VM's boot id; callers that can check a value (e.g. that a directory
+        still exists) call invalidate() when it fails and resolve again.
+
+        Format: a header line, the boot id, then NAME=VALUE lines.
+    */
+    class WinEnvCache final
+    {
+        public:
+            WinEnvCache() : m_dir(_get_cache_dir()), m_bootId(_read_boot_id())
+            {
+                load();
+            }
+
+            std::vector<std::string> get(const std::vector<std::string>& names)
+            {
+                const std::lock_guard<std::mutex> lock(m_mutex);
+
+                std::vector<std::string> missing;
+                for (const auto& v : names)
+                {
+                    if (!m_values.contains(v) && std::find(missing.cbegin(), missing.cend(), v) == missing.cend())
+                    {
+                        missing.push_back(v);
+                    }
+                }
+
+                if (!missing.empty())
+                {
+                    const std::vector<std::string> values = _get_win_envs(missing);
+                    for (size_t i = 0; i < missing.size(); ++i)
+                    {
+                        m_values[missing[i]] = values[i];
+                    }
+
+                    store();
+                }
+
+                std::vector<std::string> ret;
+                ret.reserve(names.size());
+
+                for (const auto& v : names)
+                {
+                    ret.push_back(m_values.at(v));
+                }
+
+                return ret;
+            }
+
+            void invalidate()
+            {
+                const std::lock_guard<std::mutex> lock(m_mutex);
+                m_values.clear();
+            }
+
+        private:
+            std::mutex m_mutex;
+            std::string m_dir;
+            std::string m_bootId;
+            std::map<std::string, std::string> m_values;
+
+            void load()
+            {
+                if (m_dir.empty() || m_bootId.empty())
+                {
+                    return;
+                }
+
+                std::ifstream in(menphina::path_join(m_dir, WIN_ENV_CACHE_NAME));
+                std::string line;
+
+                if (!in || !std::getline(in, line) || line != WIN_ENV_CACHE_HEADER)
+                {
+                    return;
+                }
+
+                if (!std::getline(in, line) || line != m_bootId)
+                {
+                    return;
+                }
+
+                while (std::getline(in, line))
+                {
+                    const size_t eq = line.find('=');
+                    if (eq == std::string::npos || eq == 0)
+                    {
+                        // Damaged; ignore all of it.
+                        m_values.clear();
+                        return;
+                    }
+
+                    m_values.emplace(line.substr(0, eq), line.substr(eq + 1));
+                }
+            }
+
+            // Best effort; failing to cache only costs the next run time.
+            void store() const
+            {
+                if (m_dir.empty() || m_bootId.empty())
+                {
+                    return;
+                }
+
+                std::string data = WIN_ENV_CACHE_HEADER + "\n" + m_bootId + "\n";
+                for (const auto& [name, value] : m_values)
+                {
+                    data += name;
+                    data += '=';
+                    data += value;
+                    data += '\n';
+                }
+
+                try
+                {
+                    std::filesystem::create_directories(m_dir);
+
+                    const int dirfd = open(m_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                    if (dirfd == -1)
+                    {
+                        return;
+                    }
+
+                    const menphina::UniqueFd dir(dirfd);
+                    const std::string staged = menphina::staging_name(WIN_ENV_CACHE_NAME);
+
+                    try
+                    {
+                        menphina::UniqueFd fd = menphina::open_staged(dirfd, staged);
+                        menphina::write_all(fd.get(), data.data(), data.size(), staged);
+                        fd.reset();
+
+                        menphina::publish_staged(dirfd, staged, WIN_ENV_CACHE_NAME, true);
+                    }
+                    catch (const std::exception&)
+                    {
+                        menphina::discard_staged(dirfd, staged);
+                    }
+                }
+                catch (const std::exception&)
+                {
+                    // Nothing to do.
+                }
+            }
+    };
+
+    WinEnvCache & _get_win_env_cache()
+    {
+        static WinEnvCache cache;
+        return cache;
+    }
+
     const std::string & _get_linux_launcher_dir()
     {
         const menphina::Platform p = menphina::get_current_platform();
@@ -281,8 +526,6 @@ namespace
         }
     }
 
-    // TODO remove attribute
-    [[maybe_unused]]
     std::string _to_wsl_path(const std::string& winPath)
     {
         // We have to determine the drive letter, and swap the things.
@@ -322,6 +565,33 @@ namespace
         return ret;
     }
 
+    std::string _resolve_wsl_home(WinEnvCache& cache)
+    {
+        const std::string home = cache.get({ WSL_HOME_VAR_NAME }).front();
+        if (home.empty())
+        {
+            throw std::runtime_error("Unable to read Windows env " + WSL_HOME_VAR_NAME);
+        }
+
+        return _to_wsl_path(home);
+    }
+
+    std::string _get_wsl_home()
+    {
+        WinEnvCache& cache = _get_win_env_cache();
+        std::string ret = _resolve_wsl_home(cache);
+
+        // A cached profile directory that no longer exists means the cache
+        // has outlived the Windows session it came from.
+        if (!menphina::path_exists(ret))
+        {
+            cache.invalidate();
+            ret = _resolve_wsl_home(cache);
+        }
+
+        return ret;
+    }
+
 #endif
 
     std::string _get_home()
@@ -331,7 +601,7 @@ namespace
         const menphina::Platform p = menphina::get_current_platform();
         if (p == menphina::Platform::WSL)
         {
-            return _get_win_env(WSL_HOME_VAR_NAME);
+            return _get_wsl_home();
         }
 #endif
 
@@ -361,10 +631,19 @@ menphina::Platform menphina::get_current_platform()
 #endif
 }
 
+std::string_view menphina::path_basename_view(const std::string_view pathstr)
+{
+#if defined ( _WIN32 )
+    const size_t sep = pathstr.find_last_of("\\/:");
+#else
+    const size_t sep = pathstr.rfind('/');
+#endif
+    return (sep == std::string_view::npos) ? pathstr : pathstr.substr(sep + 1);
+}
+
 std::string menphina::path_basename(const std::string_view pathstr)
 {
-    const std::filesystem::path p(pathstr);
-    return p.filename().string();
+    return std::string(path_basename_view(pathstr));
 }
 
 const std::string & menphina::get_user_home_directory()
@@ -373,10 +652,69 @@ const std::string & menphina::get_user_home_directory()
     return h;
 }
 
+void menphina::path_append(std::string& out, const std::string_view b)
+{
+#if defined ( _WIN32 )
+    // Drive letters and UNC roots; not worth doing by hand.
+    std::filesystem::path p(out);
+    p /= b;
+    out = p.string();
+#else
+    // Same rules as std::filesystem::path::operator/= on POSIX.
+    if (!b.empty() && b.front() == '/')
+    {
+        out.assign(b);
+        return;
+    }
+
+    if (!out.empty() && out.back() != '/')
+    {
+        out.push_back('/');
+    }
+
+    out.append(b);
+#endif
+}
+
+bool menphina::path_is_contained(const std::string_view path)
+{
+    if (path.empty() || path.front() == '/')
+    {
+        return false;
+    }
+
+    if (path.find('\\') != std::string_view::npos || path.find('\0') != std::string_view::npos)
+    {
+        return false;
+    }
+
+    size_t start = 0;
+    while (start <= path.size())
+    {
+        size_t end = path.find('/', start);
+        if (end == std::string_view::npos)
+        {
+            end = path.size();
+        }
+
+        const std::string_view component = path.substr(start, end - start);
+        if (component.empty() || component == "." || component == "..")
+        {
+            return false;
+        }
+
+        start = end + 1;
+    }
+
+    return true;
+}
+
 std::string menphina::path_join(const std::string_view a, const std::string_view b)
 {
-    std::filesystem::path ret(a);
-    ret /= b;
+    std::string ret;
+    ret.reserve(a.size() + b.size() + 1);
+    ret.assign(a);
+    path_append(ret, b);
     return ret;
 }
 
@@ -386,7 +724,20 @@ bool menphina::path_exists(const std::string_view path)
     return std::filesystem::exists(path);
 }
 
-const std::string & get_relative_launcher_config_dir()
+std::string menphina::native_path(const std::string_view path)
+{
+#if defined ( __linux__ )
+    // Only a drive qualified path (C:...) needs translating.
+    if (get_current_platform() == menphina::Platform::WSL && path.size() >= 2 && std::isalpha(path[0]) && path[1] == ':')
+    {
+        return _to_wsl_path(std::string(path));
+    }
+#endif
+
+    return std::string(path);
+}
+
+const std::string & menphina::get_relative_launcher_config_dir()
 {
 #if defined ( __linux__ )
     static const std::string & launcherDir = _get_linux_launcher_dir();
@@ -0,0 +1,304 @@
+/* Copyright 2024 isaki */
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <limits>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "menphina/fileio.hpp"
+#include "menphina/hash.hpp"
+#include "menphina/m_exception.hpp"
+#include "menphina/refindex.hpp"
+#include "menphina/trace.hpp"
+
+namespace
+{
+    static_assert(std::endian::native == std::endian::little, "the reference index is written in host byte order");
+
+    inline constexpr uint64_t TABLE_ALIGNMENT = 8;
+
+    inline bool _source_less(const menphina::refindex_entry_t& a, const menphina::refindex_entry_t& b)
+    {
+        return (a.kind != b.kind) ? a.kind < b.kind : a.name < b.name;
+    }
+
+    void _append_table(std::string& out, const void * data, const size_t length)
+    {
+        out.append((TABLE_ALIGNMENT - (out.size() % TABLE_ALIGNMENT)) % TABLE_ALIGNMENT, '\0');
+        out.append(static_cast<const char *>(data), length);
+    }
+}
+
+std::string menphina::normalize_reference(const std::string_view path)
+{
+    std::string ret(path);
+    for (char& c : ret)
+    {
+        if (c == '\\')
+        {
+            c = '/';
+        }
+        else if (c >= 'A' && c <= 'Z')
+        {
+            c = static_cast<char>(c - 'A' + 'a');
+        }
+    }
+
+    return ret;
+}
+
+/* ReferenceIndex */
+
+menphina::ReferenceIndex::ReferenceIndex(const std::string& file) :
+    m_file(file),
+    m_base(nullptr),
+    m_size(0)
+{
+    TraceSpan span(trace_category::READ, "refindex.load");
+
+    if (!load())
+    {
+        unload();
+    }
+
+    span.add_bytes(m_size);
+}
+
+menphina::ReferenceIndex::~ReferenceIndex()
+{
+    unload();
+}
+
+void menphina::ReferenceIndex::unload()
+{
+    if (m_base != nullptr)
+    {
+        munmap(const_cast<char *>(m_base), m_size);
+    }
+
+    m_base = nullptr;
+    m_size = 0;
+    m_sources = {};
+    m_refs = {};
+    m_strings = {};
+}
+
+bool menphina::ReferenceIndex::load()
+{
+    const int fd = open(m_file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return false;
+    }
+
+    const UniqueFd guard(fd);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < sizeof(refindex_header_t))
+    {
+        return false;
+    }
+
+    void * map = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        return false;
+    }
+
+    m_base = static_cast<const char *>(map);
+    m_size = static_cast<uint64_t>(st.st_size);
+
+    refindex_header_t header;
+    std::memcpy(&header, m_base, sizeof(header));
+
+    if (header.magic != REFINDEX_MAGIC || header.version != REFINDEX_VERSION)
+    {
+        return false;
+    }
+
+    const auto inRange = [this](const uint64_t offset, const uint64_t count, const size_t size, const size_t align) {
+        return offset % align == 0 && offset <= m_size && count <= (m_size - offset) / size;
+    };
+
+    if (!inRange(header.source_table_offset, header.source_count, sizeof(refindex_source_t), alignof(refindex_source_t))
+        || !inRange(header.ref_table_offset, header.ref_count, sizeof(refindex_ref_t), alignof(refindex_ref_t))
+        || !inRange(header.strings_offset, header.strings_size, 1, 1))
+    {
+        return false;
+    }
+
+    m_sources = std::span<const refindex_source_t>(reinterpret_cast<const refindex_source_t *>(m_base + header.source_table_offset), header.source_count);
+    m_refs = std::span<const refindex_ref_t>(reinterpret_cast<const refindex_ref_t *>(m_base + header.ref_table_offset), header.ref_count);
+    m_strings = std::string_view(m_base + header.strings_offset, header.strings_size);
+
+    // Everything is checked once here so lookups can trust the tables.
+    for (const auto& s : m_sources)
+    {
+        if (s.name_offset > m_strings.size() || s.name_length > m_strings.size() - s.name_offset
+            || s.first_ref > m_refs.size() || s.ref_count > m_refs.size() - s.first_ref)
+        {
+            return false;
+        }
+    }
+
+    for (const auto& r : m_refs)
+    {
+        if (r.offset > m_strings.size() || r.length > m_strings.size() - r.offset)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+const menphina::refindex_source_t * menphina::ReferenceIndex::find(const RefSourceKind kind, const std::string_view name, const content_hash_t& fingerprint) const
+{
+    const uint32_t k = static_cast<uint32_t>(kind);
+
+    const auto it = std::lower_bound(m_sources.begin(), m_sources.end(), name, [this, k](const refindex_source_t& s, const std::string_view n) {
+        return (s.kind != k) ? s.kind < k : this->name(s) < n;
+    });
+
+    if (it == m_sources.end() || it->kind != k || this->name(*it) != name)
+    {
+        return nullptr;
+    }
+
+    return (content_hash_t { it->fingerprint_lo, it->fingerprint_hi } == fingerprint) ? &*it : nullptr;
+}
+
+std::string_view menphina::ReferenceIndex::name(const refindex_source_t& source) const
+{
+    return m_strings.substr(source.name_offset, source.name_length);
+}
+
+std::vector<std::string_view> menphina::ReferenceIndex::refs(const refindex_source_t& source) const
+{
+    std::vector<std::string_view> ret;
+    ret.reserve(source.ref_count);
+
+    for (const auto& r : m_refs.subspan(source.first_ref, source.ref_count))
+    {
+        ret.push_back(m_strings.substr(r.offset, r.length));
+    }
+
+    return ret;
+}
+
+/* Writing */
+
+void menphina::write_reference_index(const std::string& file, std::vector<refindex_entry_t> entries)
+{
+    TraceSpan span(trace_category::WRITE, "refindex.write");
+
+    std::sort(entries.begin(), entries.end(), _source_less);
+
+    std::vector<refindex_source_t> sources;
+    std::vector<refindex_ref_t> refs;
+    std::string strings;
+
+    const auto addString = [&strings](const std::string_view s) {
+        if (s.size() > std::numeric_limits<uint32_t>::max()) [[unlikely]]
+        {
+            throw std::runtime_error("reference index string too long");
+        }
+
+        const uint64_t ret = strings.size();
+        strings.append(s);
+        return ret;
+    };
+
+    sources.reserve(entries.size());
+    for (auto& e : entries)
+    {
+        std::sort(e.refs.begin(), e.refs.end());
+        e.refs.erase(std::unique(e.refs.begin(), e.refs.end()), e.refs.end());
+
+        sources.push_back(refindex_source_t {
+            .name_offset = addString(e.name),
+            .name_length = static_cast<uint32_t>(e.name.size()),
+            .kind = static_cast<uint32_t>(e.kind),
+            .fingerprint_lo = e.fingerprint.lo,
+            .fingerprint_hi = e.fingerprint.hi,
+            .first_ref = refs.size(),
+            .ref_count = e.refs.size()
+        });
+
+        for (const auto& r : e.refs)
+        {
+            refs.push_back(refindex_ref_t {
+                .offset = addString(r),
+                .length = static_cast<uint32_t>(r.size()),
+                .reserved = 0
+            });
+        }
+    }
+
+    refindex_header_t header {};
+    header.magic = REFINDEX_MAGIC;
+    header.version = REFINDEX_VERSION;
+
+    // The index is small next to what it describes, so it is assembled in
+    // memory and written in one go.
+    std::string out(sizeof(header), '\0');
+
+    _append_table(out, sources.data(), sources.size() * sizeof(refindex_source_t));
+    header.source_table_offset = out.size() - sources.size() * sizeof(refindex_source_t);
+    header.source_count = sources.size();
+
+    _append_table(out, refs.data(), refs.size() * sizeof(refindex_ref_t));
+    header.ref_table_offset = out.size() - refs.size() * sizeof(refindex_ref_t);
+    header.ref_count = refs.size();
+
+    header.strings_offset = out.size();
+    header.strings_size = strings.size();
+    out.append(strings);
+
+    std::memcpy(out.data(), &header, sizeof(header));
+
+    // A cache; a crash that loses it only costs the next run a full parse,
+    // so it is staged, so that a reader never sees half of it, but not
+    // synced.
+    const std::filesystem::path target(file);
+    const std::string dir = (target.has_parent_path()) ? target.parent_path().string() : std::string(".");
+    const UniqueFd dirfd(open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (!dirfd.valid())
+    {
+        const int err = errno;
+        throw menphina::errno_exception("Unable to open directory " + dir, err);
+    }
+
+    const std::string name = target.filename().string();
+    const std::string staged = staging_name(name);
+    UniqueFd fd = open_staged(dirfd.get(), staged);
+
+    try
+    {
+        write_all(fd.get(), out.data(), out.size(), file);
+        fd.reset();
+        publish_staged(dirfd.get(), staged, name, true);
+    }
+    catch (...)
+    {
+        fd.reset();
+        discard_staged(dirfd.get(), staged);
+        throw;
+    }
+
+    span.add_bytes(out.size());
+    span.add_files(1);
+}
@@ -0,0 +1,643 @@
+/* Copyright 2024 isaki */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if defined ( __linux__ )
+#include <cerrno>
+#include <deque>
+#include <mutex>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <filesystem>
+#endif
+
+#include "menphina/fileio.hpp"
+#include "menphina/m_exception.hpp"
+#include "menphina/parallel.hpp"
+#include "menphina/patharena.hpp"
+#include "menphina/scan.hpp"
+#include "menphina/trace.hpp"
+
+namespace
+{
+    inline constexpr uint32_t ROOT_INDEX = menphina::ROOT_PATH;
+    inline constexpr uint32_t MAX_INDEX = std::numeric_limits<uint32_t>::max();
+
+    // What DirectoryScanner::scan() moves into the ScanResult.
+    struct raw_scan_t
+    {
+        std::vector<menphina::scan_entry_t> entries;
+        menphina::PathArena paths;
+        std::vector<std::string> errors;
+        menphina::scan_stats_t stats;
+    };
+
+    inline void _check_index_space(const size_t entries, const size_t names)
+    {
+        if (entries >= MAX_INDEX || names >= MAX_INDEX) [[unlikely]]
+        {
+            throw std::runtime_error("directory scan exceeds the supported number of entries");
+        }
+    }
+
+#if defined ( __linux__ )
+    // glibc only grew a getdents64() wrapper in 2.30, so we use the raw
+    // syscall and pick the linux_dirent64 records apart by offset (the
+    // struct ends in a flexible array member, which is not valid C++).
+    inline constexpr size_t DIRENT_RECLEN_OFFSET = 16;
+    inline constexpr size_t DIRENT_TYPE_OFFSET = 18;
+    inline constexpr size_t DIRENT_NAME_OFFSET = 19;
+
+    inline constexpr unsigned STATX_FLAGS = AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC;
+    inline constexpr unsigned STATX_FIELDS = STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_INO;
+
+    // Number of failed steal rounds before an idle worker starts sleeping.
+    inline constexpr unsigned IDLE_SPIN_LIMIT = 64;
+    inline constexpr std::chrono::microseconds IDLE_SLEEP { 50 };
+
+    // Directory references during the scan are (worker << 32 | local index);
+    // they are rewritten into flat indexes once all workers are done.
+    inline constexpr uint64_t _make_ref(const size_t worker, const size_t index)
+    {
+        return (static_cast<uint64_t>(worker) << 32) | static_cast<uint64_t>(index);
+    }
+
+    struct dir_handle_t
+    {
+        menphina::UniqueFd fd;
+    };
+
+    struct work_item_t
+    {
+        // Keeps the parent directory open until this item has been opened
+        // relative to it.
+        std::shared_ptr<const dir_handle_t> parent;
+        std::string name;
+        uint64_t ref;
+        uint16_t depth;
+    };
+
+    struct worker_state_t
+    {
+        std::mutex lock;
+        std::deque<work_item_t> queue;
+
+        std::vector<menphina::scan_entry_t> entries;
+        std::vector<uint64_t> parents;
+
+        // Names are only interned once all workers are done; until then
+        // entry i is names[nameEnds[i - 1], nameEnds[i]).
+        std::string names;
+        std::vector<uint32_t> nameEnds;
+        std::vector<std::string> errors;
+
+        uint64_t directories = 0;
+        uint64_t files = 0;
+        uint64_t bytes = 0;
+    };
+
+    menphina::EntryType _from_dtype(const unsigned char dtype)
+    {
+        switch (dtype)
+        {
+            case DT_REG:
+                return menphina::EntryType::File;
+            case DT_DIR:
+                return menphina::EntryType::Directory;
+            case DT_LNK:
+                return menphina::EntryType::Symlink;
+            case DT_UNKNOWN:
+                return menphina::EntryType::Unknown;
+            default:
+                return menphina::EntryType::Other;
+        }
+    }
+
+    menphina::EntryType _from_mode(const uint16_t mode)
+    {
+        switch (mode & S_IFMT)
+        {
+            case S_IFREG:
+                return menphina::EntryType::File;
+            case S_IFDIR:
+                return menphina::EntryType::Directory;
+            case S_IFLNK:
+                return menphina::EntryType::Symlink;
+            default:
+                return menphina::EntryType::Other;
+        }
+    }
+
+    class ParallelScan final
+    {
+        public:
+            ParallelScan(const menphina::scan_options_t& options, const unsigned threads, const size_t direntLength) :
+                m_options(options),
+                m_direntLength(direntLength),
+                m_pending(0),
+                m_failed(false)
+            {
+                m_workers.reserve(threads);
+                for (unsigned i = 0; i < threads; ++i)
+                {
+                    m_workers.push_back(std::make_unique<worker_state_t>());
+                }
+            }
+
+            raw_scan_t run(menphina::UniqueFd&& rootFd)
+            {
+                auto root = std::make_shared<dir_handle_t>();
+                root->fd = std::move(rootFd);
+
+                // The root is entry 0 of worker 0 and is its own parent; it
+                // is re-opened through "." so every directory, including the
+                // root, goes through the same code path.
+                worker_state_t& first = *m_workers[0];
+                first.entries.push_back(menphina::scan_entry_t {
+                    .depth = 0,
+                    .type = menphina::EntryType::Directory,
+                    .size = 0,
+                    .mtime_ns = 0,
+                    .inode = 0
+                });
+                first.parents.push_back(_make_ref(0, ROOT_INDEX));
+                first.nameEnds.push_back(0);
+                first.directories = 1;
+
+                m_pending.store(1, std::memory_order_relaxed);
+                first.queue.push_back(work_item_t { std::move(root), ".", _make_ref(0, ROOT_INDEX), 0 });
+
+                std::vector<std::thread> threads;
+                threads.reserve(m_workers.size() - 1);
+                for (size_t i = 1; i < m_workers.size(); ++i)
+                {
+                    // Out of threads (EAGAIN) or memory: the workers already
+                    // running steal from each other as always; the queues of
+                    // the ones that never started just stay empty.
+                    try
+                    {
+                        threads.emplace_back(&ParallelScan::worker, this, i);
+                    }
+                    catch (...)
+                    {
+                        break;
+                    }
+                }
+
+                worker(0);
+
+                for (auto& t : threads)
+                {
+                    t.join();
+                }
+
+                if (m_error)
+                {
+                    std::rethrow_exception(m_error);
+                }
+
+                raw_scan_t ret = merge();
+                ret.stats.threads = static_cast<unsigned>(threads.size() + 1);
+                return ret;
+            }
+
+        private:
+            const menphina::scan_options_t& m_options;
+            const size_t m_direntLength;
+            std::vector<std::unique_ptr<worker_state_t>> m_workers;
+
+            // Directories queued or being processed; zero means the walk is done.
+            std::atomic<uint64_t> m_pending;
+
+            std::atomic<bool> m_failed;
+            std::mutex m_errorLock;
+            std::exception_ptr m_error;
+
+            bool pop(const size_t self, work_item_t& out)
+            {
+                // Own queue is LIFO (depth first, keeps fds and caches warm);
+                // stealing takes the oldest item, which is the largest subtree.
+                {
+                    worker_state_t& own = *m_workers[self];
+                    std::lock_guard<std::mutex> guard(own.lock);
+                    if (!own.queue.empty())
+                    {
+                        out = std::move(own.queue.back());
+                        own.queue.pop_back();
+                        return true;
+                    }
+                }
+
+                const size_t count = m_workers.size();
+                for (size_t i = 1; i < count; ++i)
+                {
+                    worker_state_t& victim = *m_workers[(self + i) % count];
+                    std::lock_guard<std::mutex> guard(victim.lock);
+                    if (!victim.queue.empty())
+                    {
+                        out = std::move(victim.queue.front());
+                        victim.queue.pop_front();
+                        return true;
+                    }
+                }
+
+                return false;
+            }
+
+            void worker(const size_t self)
+            {
+                menphina::TraceSpan span(menphina::trace_category::SCAN, "scan.worker");
+                const size_t before = m_workers[self]->entries.size();
+
+                try
+                {
+                    std::vector<char> buffer(m_direntLength);
+                    unsigned idle = 0;
+                    work_item_t item;
+
+                    while (!m_failed.load(std::memory_order_relaxed))
+                    {
+                        if (pop(self, item))
+                        {
+                            idle = 0;
+                            process(self, item, buffer);
+                            m_pending.fetch_sub(1, std::memory_order_acq_rel);
+                            continue;
+                        }
+
+                        if (m_pending.load(std::memory_order_acquire) == 0)
+                        {
+                            break;
+                        }
+
+                        if (++idle < IDLE_SPIN_LIMIT)
+                        {
+                            std::this_thread::yield();
+                        }
+                        else
+                        {
+                            std::this_thread::sleep_for(IDLE_SLEEP);
+                        }
+                    }
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> guard(m_errorLock);
+                    if (!m_error)
+                    {
+                        m_error = std::current_exception();
+                    }
+
+                    m_failed.store(true, std::memory_order_relaxed);
+                }
+
+                span.add_files(m_workers[self]->entries.size() - before);
+            }
+
+            void process(const size_t self, work_item_t& item, std::vector<char>& buffer)
+            {
+                worker_state_t& state = *m_workers[self];
+
+                const int fd = openat(item.parent->fd.get(), item.name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+                const int openErr = errno;
+                item.parent.reset();
+
+                if (fd == -1)
+                {
+                    state.errors.emplace_back(menphina::errno_exception("failed to open directory '" + item.name + "'", openErr).what());
+                    return;
+                }
+
+                auto handle = std::make_shared<dir_handle_t>();
+                handle->fd.reset(fd);
+
+                const uint16_t childDepth = (item.depth < std::numeric_limits<uint16_t>::max()) ? item.depth + 1 : item.depth;
+
+                for (;;)
+                {
+                    const long n = syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+                    if (n == 0)
+                    {
+                        break;
+                    }
+
+                    if (n < 0)
+                    {
+                        const int err = errno;
+                        state.errors.emplace_back(menphina::errno_exception("failed to read directory '" + item.name + "'", err).what());
+                        break;
+                    }
+
+                    for (long pos = 0; pos < n;)
+                    {
+                        const char * rec = buffer.data() + pos;
+
+                        unsigned short reclen;
+                        std::memcpy(&reclen, rec + DIRENT_RECLEN_OFFSET, sizeof(reclen));
+                        pos += reclen;
+
+                        const char * name = rec + DIRENT_NAME_OFFSET;
+                        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                        {
+                            continue;
+                        }
+
+                        const size_t nameLength = std::strlen(name);
+
+                        menphina::scan_entry_t entry {
+                            .depth = childDepth,
+                            .type = _from_dtype(static_cast<unsigned char>(rec[DIRENT_TYPE_OFFSET])),
+                            .size = 0,
+                            .mtime_ns = 0,
+                            .inode = 0
+                        };
+
+                        std::memcpy(&entry.inode, rec, sizeof(entry.inode));
+
+                        const bool wantStat = entry.type == menphina::EntryType::Unknown
+                            || (entry.type == menphina::EntryType::File && m_options.stat_files)
+                            || (entry.type == menphina::EntryType::Directory && m_options.stat_directories);
+
+                        if (wantStat)
+                        {
+                            struct statx stx;
+                            if (statx(fd, name, STATX_FLAGS, STATX_FIELDS, &stx) == 0)
+                            {
+                                entry.type = _from_mode(stx.stx_mode);
+                                entry.size = stx.stx_size;
+                                entry.mtime_ns = static_cast<int64_t>(stx.stx_mtime.tv_sec) * 1000000000 + stx.stx_mtime.tv_nsec;
+                                entry.inode = stx.stx_ino;
+                            }
+                            else
+                            {
+                                // Most likely deleted under us; keep the entry
+                                // with what getdents told us.
+                                const int err = errno;
+                                state.errors.emplace_back(menphina::errno_exception("failed to stat '" + std::string(name, nameLength) + "'", err).what());
+                            }
+                        }
+
+                        const size_t local = state.entries.size();
+                        _check_index_space(local, state.names.size() + nameLength);
+
+                        state.names.append(name, nameLength);
+                        state.nameEnds.push_back(static_cast<uint32_t>(state.names.size()));
+                        state.entries.push_back(entry);
+                        state.parents.push_back(item.ref);
+
+                        if (entry.type == menphina::EntryType::Directory)
+                        {
+                            ++state.directories;
+
+                            m_pending.fetch_add(1, std::memory_order_relaxed);
+                            std::lock_guard<std::mutex> guard(state.lock);
+                            state.queue.push_back(work_item_t { handle, std::string(name, nameLength), _make_ref(self, local), childDepth });
+                        }
+                        else if (entry.type == menphina::EntryType::File)
+                        {
+                            ++state.files;
+                            state.bytes += entry.size;
+                        }
+                    }
+                }
+            }
+
+            raw_scan_t merge()
+            {
+                raw_scan_t ret;
+
+                std::vector<size_t> entryOffsets(m_workers.size());
+
+                size_t totalEntries = 0;
+                size_t totalErrors = 0;
+                for (size_t w = 0; w < m_workers.size(); ++w)
+                {
+                    entryOffsets[w] = totalEntries;
+                    totalEntries += m_workers[w]->entries.size();
+                    totalErrors += m_workers[w]->errors.size();
+                }
+
+                _check_index_space(totalEntries, 0);
+
+                ret.entries.reserve(totalEntries);
+                ret.paths.reserve(totalEntries);
+                ret.errors.reserve(totalErrors);
+
+                for (size_t w = 0; w < m_workers.size(); ++w)
+                {
+                    worker_state_t& state = *m_workers[w];
+
+                    // Entry 0 of worker 0 is the root, which every arena
+                    // starts out with.
+                    for (size_t i = (w == 0) ? 1 : 0; i < state.entries.size(); ++i)
+                    {
+                        const uint64_t ref = state.parents[i];
+                        const uint32_t parent = static_cast<uint32_t>(entryOffsets[ref >> 32] + (ref & 0xFFFFFFFFu));
+                        const uint32_t nameStart = (i == 0) ? 0 : state.nameEnds[i - 1];
+
+                        // A directory lists every name once, so nothing needs
+                        // to be looked up; the parent may be in a later worker.
+                        ret.paths.add(parent, std::string_view(state.names.data() + nameStart, state.nameEnds[i] - nameStart));
+                    }
+
+                    ret.entries.insert(ret.entries.end(), state.entries.begin(), state.entries.end());
+                    std::move(state.errors.begin(), state.errors.end(), std::back_inserter(ret.errors));
+
+                    ret.stats.directories += state.directories;
+                    ret.stats.files += state.files;
+                    ret.stats.bytes += state.bytes;
+
+                    // Release worker memory as we go; the merged copy is the
+                    // one that survives.
+                    state.entries = {};
+                    state.parents = {};
+                    state.names = {};
+                    state.nameEnds = {};
+                }
+
+                ret.stats.entries = ret.entries.size();
+                ret.stats.errors = ret.errors.size();
+                ret.stats.threads = static_cast<unsigned>(m_workers.size());
+                return ret;
+            }
+    };
+
+    raw_scan_t _scan(const std::string& root, const menphina::scan_options_t& options, const unsigned threads)
+    {
+        const int fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            const int err = errno;
+            throw menphina::errno_exception("Unable to open directory " + root, err);
+        }
+
+        menphina::UniqueFd rootFd(fd);
+
+        // One fstatfs for the whole walk; mount points below the root are
+        // not expected in a mod directory.
+        const menphina::io_policy_t policy = menphina::get_io_policy_fd(fd);
+
+        ParallelScan scan(options, threads, policy.dirent_buffer_length);
+        raw_scan_t ret = scan.run(std::move(rootFd));
+        ret.stats.io_policy = policy.kind;
+        return ret;
+    }
+
+#else
+
+    // Portable single threaded fallback; only the Linux build gets the
+    // syscall level scanner.
+    raw_scan_t _scan(const std::string& root, const menphina::scan_options_t& options, [[maybe_unused]] const unsigned threads)
+    {
+        namespace fs = std::filesystem;
+
+        raw_scan_t ret;
+        ret.entries.push_back(menphina::scan_entry_t {
+            .depth = 0,
+            .type = menphina::EntryType::Directory,
+            .size = 0,
+            .mtime_ns = 0,
+            .inode = 0
+        });
+        ret.stats.directories = 1;
+
+        // Index of the most recent directory at each depth.
+        std::vector<uint32_t> dirStack { ROOT_INDEX };
+
+        std::error_code ec;
+        fs::recursive_directory_iterator it(root, fs::directory_options::skip_permission_denied, ec);
+        if (ec)
+        {
+            throw std::runtime_error("Unable to open directory " + root + ": " + ec.message());
+        }
+
+        for (const fs::recursive_directory_iterator end; it != end; it.increment(ec))
+        {
+            if (ec)
+            {
+                ret.errors.push_back(ec.message());
+                ec.clear();
+                continue;
+            }
+
+            const auto& de = *it;
+            const size_t depth = static_cast<size_t>(it.depth()) + 1;
+            const std::string name = de.path().filename().string();
+
+            menphina::scan_entry_t entry {
+                .depth = static_cast<uint16_t>(depth),
+                .type = menphina::EntryType::Other,
+                .size = 0,
+                .mtime_ns = 0,
+                .inode = 0
+            };
+
+            std::error_code sec;
+            if (de.is_symlink(sec))
+            {
+                entry.type = menphina::EntryType::Symlink;
+            }
+            else if (de.is_directory(sec))
+            {
+                entry.type = menphina::EntryType::Directory;
+            }
+            else if (de.is_regular_file(sec))
+            {
+                entry.type = menphina::EntryType::File;
+                if (options.stat_files)
+                {
+                    entry.size = de.file_size(sec);
+                    entry.mtime_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(de.last_write_time(sec).time_since_epoch()).count();
+                }
+            }
+
+            _check_index_space(ret.entries.size(), 0);
+            const uint32_t index = ret.paths.add(dirStack[depth - 1], name);
+            ret.entries.push_back(entry);
+
+            if (entry.type == menphina::EntryType::Directory)
+            {
+                ++ret.stats.directories;
+                dirStack.resize(depth + 1);
+                dirStack[depth] = index;
+            }
+            else if (entry.type == menphina::EntryType::File)
+            {
+                ++ret.stats.files;
+                ret.stats.bytes += entry.size;
+            }
+        }
+
+        ret.stats.entries = ret.entries.size();
+        ret.stats.errors = ret.errors.size();
+        ret.stats.threads = 1;
+        ret.stats.io_policy = menphina::get_io_policy(root).kind;
+        return ret;
+    }
+
+#endif
+}
+
+/* scan_stats_t */
+
+double menphina::scan_stats_t::entries_per_second() const
+{
+    return (seconds > 0.0) ? static_cast<double>(entries) / seconds : 0.0;
+}
+
+/* ScanResult */
+
+menphina::ScanResult::ScanResult() {}
+
+menphina::ScanResult::~ScanResult() {}
+
+menphina::ScanResult::ScanResult(ScanResult&&) noexcept = default;
+
+menphina::ScanResult& menphina::ScanResult::operator=(ScanResult&&) noexcept = default;
+
+/* DirectoryScanner */
+
+menphina::DirectoryScanner::DirectoryScanner(const scan_options_t& options) : m_options(options) {}
+
+menphina::DirectoryScanner::~DirectoryScanner() {}
+
+menphina::ScanResult menphina::DirectoryScanner::scan(const std::string_view root) const
+{
+    const unsigned threads = resolve_thread_count(m_options.threads);
+    const std::string rootStr(root);
+
+    TraceSpan span(trace_category::SCAN, "scan");
+
+    const auto start = std::chrono::steady_clock::now();
+    raw_scan_t raw = _scan(rootStr, m_options, threads);
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    ScanResult ret;
+    ret.m_root = rootStr;
+    ret.m_entries = std::move(raw.entries);
+    ret.m_paths = std::move(raw.paths);
+    ret.m_errors = std::move(raw.errors);
+    ret.m_stats = raw.stats;
+    ret.m_stats.seconds = elapsed.count();
+
+    span.add_files(ret.m_stats.files);
+    span.add_bytes(ret.m_stats.bytes);
+    return ret;
+}
@@ -0,0 +1,202 @@
+/* Copyright 2024 isaki */
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "menphina/fileio.hpp"
+#include "menphina/m_exception.hpp"
+#include "menphina/trace.hpp"
+
+namespace
+{
+    // Marks spans that were started while tracing was off.
+    inline constexpr uint64_t NOT_TRACING = UINT64_MAX;
+
+    struct trace_event_t
+    {
+        const char * category;
+        const char * name;
+        uint64_t start_ns;
+        uint64_t duration_ns;
+        uint64_t bytes;
+        uint64_t files;
+    };
+
+    struct thread_buffer_t
+    {
+        uint32_t tid;
+        std::vector<trace_event_t> events;
+    };
+
+    struct phase_total_t
+    {
+        uint64_t spans = 0;
+        uint64_t duration_ns = 0;
+        uint64_t bytes = 0;
+        uint64_t files = 0;
+    };
+
+    std::atomic<bool> g_enabled { false };
+
+    // Buffers outlive their threads so nothing is lost when a worker pool
+    // exits before the trace is written.
+    std::mutex g_lock;
+    std::vector<std::shared_ptr<thread_buffer_t>> g_buffers;
+
+    const std::chrono::steady_clock::time_point g_epoch = std::chrono::steady_clock::now();
+
+    uint64_t _now_ns()
+    {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - g_epoch).count());
+    }
+
+    thread_buffer_t& _thread_buffer()
+    {
+        thread_local std::shared_ptr<thread_buffer_t> buffer;
+        if (!buffer)
+        {
+            buffer = std::make_shared<thread_buffer_t>();
+
+            std::lock_guard<std::mutex> guard(g_lock);
+            buffer->tid = static_cast<uint32_t>(g_buffers.size());
+            g_buffers.push_back(buffer);
+        }
+
+        return *buffer;
+    }
+
+    // Chrome wants microseconds; keep the nanoseconds as a fraction.
+    void _append_us(std::string& out, const uint64_t ns)
+    {
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%llu.%03llu", static_cast<unsigned long long>(ns / 1000), static_cast<unsigned long long>(ns % 1000));
+        out += buf;
+    }
+
+    void _append_event(std::string& out, const uint32_t tid, const trace_event_t& e)
+    {
+        out += ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":";
+        out += std::to_string(tid);
+        out += ",\"cat\":\"";
+        out += e.category;
+        out += "\",\"name\":\"";
+        out += e.name;
+        out += "\",\"ts\":";
+        _append_us(out, e.start_ns);
+        out += ",\"dur\":";
+        _append_us(out, e.duration_ns);
+        out += ",\"args\":{\"bytes\":";
+        out += std::to_string(e.bytes);
+        out += ",\"files\":";
+        out += std::to_string(e.files);
+        out += "}}";
+    }
+}
+
+void menphina::trace_enable()
+{
+    _thread_buffer();
+    g_enabled.store(true, std::memory_order_relaxed);
+}
+
+bool menphina::trace_enabled()
+{
+    return g_enabled.load(std::memory_order_relaxed);
+}
+
+void menphina::trace_write(const std::string& file, std::ostream& out)
+{
+    std::vector<std::shared_ptr<thread_buffer_t>> buffers;
+    {
+        std::lock_guard<std::mutex> guard(g_lock);
+        buffers = g_buffers;
+    }
+
+    std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+        "{\"ph\":\"M\",\"pid\":1,\"name\":\"process_name\",\"args\":{\"name\":\"menphina\"}}";
+
+    // Keyed by (category, name); phases are reported in category order.
+    std::map<std::pair<std::string, std::string>, phase_total_t> totals;
+
+    for (const auto& b : buffers)
+    {
+        json += ",\n{\"ph\":\"M\",\"pid\":1,\"tid\":" + std::to_string(b->tid)
+            + ",\"name\":\"thread_name\",\"args\":{\"name\":\"" + ((b->tid == 0) ? std::string("main") : "worker " + std::to_string(b->tid)) + "\"}}";
+
+        for (const trace_event_t& e : b->events)
+        {
+            _append_event(json, b->tid, e);
+
+            phase_total_t& t = totals[{ e.category, e.name }];
+            ++t.spans;
+            t.duration_ns += e.duration_ns;
+            t.bytes += e.bytes;
+            t.files += e.files;
+        }
+    }
+
+    json += "\n]}\n";
+
+    const int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        throw menphina::file_open_exception(file, false);
+    }
+
+    const UniqueFd guard(fd);
+    write_all(fd, json.data(), json.size(), file);
+
+    // Time is summed over threads, so parallel phases can exceed wall time.
+    out << "Trace written to " << file << std::endl;
+    for (const auto& [key, t] : totals)
+    {
+        out << "  " << key.first << "/" << key.second << ": "
+            << t.spans << " spans, "
+            << static_cast<double>(t.duration_ns) / 1e6 << " ms, "
+            << t.bytes << " bytes, "
+            << t.files << " files"
+            << std::endl;
+    }
+}
+
+/* TraceSpan */
+
+menphina::TraceSpan::TraceSpan(const char * category, const char * name) :
+    m_category(category),
+    m_name(name),
+    m_start(trace_enabled() ? _now_ns() : NOT_TRACING),
+    m_bytes(0),
+    m_files(0)
+{
+}
+
+menphina::TraceSpan::~TraceSpan()
+{
+    if (m_start == NOT_TRACING)
+    {
+        return;
+    }
+
+    const uint64_t end = _now_ns();
+
+    // Allocation failure here must not take the traced code down with it.
+    try
+    {
+        _thread_buffer().events.push_back(trace_event_t { m_category, m_name, m_start, end - m_start, m_bytes, m_files });
+    }
+    catch (...)
+    {
+    }
+}
@@ -0,0 +1,271 @@
+/* Copyright 2024 isaki */
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "menphina/fileio.hpp"
+#include "menphina/hash.hpp"
+#include "menphina/iopolicy.hpp"
+#include "menphina/json.hpp"
+#include "menphina/parallel.hpp"
+#include "menphina/penumbra.hpp"
+#include "menphina/platform.hpp"
+#include "menphina/trace.hpp"
+#include "menphina/verify.hpp"
+#include "menphina/xmpkg.hpp"
+
+namespace
+{
+    enum class VerifyResult : uint8_t
+    {
+        Match = 0,
+        Missing,
+        NotAFile,
+        SizeMismatch,
+        ContentMismatch,
+        Unreadable
+    };
+
+    struct verify_entry_t
+    {
+        const menphina::xmpkg_mod_t * mod = nullptr;
+        const menphina::xmpkg_file_t * file = nullptr;
+        VerifyResult result = VerifyResult::Match;
+        uint64_t found_size = 0;
+        std::string error;
+    };
+
+    struct verify_stats_t
+    {
+        uint64_t files = 0;
+        uint64_t bytes_hashed = 0;
+        uint64_t matched = 0;
+        uint64_t missing = 0;
+        uint64_t mismatched = 0;
+        uint64_t unreadable = 0;
+    };
+
+    std::vector<const menphina::xmpkg_mod_t *> _select_mods(const menphina::XmpkgReader& reader, const std::vector<std::string>& names)
+    {
+        std::vector<const menphina::xmpkg_mod_t *> ret;
+
+        if (names.empty())
+        {
+            ret.reserve(reader.mods().size());
+            for (const auto& mod : reader.mods())
+            {
+                ret.push_back(&mod);
+            }
+
+            return ret;
+        }
+
+        ret.reserve(names.size());
+        for (const auto& name : names)
+        {
+            const menphina::xmpkg_mod_t * mod = reader.find_mod(name);
+            if (mod == nullptr)
+            {
+                throw std::runtime_error("Mod not found in " + reader.path() + ": " + name);
+            }
+
+            ret.push_back(mod);
+        }
+
+        return ret;
+    }
+
+    void _verify_file(verify_entry_t& entry, const std::string& full, std::vector<char>& buffer)
+    {
+        const menphina::UniqueFd fd(open(full.c_str(), O_RDONLY | O_CLOEXEC));
+        if (!fd.valid())
+        {
+            const int err = errno;
+            entry.result = (err == ENOENT || err == ENOTDIR) ? VerifyResult::Missing : VerifyResult::Unreadable;
+            entry.error = std::strerror(err);
+            return;
+        }
+
+        struct stat st {};
+        if (fstat(fd.get(), &st) != 0)
+        {
+            entry.result = VerifyResult::Unreadable;
+            entry.error = std::strerror(errno);
+            return;
+        }
+
+        if (!S_ISREG(st.st_mode))
+        {
+            entry.result = VerifyResult::NotAFile;
+            return;
+        }
+
+        entry.found_size = static_cast<uint64_t>(st.st_size);
+        if (entry.found_size != entry.file->size)
+        {
+            entry.result = VerifyResult::SizeMismatch;
+            return;
+        }
+
+        menphina::TraceSpan span(menphina::trace_category::HASH, "verify.file");
+        span.add_files(1);
+        span.add_bytes(entry.found_size);
+
+#if defined ( __linux__ )
+        posix_fadvise(fd.get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+        try
+        {
+            const menphina::content_hash_t hash = menphina::content_hash_fd(fd.get(), buffer);
+            if (hash.lo != entry.file->hash_lo || hash.hi != entry.file->hash_hi)
+            {
+                entry.result = VerifyResult::ContentMismatch;
+            }
+        }
+        catch (const std::exception& e)
+        {
+            entry.result = VerifyResult::Unreadable;
+            entry.error = e.what();
+        }
+    }
+}
+
+menphina::Verify::Verify(const std::string& packageFile, const std::vector<std::string>& mods) :
+    m_packageFile(packageFile),
+    m_mods(mods)
+{
+}
+
+menphina::Verify::~Verify() {}
+
+void menphina::Verify::run(const std::string_view& launcherDir)
+{
+    penumbra_config_t config {};
+    read_json_file(config, get_penumbra_config_file(launcherDir));
+
+    const std::string modDir = native_path(config.ModDirectory);
+    const io_policy_t policy = get_io_policy(modDir);
+
+    const XmpkgReader reader(m_packageFile);
+    const std::vector<const xmpkg_mod_t *> mods = _select_mods(reader, m_mods);
+
+    std::vector<verify_entry_t> entries;
+    for (const xmpkg_mod_t * mod : mods)
+    {
+        for (const xmpkg_file_t& file : reader.files(*mod))
+        {
+            verify_entry_t& entry = entries.emplace_back();
+            entry.mod = mod;
+            entry.file = &file;
+        }
+    }
+
+    // Largest first: handed out dynamically, the small files then fill in
+    // around the big ones instead of one big file running last on its own.
+    std::vector<size_t> order(entries.size());
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+        order[i] = i;
+    }
+
+    std::stable_sort(order.begin(), order.end(), [&entries](const size_t a, const size_t b) {
+        return entries[a].file->size > entries[b].file->size;
+    });
+
+    const unsigned threads = resolve_thread_count(0);
+    std::vector<std::vector<char>> buffers(threads, std::vector<char>(policy.transfer_length));
+    std::atomic<uint64_t> progress(0);
+
+    const auto start = std::chrono::steady_clock::now();
+
+    // Only the calling thread (worker 0) reports; any of them may stop.
+    parallel_for(order.size(), threads, [&](const size_t i, const unsigned worker)
+    {
+        check_cancelled();
+        const uint64_t done = progress.fetch_add(1, std::memory_order_relaxed);
+        if (worker == 0)
+        {
+            report_progress("verify", done, entries.size());
+        }
+
+        verify_entry_t& entry = entries[order[i]];
+        const std::string full = path_join(path_join(modDir, reader.name(*entry.mod)), reader.path(*entry.file));
+        _verify_file(entry, full, buffers[worker]);
+    });
+
+    report_progress("verify", entries.size(), entries.size());
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Reported in package order, so runs over the same tree read the same.
+    verify_stats_t stats;
+    for (const verify_entry_t& entry : entries)
+    {
+        ++stats.files;
+
+        const std::string name = path_join(reader.name(*entry.mod), reader.path(*entry.file));
+        switch (entry.result)
+        {
+            case VerifyResult::Match:
+                ++stats.matched;
+                stats.bytes_hashed += entry.file->size;
+                break;
+            case VerifyResult::Missing:
+                ++stats.missing;
+                std::cout << "Missing: " << name << std::endl;
+                break;
+            case VerifyResult::NotAFile:
+                ++stats.mismatched;
+                std::cout << "Not a file: " << name << std::endl;
+                break;
+            case VerifyResult::SizeMismatch:
+                ++stats.mismatched;
+                std::cout << "Size mismatch: " << name << " (expected " << entry.file->size << " bytes, found " << entry.found_size << ")" << std::endl;
+                break;
+            case VerifyResult::ContentMismatch:
+                ++stats.mismatched;
+                stats.bytes_hashed += entry.file->size;
+                std::cout << "Content mismatch: " << name << std::endl;
+                break;
+            case VerifyResult::Unreadable:
+                ++stats.unreadable;
+                std::cerr << "Unable to read " << name << ": " << entry.error << std::endl;
+                break;
+        }
+    }
+
+    const double rate = (seconds > 0.0) ? static_cast<double>(stats.bytes_hashed) / seconds / (1024.0 * 1024.0) : 0.0;
+
+    std::cout << "Verified " << stats.files << " files in "
+        << mods.size() << " mods against " << m_packageFile
+        << " (" << io_policy_name(policy.kind) << " I/O, "
+        << content_hash_isa() << " hash, "
+        << threads << " threads): "
+        << stats.matched << " match, "
+        << stats.mismatched << " differ, "
+        << stats.missing << " missing, "
+        << stats.unreadable << " unreadable; "
+        << stats.bytes_hashed << " bytes hashed at "
+        << static_cast<uint64_t>(rate) << " MiB/s"
+        << std::endl;
+
+    const uint64_t problems = stats.mismatched + stats.missing + stats.unreadable;
+    if (problems != 0)
+    {
+        throw std::runtime_error(std::to_string(problems) + " files do not match " + m_packageFile);
+    }
+}
@@ -0,0 +1,696 @@
+/* Copyright 2024 isaki */
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#if defined ( __linux__ )
+#include <sys/inotify.h>
+#endif
+
+#include "menphina/clean.hpp"
+#include "menphina/fileio.hpp"
+#include "menphina/iopolicy.hpp"
+#include "menphina/m_exception.hpp"
+#include "menphina/penumbra.hpp"
+#include "menphina/platform.hpp"
+#include "menphina/watch.hpp"
+
+namespace
+{
+    const std::string REQUEST_CLEAN { "clean" };
+    const std::string REPLY_OK { "ok" };
+    const std::string REPLY_UNSUPPORTED { "unsupported" };
+    const std::string REPLY_DONE { "done" };
+    const std::string REPLY_FAILED { "failed: " };
+
+    inline constexpr size_t MAX_REQUEST_LENGTH = 64 * 1024;
+
+    bool _socket_address(const std::string& file, struct sockaddr_un& addr)
+    {
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+
+        if (file.size() >= sizeof(addr.sun_path))
+        {
+            return false;
+        }
+
+        std::memcpy(addr.sun_path, file.data(), file.size());
+        return true;
+    }
+
+    // Invalid if nothing is listening on file.
+    menphina::UniqueFd _connect(const std::string& file)
+    {
+        struct sockaddr_un addr;
+        if (!_socket_address(file, addr))
+        {
+            return menphina::UniqueFd();
+        }
+
+        menphina::UniqueFd fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+        if (!fd.valid())
+        {
+            return fd;
+        }
+
+        if (connect(fd.get(), reinterpret_cast<const struct sockaddr *>(&addr), sizeof(addr)) != 0)
+        {
+            fd.reset();
+        }
+
+        return fd;
+    }
+
+    void _send_all(const int fd, const std::string_view data)
+    {
+        size_t done = 0;
+        while (done < data.size())
+        {
+            const ssize_t n = send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+            if (n < 0)
+            {
+                const int err = errno;
+                if (err == EINTR)
+                {
+                    continue;
+                }
+
+                throw menphina::errno_exception("Failed to write to the watch socket", err);
+            }
+
+            done += static_cast<size_t>(n);
+        }
+    }
+
+    // Reads until EOF, or until a newline when line is set.
+    std::string _receive(const int fd, const bool line)
+    {
+        std::string ret;
+        char buffer[4096];
+
+        for (;;)
+        {
+            if (line && ret.find('\n') != std::string::npos)
+            {
+                return ret.substr(0, ret.find('\n'));
+            }
+
+            if (line && ret.size() > MAX_REQUEST_LENGTH)
+            {
+                throw std::runtime_error("Request on the watch socket is too long");
+            }
+
+            const ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+            if (n < 0)
+            {
+                const int err = errno;
+                if (err == EINTR)
+                {
+                    continue;
+                }
+
+                throw menphina::errno_exception("Failed to read from the watch socket", err);
+            }
+
+            if (n == 0)
+            {
+                return ret;
+            }
+
+            ret.append(buffer, static_cast<size_t>(n));
+        }
+    }
+
+    // Launcher directories are compared in this form on both ends.
+    std::string _canonical(const std::string_view path)
+    {
+        std::error_code ec;
+        const std::filesystem::path p = std::filesystem::weakly_canonical(std::filesystem::path(path), ec);
+        return (ec) ? std::string(path) : p.string();
+    }
+
+#if defined ( __linux__ )
+    // Events are applied once nothing has happened for QUIET_MS, and at the
+    // latest MAX_DELAY_MS after the first one; unpacking a mod produces
+    // thousands of events in one burst.
+    inline constexpr int QUIET_MS = 250;
+    inline constexpr int MAX_DELAY_MS = 2000;
+
+    // How often an idle loop looks for cancellation.
+    inline constexpr int IDLE_POLL_MS = 500;
+
+    inline constexpr time_t REQUEST_TIMEOUT_S = 5;
+
+    inline constexpr uint32_t WATCH_MASK = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB
+        | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+    using clock_type = std::chrono::steady_clock;
+
+    // The socket clean requests come in on; removed again on destruction.
+    class ListeningSocket final
+    {
+        public:
+            explicit ListeningSocket(const std::string& file) : m_file(file)
+            {
+                struct sockaddr_un addr;
+                if (!_socket_address(file, addr))
+                {
+                    throw std::runtime_error("Socket path too long: " + file);
+                }
+
+                if (_connect(file).valid())
+                {
+                    throw std::runtime_error("Another watch process is already listening on " + file);
+                }
+
+                // Nobody answers; left behind by a watch process that died.
+                unlink(file.c_str());
+
+                m_fd.reset(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+                if (!m_fd.valid())
+                {
+                    const int err = errno;
+                    throw menphina::errno_exception("Unable to create socket", err);
+                }
+
+                if (bind(m_fd.get(), reinterpret_cast<const struct sockaddr *>(&addr), sizeof(addr)) != 0)
+                {
+                    const int err = errno;
+                    throw menphina::errno_exception("Unable to bind " + file, err);
+                }
+
+                // Cleaning edits the user's configuration; nobody else gets
+                // to ask for it.
+                if (chmod(file.c_str(), S_IRUSR | S_IWUSR) != 0 || listen(m_fd.get(), 8) != 0)
+                {
+                    const int err = errno;
+                    unlink(file.c_str());
+                    throw menphina::errno_exception("Unable to listen on " + file, err);
+                }
+            }
+
+            ~ListeningSocket()
+            {
+                m_fd.reset();
+                unlink(m_file.c_str());
+            }
+
+            ListeningSocket(const ListeningSocket&) = delete;
+            ListeningSocket& operator=(const ListeningSocket&) = delete;
+
+            inline int fd() const
+            {
+                return m_fd.get();
+            }
+
+        private:
+            std::string m_file;
+            menphina::UniqueFd m_fd;
+    };
+
+    enum class WatchKind : uint8_t
+    {
+        ModDirectory = 0,
+        Mod = 1,
+        Config = 2
+    };
+
+    struct watch_t
+    {
+        WatchKind kind;
+        std::string path;
+
+        // The mod the directory belongs to; only for WatchKind::Mod.
+        std::string mod;
+    };
+
+    // What the events read since the last apply amount to.
+    struct changes_t
+    {
+        std::set<std::string> mods;
+        bool config = false;
+
+        // Events were lost or the ModDirectory itself went away.
+        bool rescan = false;
+
+        inline bool empty() const
+        {
+            return mods.empty() && !config && !rescan;
+        }
+    };
+
+    class Watcher final
+    {
+        public:
+            Watcher() : m_fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)), m_degraded(false)
+            {
+                if (!m_fd.valid())
+                {
+                    const int err = errno;
+                    throw menphina::errno_exception("inotify_init1 failed", err);
+                }
+            }
+
+            inline int fd() const
+            {
+                return m_fd.get();
+            }
+
+            inline size_t size() const
+            {
+                return m_watches.size();
+            }
+
+            // Set once a directory could not be watched; changes below it
+            // go unnoticed, so the caller has to rescan instead.
+            inline bool degraded() const
+            {
+                return m_degraded;
+            }
+
+            // With follow set a link to a directory is watched through;
+            // mod roots may be links, like in the full scan.
+            void watch(const std::string& path, const WatchKind kind, const std::string& mod = {}, const bool follow = false)
+            {
+                const uint32_t mask = (follow) ? WATCH_MASK & ~static_cast<uint32_t>(IN_DONT_FOLLOW) : WATCH_MASK;
+                const int wd = inotify_add_watch(m_fd.get(), path.c_str(), mask);
+                if (wd != -1)
+                {
+                    // The same directory gives the same descriptor back; a
+                    // renamed mod takes its directories over this way.
+                    m_watches.insert_or_assign(wd, watch_t { kind, path, mod });
+                    return;
+                }
+
+                const int err = errno;
+                if (err == ENOENT || err == ENOTDIR)
+                {
+                    // Gone again already; its parent reported that.
+                    return;
+                }
+
+                if (!m_degraded)
+                {
+                    std::cerr << "warning: unable to watch " << path << " (" << std::strerror(err) << ")";
+                    if (err == ENOSPC)
+                    {
+                        std::cerr << "; raise fs.inotify.max_user_watches";
+                    }
+
+                    std::cerr << "; rescanning on every clean request instead" << std::endl;
+                }
+
+                m_degraded = true;
+            }
+
+            void watch_mod(const menphina::CleanState& state, const std::string& name)
+            {
+                const std::string root = menphina::path_join(state.mod_directory(), name);
+                for (const auto& dir : state.mod_directories(name))
+                {
+                    watch((dir.empty()) ? root : menphina::path_join(root, dir), WatchKind::Mod, name, dir.empty());
+                }
+            }
+
+            // Reads everything queued; returns false if nothing was.
+            bool read(changes_t& changes)
+            {
+                alignas(struct inotify_event) char buffer[64 * 1024];
+                bool any = false;
+
+                for (;;)
+                {
+                    const ssize_t n = ::read(m_fd.get(), buffer, sizeof(buffer));
+                    if (n < 0)
+                    {
+                        const int err = errno;
+                        if (err == EINTR)
+                        {
+                            continue;
+                        }
+
+                        if (err == EAGAIN)
+                        {
+                            return any;
+                        }
+
+                        throw menphina::errno_exception("Failed to read inotify events", err);
+                    }
+
+                    any = true;
+
+                    for (ssize_t pos = 0; pos < n;)
+                    {
+                        const struct inotify_event * ev = reinterpret_cast<const struct inotify_event *>(buffer + pos);
+                        pos += static_cast<ssize_t>(sizeof(struct inotify_event) + ev->len);
+                        handle(*ev, changes);
+                    }
+                }
+            }
+
+        private:
+            menphina::UniqueFd m_fd;
+            std::unordered_map<int, watch_t> m_watches;
+            bool m_degraded;
+
+            void handle(const struct inotify_event& ev, changes_t& changes)
+            {
+                if (ev.mask & IN_Q_OVERFLOW)
+                {
+                    changes.rescan = true;
+                    return;
+                }
+
+                const auto found = m_watches.find(ev.wd);
+                if (found == m_watches.end())
+                {
+                    return;
+                }
+
+                if (ev.mask & IN_IGNORED)
+                {
+                    m_watches.erase(found);
+                    return;
+                }
+
+                const watch_t& w = found->second;
+                const std::string_view name = (ev.len != 0) ? std::string_view(ev.name) : std::string_view {};
+
+                switch (w.kind)
+                {
+                    case WatchKind::ModDirectory:
+                        if (ev.mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+                        {
+                            changes.rescan = true;
+                        }
+                        else if (!name.empty())
+                        {
+                            // Not only directories: a link to one is a mod
+                            // too, and refresh_mod sorts out the rest.
+                            changes.mods.emplace(name);
+                        }
+                        break;
+                    case WatchKind::Mod:
+                        changes.mods.insert(w.mod);
+                        break;
+                    case WatchKind::Config:
+                        changes.config = true;
+                        if ((ev.mask & IN_ISDIR) && (ev.mask & (IN_CREATE | IN_MOVED_TO)) && !name.empty())
+                        {
+                            // The collections directory showing up.
+                            watch(menphina::path_join(w.path, name), WatchKind::Config);
+                        }
+                        break;
+                }
+            }
+    };
+#endif
+}
+
+menphina::Watch::Watch(const std::string& indexFile, const std::string& socketFile) :
+    m_indexFile(indexFile),
+    m_socketFile(socketFile)
+{
+}
+
+menphina::Watch::~Watch() {}
+
+#if defined ( __linux__ )
+void menphina::Watch::run(const std::string_view& launcherDir)
+{
+    const std::string served = _canonical(launcherDir);
+
+    CleanState state(launcherDir, m_indexFile, [this]([[maybe_unused]] const char * phase, [[maybe_unused]] const uint64_t done, [[maybe_unused]] const uint64_t total)
+    {
+        check_cancelled();
+    });
+
+    const ListeningSocket listener(m_socketFile);
+    Watcher watcher;
+
+    // Watches go in before the scan so nothing that happens during it is
+    // missed; at worst a mod gets rescanned once more.
+    watcher.watch(state.mod_directory(), WatchKind::ModDirectory);
+    watcher.watch(state.config_directory(), WatchKind::Config);
+    watcher.watch(get_penumbra_collections_dir(launcherDir), WatchKind::Config);
+
+    state.refresh(std::cout, std::cerr);
+    for (const auto& name : state.mods())
+    {
+        watcher.watch_mod(state, name);
+    }
+
+    // Changes made from Windows to a drvfs or 9p mount never produce inotify
+    // events, so there every request rescans; with the reference index that
+    // still only costs the scan.
+    const bool remote = get_io_policy(state.mod_directory()).kind == IoPolicyKind::Remote;
+    if (remote)
+    {
+        std::cerr << "warning: " << state.mod_directory() << " is on a remote filesystem that inotify cannot see changes on;"
+            << " rescanning on every clean request" << std::endl;
+    }
+
+    std::cout << "Watching " << state.mod_directory() << " and " << state.config_directory()
+        << " (" << watcher.size() << " directories); clean requests on " << m_socketFile << std::endl;
+
+    changes_t changes;
+    clock_type::time_point firstEvent;
+    clock_type::time_point lastEvent;
+    uint64_t requests = 0;
+
+    const auto apply = [&state, &watcher, &changes]()
+    {
+        if (changes.rescan)
+        {
+            state.refresh(std::cout, std::cerr);
+            for (const auto& name : state.mods())
+            {
+                watcher.watch_mod(state, name);
+            }
+        }
+        else
+        {
+            for (const auto& name : changes.mods)
+            {
+                state.refresh_mod(name);
+                watcher.watch_mod(state, name);
+            }
+
+            if (!changes.mods.empty())
+            {
+                std::cout << "Updated " << changes.mods.size() << " mods" << std::endl;
+            }
+        }
+
+        if (changes.config)
+        {
+            state.refresh_config();
+        }
+
+        changes = changes_t {};
+    };
+
+    const auto serve = [&](const int client)
+    {
+        const struct timeval timeout { .tv_sec = REQUEST_TIMEOUT_S, .tv_usec = 0 };
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        const std::string request = _receive(client, true);
+        if (request.empty())
+        {
+            // Another watch process checking whether this one is alive.
+            return;
+        }
+
+        const size_t space = request.find(' ');
+        if (request.substr(0, space) != REQUEST_CLEAN || space == std::string::npos || request.substr(space + 1) != served)
+        {
+            _send_all(client, REPLY_UNSUPPORTED + "\n");
+            return;
+        }
+
+        // Whatever happened up to now has to be in the answer.
+        watcher.read(changes);
+        changes.rescan = changes.rescan || remote || watcher.degraded() || !state.complete();
+        apply();
+
+        std::ostringstream out;
+        std::string status = REPLY_DONE;
+        try
+        {
+            state.clean(out, out);
+        }
+        catch (const menphina::cancelled_exception&)
+        {
+            throw;
+        }
+        catch (const std::exception& e)
+        {
+            status = REPLY_FAILED + e.what();
+        }
+
+        _send_all(client, REPLY_OK + "\n" + out.str() + status + "\n");
+
+        report_progress("watch", ++requests, 0);
+        std::cout << "Answered clean request " << requests << std::endl;
+    };
+
+    report_progress("watch", 0, 0);
+
+    for (;;)
+    {
+        check_cancelled();
+
+        const clock_type::time_point now = clock_type::now();
+
+        int timeout = IDLE_POLL_MS;
+        if (!changes.empty())
+        {
+            const clock_type::time_point due = std::min(lastEvent + std::chrono::milliseconds(QUIET_MS), firstEvent + std::chrono::milliseconds(MAX_DELAY_MS));
+            timeout = static_cast<int>(std::clamp<int64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(due - now).count(), 0, IDLE_POLL_MS));
+        }
+
+        struct pollfd fds[2] = {
+            { .fd = watcher.fd(), .events = POLLIN, .revents = 0 },
+            { .fd = listener.fd(), .events = POLLIN, .revents = 0 }
+        };
+
+        if (poll(fds, 2, timeout) < 0)
+        {
+            const int err = errno;
+            if (err == EINTR)
+            {
+                continue;
+            }
+
+            throw menphina::errno_exception("poll failed", err);
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            const bool idle = changes.empty();
+            if (watcher.read(changes))
+            {
+                lastEvent = clock_type::now();
+                if (idle)
+                {
+                    firstEvent = lastEvent;
+                }
+            }
+        }
+
+        if (!changes.empty())
+        {
+            const clock_type::time_point t = clock_type::now();
+            if (t >= lastEvent + std::chrono::milliseconds(QUIET_MS) || t >= firstEvent + std::chrono::milliseconds(MAX_DELAY_MS))
+            {
+                try
+                {
+                    apply();
+                }
+                catch (const menphina::cancelled_exception&)
+                {
+                    throw;
+                }
+                catch (const std::exception& e)
+                {
+                    // Typically a directory vanishing mid-scan; the next
+                    // request starts over from a full scan.
+                    std::cerr << "warning: " << e.what() << std::endl;
+                    changes = changes_t {};
+                    changes.rescan = true;
+                    firstEvent = lastEvent = clock_type::now();
+                }
+            }
+        }
+
+        if (fds[1].revents & POLLIN)
+        {
+            const UniqueFd client(accept4(listener.fd(), nullptr, nullptr, SOCK_CLOEXEC));
+            if (!client.valid())
+            {
+                continue;
+            }
+
+            try
+            {
+                serve(client.get());
+            }
+            catch (const menphina::cancelled_exception&)
+            {
+                throw;
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << "warning: clean request failed: " << e.what() << std::endl;
+            }
+        }
+    }
+}
+#else
+void menphina::Watch::run([[maybe_unused]] const std::string_view& launcherDir)
+{
+    throw std::runtime_error("watch mode requires inotify (Linux)");
+}
+#endif
+
+bool menphina::watch_request_clean(const std::string& socketFile, const std::string_view launcherDir, std::ostream& out)
+{
+    const UniqueFd fd = _connect(socketFile);
+    if (!fd.valid())
+    {
+        return false;
+    }
+
+    _send_all(fd.get(), REQUEST_CLEAN + " " + _canonical(launcherDir) + "\n");
+    const std::string reply = _receive(fd.get(), false);
+
+    if (!reply.starts_with(REPLY_OK + "\n"))
+    {
+        return false;
+    }
+
+    // "ok\n" <output> <status> "\n"
+    const std::string_view body = std::string_view(reply).substr(REPLY_OK.size() + 1);
+    const size_t statusStart = (body.size() >= 2) ? body.rfind('\n', body.size() - 2) : std::string_view::npos;
+    const std::string_view output = (statusStart == std::string_view::npos) ? std::string_view {} : body.substr(0, statusStart + 1);
+    std::string_view status = (statusStart == std::string_view::npos) ? body : body.substr(statusStart + 1);
+
+    if (!status.ends_with('\n'))
+    {
+        throw std::runtime_error("The watch process closed the connection early");
+    }
+
+    status.remove_suffix(1);
+    out << output << std::flush;
+
+    if (status.starts_with(REPLY_FAILED))
+    {
+        throw std::runtime_error(std::string(status.substr(REPLY_FAILED.size())));
+    }
+
+    if (status != REPLY_DONE)
+    {
+        throw std::runtime_error("Unexpected reply from the watch process: " + std::string(status));
+    }
+
+    return true;
+}
@@ -0,0 +1,839 @@
+/* Copyright 2024 isaki */
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <limits>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "menphina/fileio.hpp"
+#include "menphina/hash.hpp"
+#include "menphina/m_exception.hpp"
+#include "menphina/platform.hpp"
+#include "menphina/trace.hpp"
+#include "menphina/xmdelta.hpp"
+#include "menphina/xmpkg.hpp"
+
+namespace
+{
+    static_assert(std::endian::native == std::endian::little, "xmdelta is written in host byte order");
+
+    inline constexpr uint64_t MAX_STRING_LENGTH = std::numeric_limits<uint32_t>::max();
+    inline constexpr uint64_t TABLE_ALIGNMENT = 8;
+
+    // Block sizes follow rsync: about the square root of the base file,
+    // within these bounds.
+    inline constexpr size_t MIN_BLOCK_SIZE = 1024;
+    inline constexpr size_t MAX_BLOCK_SIZE = 128 * 1024;
+
+    // A matching tail shorter than this costs more as an op than as data.
+    inline constexpr size_t MIN_TAIL_MATCH = 64;
+
+    inline constexpr uint32_t NO_BLOCK = std::numeric_limits<uint32_t>::max();
+
+    inline menphina::content_hash_t _file_hash(const menphina::xmpkg_file_t& f)
+    {
+        return menphina::content_hash_t { f.hash_lo, f.hash_hi };
+    }
+
+    [[noreturn]] void _corrupt(const std::string& path, const std::string_view what)
+    {
+        throw std::runtime_error("Corrupt xmdelta " + path + ": " + std::string(what));
+    }
+
+    size_t _block_size(const size_t baseSize)
+    {
+        const size_t root = static_cast<size_t>(std::sqrt(static_cast<double>(baseSize)));
+        return std::clamp((root + 63) & ~size_t { 63 }, MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+    }
+
+    // rsync's weak checksum: two 16 bit sums over a window, updated in O(1)
+    // as the window slides by a byte.
+    class RollingChecksum final
+    {
+        public:
+            void reset(const unsigned char * data, const size_t length)
+            {
+                m_a = 0;
+                m_b = 0;
+                for (size_t i = 0; i < length; ++i)
+                {
+                    m_a += data[i];
+                    m_b += static_cast<uint32_t>(length - i) * data[i];
+                }
+            }
+
+            inline void roll(const unsigned char out, const unsigned char in, const size_t length)
+            {
+                m_a += static_cast<uint32_t>(in) - out;
+                m_b += m_a - static_cast<uint32_t>(length) * out;
+            }
+
+            inline uint32_t value() const
+            {
+                return (m_a & 0xFFFF) | (m_b << 16);
+            }
+
+        private:
+            uint32_t m_a = 0;
+            uint32_t m_b = 0;
+    };
+
+    // The blocks of a base file by weak checksum.
+    class BlockTable final
+    {
+        public:
+            BlockTable(const std::span<const unsigned char> base, const size_t blockSize) :
+                m_base(base),
+                m_blockSize(blockSize),
+                m_filter(FILTER_WORDS, 0)
+            {
+                const size_t blocks = base.size() / blockSize;
+                m_entries.reserve(blocks);
+
+                RollingChecksum sum;
+                for (size_t i = 0; i < blocks; ++i)
+                {
+                    sum.reset(base.data() + i * blockSize, blockSize);
+                    const uint32_t weak = sum.value();
+                    m_entries.emplace_back(weak, static_cast<uint32_t>(i));
+                    m_filter[_filter_bit(weak) / 64] |= uint64_t { 1 } << (_filter_bit(weak) % 64);
+                }
+
+                // Stable, so equal blocks are tried front to back.
+                std::stable_sort(m_entries.begin(), m_entries.end(), [](const auto& a, const auto& b) {
+                    return a.first < b.first;
+                });
+            }
+
+            inline size_t blocks() const
+            {
+                return m_base.size() / m_blockSize;
+            }
+
+            inline bool matches(const uint32_t block, const unsigned char * data) const
+            {
+                return block < blocks() && std::memcmp(m_base.data() + static_cast<size_t>(block) * m_blockSize, data, m_blockSize) == 0;
+            }
+
+            // A block with checksum weak and the content at data, if any.
+            uint32_t find(const uint32_t weak, const unsigned char * data) const
+            {
+                if ((m_filter[_filter_bit(weak) / 64] & (uint64_t { 1 } << (_filter_bit(weak) % 64))) == 0)
+                {
+                    return NO_BLOCK;
+                }
+
+                auto it = std::lower_bound(m_entries.begin(), m_entries.end(), weak, [](const auto& e, const uint32_t w) {
+                    return e.first < w;
+                });
+
+                for (; it != m_entries.end() && it->first == weak; ++it)
+                {
+                    if (matches(it->second, data))
+                    {
+                        return it->second;
+                    }
+                }
+
+                return NO_BLOCK;
+            }
+
+        private:
+            static constexpr size_t FILTER_WORDS = 1024;
+
+            static inline size_t _filter_bit(const uint32_t weak)
+            {
+                return ((weak >> 16) ^ (weak * 0x9E3779B1u)) % (FILTER_WORDS * 64);
+            }
+
+            std::span<const unsigned char> m_base;
+            size_t m_blockSize;
+            std::vector<std::pair<uint32_t, uint32_t>> m_entries;
+            std::vector<uint64_t> m_filter;
+    };
+
+    // Builds the ops that turn base into target. Literal ops are left
+    // pointing into target; the writer moves their data into the delta.
+    void _match(const std::span<const unsigned char> base, const std::span<const unsigned char> target, std::vector<menphina::xmdelta_op_t>& ops)
+    {
+        ops.clear();
+
+        const auto emit = [&ops](const menphina::DeltaOpKind kind, const uint64_t offset, const uint64_t length)
+        {
+            if (length == 0)
+            {
+                return;
+            }
+
+            if (!ops.empty())
+            {
+                menphina::xmdelta_op_t& last = ops.back();
+                if (last.kind == static_cast<uint32_t>(kind) && last.offset + last.length == offset)
+                {
+                    last.length += length;
+                    return;
+                }
+            }
+
+            ops.push_back(menphina::xmdelta_op_t { .offset = offset, .length = length, .kind = static_cast<uint32_t>(kind), .reserved = 0 });
+        };
+
+        // Appends and edits near the start leave a long common tail that
+        // no whole block of the base lines up with.
+        size_t tail = 0;
+        const size_t maxTail = std::min(base.size(), target.size());
+        while (tail < maxTail && base[base.size() - 1 - tail] == target[target.size() - 1 - tail])
+        {
+            ++tail;
+        }
+
+        if (tail < MIN_TAIL_MATCH)
+        {
+            tail = 0;
+        }
+
+        const size_t end = target.size() - tail;
+        const size_t blockSize = _block_size(base.size());
+        size_t literalStart = 0;
+        size_t pos = 0;
+
+        if (base.size() >= blockSize && end >= blockSize)
+        {
+            const BlockTable table(base, blockSize);
+            const unsigned char * data = target.data();
+
+            RollingChecksum sum;
+            sum.reset(data, blockSize);
+
+            // After a match the next block is the likeliest one to follow.
+            uint32_t expected = NO_BLOCK;
+
+            while (pos + blockSize <= end)
+            {
+                uint32_t block = NO_BLOCK;
+                if (expected != NO_BLOCK && table.matches(expected, data + pos))
+                {
+                    block = expected;
+                }
+                else
+                {
+                    block = table.find(sum.value(), data + pos);
+                }
+
+                if (block != NO_BLOCK)
+                {
+                    emit(menphina::DeltaOpKind::Literal, literalStart, pos - literalStart);
+                    emit(menphina::DeltaOpKind::Copy, static_cast<uint64_t>(block) * blockSize, blockSize);
+
+                    pos += blockSize;
+                    literalStart = pos;
+                    expected = block + 1;
+
+                    if (pos + blockSize <= end)
+                    {
+                        sum.reset(data + pos, blockSize);
+                    }
+
+                    continue;
+                }
+
+                expected = NO_BLOCK;
+                if (pos + blockSize == end)
+                {
+                    break;
+                }
+
+                sum.roll(data[pos], data[pos + blockSize], blockSize);
+                ++pos;
+            }
+        }
+
+        emit(menphina::DeltaOpKind::Literal, literalStart, end - literalStart);
+        emit(menphina::DeltaOpKind::Copy, base.size() - tail, tail);
+    }
+
+    inline std::span<const unsigned char> _bytes(const std::vector<char>& v)
+    {
+        return std::span<const unsigned char>(reinterpret_cast<const unsigned char *>(v.data()), v.size());
+    }
+
+    class DeltaWriter final
+    {
+        public:
+            explicit DeltaWriter(const std::string& path) :
+                m_offset(0),
+                m_finished(false)
+            {
+                const std::filesystem::path target(path);
+                const std::string dir = (target.has_parent_path()) ? target.parent_path().string() : std::string(".");
+                m_dirFd.reset(open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+                if (!m_dirFd.valid())
+                {
+                    const int err = errno;
+                    throw menphina::errno_exception("Unable to open directory " + dir, err);
+                }
+
+                m_name = target.filename().string();
+                m_staged = menphina::staging_name(m_name);
+                m_stagedPath = menphina::path_join(dir, m_staged);
+                m_fd = menphina::open_staged(m_dirFd.get(), m_staged);
+                m_offset = sizeof(menphina::xmdelta_header_t);
+            }
+
+            ~DeltaWriter()
+            {
+                if (!m_finished)
+                {
+                    m_fd.reset();
+                    menphina::discard_staged(m_dirFd.get(), m_staged);
+                }
+            }
+
+            DeltaWriter(const DeltaWriter&) = delete;
+            DeltaWriter& operator=(const DeltaWriter&) = delete;
+
+            inline menphina::xmdelta_write_stats_t& stats()
+            {
+                return m_stats;
+            }
+
+            void begin_mod(const std::string_view name)
+            {
+                m_mods.push_back(menphina::xmdelta_mod_t {
+                    .name_offset = add_string(name),
+                    .name_length = static_cast<uint32_t>(name.size()),
+                    .reserved = 0,
+                    .first_file = m_files.size(),
+                    .file_count = 0
+                });
+
+                ++m_stats.mods;
+            }
+
+            // file only needs its target fields and kind set; ops are as
+            // _match() left them.
+            void add_file(menphina::xmdelta_file_t file, const std::string_view path, const std::string_view baseMod, const std::string_view basePath,
+                const std::span<const unsigned char> target, const std::vector<menphina::xmdelta_op_t>& ops)
+            {
+                file.path_offset = add_string(path);
+                file.path_length = static_cast<uint32_t>(path.size());
+                file.base_mod_offset = add_string(baseMod);
+                file.base_mod_length = static_cast<uint32_t>(baseMod.size());
+                file.base_path_offset = add_string(basePath);
+                file.base_path_length = static_cast<uint32_t>(basePath.size());
+                file.first_op = m_ops.size();
+                file.op_count = ops.size();
+
+                for (menphina::xmdelta_op_t op : ops)
+                {
+                    if (op.kind == static_cast<uint32_t>(menphina::DeltaOpKind::Literal))
+                    {
+                        op.offset = write_literal(target.subspan(op.offset, op.length), file.kind == static_cast<uint32_t>(menphina::DeltaFileKind::Whole));
+                        m_stats.literal_bytes += op.length;
+                    }
+                    else
+                    {
+                        m_stats.copied_bytes += op.length;
+                    }
+
+                    m_ops.push_back(op);
+                }
+
+                m_files.push_back(file);
+                ++m_mods.back().file_count;
+                ++m_stats.files;
+            }
+
+            void finish(const uint64_t baseSize, const uint64_t targetSize)
+            {
+                menphina::TraceSpan span(menphina::trace_category::WRITE, "delta.index");
+
+                menphina::xmdelta_trailer_t trailer {};
+                trailer.op_count = m_ops.size();
+                trailer.op_table_offset = write_table(m_ops);
+                trailer.mod_count = m_mods.size();
+                trailer.mod_table_offset = write_table(m_mods);
+                trailer.file_count = m_files.size();
+                trailer.file_table_offset = write_table(m_files);
+
+                trailer.strings_offset = m_offset;
+                trailer.strings_size = m_strings.size();
+                menphina::pwrite_all(m_fd.get(), m_strings.data(), m_strings.size(), m_offset, m_stagedPath);
+                m_offset += m_strings.size();
+
+                trailer.version = menphina::XMDELTA_VERSION;
+                trailer.magic = menphina::XMDELTA_MAGIC;
+                menphina::pwrite_all(m_fd.get(), &trailer, sizeof(trailer), m_offset, m_stagedPath);
+                m_offset += sizeof(trailer);
+
+                // Written last, so a delta cut short never looks complete.
+                const menphina::xmdelta_header_t header {
+                    .magic = menphina::XMDELTA_MAGIC,
+                    .version = menphina::XMDELTA_VERSION,
+                    .reserved = 0,
+                    .base_size = baseSize,
+                    .target_size = targetSize
+                };
+
+                menphina::pwrite_all(m_fd.get(), &header, sizeof(header), 0, m_stagedPath);
+
+                if (fsync(m_fd.get()) != 0)
+                {
+                    const int err = errno;
+                    throw menphina::errno_exception("Failed to sync " + m_stagedPath, err);
+                }
+
+                m_fd.reset();
+                menphina::publish_staged(m_dirFd.get(), m_staged, m_name, true);
+
+                m_stats.delta_size = m_offset;
+                m_finished = true;
+            }
+
+        private:
+            menphina::UniqueFd m_dirFd;
+            std::string m_name;
+            std::string m_staged;
+            std::string m_stagedPath;
+            menphina::UniqueFd m_fd;
+            uint64_t m_offset;
+            bool m_finished;
+
+            std::vector<menphina::xmdelta_op_t> m_ops;
+            std::vector<menphina::xmdelta_mod_t> m_mods;
+            std::vector<menphina::xmdelta_file_t> m_files;
+            std::string m_strings;
+
+            // Whole files already written, by content.
+            std::unordered_map<menphina::content_hash_t, uint64_t, menphina::content_hash_hasher> m_wholeData;
+
+            menphina::xmdelta_write_stats_t m_stats;
+
+            uint64_t add_string(const std::string_view s)
+            {
+                if (s.size() > MAX_STRING_LENGTH) [[unlikely]]
+                {
+                    throw std::runtime_error("xmdelta string too long");
+                }
+
+                const uint64_t ret = m_strings.size();
+                m_strings.append(s);
+                return ret;
+            }
+
+            uint64_t write_literal(const std::span<const unsigned char> data, const bool whole)
+            {
+                menphina::content_hash_t hash;
+                if (whole)
+                {
+                    hash = menphina::content_hash(data.data(), data.size());
+                    const auto found = m_wholeData.find(hash);
+                    if (found != m_wholeData.end())
+                    {
+                        m_stats.duplicate_bytes += data.size();
+                        return found->second;
+                    }
+                }
+
+                menphina::TraceSpan span(menphina::trace_category::WRITE, "delta.write");
+                span.add_bytes(data.size());
+
+                const uint64_t ret = m_offset;
+                menphina::pwrite_all(m_fd.get(), data.data(), data.size(), m_offset, m_stagedPath);
+                m_offset += data.size();
+
+                if (whole)
+                {
+                    m_wholeData.emplace(hash, ret);
+                }
+
+                return ret;
+            }
+
+            template<class T>
+            uint64_t write_table(const std::vector<T>& table)
+            {
+                static constexpr char zeros[TABLE_ALIGNMENT] = {};
+
+                const uint64_t pad = (TABLE_ALIGNMENT - (m_offset % TABLE_ALIGNMENT)) % TABLE_ALIGNMENT;
+                menphina::pwrite_all(m_fd.get(), zeros, pad, m_offset, m_stagedPath);
+                m_offset += pad;
+
+                const uint64_t ret = m_offset;
+                const size_t length = table.size() * sizeof(T);
+                menphina::pwrite_all(m_fd.get(), table.data(), length, m_offset, m_stagedPath);
+                m_offset += length;
+                return ret;
+            }
+    };
+
+    struct base_file_t
+    {
+        const menphina::xmpkg_mod_t * mod;
+        const menphina::xmpkg_file_t * file;
+    };
+
+    // Base files by content that a patch can read from no matter where it
+    // is: ones the target leaves alone, because applying the delta replaces
+    // files in no particular order.
+    std::unordered_map<menphina::content_hash_t, base_file_t, menphina::content_hash_hasher> _stable_base_files(const menphina::XmpkgReader& base, const menphina::XmpkgReader& target)
+    {
+        std::unordered_map<menphina::content_hash_t, base_file_t, menphina::content_hash_hasher> ret;
+
+        for (const menphina::xmpkg_mod_t& mod : base.mods())
+        {
+            const menphina::xmpkg_mod_t * targetMod = target.find_mod(base.name(mod));
+
+            for (const menphina::xmpkg_file_t& file : base.files(mod))
+            {
+                const menphina::xmpkg_file_t * targetFile = (targetMod == nullptr) ? nullptr : target.find_file(*targetMod, base.path(file));
+                if (targetFile == nullptr || _file_hash(*targetFile) == _file_hash(file))
+                {
+                    ret.emplace(_file_hash(file), base_file_t { &mod, &file });
+                }
+            }
+        }
+
+        return ret;
+    }
+}
+
+menphina::xmdelta_write_stats_t menphina::write_xmdelta(const XmpkgReader& base, const XmpkgReader& target, const std::string& path,
+    const std::function<void(uint64_t, uint64_t)>& step)
+{
+    const auto stable = _stable_base_files(base, target);
+
+    uint64_t total = 0;
+    for (const xmpkg_mod_t& mod : target.mods())
+    {
+        total += mod.file_count;
+    }
+
+    DeltaWriter writer(path);
+    std::vector<char> baseData;
+    std::vector<char> targetData;
+    std::vector<xmdelta_op_t> ops;
+    uint64_t done = 0;
+
+    for (const xmpkg_mod_t& mod : target.mods())
+    {
+        const std::string_view modName = target.name(mod);
+        const xmpkg_mod_t * baseMod = base.find_mod(modName);
+
+        writer.begin_mod(modName);
+
+        for (const xmpkg_file_t& file : target.files(mod))
+        {
+            if (step)
+            {
+                step(done++, total);
+            }
+
+            const std::string_view filePath = target.path(file);
+
+            xmdelta_file_t entry {};
+            entry.size = file.size;
+            entry.mtime_ns = file.mtime_ns;
+            entry.hash_lo = file.hash_lo;
+            entry.hash_hi = file.hash_hi;
+
+            // Same path first, then the same content anywhere.
+            base_file_t from { nullptr, nullptr };
+            if (baseMod != nullptr)
+            {
+                from = base_file_t { baseMod, base.find_file(*baseMod, filePath) };
+            }
+
+            if (from.file == nullptr)
+            {
+                const auto found = stable.find(_file_hash(file));
+                from = (found != stable.end()) ? found->second : base_file_t { nullptr, nullptr };
+            }
+
+            if (from.file != nullptr && from.mod == baseMod && _file_hash(*from.file) == _file_hash(file) && base.path(*from.file) == filePath)
+            {
+                entry.kind = static_cast<uint32_t>(DeltaFileKind::Unchanged);
+                writer.add_file(entry, filePath, {}, {}, {}, {});
+                ++writer.stats().unchanged;
+                continue;
+            }
+
+            target.load(file, targetData);
+
+            std::string_view fromMod;
+            std::string_view fromPath;
+
+            if (from.file != nullptr)
+            {
+                base.load(*from.file, baseData);
+
+                TraceSpan span(trace_category::HASH, "delta.match");
+                span.add_bytes(file.size);
+                _match(_bytes(baseData), _bytes(targetData), ops);
+            }
+
+            const bool copies = std::any_of(ops.begin(), ops.end(), [](const xmdelta_op_t& op) {
+                return op.kind == static_cast<uint32_t>(DeltaOpKind::Copy);
+            });
+
+            if (from.file != nullptr && copies)
+            {
+                entry.kind = static_cast<uint32_t>(DeltaFileKind::Patch);
+                entry.base_size = from.file->size;
+                entry.base_mtime_ns = from.file->mtime_ns;
+                entry.base_hash_lo = from.file->hash_lo;
+                entry.base_hash_hi = from.file->hash_hi;
+                fromMod = base.name(*from.mod);
+                fromPath = base.path(*from.file);
+                ++writer.stats().patched;
+            }
+            else
+            {
+                entry.kind = static_cast<uint32_t>(DeltaFileKind::Whole);
+                ops.assign(1, xmdelta_op_t { .offset = 0, .length = file.size, .kind = static_cast<uint32_t>(DeltaOpKind::Literal), .reserved = 0 });
+                if (file.size == 0)
+                {
+                    ops.clear();
+                }
+
+                ++writer.stats().whole;
+            }
+
+            writer.add_file(entry, filePath, fromMod, fromPath, _bytes(targetData), ops);
+            ops.clear();
+        }
+    }
+
+    if (step)
+    {
+        step(done, total);
+    }
+
+    writer.finish(base.size(), target.size());
+    return writer.stats();
+}
+
+bool menphina::is_xmdelta(const std::string& path)
+{
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        throw menphina::file_open_exception(path, true);
+    }
+
+    const UniqueFd guard(fd);
+
+    std::array<char, 8> magic {};
+    return pread_full(fd, magic.data(), magic.size(), 0, path) == magic.size() && magic == XMDELTA_MAGIC;
+}
+
+/* XmdeltaReader */
+
+menphina::XmdeltaReader::XmdeltaReader(const std::string& path) :
+    m_path(path),
+    m_base(nullptr),
+    m_size(0),
+    m_dataEnd(0)
+{
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        throw menphina::file_open_exception(path, true);
+    }
+
+    m_fd.reset(fd);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        const int err = errno;
+        throw menphina::errno_exception("Unable to stat " + path, err);
+    }
+
+    m_size = static_cast<uint64_t>(st.st_size);
+    if (m_size < sizeof(xmdelta_header_t) + sizeof(xmdelta_trailer_t))
+    {
+        _corrupt(path, "file too small");
+    }
+
+    void * map = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        const int err = errno;
+        throw menphina::errno_exception("Unable to map " + path, err);
+    }
+
+    m_base = static_cast<const std::byte *>(map);
+
+    try
+    {
+        xmdelta_header_t header;
+        std::memcpy(&header, m_base, sizeof(header));
+
+        xmdelta_trailer_t trailer;
+        const uint64_t trailerOffset = m_size - sizeof(trailer);
+        std::memcpy(&trailer, m_base + trailerOffset, sizeof(trailer));
+
+        if (header.magic != XMDELTA_MAGIC || trailer.magic != XMDELTA_MAGIC)
+        {
+            _corrupt(path, "bad magic");
+        }
+
+        if (header.version != XMDELTA_VERSION || trailer.version != XMDELTA_VERSION)
+        {
+            throw std::runtime_error("Unsupported xmdelta version " + std::to_string(header.version) + " in " + path);
+        }
+
+        m_ops = table_at<xmdelta_op_t>(trailer.op_table_offset, trailer.op_count, trailerOffset);
+        m_mods = table_at<xmdelta_mod_t>(trailer.mod_table_offset, trailer.mod_count, trailerOffset);
+        m_files = table_at<xmdelta_file_t>(trailer.file_table_offset, trailer.file_count, trailerOffset);
+        m_dataEnd = trailer.op_table_offset;
+
+        if (trailer.strings_offset > trailerOffset || trailer.strings_size > trailerOffset - trailer.strings_offset)
+        {
+            _corrupt(path, "string pool out of range");
+        }
+
+        m_strings = std::string_view(reinterpret_cast<const char *>(m_base + trailer.strings_offset), trailer.strings_size);
+
+        // As in XmpkgReader: every name and path is joined onto the mod
+        // directory, the base ones of a patch included.
+        for (const xmdelta_mod_t& mod : m_mods)
+        {
+            if (!path_is_contained(name(mod)))
+            {
+                _corrupt(path, "bad mod name");
+            }
+        }
+
+        for (const xmdelta_file_t& file : m_files)
+        {
+            if (!path_is_contained(this->path(file)))
+            {
+                _corrupt(path, "bad file path");
+            }
+
+            if (file.kind == static_cast<uint32_t>(DeltaFileKind::Patch) && (!path_is_contained(base_mod(file)) || !path_is_contained(base_path(file))))
+            {
+                _corrupt(path, "bad base file path");
+            }
+        }
+    }
+    catch (...)
+    {
+        munmap(const_cast<std::byte *>(m_base), m_size);
+        throw;
+    }
+}
+
+menphina::XmdeltaReader::~XmdeltaReader()
+{
+    munmap(const_cast<std::byte *>(m_base), m_size);
+}
+
+template<class T>
+std::span<const T> menphina::XmdeltaReader::table_at(const uint64_t offset, const uint64_t count, const uint64_t limit) const
+{
+    if (offset % alignof(T) != 0 || offset > limit || count > (limit - offset) / sizeof(T))
+    {
+        _corrupt(m_path, "table out of range");
+    }
+
+    return std::span<const T>(reinterpret_cast<const T *>(m_base + offset), count);
+}
+
+std::string_view menphina::XmdeltaReader::string_at(const uint64_t offset, const uint32_t length) const
+{
+    if (offset > m_strings.size() || length > m_strings.size() - offset) [[unlikely]]
+    {
+        _corrupt(m_path, "string out of range");
+    }
+
+    return m_strings.substr(offset, length);
+}
+
+std::span<const menphina::xmdelta_file_t> menphina::XmdeltaReader::files(const xmdelta_mod_t& mod) const
+{
+    if (mod.first_file > m_files.size() || mod.file_count > m_files.size() - mod.first_file) [[unlikely]]
+    {
+        _corrupt(m_path, "mod file range out of range");
+    }
+
+    return m_files.subspan(mod.first_file, mod.file_count);
+}
+
+std::span<const menphina::xmdelta_op_t> menphina::XmdeltaReader::ops(const xmdelta_file_t& file) const
+{
+    if (file.first_op > m_ops.size() || file.op_count > m_ops.size() - file.first_op) [[unlikely]]
+    {
+        _corrupt(m_path, "op range out of range");
+    }
+
+    const std::span<const xmdelta_op_t> ret = m_ops.subspan(file.first_op, file.op_count);
+
+    uint64_t length = 0;
+    for (const xmdelta_op_t& op : ret)
+    {
+        const uint64_t limit = (op.kind == static_cast<uint32_t>(DeltaOpKind::Literal)) ? m_dataEnd : file.base_size;
+        const uint64_t start = (op.kind == static_cast<uint32_t>(DeltaOpKind::Literal)) ? sizeof(xmdelta_header_t) : 0;
+
+        if (op.kind > static_cast<uint32_t>(DeltaOpKind::Literal) || op.offset < start || op.offset > limit || op.length > limit - op.offset) [[unlikely]]
+        {
+            _corrupt(m_path, "op out of range");
+        }
+
+        length += op.length;
+    }
+
+    if (length != file.size) [[unlikely]]
+    {
+        _corrupt(m_path, "ops do not add up to the file size");
+    }
+
+    return ret;
+}
+
+std::string_view menphina::XmdeltaReader::name(const xmdelta_mod_t& mod) const
+{
+    return string_at(mod.name_offset, mod.name_length);
+}
+
+std::string_view menphina::XmdeltaReader::path(const xmdelta_file_t& file) const
+{
+    return string_at(file.path_offset, file.path_length);
+}
+
+std::string_view menphina::XmdeltaReader::base_mod(const xmdelta_file_t& file) const
+{
+    return string_at(file.base_mod_offset, file.base_mod_length);
+}
+
+std::string_view menphina::XmdeltaReader::base_path(const xmdelta_file_t& file) const
+{
+    return string_at(file.base_path_offset, file.base_path_length);
+}
+
+const menphina::xmdelta_mod_t * menphina::XmdeltaReader::find_mod(const std::string_view name) const
+{
+    const auto it = std::lower_bound(m_mods.begin(), m_mods.end(), name, [this](const xmdelta_mod_t& m, const std::string_view n) {
+        return this->name(m) < n;
+    });
+
+    return (it != m_mods.end() && this->name(*it) == name) ? &*it : nullptr;
+}
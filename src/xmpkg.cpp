@@ -0,0 +1,840 @@
+/* Copyright 2024 isaki */
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <limits>
+#include <numeric>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "menphina/copy.hpp"
+#include "menphina/fileio.hpp"
+#include "menphina/hash.hpp"
+#include "menphina/trace.hpp"
+#include "menphina/m_exception.hpp"
+#include "menphina/platform.hpp"
+#include "menphina/xmpkg.hpp"
+
+namespace
+{
+    static_assert(std::endian::native == std::endian::little, "xmpkg is written in host byte order");
+
+    inline constexpr uint64_t MAX_STRING_LENGTH = std::numeric_limits<uint32_t>::max();
+
+    inline constexpr uint64_t TABLE_ALIGNMENT = 8;
+
+    // Deflated chunks have to save at least 1/MIN_DEFLATE_GAIN of their size;
+    // already compressed textures are left alone.
+    inline constexpr uint32_t MIN_DEFLATE_GAIN = 16;
+
+    inline std::string_view _view(const std::string& pool, const uint64_t offset, const uint32_t length)
+    {
+        return std::string_view(pool).substr(offset, length);
+    }
+
+    inline menphina::content_hash_t _chunk_hash(const menphina::xmpkg_chunk_t& c)
+    {
+        return menphina::content_hash_t { c.hash_lo, c.hash_hi };
+    }
+
+    [[noreturn]] void _corrupt(const std::string& path, const std::string_view what)
+    {
+        throw std::runtime_error("Corrupt xmpkg " + path + ": " + std::string(what));
+    }
+
+    // The raw content of a chunk into out, which has room for raw_size bytes.
+    void _decode(const menphina::xmpkg_chunk_t& c, const std::span<const std::byte> data, char * out, const std::string& path)
+    {
+        if (c.codec == static_cast<uint32_t>(menphina::ChunkCodec::Store))
+        {
+            if (data.size() != c.raw_size) [[unlikely]]
+            {
+                _corrupt(path, "stored chunk size mismatch");
+            }
+
+            std::memcpy(out, data.data(), data.size());
+            return;
+        }
+
+        if (c.codec != static_cast<uint32_t>(menphina::ChunkCodec::Deflate)) [[unlikely]]
+        {
+            throw std::runtime_error("Unsupported chunk codec " + std::to_string(c.codec) + " in " + path);
+        }
+
+        menphina::TraceSpan span(menphina::trace_category::COMPRESS, "chunk.inflate");
+        span.add_bytes(c.raw_size);
+
+        uLongf length = c.raw_size;
+        const int rc = uncompress(reinterpret_cast<Bytef *>(out), &length, reinterpret_cast<const Bytef *>(data.data()), data.size());
+        if (rc != Z_OK || length != c.raw_size) [[unlikely]]
+        {
+            _corrupt(path, "chunk does not inflate");
+        }
+    }
+}
+
+menphina::ChunkCodec menphina::xmpkg_encode_chunk(const void * data, const uint32_t length, const int level, std::vector<char>& out)
+{
+    out.clear();
+    if (level == 0 || length == 0)
+    {
+        return ChunkCodec::Store;
+    }
+
+    TraceSpan span(trace_category::COMPRESS, "chunk.deflate");
+    span.add_bytes(length);
+
+    out.resize(compressBound(length));
+    uLongf stored = out.size();
+    const int rc = compress2(reinterpret_cast<Bytef *>(out.data()), &stored, static_cast<const Bytef *>(data), length, level);
+    if (rc != Z_OK)
+    {
+        throw std::runtime_error("Unable to deflate chunk: " + std::string(zError(rc)));
+    }
+
+    if (stored > length - length / MIN_DEFLATE_GAIN)
+    {
+        out.clear();
+        return ChunkCodec::Store;
+    }
+
+    out.resize(stored);
+    return ChunkCodec::Deflate;
+}
+
+/* XmpkgWriter */
+
+menphina::XmpkgWriter::XmpkgWriter(const std::string& path) :
+    m_path(path),
+    m_offset(0),
+    m_finished(false),
+    m_fileOpen(false),
+    m_buffer(XMPKG_CHUNK_SIZE)
+{
+    const std::filesystem::path target(path);
+    const std::string dir = (target.has_parent_path()) ? target.parent_path().string() : std::string(".");
+    m_dirFd.reset(open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (!m_dirFd.valid())
+    {
+        const int err = errno;
+        throw menphina::errno_exception("Unable to open directory " + dir, err);
+    }
+
+    m_name = target.filename().string();
+    m_staged = staging_name(m_name);
+    m_stagedPath = path_join(dir, m_staged);
+    m_fd = open_staged(m_dirFd.get(), m_staged);
+
+    const xmpkg_header_t header {
+        .magic = XMPKG_MAGIC,
+        .version = XMPKG_VERSION,
+        .chunk_size = XMPKG_CHUNK_SIZE,
+        .reserved = { 0, 0 }
+    };
+
+    try
+    {
+        pwrite_all(m_fd.get(), &header, sizeof(header), 0, m_stagedPath);
+    }
+    catch (...)
+    {
+        m_fd.reset();
+        discard_staged(m_dirFd.get(), m_staged);
+        throw;
+    }
+
+    m_offset = sizeof(header);
+}
+
+menphina::XmpkgWriter::~XmpkgWriter()
+{
+    if (!m_finished)
+    {
+        m_fd.reset();
+        discard_staged(m_dirFd.get(), m_staged);
+    }
+}
+
+uint64_t menphina::XmpkgWriter::add_string(const std::string_view s)
+{
+    if (s.size() > MAX_STRING_LENGTH) [[unlikely]]
+    {
+        throw std::runtime_error("xmpkg string too long");
+    }
+
+    const uint64_t ret = m_strings.size();
+    m_strings.append(s);
+    return ret;
+}
+
+void menphina::XmpkgWriter::add_chunk(const char * data, const uint32_t length)
+{
+    content_hash_t hash;
+    {
+        TraceSpan span(trace_category::HASH, "chunk.hash");
+        span.add_bytes(length);
+        hash = content_hash(data, length);
+    }
+
+    add_encoded_chunk(hash, data, length, length, ChunkCodec::Store);
+}
+
+uint32_t menphina::XmpkgWriter::store_chunk(const content_hash_t& hash, const void * data, const uint32_t storedSize, const uint32_t rawSize, const uint32_t codec)
+{
+    bool isNew;
+    const uint32_t index = reserve_chunk(hash, storedSize, rawSize, codec, isNew);
+    if (isNew)
+    {
+        if (data == nullptr) [[unlikely]]
+        {
+            throw std::logic_error("XmpkgWriter: no data for a new chunk");
+        }
+
+        TraceSpan span(trace_category::WRITE, "chunk.write");
+        span.add_bytes(storedSize);
+        pwrite_all(m_fd.get(), data, storedSize, m_chunks[index].offset, m_stagedPath);
+    }
+
+    return index;
+}
+
+uint32_t menphina::XmpkgWriter::reserve_chunk(const content_hash_t& hash, const uint32_t storedSize, const uint32_t rawSize, const uint32_t codec, bool& isNew)
+{
+    const auto found = m_chunkIndex.find(hash);
+    if (found != m_chunkIndex.end())
+    {
+        ++m_stats.duplicate_chunks;
+        isNew = false;
+        return found->second;
+    }
+
+    if (m_chunks.size() >= std::numeric_limits<uint32_t>::max()) [[unlikely]]
+    {
+        throw std::runtime_error("xmpkg chunk table is full");
+    }
+
+    const uint32_t index = static_cast<uint32_t>(m_chunks.size());
+    m_chunks.push_back(xmpkg_chunk_t {
+        .hash_lo = hash.lo,
+        .hash_hi = hash.hi,
+        .offset = m_offset,
+        .stored_size = storedSize,
+        .raw_size = rawSize,
+        .codec = codec,
+        .reserved = 0
+    });
+    m_chunkIndex.emplace(hash, index);
+
+    m_offset += storedSize;
+    m_stats.stored_bytes += storedSize;
+    ++m_stats.chunks;
+    isNew = true;
+    return index;
+}
+
+void menphina::XmpkgWriter::begin_mod(const std::string_view name)
+{
+    if (!path_is_contained(name))
+    {
+        throw std::runtime_error("Cannot package mod " + std::string(name) + ": not a plain directory name");
+    }
+
+    m_mods.push_back(xmpkg_mod_t {
+        .name_offset = add_string(name),
+        .name_length = static_cast<uint32_t>(name.size()),
+        .reserved = 0,
+        .first_file = m_files.size(),
+        .file_count = 0
+    });
+
+    ++m_stats.mods;
+}
+
+void menphina::XmpkgWriter::add_file(const std::string_view path, const int fd, const int64_t mtimeNs)
+{
+    begin_file(path, mtimeNs);
+
+    ContentHasher fileHash;
+    for (bool first = true;; first = false)
+    {
+        size_t n;
+        {
+            TraceSpan span(trace_category::READ, "file.read");
+            n = read_full(fd, m_buffer.data(), m_buffer.size(), path);
+            span.add_bytes(n);
+            span.add_files((first) ? 1 : 0);
+        }
+
+        if (n == 0)
+        {
+            break;
+        }
+
+        {
+            TraceSpan span(trace_category::HASH, "file.hash");
+            span.add_bytes(n);
+            fileHash.update(m_buffer.data(), n);
+        }
+
+        add_chunk(m_buffer.data(), static_cast<uint32_t>(n));
+
+        if (n < m_buffer.size())
+        {
+            break;
+        }
+    }
+
+    end_file(fileHash.finish());
+}
+
+void menphina::XmpkgWriter::begin_file(const std::string_view path, const int64_t mtimeNs)
+{
+    if (m_mods.empty() || m_fileOpen) [[unlikely]]
+    {
+        throw std::logic_error("XmpkgWriter::begin_file called outside of a mod or inside a file");
+    }
+
+    if (!path_is_contained(path))
+    {
+        throw std::runtime_error("Cannot package " + std::string(path) + ": not a plain relative path");
+    }
+
+    m_files.push_back(xmpkg_file_t {
+        .path_offset = add_string(path),
+        .path_length = static_cast<uint32_t>(path.size()),
+        .chunk_count = 0,
+        .first_chunk_ref = m_refs.size(),
+        .size = 0,
+        .mtime_ns = mtimeNs,
+        .hash_lo = 0,
+        .hash_hi = 0
+    });
+
+    m_fileOpen = true;
+}
+
+void menphina::XmpkgWriter::add_encoded_chunk(const content_hash_t& hash, const void * data, const uint32_t storedSize, const uint32_t rawSize, const ChunkCodec codec)
+{
+    if (!m_fileOpen) [[unlikely]]
+    {
+        throw std::logic_error("XmpkgWriter::add_encoded_chunk called outside of a file");
+    }
+
+    xmpkg_file_t& file = m_files.back();
+    if (file.chunk_count == std::numeric_limits<uint32_t>::max()) [[unlikely]]
+    {
+        throw std::runtime_error("xmpkg file has too many chunks");
+    }
+
+    m_refs.push_back(store_chunk(hash, data, storedSize, rawSize, static_cast<uint32_t>(codec)));
+    ++file.chunk_count;
+    file.size += rawSize;
+}
+
+void menphina::XmpkgWriter::end_file(const content_hash_t& hash)
+{
+    if (!m_fileOpen) [[unlikely]]
+    {
+        throw std::logic_error("XmpkgWriter::end_file called outside of a file");
+    }
+
+    xmpkg_file_t& file = m_files.back();
+    file.hash_lo = hash.lo;
+    file.hash_hi = hash.hi;
+
+    m_fileOpen = false;
+    ++m_mods.back().file_count;
+
+    ++m_stats.files;
+    m_stats.raw_bytes += file.size;
+}
+
+bool menphina::XmpkgWriter::has_chunk(const content_hash_t& hash) const
+{
+    return m_chunkIndex.contains(hash);
+}
+
+void menphina::XmpkgWriter::add_reused_file(const XmpkgReader& source, const xmpkg_file_t& file)
+{
+    if (m_mods.empty() || m_fileOpen) [[unlikely]]
+    {
+        throw std::logic_error("XmpkgWriter::add_reused_file called outside of a mod or inside a file");
+    }
+
+    const std::string_view path = source.path(file);
+
+    xmpkg_file_t copy = file;
+    copy.path_offset = add_string(path);
+    copy.first_chunk_ref = m_refs.size();
+
+    for (const uint32_t ref : source.chunk_refs(file))
+    {
+        const xmpkg_chunk_t& c = source.chunk(ref);
+
+        // Bounds checks the chunk; the data itself is copied by finish().
+        source.chunk_data(c);
+
+        bool isNew;
+        const uint32_t index = reserve_chunk(_chunk_hash(c), c.stored_size, c.raw_size, c.codec, isNew);
+        if (isNew)
+        {
+            m_copy.add(copy_op_t {
+                .src_fd = source.fd(),
+                .src_offset = c.offset,
+                .dst_fd = m_fd.get(),
+                .dst_offset = m_chunks[index].offset,
+                .length = c.stored_size
+            });
+        }
+
+        m_refs.push_back(index);
+    }
+
+    m_files.push_back(copy);
+    ++m_mods.back().file_count;
+
+    ++m_stats.files;
+    ++m_stats.reused_files;
+    m_stats.raw_bytes += file.size;
+    m_stats.reused_bytes += file.size;
+}
+
+void menphina::XmpkgWriter::align_table()
+{
+    static constexpr char zeros[TABLE_ALIGNMENT] = {};
+
+    const uint64_t pad = (TABLE_ALIGNMENT - (m_offset % TABLE_ALIGNMENT)) % TABLE_ALIGNMENT;
+    pwrite_all(m_fd.get(), zeros, pad, m_offset, m_stagedPath);
+    m_offset += pad;
+}
+
+template<class T>
+uint64_t menphina::XmpkgWriter::write_table(const std::vector<T>& table)
+{
+    align_table();
+
+    const uint64_t ret = m_offset;
+    const size_t length = table.size() * sizeof(T);
+    pwrite_all(m_fd.get(), table.data(), length, m_offset, m_stagedPath);
+    m_offset += length;
+    return ret;
+}
+
+void menphina::XmpkgWriter::finish()
+{
+    if (m_finished || m_fileOpen) [[unlikely]]
+    {
+        throw std::logic_error("XmpkgWriter::finish called twice or inside a file");
+    }
+
+    // Sort the manifest so readers can binary search it: mods by name and
+    // files by path within their mod. Chunk references stay where they are;
+    // files point at them by index.
+    std::sort(m_mods.begin(), m_mods.end(), [this](const xmpkg_mod_t& a, const xmpkg_mod_t& b) {
+        return _view(m_strings, a.name_offset, a.name_length) < _view(m_strings, b.name_offset, b.name_length);
+    });
+
+    std::vector<xmpkg_file_t> files;
+    files.reserve(m_files.size());
+    for (size_t m = 0; m < m_mods.size(); ++m)
+    {
+        xmpkg_mod_t& mod = m_mods[m];
+        const std::string_view name = _view(m_strings, mod.name_offset, mod.name_length);
+        if (m != 0 && name == _view(m_strings, m_mods[m - 1].name_offset, m_mods[m - 1].name_length))
+        {
+            throw std::runtime_error("duplicate mod in xmpkg: " + std::string(name));
+        }
+
+        const uint64_t first = files.size();
+        files.insert(files.end(), m_files.begin() + mod.first_file, m_files.begin() + mod.first_file + mod.file_count);
+        mod.first_file = first;
+
+        const auto begin = files.begin() + first;
+        std::sort(begin, files.end(), [this](const xmpkg_file_t& a, const xmpkg_file_t& b) {
+            return _view(m_strings, a.path_offset, a.path_length) < _view(m_strings, b.path_offset, b.path_length);
+        });
+
+        const auto dup = std::adjacent_find(begin, files.end(), [this](const xmpkg_file_t& a, const xmpkg_file_t& b) {
+            return _view(m_strings, a.path_offset, a.path_length) == _view(m_strings, b.path_offset, b.path_length);
+        });
+
+        if (dup != files.end())
+        {
+            throw std::runtime_error("duplicate file in xmpkg mod " + std::string(name) + ": "
+                + std::string(_view(m_strings, dup->path_offset, dup->path_length)));
+        }
+    }
+
+    m_files = std::move(files);
+
+    TraceSpan span(trace_category::WRITE, "package.index");
+
+    std::vector<uint32_t> chunkIndex(m_chunks.size());
+    std::iota(chunkIndex.begin(), chunkIndex.end(), 0u);
+    std::sort(chunkIndex.begin(), chunkIndex.end(), [this](const uint32_t a, const uint32_t b) {
+        return _chunk_hash(m_chunks[a]) < _chunk_hash(m_chunks[b]);
+    });
+
+    xmpkg_trailer_t trailer {};
+    trailer.chunk_count = m_chunks.size();
+    trailer.chunk_table_offset = write_table(m_chunks);
+    trailer.mod_count = m_mods.size();
+    trailer.mod_table_offset = write_table(m_mods);
+    trailer.file_count = m_files.size();
+    trailer.file_table_offset = write_table(m_files);
+    trailer.ref_count = m_refs.size();
+    trailer.ref_table_offset = write_table(m_refs);
+    trailer.chunk_index_offset = write_table(chunkIndex);
+
+    trailer.strings_offset = m_offset;
+    trailer.strings_size = m_strings.size();
+    pwrite_all(m_fd.get(), m_strings.data(), m_strings.size(), m_offset, m_stagedPath);
+    m_offset += m_strings.size();
+
+    trailer.version = XMPKG_VERSION;
+    trailer.magic = XMPKG_MAGIC;
+    pwrite_all(m_fd.get(), &trailer, sizeof(trailer), m_offset, m_stagedPath);
+    m_offset += sizeof(trailer);
+
+    if (m_copy.pending() != 0)
+    {
+        TraceSpan copySpan(trace_category::WRITE, "package.copy");
+        copySpan.add_bytes(m_copy.pending_bytes());
+        m_copy.run();
+    }
+
+    if (fsync(m_fd.get()) != 0)
+    {
+        const int err = errno;
+        throw menphina::errno_exception("Failed to sync " + m_stagedPath, err);
+    }
+
+    m_fd.reset();
+    publish_staged(m_dirFd.get(), m_staged, m_name, true);
+
+    m_finished = true;
+}
+
+/* XmpkgReader */
+
+menphina::XmpkgReader::XmpkgReader(const std::string& path) :
+    m_path(path),
+    m_base(nullptr),
+    m_size(0)
+{
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        throw menphina::file_open_exception(path, true);
+    }
+
+    m_fd.reset(fd);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        const int err = errno;
+        throw menphina::errno_exception("Unable to stat " + path, err);
+    }
+
+    m_size = static_cast<uint64_t>(st.st_size);
+    if (m_size < sizeof(xmpkg_header_t) + sizeof(xmpkg_trailer_t))
+    {
+        _corrupt(path, "file too small");
+    }
+
+    void * map = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        const int err = errno;
+        throw menphina::errno_exception("Unable to map " + path, err);
+    }
+
+    m_base = static_cast<const std::byte *>(map);
+
+    try
+    {
+        xmpkg_header_t header;
+        std::memcpy(&header, m_base, sizeof(header));
+
+        xmpkg_trailer_t trailer;
+        const uint64_t trailerOffset = m_size - sizeof(trailer);
+        std::memcpy(&trailer, m_base + trailerOffset, sizeof(trailer));
+
+        if (header.magic != XMPKG_MAGIC || trailer.magic != XMPKG_MAGIC)
+        {
+            _corrupt(path, "bad magic");
+        }
+
+        if (header.version != XMPKG_VERSION || trailer.version != XMPKG_VERSION)
+        {
+            throw std::runtime_error("Unsupported xmpkg version " + std::to_string(header.version) + " in " + path);
+        }
+
+        m_chunks = table_at<xmpkg_chunk_t>(trailer.chunk_table_offset, trailer.chunk_count, trailerOffset);
+        m_mods = table_at<xmpkg_mod_t>(trailer.mod_table_offset, trailer.mod_count, trailerOffset);
+        m_files = table_at<xmpkg_file_t>(trailer.file_table_offset, trailer.file_count, trailerOffset);
+        m_refs = table_at<uint32_t>(trailer.ref_table_offset, trailer.ref_count, trailerOffset);
+        m_chunkIndex = table_at<uint32_t>(trailer.chunk_index_offset, trailer.chunk_count, trailerOffset);
+
+        if (trailer.strings_offset > trailerOffset || trailer.strings_size > trailerOffset - trailer.strings_offset)
+        {
+            _corrupt(path, "string pool out of range");
+        }
+
+        m_strings = std::string_view(reinterpret_cast<const char *>(m_base + trailer.strings_offset), trailer.strings_size);
+
+        // Only the data is random access; the tables are read front to back
+        // by nearly every caller. The chunk data runs from the header to the
+        // first table, and only the whole pages inside it are advised.
+        const uint64_t dataEnd = std::min({
+            trailer.chunk_table_offset,
+            trailer.mod_table_offset,
+            trailer.file_table_offset,
+            trailer.ref_table_offset,
+            trailer.chunk_index_offset,
+            trailer.strings_offset
+        });
+
+        static const uint64_t pageSize = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+        const uint64_t randomStart = ((sizeof(xmpkg_header_t) + pageSize - 1) / pageSize) * pageSize;
+        const uint64_t randomEnd = dataEnd - (dataEnd % pageSize);
+        if (randomEnd > randomStart)
+        {
+            madvise(const_cast<std::byte *>(m_base + randomStart), randomEnd - randomStart, MADV_RANDOM);
+        }
+    }
+    catch (...)
+    {
+        munmap(const_cast<std::byte *>(m_base), m_size);
+        throw;
+    }
+}
+
+menphina::XmpkgReader::~XmpkgReader()
+{
+    munmap(const_cast<std::byte *>(m_base), m_size);
+}
+
+template<class T>
+std::span<const T> menphina::XmpkgReader::table_at(const uint64_t offset, const uint64_t count, const uint64_t limit) const
+{
+    if (offset % alignof(T) != 0 || offset > limit || count > (limit - offset) / sizeof(T))
+    {
+        _corrupt(m_path, "table out of range");
+    }
+
+    return std::span<const T>(reinterpret_cast<const T *>(m_base + offset), count);
+}
+
+std::string_view menphina::XmpkgReader::string_at(const uint64_t offset, const uint32_t length) const
+{
+    if (offset > m_strings.size() || length > m_strings.size() - offset) [[unlikely]]
+    {
+        _corrupt(m_path, "string out of range");
+    }
+
+    return m_strings.substr(offset, length);
+}
+
+std::span<const menphina::xmpkg_file_t> menphina::XmpkgReader::files(const xmpkg_mod_t& mod) const
+{
+    if (mod.first_file > m_files.size() || mod.file_count > m_files.size() - mod.first_file) [[unlikely]]
+    {
+        _corrupt(m_path, "mod file range out of range");
+    }
+
+    return m_files.subspan(mod.first_file, mod.file_count);
+}
+
+std::span<const uint32_t> menphina::XmpkgReader::chunk_refs(const xmpkg_file_t& file) const
+{
+    if (file.first_chunk_ref > m_refs.size() || file.chunk_count > m_refs.size() - file.first_chunk_ref) [[unlikely]]
+    {
+        _corrupt(m_path, "chunk references out of range");
+    }
+
+    return m_refs.subspan(file.first_chunk_ref, file.chunk_count);
+}
+
+std::string_view menphina::XmpkgReader::name(const xmpkg_mod_t& mod) const
+{
+    const std::string_view ret = string_at(mod.name_offset, mod.name_length);
+    if (!path_is_contained(ret)) [[unlikely]]
+    {
+        _corrupt(m_path, "bad mod name");
+    }
+
+    return ret;
+}
+
+std::string_view menphina::XmpkgReader::path(const xmpkg_file_t& file) const
+{
+    const std::string_view ret = string_at(file.path_offset, file.path_length);
+    if (!path_is_contained(ret)) [[unlikely]]
+    {
+        _corrupt(m_path, "bad file path");
+    }
+
+    return ret;
+}
+
+const menphina::xmpkg_chunk_t& menphina::XmpkgReader::chunk(const uint32_t index) const
+{
+    if (index >= m_chunks.size()) [[unlikely]]
+    {
+        _corrupt(m_path, "chunk index out of range");
+    }
+
+    return m_chunks[index];
+}
+
+std::span<const std::byte> menphina::XmpkgReader::chunk_data(const xmpkg_chunk_t& chunk) const
+{
+    if (chunk.offset < sizeof(xmpkg_header_t) || chunk.offset > m_size || chunk.stored_size > m_size - chunk.offset) [[unlikely]]
+    {
+        _corrupt(m_path, "chunk data out of range");
+    }
+
+    return std::span<const std::byte>(m_base + chunk.offset, chunk.stored_size);
+}
+
+const menphina::xmpkg_mod_t * menphina::XmpkgReader::find_mod(const std::string_view name) const
+{
+    const auto it = std::lower_bound(m_mods.begin(), m_mods.end(), name, [this](const xmpkg_mod_t& m, const std::string_view n) {
+        return string_at(m.name_offset, m.name_length) < n;
+    });
+
+    return (it != m_mods.end() && this->name(*it) == name) ? &*it : nullptr;
+}
+
+const menphina::xmpkg_file_t * menphina::XmpkgReader::find_file(const xmpkg_mod_t& mod, const std::string_view path) const
+{
+    const std::span<const xmpkg_file_t> list = files(mod);
+    const auto it = std::lower_bound(list.begin(), list.end(), path, [this](const xmpkg_file_t& f, const std::string_view p) {
+        return string_at(f.path_offset, f.path_length) < p;
+    });
+
+    return (it != list.end() && this->path(*it) == path) ? &*it : nullptr;
+}
+
+const menphina::xmpkg_chunk_t * menphina::XmpkgReader::find_chunk(const content_hash_t& hash) const
+{
+    const auto it = std::lower_bound(m_chunkIndex.begin(), m_chunkIndex.end(), hash, [this](const uint32_t i, const content_hash_t& h) {
+        return _chunk_hash(chunk(i)) < h;
+    });
+
+    if (it == m_chunkIndex.end())
+    {
+        return nullptr;
+    }
+
+    const xmpkg_chunk_t& c = chunk(*it);
+    return (_chunk_hash(c) == hash) ? &c : nullptr;
+}
+
+void menphina::XmpkgReader::will_need(const xmpkg_file_t& file) const
+{
+    static const uint64_t pageSize = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+
+    for (const uint32_t ref : chunk_refs(file))
+    {
+        const std::span<const std::byte> data = chunk_data(chunk(ref));
+        const uint64_t start = static_cast<uint64_t>(data.data() - m_base);
+        const uint64_t aligned = start - (start % pageSize);
+        madvise(const_cast<std::byte *>(m_base + aligned), data.size() + (start - aligned), MADV_WILLNEED);
+    }
+}
+
+void menphina::XmpkgReader::extract(const xmpkg_file_t& file, const int fd) const
+{
+    const std::string_view name = path(file);
+
+    TraceSpan span(trace_category::WRITE, "file.extract");
+    span.add_files(1);
+    span.add_bytes(file.size);
+
+    std::vector<char> raw;
+    for (const uint32_t ref : chunk_refs(file))
+    {
+        const xmpkg_chunk_t& c = chunk(ref);
+        const std::span<const std::byte> data = chunk_data(c);
+
+        if (c.codec == static_cast<uint32_t>(ChunkCodec::Store))
+        {
+            write_all(fd, data.data(), data.size(), name);
+            continue;
+        }
+
+        raw.resize(c.raw_size);
+        _decode(c, data, raw.data(), m_path);
+        write_all(fd, raw.data(), raw.size(), name);
+    }
+}
+
+void menphina::XmpkgReader::load(const xmpkg_file_t& file, std::vector<char>& out) const
+{
+    out.resize(file.size);
+
+    uint64_t offset = 0;
+    for (const uint32_t ref : chunk_refs(file))
+    {
+        const xmpkg_chunk_t& c = chunk(ref);
+        if (c.raw_size > file.size - offset) [[unlikely]]
+        {
+            _corrupt(m_path, "file larger than its size");
+        }
+
+        _decode(c, chunk_data(c), out.data() + offset, m_path);
+        offset += c.raw_size;
+    }
+
+    if (offset != file.size) [[unlikely]]
+    {
+        _corrupt(m_path, "file smaller than its size");
+    }
+}
+
+bool menphina::XmpkgReader::queue_extract(const xmpkg_file_t& file, const int fd, CopyEngine& engine) const
+{
+    const std::span<const uint32_t> refs = chunk_refs(file);
+
+    for (const uint32_t ref : refs)
+    {
+        if (chunk(ref).codec != static_cast<uint32_t>(ChunkCodec::Store))
+        {
+            return false;
+        }
+    }
+
+    uint64_t offset = 0;
+    for (const uint32_t ref : refs)
+    {
+        const xmpkg_chunk_t& c = chunk(ref);
+        chunk_data(c);
+
+        engine.add(copy_op_t {
+            .src_fd = m_fd.get(),
+            .src_offset = c.offset,
+            .dst_fd = fd,
+            .dst_offset = offset,
+            .length = c.stored_size
+        });
+
+        offset += c.stored_size;
+    }
+
+    return true;
+}